@@ -26,16 +26,18 @@ const esbuildProblemMatcherPlugin = {
 
 async function main() {
 	const ctx = await esbuild.context({
-		entryPoints: [
-			'src/extension.ts'
-		],
+		entryPoints: {
+			'extension': 'src/extension.ts',
+			// Loaded with new Worker() next to the bundle, see DatabaseClient
+			'databaseWorker': 'src/core/databaseWorker.ts'
+		},
 		bundle: true,
 		format: 'cjs',
 		minify: production,
 		sourcemap: !production,
 		sourcesContent: false,
 		platform: 'node',
-		outfile: 'dist/extension.js',
+		outdir: 'dist',
 		external: [
 			"vscode",          // provided by VSCode runtime
 			...builtinModules  // Node.js built-ins (includes node:sqlite)
@@ -1,4 +1,5 @@
 import * as vscode from 'vscode';
+import { DATABASE_CONSTANTS, FILE_PATTERNS } from './utils/constants';
 
 export interface MacroLensConfig {
     stripExtraParentheses: boolean;
@@ -10,7 +11,18 @@ export interface MacroLensConfig {
     debounceDelay: number;
     maxUpdateDelay: number;
     maxExpansionDepth: number;
+    maxExpansionSteps: number;
+    maxExpansionLength: number;
+    expansionTimeout: number;
     diagnosticsFocusOnly: boolean;
+    activeConfiguration: string[];
+    scopeToIncludes: boolean;
+    compileCommandsPath: string;
+    includeGlob: string;
+    excludeGlobs: string[];
+    streamingThreshold: number;
+    maxFileSize: number;
+    useGitignore: boolean;
 }
 
 export class Configuration {
@@ -36,7 +48,18 @@ export class Configuration {
             debounceDelay: config.get('debounceDelay', 500),
             maxUpdateDelay: config.get('maxUpdateDelay', 8000),
             maxExpansionDepth: config.get('maxExpansionDepth', 30),
-            diagnosticsFocusOnly: config.get('diagnosticsFocusOnly', true)
+            maxExpansionSteps: config.get('maxExpansionSteps', 2000),
+            maxExpansionLength: config.get('maxExpansionLength', 100000),
+            expansionTimeout: config.get('expansionTimeout', 250),
+            diagnosticsFocusOnly: config.get('diagnosticsFocusOnly', true),
+            activeConfiguration: config.get<string[]>('activeConfiguration', []),
+            scopeToIncludes: config.get('scopeToIncludes', false),
+            compileCommandsPath: config.get('compileCommandsPath', ''),
+            includeGlob: config.get('includeGlob', FILE_PATTERNS.C_CPP_GLOB),
+            excludeGlobs: config.get<string[]>('excludeGlobs', [...FILE_PATTERNS.EXCLUDE_GLOBS]),
+            streamingThreshold: config.get('streamingThreshold', DATABASE_CONSTANTS.DEFAULT_STREAMING_THRESHOLD_MB),
+            maxFileSize: config.get('maxFileSize', DATABASE_CONSTANTS.DEFAULT_MAX_FILE_SIZE_MB),
+            useGitignore: config.get('useGitignore', true)
         };
     }
 
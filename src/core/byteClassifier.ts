@@ -0,0 +1,225 @@
+/**
+ * Byte classes reported per 16-byte block, in mask order
+ */
+export const enum ByteClass {
+    LineBreak = 0,   // \n or \r
+    Hash = 1,        // #
+    Slash = 2,       // /
+    Star = 3,        // *
+    Quote = 4,       // " or '
+    Backslash = 5    // \
+}
+
+const CLASS_COUNT = 6;
+const BLOCK_SIZE = 16;
+const PAGE_SIZE = 65536;
+/** Bytes classified per kernel call; the module memory holds one chunk and its masks */
+const CHUNK_SIZE = 64 * 1024;
+const MEMORY_PAGES = Math.ceil((CHUNK_SIZE + CHUNK_SIZE / BLOCK_SIZE * CLASS_COUNT * 2) / PAGE_SIZE);
+
+/** Byte values of each class (LineBreak and Quote have two) */
+const CLASS_BYTES: number[][] = [[0x0a, 0x0d], [0x23], [0x2f], [0x2a], [0x22, 0x27], [0x5c]];
+
+/**
+ * Minimal view of the WebAssembly API, which is optional in the extension host
+ */
+interface WasmApi {
+    validate(bytes: Uint8Array): boolean;
+    Module: new (bytes: Uint8Array) => object;
+    Instance: new (module: object, imports: object) => { exports: Record<string, unknown> };
+}
+
+interface WasmMemory {
+    buffer: ArrayBuffer;
+}
+
+/**
+ * Per-block bitmasks of the byte classes of a buffer
+ * Bit i of a mask is set when byte (block * 16 + i) belongs to the class.
+ */
+export class ByteMasks {
+    constructor(private masks: Uint16Array, readonly length: number) {}
+
+    /**
+     * Index of the first byte at or after from belonging to any of the classes, or -1
+     * @param classes Bit set of classes (1 << ByteClass.X)
+     */
+    next(from: number, classes: number): number {
+        const blocks = this.masks.length / CLASS_COUNT;
+        let block = from >>> 4;
+        if (block >= blocks) {
+            return -1;
+        }
+        let bits = this.combine(block, classes) & (0xffff << (from & 15));
+        while (bits === 0) {
+            if (++block >= blocks) {
+                return -1;
+            }
+            bits = this.combine(block, classes);
+        }
+        return (block << 4) + 31 - Math.clz32(bits & -bits);
+    }
+
+    private combine(block: number, classes: number): number {
+        const base = block * CLASS_COUNT;
+        let bits = 0;
+        for (let c = 0; c < CLASS_COUNT; c++) {
+            if (classes & (1 << c)) {
+                bits |= this.masks[base + c];
+            }
+        }
+        return bits;
+    }
+}
+
+/**
+ * Classifies bytes 16 at a time with a WebAssembly SIMD128 kernel
+ *
+ * The module is assembled in code (no build step) and only used when the runtime
+ * validates SIMD; getInstance() returns null otherwise and callers keep their scalar loops.
+ */
+export class ByteClassifier {
+    private static instance: ByteClassifier | null | undefined;
+
+    private constructor(
+        private memory: WasmMemory,
+        private kernel: (source: number, length: number, destination: number) => void
+    ) {}
+
+    static getInstance(): ByteClassifier | null {
+        if (ByteClassifier.instance === undefined) {
+            ByteClassifier.instance = ByteClassifier.create();
+        }
+        return ByteClassifier.instance;
+    }
+
+    /**
+     * Compute the class masks of a buffer
+     * Large buffers go through the module CHUNK_SIZE bytes at a time, so its memory
+     * (which could grow but never shrink) stays at one chunk whatever the file size.
+     */
+    classify(bytes: Uint8Array): ByteMasks {
+        const masks = new Uint16Array(Math.ceil(bytes.length / BLOCK_SIZE) * CLASS_COUNT);
+        for (let offset = 0; offset < bytes.length; offset += CHUNK_SIZE) {
+            const chunk = bytes.subarray(offset, offset + CHUNK_SIZE);
+            const blocks = Math.ceil(chunk.length / BLOCK_SIZE);
+            const padded = blocks * BLOCK_SIZE;
+
+            const input = new Uint8Array(this.memory.buffer, 0, padded);
+            input.set(chunk);
+            input.fill(0, chunk.length);
+            this.kernel(0, padded, CHUNK_SIZE);
+
+            masks.set(new Uint16Array(this.memory.buffer, CHUNK_SIZE, blocks * CLASS_COUNT), offset / BLOCK_SIZE * CLASS_COUNT);
+        }
+        return new ByteMasks(masks, bytes.length);
+    }
+
+    private static create(): ByteClassifier | null {
+        const wasm = (globalThis as { WebAssembly?: WasmApi }).WebAssembly;
+        if (!wasm) {
+            return null;
+        }
+
+        try {
+            const binary = ByteClassifier.assemble();
+            if (!wasm.validate(binary)) {
+                return null;
+            }
+            const instance = new wasm.Instance(new wasm.Module(binary), {});
+            return new ByteClassifier(
+                instance.exports.memory as WasmMemory,
+                instance.exports.classify as (source: number, length: number, destination: number) => void
+            );
+        } catch (error) {
+            console.warn('MacroLens: SIMD byte classifier unavailable:', error);
+            return null;
+        }
+    }
+
+    /**
+     * Assemble the module:
+     *
+     *   (func (export "classify") (param $src i32) (param $len i32) (param $dst i32)
+     *     for ($i = 0; $i < $len; $i += 16, $dst += 12)
+     *       $v = v128.load($src + $i)
+     *       for each class: i32.store16 offset=2*class ($dst) (i8x16.bitmask (OR of i8x16.eq $v (splat byte))))
+     */
+    private static assemble(): Uint8Array {
+        const SIMD = 0xfd;
+        const [I32, V128] = [0x7f, 0x7b];
+        const [SRC, LEN, DST, I, V] = [0, 1, 2, 3, 4];
+
+        const code: number[] = [
+            0x02, 0x40,                         // block
+            0x03, 0x40,                         //   loop
+            0x20, I, 0x20, LEN, 0x4f,           //     $i >= $len
+            0x0d, 0x01,                         //     br_if 1 (exit)
+            0x20, SRC, 0x20, I, 0x6a,           //     $src + $i
+            SIMD, 0x00, 0x00, 0x00,             //     v128.load align=1
+            0x21, V                             //     local.set $v
+        ];
+
+        CLASS_BYTES.forEach((values, index) => {
+            code.push(0x20, DST);                           // address
+            values.forEach((value, n) => {
+                code.push(0x20, V);                         // $v
+                code.push(0x41, ...ByteClassifier.signedLeb(value), SIMD, 0x0f);  // i8x16.splat
+                code.push(SIMD, 0x23);                      // i8x16.eq
+                if (n > 0) {
+                    code.push(SIMD, 0x50);                  // v128.or
+                }
+            });
+            code.push(SIMD, 0x64);                          // i8x16.bitmask
+            code.push(0x3b, 0x01, index * 2);               // i32.store16 align=2 offset=2*class
+        });
+
+        code.push(
+            0x20, DST, 0x41, CLASS_COUNT * 2, 0x6a, 0x21, DST,  // $dst += 12
+            0x20, I, 0x41, BLOCK_SIZE, 0x6a, 0x21, I,           // $i += 16
+            0x0c, 0x00,                                         //     br 0 (loop)
+            0x0b,                                               //   end loop
+            0x0b,                                               // end block
+            0x0b                                                // end function
+        );
+
+        const body = [0x02, 0x01, I32, 0x01, V128, ...code];   // locals: $i i32, $v v128
+        const section = (id: number, content: number[]) => [id, ...ByteClassifier.unsignedLeb(content.length), ...content];
+        const name = (text: string) => [text.length, ...Array.from(text, char => char.charCodeAt(0))];
+
+        return new Uint8Array([
+            0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,                 // magic, version
+            ...section(1, [0x01, 0x60, 0x03, I32, I32, I32, 0x00]),          // type: (i32 i32 i32) -> ()
+            ...section(3, [0x01, 0x00]),                                     // function 0 has type 0
+            ...section(5, [0x01, 0x00, MEMORY_PAGES]),                       // memory: one chunk and its masks
+            ...section(7, [0x02, ...name('memory'), 0x02, 0x00, ...name('classify'), 0x00, 0x00]),
+            ...section(10, [0x01, ...ByteClassifier.unsignedLeb(body.length), ...body])
+        ]);
+    }
+
+    private static unsignedLeb(value: number): number[] {
+        const bytes: number[] = [];
+        do {
+            let byte = value & 0x7f;
+            value >>>= 7;
+            if (value !== 0) {
+                byte |= 0x80;
+            }
+            bytes.push(byte);
+        } while (value !== 0);
+        return bytes;
+    }
+
+    private static signedLeb(value: number): number[] {
+        const bytes: number[] = [];
+        for (;;) {
+            const byte = value & 0x7f;
+            value >>= 7;
+            if ((value === 0 && (byte & 0x40) === 0) || (value === -1 && (byte & 0x40) !== 0)) {
+                bytes.push(byte);
+                return bytes;
+            }
+            bytes.push(byte | 0x80);
+        }
+    }
+}
@@ -0,0 +1,302 @@
+import * as path from 'path';
+import { MacroDef } from './macroDb';
+
+/**
+ * An entry of a JSON compilation database (compile_commands.json)
+ */
+interface CompileCommandEntry {
+    directory: string;
+    file: string;
+    command?: string;
+    arguments?: string[];
+}
+
+/**
+ * Preprocessor state set up by the command line of one or more translation units
+ * Translation units with identical preprocessor flags share one configuration
+ */
+export interface CommandLineConfiguration {
+    defines: Map<string, MacroDef[]>; // After applying -D and -U in order (one definition each)
+    includeDirectories: string[];     // -I, -isystem and -iquote, absolute
+    forcedIncludes: string[];         // -include, absolute
+    units: number;                    // Number of translation units using this configuration
+}
+
+const DEFINE_ARGUMENT = /^([A-Za-z_]\w*)(?:\(([^)]*)\))?(?:=([\s\S]*))?$/;
+
+/** Compiler drivers accepting MSVC style /D, /U, /I and /FI options */
+const MSVC_DRIVER = /(?:^|[\\/])(?:cl|clang-cl)(?:\.exe)?$/i;
+
+/**
+ * Predefined macros, include directories and forced includes per translation unit
+ *
+ * Thousands of translation units typically share a handful of flag sets, so units are
+ * mapped to deduplicated configurations, and identical -D arguments share one definition.
+ * Files that are not in the database (headers) use the most common configuration.
+ */
+export class CompileCommands {
+    private configurations: CommandLineConfiguration[] = [];
+    private byFile = new Map<string, CommandLineConfiguration>();
+    private defaultConfiguration: CommandLineConfiguration | undefined;
+
+    private constructor(readonly source: string) {}
+
+    /**
+     * Parse the content of a compile_commands.json file
+     * @param content JSON text
+     * @param source Path of the file, used as the location of command line definitions
+     */
+    static parse(content: string, source: string): CompileCommands {
+        const entries = JSON.parse(content) as CompileCommandEntry[];
+        if (!Array.isArray(entries)) {
+            throw new Error('compile_commands.json must contain an array');
+        }
+
+        const commands = new CompileCommands(source);
+        const byKey = new Map<string, CommandLineConfiguration>();
+        const defineCache = new Map<string, MacroDef[]>();
+
+        for (const entry of entries) {
+            if (!entry || typeof entry.file !== 'string') {
+                continue;
+            }
+            const directory = typeof entry.directory === 'string' ? entry.directory : path.dirname(source);
+            const args = Array.isArray(entry.arguments)
+                ? entry.arguments
+                : CompileCommands.splitCommandLine(entry.command || '');
+            const flags = CompileCommands.extractFlags(args, directory);
+
+            // Flags are kept in command line order since later -D/-U override earlier ones
+            const key = flags.join('\0');
+            let configuration = byKey.get(key);
+            if (!configuration) {
+                configuration = CompileCommands.buildConfiguration(flags, source, defineCache);
+                byKey.set(key, configuration);
+                commands.configurations.push(configuration);
+            }
+            configuration.units++;
+            commands.byFile.set(path.resolve(directory, entry.file), configuration);
+        }
+
+        for (const configuration of commands.configurations) {
+            if (!commands.defaultConfiguration || configuration.units > commands.defaultConfiguration.units) {
+                commands.defaultConfiguration = configuration;
+            }
+        }
+        return commands;
+    }
+
+    /**
+     * Get the command line definition of a macro as seen by a file
+     * Files without a compile command (and lookups without a file) use the most common configuration
+     */
+    getDefinitions(file: string | undefined, name: string): MacroDef[] | undefined {
+        const configuration = (file !== undefined && this.byFile.get(file)) || this.defaultConfiguration;
+        return configuration?.defines.get(name);
+    }
+
+    /**
+     * Include directories of all configurations, the most common configurations first
+     */
+    getIncludeDirectories(): string[] {
+        const directories = new Set<string>();
+        const sorted = this.configurations.slice().sort((a, b) => b.units - a.units);
+        for (const configuration of sorted) {
+            for (const directory of configuration.includeDirectories) {
+                directories.add(directory);
+            }
+        }
+        return Array.from(directories);
+    }
+
+    /**
+     * Translation units with forced includes, for the include graph
+     */
+    getForcedIncludesByFile(): Map<string, string[]> {
+        const forced = new Map<string, string[]>();
+        for (const [file, configuration] of this.byFile) {
+            if (configuration.forcedIncludes.length > 0) {
+                forced.set(file, configuration.forcedIncludes);
+            }
+        }
+        return forced;
+    }
+
+    get configurationCount(): number {
+        return this.configurations.length;
+    }
+
+    get unitCount(): number {
+        return this.byFile.size;
+    }
+
+    /**
+     * Reduce a command line to its preprocessor flags in normalized form:
+     * "D<arg>", "U<name>", "I<dir>" and "F<file>", with paths made absolute
+     */
+    private static extractFlags(args: string[], directory: string): string[] {
+        const flags: string[] = [];
+        const msvc = args.length > 0 && MSVC_DRIVER.test(args[0]);
+        for (let i = 1; i < args.length; i++) {
+            const arg = args[i];
+            if (arg.length < 2 || (arg[0] !== '-' && !(msvc && arg[0] === '/'))) {
+                continue;
+            }
+
+            // Options taking a value either attached (-DX) or as the next argument (-D X)
+            const option = CompileCommands.matchOption(arg);
+            if (!option) {
+                continue;
+            }
+            let value = arg.substring(option.prefix.length);
+            if (value === '') {
+                if (i + 1 >= args.length) {
+                    break;
+                }
+                value = args[++i];
+            }
+
+            if (option.kind === 'I' || option.kind === 'F') {
+                value = path.resolve(directory, value);
+            }
+            flags.push(option.kind + value);
+        }
+        return flags;
+    }
+
+    private static matchOption(arg: string): { prefix: string; kind: string } | undefined {
+        if (arg[0] === '-') {
+            if (arg.startsWith('-include') && !arg.startsWith('-include-')) {
+                return { prefix: '-include', kind: 'F' };
+            }
+            if (arg.startsWith('-isystem')) {
+                return { prefix: '-isystem', kind: 'I' };
+            }
+            if (arg.startsWith('-iquote')) {
+                return { prefix: '-iquote', kind: 'I' };
+            }
+        } else if (arg.startsWith('/FI')) {
+            return { prefix: '/FI', kind: 'F' };
+        }
+
+        // -D, -U, -I (and the MSVC /D, /U, /I spellings)
+        const kind = arg[1];
+        if (kind === 'D' || kind === 'U' || kind === 'I') {
+            return { prefix: arg.substring(0, 2), kind };
+        }
+        return undefined;
+    }
+
+    private static buildConfiguration(
+        flags: string[],
+        source: string,
+        defineCache: Map<string, MacroDef[]>
+    ): CommandLineConfiguration {
+        const configuration: CommandLineConfiguration = {
+            defines: new Map(),
+            includeDirectories: [],
+            forcedIncludes: [],
+            units: 0
+        };
+
+        for (const flag of flags) {
+            const value = flag.substring(1);
+            switch (flag[0]) {
+                case 'D': {
+                    let defs = defineCache.get(value);
+                    if (!defs) {
+                        const def = CompileCommands.parseDefine(value, source);
+                        if (!def) {
+                            continue;
+                        }
+                        defs = [def];
+                        defineCache.set(value, defs);
+                    }
+                    configuration.defines.set(defs[0].name, defs);
+                    break;
+                }
+                case 'U':
+                    configuration.defines.delete(value);
+                    break;
+                case 'I':
+                    configuration.includeDirectories.push(value);
+                    break;
+                case 'F':
+                    configuration.forcedIncludes.push(value);
+                    break;
+            }
+        }
+        return configuration;
+    }
+
+    /**
+     * Convert a -D argument (NAME, NAME=VALUE or NAME(params)=VALUE) into a definition
+     * As with the compiler, -DNAME defines NAME as 1
+     */
+    private static parseDefine(argument: string, source: string): MacroDef | undefined {
+        const match = DEFINE_ARGUMENT.exec(argument);
+        if (!match) {
+            return undefined;
+        }
+
+        const def: MacroDef = {
+            name: match[1],
+            body: match[3] === undefined ? '1' : match[3].trim(),
+            file: source,
+            line: 1,
+            isDefine: true
+        };
+        if (match[2] !== undefined) {
+            def.params = match[2].split(',').map(param => param.trim()).filter(param => param.length > 0);
+        }
+        return def;
+    }
+
+    /**
+     * Split a shell command line into arguments, honoring quotes and backslash escapes
+     */
+    static splitCommandLine(command: string): string[] {
+        const args: string[] = [];
+        let current = '';
+        let inArgument = false;
+        let quote = '';
+
+        for (let i = 0; i < command.length; i++) {
+            const char = command[i];
+            if (quote === "'") {
+                if (char === "'") {
+                    quote = '';
+                } else {
+                    current += char;
+                }
+            } else if (char === '\\' && i + 1 < command.length &&
+                (quote === '' || command[i + 1] === '"' || command[i + 1] === '\\')) {
+                current += command[++i];
+                inArgument = true;
+            } else if (quote === '"') {
+                if (char === '"') {
+                    quote = '';
+                } else {
+                    current += char;
+                }
+            } else if (char === '"' || char === "'") {
+                quote = char;
+                inArgument = true;
+            } else if (char === ' ' || char === '\t' || char === '\n') {
+                if (inArgument) {
+                    args.push(current);
+                    current = '';
+                    inArgument = false;
+                }
+            } else {
+                current += char;
+                inArgument = true;
+            }
+        }
+
+        if (inArgument) {
+            args.push(current);
+        }
+        return args;
+    }
+}
@@ -0,0 +1,509 @@
+/**
+ * Preprocessor conditional directives that open, switch or close a branch
+ */
+export type ConditionalKind = 'if' | 'ifdef' | 'ifndef' | 'elif' | 'else' | 'endif';
+
+export interface ConditionalDirective {
+    line: number;       // 0-based line of the directive
+    kind: ConditionalKind;
+    expression: string; // Controlling expression or macro name (empty for #else/#endif)
+}
+
+const CONDITIONAL_DIRECTIVE = /^#\s*(if|ifdef|ifndef|elif|else|endif)\b\s*(.*)$/;
+const NEGATED_DEFINED = /^!\s*defined\s*(?:\(\s*(\w+)\s*\)|(\w+))$/;
+
+interface ConditionFrame {
+    arms: string[];         // Conditions of the arms seen so far
+    current: string | null; // Condition of the active arm (null for include guards)
+}
+
+/**
+ * Tracks the condition guarding each line while walking a file top to bottom
+ *
+ * Conditions are kept as C preprocessor expressions, e.g. an #else arm of
+ * `#ifdef _WIN32` yields `!defined(_WIN32)`; nested branches are joined with `&&`.
+ */
+export class ConditionStack {
+    private frames: ConditionFrame[] = [];
+    private cached: string | undefined;
+
+    constructor(private readonly guardLine: number = -1) {}
+
+    /**
+     * Recognize a conditional directive in a whitespace-normalized, comment-free line
+     */
+    static parseDirective(line: string, index: number): ConditionalDirective | null {
+        const match = CONDITIONAL_DIRECTIVE.exec(line);
+        if (!match) {
+            return null;
+        }
+        return { line: index, kind: match[1] as ConditionalKind, expression: match[2].trim() };
+    }
+
+    /**
+     * Find the include guard of a file: an outermost #ifndef NAME immediately followed by
+     * #define NAME whose #endif closes the file. Returns the guard line or -1.
+     */
+    static findIncludeGuard(directives: ConditionalDirective[], lines: string[]): number {
+        const first = directives[0];
+        if (!first) {
+            return -1;
+        }
+
+        let next = first.line + 1;
+        while (next < lines.length && lines[next].trim() === '') {
+            next++;
+        }
+        return this.findIncludeGuardFollowedBy(directives, lines[next]);
+    }
+
+    /**
+     * findIncludeGuard given only the first non-blank line after the first directive
+     * (for callers that do not keep the lines of the file)
+     */
+    static findIncludeGuardFollowedBy(directives: ConditionalDirective[], followingLine: string | undefined): number {
+        const first = directives[0];
+        if (!first) {
+            return -1;
+        }
+
+        let guardName: string | undefined;
+        if (first.kind === 'ifndef') {
+            guardName = first.expression.split(/\s/)[0];
+        } else if (first.kind === 'if') {
+            const match = NEGATED_DEFINED.exec(first.expression);
+            guardName = match ? (match[1] || match[2]) : undefined;
+        }
+        if (!guardName) {
+            return -1;
+        }
+
+        if (followingLine === undefined || !new RegExp(`^\\s*#\\s*define\\s+${guardName}\\b`).test(followingLine)) {
+            return -1;
+        }
+
+        // The guard must span the whole file without alternative arms
+        let depth = 0;
+        for (let i = 0; i < directives.length; i++) {
+            const kind = directives[i].kind;
+            if (kind === 'if' || kind === 'ifdef' || kind === 'ifndef') {
+                depth++;
+            } else if (kind === 'endif') {
+                depth--;
+                if (depth === 0) {
+                    return i === directives.length - 1 ? first.line : -1;
+                }
+            } else if (depth === 1) {
+                return -1;
+            }
+        }
+        return -1;
+    }
+
+    apply(directive: ConditionalDirective): void {
+        const top = this.frames[this.frames.length - 1];
+        switch (directive.kind) {
+            case 'if':
+                if (directive.line === this.guardLine) {
+                    this.frames.push({ arms: [], current: null });
+                } else {
+                    this.push(`(${directive.expression})`);
+                }
+                break;
+            case 'ifdef':
+                this.push(`defined(${directive.expression.split(/\s/)[0]})`);
+                break;
+            case 'ifndef':
+                if (directive.line === this.guardLine) {
+                    this.frames.push({ arms: [], current: null });
+                } else {
+                    this.push(`!defined(${directive.expression.split(/\s/)[0]})`);
+                }
+                break;
+            case 'elif':
+                if (top && top.current !== null) {
+                    const arm = `(${directive.expression})`;
+                    top.current = [...top.arms.map(ConditionStack.negate), arm].join(' && ');
+                    top.arms.push(arm);
+                }
+                break;
+            case 'else':
+                if (top && top.current !== null) {
+                    top.current = top.arms.map(ConditionStack.negate).join(' && ');
+                }
+                break;
+            case 'endif':
+                this.frames.pop();
+                break;
+        }
+        this.cached = undefined;
+    }
+
+    /**
+     * Condition of the current line, or undefined when it is unconditional
+     */
+    current(): string | undefined {
+        if (this.cached === undefined) {
+            this.cached = this.frames
+                .filter(frame => frame.current !== null)
+                .map(frame => frame.current)
+                .join(' && ');
+        }
+        return this.cached || undefined;
+    }
+
+    private push(condition: string): void {
+        this.frames.push({ arms: [condition], current: condition });
+    }
+
+    private static negate(condition: string): string {
+        return condition.startsWith('!defined(') ? condition.substring(1) : `!${condition}`;
+    }
+}
+
+/** Three-valued preprocessor value: a number, or undefined when it cannot be decided */
+type Value = number | undefined;
+
+interface EvaluationContext {
+    lookup(name: string, depth: number): Value;
+    isDefined(name: string): boolean | undefined;
+    depth: number;
+}
+
+type CompiledExpression = (context: EvaluationContext) => Value;
+
+const TOKEN = /\s*(0[xX][0-9a-fA-F]+|0[bB][01]+|\d+|[A-Za-z_]\w*|'(?:[^'\\]|\\.)+'|<<|>>|<=|>=|==|!=|&&|\|\||[-+*/%<>!~&|^?:(),])/y;
+const MAX_VALUE_DEPTH = 8;
+
+const BINARY_PRECEDENCE: Record<string, number> = {
+    '||': 2, '&&': 3, '|': 4, '^': 5, '&': 6,
+    '==': 7, '!=': 7, '<': 8, '<=': 8, '>': 8, '>=': 8,
+    '<<': 9, '>>': 9, '+': 10, '-': 10, '*': 11, '/': 11, '%': 11
+};
+
+const unknown: CompiledExpression = () => undefined;
+
+/**
+ * Compiles #if expressions into closures once; evaluation is then a few function calls
+ */
+class ExpressionCompiler {
+    private tokens: string[] = [];
+    private position = 0;
+
+    compile(expression: string): CompiledExpression {
+        this.tokens = [];
+        this.position = 0;
+
+        const source = expression.trim();
+        let index = 0;
+        while (index < source.length) {
+            TOKEN.lastIndex = index;
+            const match = TOKEN.exec(source);
+            if (!match) {
+                return unknown;
+            }
+            this.tokens.push(match[1]);
+            index = TOKEN.lastIndex;
+        }
+
+        try {
+            const compiled = this.parseExpression(0);
+            return this.position === this.tokens.length ? compiled : unknown;
+        } catch {
+            return unknown;
+        }
+    }
+
+    private peek(): string | undefined {
+        return this.tokens[this.position];
+    }
+
+    private next(): string {
+        const token = this.tokens[this.position++];
+        if (token === undefined) {
+            throw new Error('Unexpected end of expression');
+        }
+        return token;
+    }
+
+    private expect(token: string): void {
+        if (this.next() !== token) {
+            throw new Error(`Expected ${token}`);
+        }
+    }
+
+    private parseExpression(minPrecedence: number): CompiledExpression {
+        let left = this.parseUnary();
+
+        for (;;) {
+            const operator = this.peek();
+            if (operator === '?' && minPrecedence <= 1) {
+                this.next();
+                const whenTrue = this.parseExpression(0);
+                this.expect(':');
+                const whenFalse = this.parseExpression(1);
+                left = ExpressionCompiler.conditional(left, whenTrue, whenFalse);
+                continue;
+            }
+
+            const precedence = operator !== undefined ? BINARY_PRECEDENCE[operator] : undefined;
+            if (precedence === undefined || precedence < minPrecedence) {
+                return left;
+            }
+            this.next();
+            const right = this.parseExpression(precedence + 1);
+            left = ExpressionCompiler.binary(operator!, left, right);
+        }
+    }
+
+    private parseUnary(): CompiledExpression {
+        const token = this.next();
+
+        if (token === '!' || token === '~' || token === '-' || token === '+') {
+            const operand = this.parseUnary();
+            switch (token) {
+                case '!': return context => { const v = operand(context); return v === undefined ? undefined : (v ? 0 : 1); };
+                case '~': return context => { const v = operand(context); return v === undefined ? undefined : ~v; };
+                case '-': return context => { const v = operand(context); return v === undefined ? undefined : -v; };
+                default: return operand;
+            }
+        }
+
+        if (token === '(') {
+            const inner = this.parseExpression(0);
+            this.expect(')');
+            return inner;
+        }
+
+        if (token === 'defined') {
+            const parenthesized = this.peek() === '(';
+            if (parenthesized) {
+                this.next();
+            }
+            const name = this.next();
+            if (parenthesized) {
+                this.expect(')');
+            }
+            return context => {
+                const defined = context.isDefined(name);
+                return defined === undefined ? undefined : (defined ? 1 : 0);
+            };
+        }
+
+        if (/^\d/.test(token)) {
+            const value = /^0[xX]/.test(token) ? parseInt(token.substring(2), 16)
+                : /^0[bB]/.test(token) ? parseInt(token.substring(2), 2)
+                : /^0\d/.test(token) ? parseInt(token, 8)
+                : parseInt(token, 10);
+            // Integer suffixes (u, l, ul, ll) are tokenized as a separate identifier
+            if (/^[uUlL]+$/.test(this.peek() || '')) {
+                this.next();
+            }
+            return () => value;
+        }
+
+        if (token.startsWith("'")) {
+            const body = token.slice(1, -1);
+            const value = body.length === 1 ? body.charCodeAt(0) : undefined;
+            return () => value;
+        }
+
+        if (/^[A-Za-z_]/.test(token)) {
+            // Function-like macro invocations and __has_include() cannot be decided here
+            if (this.peek() === '(') {
+                this.skipParenthesized();
+                return unknown;
+            }
+            if (token === 'true') {
+                return () => 1;
+            }
+            if (token === 'false') {
+                return () => 0;
+            }
+            return context => context.lookup(token, context.depth);
+        }
+
+        throw new Error(`Unexpected token ${token}`);
+    }
+
+    private skipParenthesized(): void {
+        let depth = 0;
+        do {
+            const token = this.next();
+            if (token === '(') {
+                depth++;
+            } else if (token === ')') {
+                depth--;
+            }
+        } while (depth > 0);
+    }
+
+    private static conditional(test: CompiledExpression, whenTrue: CompiledExpression, whenFalse: CompiledExpression): CompiledExpression {
+        return context => {
+            const v = test(context);
+            if (v !== undefined) {
+                return v ? whenTrue(context) : whenFalse(context);
+            }
+            const a = whenTrue(context);
+            return a !== undefined && a === whenFalse(context) ? a : undefined;
+        };
+    }
+
+    private static binary(operator: string, left: CompiledExpression, right: CompiledExpression): CompiledExpression {
+        switch (operator) {
+            // Logical operators short-circuit on a known operand even when the other is unknown
+            case '&&':
+                return context => {
+                    const a = left(context);
+                    if (a === 0) { return 0; }
+                    const b = right(context);
+                    if (b === 0) { return 0; }
+                    return a === undefined || b === undefined ? undefined : 1;
+                };
+            case '||':
+                return context => {
+                    const a = left(context);
+                    if (a !== undefined && a !== 0) { return 1; }
+                    const b = right(context);
+                    if (b !== undefined && b !== 0) { return 1; }
+                    return a === undefined || b === undefined ? undefined : 0;
+                };
+        }
+
+        const apply = ExpressionCompiler.arithmetic(operator);
+        return context => {
+            const a = left(context);
+            const b = right(context);
+            return a === undefined || b === undefined ? undefined : apply(a, b);
+        };
+    }
+
+    private static arithmetic(operator: string): (a: number, b: number) => Value {
+        switch (operator) {
+            case '|': return (a, b) => a | b;
+            case '^': return (a, b) => a ^ b;
+            case '&': return (a, b) => a & b;
+            case '==': return (a, b) => (a === b ? 1 : 0);
+            case '!=': return (a, b) => (a !== b ? 1 : 0);
+            case '<': return (a, b) => (a < b ? 1 : 0);
+            case '<=': return (a, b) => (a <= b ? 1 : 0);
+            case '>': return (a, b) => (a > b ? 1 : 0);
+            case '>=': return (a, b) => (a >= b ? 1 : 0);
+            case '<<': return (a, b) => a << b;
+            case '>>': return (a, b) => a >> b;
+            case '+': return (a, b) => a + b;
+            case '-': return (a, b) => a - b;
+            case '*': return (a, b) => a * b;
+            case '/': return (a, b) => (b === 0 ? undefined : Math.trunc(a / b));
+            case '%': return (a, b) => (b === 0 ? undefined : a % b);
+            default: return () => undefined;
+        }
+    }
+}
+
+/**
+ * Decides whether a definition's guarding condition holds under the active configuration
+ *
+ * The configuration lists predefined macros as "NAME" or "NAME=VALUE". Evaluation is
+ * three-valued: macros defined somewhere in the project but not configured are unknown,
+ * and only conditions that are known to be false deactivate a definition.
+ */
+export class ConditionEvaluator {
+    // Compiled expressions are independent of the configuration and shared by all evaluators
+    private static compiledCache = new Map<string, CompiledExpression>();
+    private static compiler = new ExpressionCompiler();
+
+    private configured = new Map<string, string>();
+    private results = new Map<string, boolean>();
+    private known = new Map<string, boolean>();
+    private context: EvaluationContext;
+
+    constructor(configuration: readonly string[], private isProjectMacro: (name: string) => boolean) {
+        for (const entry of configuration) {
+            const separator = entry.indexOf('=');
+            const name = (separator === -1 ? entry : entry.substring(0, separator)).trim();
+            if (/^[A-Za-z_]\w*$/.test(name)) {
+                this.configured.set(name, separator === -1 ? '1' : entry.substring(separator + 1).trim());
+            }
+        }
+
+        this.context = {
+            depth: 0,
+            isDefined: name => this.configured.has(name) ? true : (this.isProjectMacro(name) ? undefined : false),
+            lookup: (name, depth) => this.lookup(name, depth)
+        };
+    }
+
+    /**
+     * True unless the condition is known to be false
+     */
+    isActive(condition: string | undefined): boolean {
+        if (!condition) {
+            return true;
+        }
+
+        let active = this.results.get(condition);
+        if (active === undefined) {
+            this.context.depth = 0;
+            active = ConditionEvaluator.compile(condition)(this.context) !== 0;
+            this.results.set(condition, active);
+        }
+        return active;
+    }
+
+    /**
+     * True only when the condition is known to hold
+     */
+    holds(condition: string | undefined): boolean {
+        if (!condition) {
+            return true;
+        }
+
+        let holds = this.known.get(condition);
+        if (holds === undefined) {
+            this.context.depth = 0;
+            const value = ConditionEvaluator.compile(condition)(this.context);
+            holds = value !== undefined && value !== 0;
+            this.known.set(condition, holds);
+        }
+        return holds;
+    }
+
+    filter<T extends { condition?: string }>(defs: T[]): T[] {
+        return defs.every(def => this.isActive(def.condition)) ? defs : defs.filter(def => this.isActive(def.condition));
+    }
+
+    /**
+     * Forget memoized results after the set of project macros changed
+     */
+    reset(): void {
+        this.results.clear();
+        this.known.clear();
+    }
+
+    private lookup(name: string, depth: number): Value {
+        const value = this.configured.get(name);
+        if (value === undefined) {
+            // Unconfigured identifiers are 0 in #if, unless the project may define them
+            return this.isProjectMacro(name) ? undefined : 0;
+        }
+        if (depth >= MAX_VALUE_DEPTH) {
+            return undefined;
+        }
+
+        const saved = this.context.depth;
+        this.context.depth = depth + 1;
+        const result = ConditionEvaluator.compile(value)(this.context);
+        this.context.depth = saved;
+        return result;
+    }
+
+    private static compile(expression: string): CompiledExpression {
+        let compiled = ConditionEvaluator.compiledCache.get(expression);
+        if (!compiled) {
+            compiled = ConditionEvaluator.compiler.compile(expression);
+            ConditionEvaluator.compiledCache.set(expression, compiled);
+        }
+        return compiled;
+    }
+}
@@ -0,0 +1,265 @@
+import * as path from 'path';
+import { Worker } from 'worker_threads';
+
+export type SqlValue = string | number | null;
+
+export interface SqlStatement {
+    sql: string;
+    params: SqlValue[];
+}
+
+/**
+ * Synchronous connection: node:sqlite DatabaseSync or the in-memory fallback
+ */
+export interface DatabaseInterface {
+    prepare(sql: string): any;
+    exec(sql: string): any;
+    close(): void;
+}
+
+export type DatabaseRequest =
+    | { kind: 'exec'; sql: string }
+    | { kind: 'run' | 'get' | 'all'; sql: string; params: SqlValue[] }
+    | { kind: 'batch'; statements: SqlStatement[] }
+    | { kind: 'close' };
+
+/** Results of one message, in request order */
+export type DatabaseResponse = Array<{ value?: unknown; error?: string }>;
+
+interface PendingRequest {
+    request: DatabaseRequest;
+    resolve: (value: any) => void;
+    reject: (error: Error) => void;
+}
+
+/**
+ * Runs requests on a synchronous connection, reusing prepared statements
+ * Shared by the worker and the in-process fallback so both behave the same
+ */
+export class RequestExecutor {
+    private statements = new Map<string, any>();
+
+    constructor(private connection: DatabaseInterface) {}
+
+    execute(requests: DatabaseRequest[]): DatabaseResponse {
+        return requests.map(request => {
+            try {
+                return { value: this.executeOne(request) };
+            } catch (error) {
+                return { error: error instanceof Error ? error.message : String(error) };
+            }
+        });
+    }
+
+    private executeOne(request: DatabaseRequest): unknown {
+        switch (request.kind) {
+            case 'exec':
+                this.connection.exec(request.sql);
+                return undefined;
+            case 'run':
+                this.prepare(request.sql).run(...request.params);
+                return undefined;
+            case 'get':
+                return this.prepare(request.sql).get(...request.params);
+            case 'all':
+                return this.prepare(request.sql).all(...request.params);
+            case 'batch':
+                for (const statement of request.statements) {
+                    this.prepare(statement.sql).run(...statement.params);
+                }
+                return undefined;
+            case 'close':
+                this.statements.clear();
+                this.connection.close();
+                return undefined;
+        }
+    }
+
+    private prepare(sql: string): any {
+        let statement = this.statements.get(sql);
+        if (!statement) {
+            statement = this.connection.prepare(sql);
+            this.statements.set(sql, statement);
+        }
+        return statement;
+    }
+}
+
+/**
+ * Asynchronous access to the index database
+ *
+ * With node:sqlite the connection lives in a dedicated worker thread, so queries and
+ * commits never block the extension host. Requests made in the same tick are sent as
+ * one message and answered with one message. Requests run in the order they are made,
+ * so a write does not need to be awaited before the next request. Without node:sqlite
+ * the in-memory fallback answers in-process behind the same interface.
+ */
+export class DatabaseClient {
+    private queue: PendingRequest[] = [];
+    private inFlight = new Map<number, PendingRequest[]>();
+    private nextMessageId = 1;
+    private flushScheduled = false;
+    private failure: Error | null = null;
+    private writeError: Error | null = null;
+
+    private constructor(
+        private worker: Worker | null,
+        private executor: RequestExecutor | null
+    ) {
+        worker?.on('message', (message: { id: number; results: DatabaseResponse }) => this.receive(message.id, message.results));
+        worker?.on('error', error => this.fail(error));
+        worker?.on('exit', code => this.fail(new Error(`Database worker exited with code ${code}`)));
+    }
+
+    /**
+     * Open a database file in a worker thread
+     * Rejects when worker threads or node:sqlite are unavailable
+     */
+    static openWorker(dbPath: string): Promise<DatabaseClient> {
+        return new Promise((resolve, reject) => {
+            const worker = new Worker(path.join(__dirname, 'databaseWorker.js'), { workerData: { dbPath } });
+            const onError = (error: Error) => {
+                worker.terminate();
+                reject(error);
+            };
+            worker.once('error', onError);
+            worker.once('message', (message: { ready: boolean; error?: string }) => {
+                worker.off('error', onError);
+                if (!message.ready) {
+                    worker.terminate();
+                    reject(new Error(message.error));
+                    return;
+                }
+                // The worker keeps the process alive only while requests are outstanding
+                worker.unref();
+                resolve(new DatabaseClient(worker, null));
+            });
+        });
+    }
+
+    /**
+     * Serve requests in-process from a synchronous connection
+     */
+    static local(connection: DatabaseInterface): DatabaseClient {
+        return new DatabaseClient(null, new RequestExecutor(connection));
+    }
+
+    get isWorker(): boolean {
+        return this.worker !== null;
+    }
+
+    exec(sql: string): Promise<void> {
+        return this.request({ kind: 'exec', sql });
+    }
+
+    run(sql: string, ...params: SqlValue[]): Promise<void> {
+        return this.request({ kind: 'run', sql, params });
+    }
+
+    get<T>(sql: string, ...params: SqlValue[]): Promise<T | undefined> {
+        return this.request({ kind: 'get', sql, params });
+    }
+
+    all<T>(sql: string, ...params: SqlValue[]): Promise<T[]> {
+        return this.request({ kind: 'all', sql, params });
+    }
+
+    /**
+     * Run write statements in order as a single request
+     */
+    batch(statements: SqlStatement[]): Promise<void> {
+        return statements.length === 0 ? Promise.resolve() : this.request({ kind: 'batch', statements });
+    }
+
+    /**
+     * Queue write statements without waiting for them
+     * A failure is reported by the next sync()
+     */
+    write(statements: SqlStatement[]): void {
+        this.batch(statements).catch((error: Error) => this.writeError ??= error);
+    }
+
+    /**
+     * Wait until the requests made so far have run
+     * Rejects with the first failed write() since the previous sync()
+     */
+    async sync(): Promise<void> {
+        await this.request({ kind: 'batch', statements: [] });
+        const error = this.writeError;
+        this.writeError = null;
+        if (error) {
+            throw error;
+        }
+    }
+
+    /**
+     * Close the connection once the requests made so far have run
+     */
+    async close(): Promise<void> {
+        try {
+            await this.request({ kind: 'close' });
+        } finally {
+            await this.worker?.terminate();
+        }
+    }
+
+    private request<T>(request: DatabaseRequest): Promise<T> {
+        if (this.failure) {
+            return Promise.reject(this.failure);
+        }
+        return new Promise<T>((resolve, reject) => {
+            this.queue.push({ request, resolve, reject });
+            if (!this.flushScheduled) {
+                this.flushScheduled = true;
+                queueMicrotask(() => this.flush());
+            }
+        });
+    }
+
+    private flush(): void {
+        this.flushScheduled = false;
+        const pending = this.queue;
+        this.queue = [];
+        if (pending.length === 0) {
+            return;
+        }
+
+        const id = this.nextMessageId++;
+        const requests = pending.map(entry => entry.request);
+        this.inFlight.set(id, pending);
+        if (this.executor) {
+            this.receive(id, this.executor.execute(requests));
+        } else {
+            this.worker!.ref();
+            this.worker!.postMessage({ id, requests });
+        }
+    }
+
+    private receive(id: number, results: DatabaseResponse): void {
+        const pending = this.inFlight.get(id);
+        this.inFlight.delete(id);
+        if (this.inFlight.size === 0) {
+            this.worker?.unref();
+        }
+        pending?.forEach((entry, index) => {
+            const result = results[index];
+            if (result?.error !== undefined) {
+                entry.reject(new Error(result.error));
+            } else {
+                entry.resolve(result?.value);
+            }
+        });
+    }
+
+    /**
+     * The worker is gone: fail everything outstanding and every later request
+     */
+    private fail(error: Error): void {
+        this.failure ??= error;
+        for (const pending of [...this.inFlight.values(), this.queue]) {
+            pending.forEach(entry => entry.reject(this.failure!));
+        }
+        this.inFlight.clear();
+        this.queue = [];
+    }
+}
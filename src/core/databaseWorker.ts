@@ -0,0 +1,18 @@
+import { parentPort, workerData } from 'worker_threads';
+import { DatabaseRequest, RequestExecutor } from './databaseClient';
+
+/**
+ * Worker thread owning the SQLite connection of the index (see DatabaseClient)
+ */
+let executor: RequestExecutor;
+try {
+    const { DatabaseSync } = require('node:sqlite');
+    executor = new RequestExecutor(new DatabaseSync(workerData.dbPath));
+    parentPort!.postMessage({ ready: true });
+} catch (error) {
+    parentPort!.postMessage({ ready: false, error: error instanceof Error ? error.message : String(error) });
+}
+
+parentPort!.on('message', (message: { id: number; requests: DatabaseRequest[] }) => {
+    parentPort!.postMessage({ id: message.id, results: executor.execute(message.requests) });
+});
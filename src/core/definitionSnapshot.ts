@@ -0,0 +1,121 @@
+import { MacroDef, MacroUndef } from './macroDb';
+import { IncludeDirective } from './includeGraph';
+
+/**
+ * New contents of one file for the next generation of definitions
+ * Paths in definitions and undefs are absolute
+ */
+export interface FileDefinitions {
+    defs: MacroDef[];
+    undefs: MacroUndef[];
+    includes: IncludeDirective[];
+}
+
+/**
+ * Derives the next generation of definitions from the published one, copy-on-write
+ *
+ * The published maps and arrays are never modified: the maps are copied on the first
+ * change, and the array of a name when the name is first changed. Names the update does
+ * not touch keep sharing their arrays with the previous generation.
+ */
+export class SnapshotBuilder {
+    private definitions: Map<string, MacroDef[]>;
+    private undefs: Map<string, MacroUndef[]>;
+    private copiedDefinitions = false;
+    private copiedUndefs = false;
+    // Arrays created by this builder, which may be modified in place
+    private ownedDefinitions = new Set<string>();
+    private ownedUndefs = new Set<string>();
+
+    constructor(definitions: Map<string, MacroDef[]>, undefs: Map<string, MacroUndef[]>) {
+        this.definitions = definitions;
+        this.undefs = undefs;
+    }
+
+    /**
+     * Replace the definitions and undefs of a file
+     * Returns the definitions the file had before
+     */
+    replaceFile(file: string, contents: FileDefinitions | null): MacroDef[] {
+        const previous: MacroDef[] = [];
+
+        for (const [name, defs] of this.definitions) {
+            if (!defs.some(def => def.file === file)) {
+                continue;
+            }
+            const kept: MacroDef[] = [];
+            for (const def of defs) {
+                (def.file === file ? previous : kept).push(def);
+            }
+            this.setDefinitions(name, kept);
+        }
+        for (const [name, undefs] of this.undefs) {
+            if (undefs.some(undef => undef.file === file)) {
+                this.setUndefs(name, undefs.filter(undef => undef.file !== file));
+            }
+        }
+
+        for (const def of contents?.defs ?? []) {
+            this.ownDefinitions(def.name).push(def);
+        }
+        for (const undef of contents?.undefs ?? []) {
+            this.ownUndefs(undef.name).push(undef);
+        }
+        return previous;
+    }
+
+    /**
+     * The maps of the next generation; names left without definitions are dropped
+     */
+    build(): { definitions: Map<string, MacroDef[]>; undefs: Map<string, MacroUndef[]> } {
+        for (const name of this.ownedDefinitions) {
+            if (this.definitions.get(name)?.length === 0) {
+                this.definitions.delete(name);
+            }
+        }
+        for (const name of this.ownedUndefs) {
+            if (this.undefs.get(name)?.length === 0) {
+                this.undefs.delete(name);
+            }
+        }
+        return { definitions: this.definitions, undefs: this.undefs };
+    }
+
+    private setDefinitions(name: string, defs: MacroDef[]): void {
+        if (!this.copiedDefinitions) {
+            this.definitions = new Map(this.definitions);
+            this.copiedDefinitions = true;
+        }
+        this.definitions.set(name, defs);
+        this.ownedDefinitions.add(name);
+    }
+
+    private setUndefs(name: string, undefs: MacroUndef[]): void {
+        if (!this.copiedUndefs) {
+            this.undefs = new Map(this.undefs);
+            this.copiedUndefs = true;
+        }
+        this.undefs.set(name, undefs);
+        this.ownedUndefs.add(name);
+    }
+
+    private ownDefinitions(name: string): MacroDef[] {
+        const defs = this.definitions.get(name);
+        if (defs && this.ownedDefinitions.has(name)) {
+            return defs;
+        }
+        const owned = defs ? defs.slice() : [];
+        this.setDefinitions(name, owned);
+        return owned;
+    }
+
+    private ownUndefs(name: string): MacroUndef[] {
+        const undefs = this.undefs.get(name);
+        if (undefs && this.ownedUndefs.has(name)) {
+            return undefs;
+        }
+        const owned = undefs ? undefs.slice() : [];
+        this.setUndefs(name, owned);
+        return owned;
+    }
+}
@@ -0,0 +1,390 @@
+import * as vscode from 'vscode';
+import { MacroDef, MacroUndef } from './macroDb';
+import { MacroParser } from './macroParser';
+import { ConditionalDirective, ConditionStack } from './conditionEvaluator';
+import { IncludeDirective } from './includeGraph';
+
+/**
+ * Edits touching any of these constructs can change definitions outside the edited lines
+ * (block comments, brace blocks, multi-line type declarations), so they force a full reparse
+ */
+const NON_LOCAL_CONSTRUCT = /[{}]|\/\*|\*\/|\b(?:typedef|struct|union|enum)\b/;
+
+/** Inside preprocessor directives only block comments can reach other lines */
+const BLOCK_COMMENT_DELIMITER = /\/\*|\*\//;
+
+/** Conditional directives change the condition of every line up to the matching #endif */
+const CONDITIONAL_DIRECTIVE_LINE = /^\s*#\s*(?:if|ifdef|ifndef|elif|else|endif)\b/;
+
+const LINE_BREAK = /\r\n|\r|\n/;
+
+/**
+ * Definitions parsed from an unsaved editor buffer
+ *
+ * The overlay keeps a shadow copy of the buffer lines so that each change event can be
+ * applied incrementally: only the edited lines (widened to whole #define continuations)
+ * are re-parsed, and definitions below the edit are shifted instead of re-parsed.
+ * Edits that may affect other lines fall back to a full reparse of the buffer.
+ */
+export class DocumentOverlay {
+    // Whether the last applied change event changed any definition, undef or include
+    private changedDefinitions = true;
+
+    private constructor(
+        readonly filePath: string,
+        public version: number,
+        private lines: string[],
+        private opaque: boolean[],
+        private defs: MacroDef[],
+        private byName: Map<string, MacroDef[]>,
+        private undefs: MacroUndef[],
+        private includes: IncludeDirective[],
+        private directives: ConditionalDirective[],
+        private guardLine: number
+    ) {}
+
+    /**
+     * Build an overlay by parsing the whole buffer
+     */
+    static fromDocument(document: vscode.TextDocument): DocumentOverlay {
+        const text = document.getText();
+        const lines = text.split(LINE_BREAK);
+        const parsed = MacroParser.parseSource(text, document.uri.fsPath);
+        return new DocumentOverlay(
+            document.uri.fsPath,
+            document.version,
+            lines,
+            DocumentOverlay.computeOpaqueLines(lines),
+            parsed.defs,
+            DocumentOverlay.indexByName(parsed.defs),
+            parsed.undefs,
+            parsed.includes,
+            parsed.directives,
+            parsed.guardLine
+        );
+    }
+
+    getDefinitions(name: string): MacroDef[] | undefined {
+        return this.byName.get(name);
+    }
+
+    getAllDefinitions(): MacroDef[] {
+        return this.defs;
+    }
+
+    getUndefs(): MacroUndef[] {
+        return this.undefs;
+    }
+
+    getIncludes(): IncludeDirective[] {
+        return this.includes;
+    }
+
+    /**
+     * Whether the last change event applied by applyChanges changed any definition,
+     * undef or include (including their line numbers); edits elsewhere leave lookups valid
+     */
+    hasChangedDefinitions(): boolean {
+        return this.changedDefinitions;
+    }
+
+    /**
+     * Whether another overlay of the same buffer parsed to the same definitions, undefs and includes
+     */
+    hasSameDefinitions(other: DocumentOverlay): boolean {
+        return DocumentOverlay.sameEntries(this.defs, other.defs) &&
+            DocumentOverlay.sameEntries(this.undefs, other.undefs) &&
+            DocumentOverlay.sameEntries(this.includes, other.includes);
+    }
+
+    /**
+     * Apply a change event incrementally
+     * Returns false when the edit cannot be handled locally and the caller must rebuild
+     */
+    applyChanges(document: vscode.TextDocument, changes: readonly vscode.TextDocumentContentChangeEvent[]): boolean {
+        if (document.version !== this.version + 1) {
+            return false;
+        }
+
+        // Dirty line ranges [start, end] in post-edit coordinates
+        const dirty: Array<[number, number]> = [];
+        let defs = this.defs;
+        let undefs = this.undefs;
+        let includes = this.includes;
+
+        // VS Code reports changes in descending document order, so each range
+        // is still valid against the shadow after applying the previous ones
+        for (const change of changes) {
+            const startLine = change.range.start.line;
+            const oldEndLine = change.range.end.line;
+            if (oldEndLine >= this.lines.length) {
+                return false;
+            }
+
+            if (!this.isLocal(startLine, oldEndLine)) {
+                return false;
+            }
+            for (let i = startLine; i <= oldEndLine; i++) {
+                if (this.opaque[i]) {
+                    return false;
+                }
+            }
+
+            const prefix = this.lines[startLine].substring(0, change.range.start.character);
+            const suffix = this.lines[oldEndLine].substring(change.range.end.character);
+            const newLines = (prefix + change.text + suffix).split(LINE_BREAK);
+
+            // Adding or removing a trailing backslash re-attaches the following line
+            const oldContinues = this.lines[oldEndLine].trimEnd().endsWith('\\');
+            const newContinues = newLines[newLines.length - 1].trimEnd().endsWith('\\');
+            if (oldContinues !== newContinues) {
+                return false;
+            }
+            const delta = newLines.length - (oldEndLine - startLine + 1);
+
+            this.lines.splice(startLine, oldEndLine - startLine + 1, ...newLines);
+            this.opaque.splice(startLine, oldEndLine - startLine + 1, ...newLines.map(() => false));
+
+            defs = DocumentOverlay.replaceLines(defs, startLine, oldEndLine, delta);
+            undefs = DocumentOverlay.replaceLines(undefs, startLine, oldEndLine, delta);
+            includes = DocumentOverlay.replaceLines(includes, startLine, oldEndLine, delta);
+
+            for (const range of dirty) {
+                if (range[0] > oldEndLine) {
+                    range[0] += delta;
+                    range[1] += delta;
+                }
+            }
+            if (delta !== 0) {
+                this.directives = this.directives.map(directive =>
+                    directive.line > oldEndLine ? { ...directive, line: directive.line + delta } : directive);
+                if (this.guardLine > oldEndLine) {
+                    this.guardLine += delta;
+                }
+            }
+            dirty.push([startLine, startLine + newLines.length - 1]);
+        }
+
+        for (const [start, end] of DocumentOverlay.mergeRanges(dirty)) {
+            // Widen to complete #define continuations so multi-line macros are parsed whole
+            let regionStart = start;
+            let regionEnd = end;
+            while (regionStart > 0 && this.lines[regionStart - 1].trimEnd().endsWith('\\')) {
+                regionStart--;
+            }
+            while (regionEnd + 1 < this.lines.length && this.lines[regionEnd].trimEnd().endsWith('\\')) {
+                regionEnd++;
+            }
+
+            if (!this.isLocal(regionStart, regionEnd)) {
+                return false;
+            }
+            const regionText = this.lines.slice(regionStart, regionEnd + 1).join('\n');
+
+            const region = MacroParser.parseSource(regionText, this.filePath, { conditions: this.conditionsAt(regionStart) });
+            defs = DocumentOverlay.replaceLines(defs, regionStart, regionEnd, 0)
+                .concat(region.defs.map(def => ({ ...def, line: def.line + regionStart })));
+            undefs = DocumentOverlay.replaceLines(undefs, regionStart, regionEnd, 0)
+                .concat(region.undefs.map(undef => ({ ...undef, line: undef.line + regionStart })));
+            includes = DocumentOverlay.replaceLines(includes, regionStart, regionEnd, 0)
+                .concat(region.includes.map(include => ({ ...include, line: include.line + regionStart })));
+        }
+
+        defs.sort((a, b) => a.line - b.line);
+        undefs.sort((a, b) => a.line - b.line);
+        includes.sort((a, b) => a.line - b.line);
+        MacroParser.assignEndLines(defs, undefs);
+        // End lines are assigned in place, so a changed end line always comes with a changed undef
+        this.changedDefinitions = !DocumentOverlay.sameEntries(this.defs, defs) ||
+            !DocumentOverlay.sameEntries(this.undefs, undefs) ||
+            !DocumentOverlay.sameEntries(this.includes, includes);
+        this.defs = defs;
+        this.undefs = undefs;
+        this.includes = includes;
+        this.byName = DocumentOverlay.indexByName(defs);
+        this.version = document.version;
+        return true;
+    }
+
+    /**
+     * Replay the conditional directives above a line to get the condition state there
+     */
+    private conditionsAt(line: number): ConditionStack {
+        const conditions = new ConditionStack(this.guardLine);
+        for (const directive of this.directives) {
+            if (directive.line >= line) {
+                break;
+            }
+            conditions.apply(directive);
+        }
+        return conditions;
+    }
+
+    /**
+     * Check that re-parsing lines [start, end] in isolation gives the same result as a full parse
+     */
+    private isLocal(start: number, end: number): boolean {
+        const firstDirective = this.directives[0];
+        for (let i = start; i <= end; i++) {
+            const line = this.lines[i];
+            // The line after the first directive decides whether that directive is an include guard
+            if (firstDirective && i > firstDirective.line &&
+                this.lines.slice(firstDirective.line + 1, i).every(previous => previous.trim() === '')) {
+                return false;
+            }
+            if (DocumentOverlay.isDirectiveLine(this.lines, i)) {
+                if (BLOCK_COMMENT_DELIMITER.test(line) || CONDITIONAL_DIRECTIVE_LINE.test(this.lines[DocumentOverlay.directiveStart(this.lines, i)])) {
+                    return false;
+                }
+            } else if (NON_LOCAL_CONSTRUCT.test(line)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    private static directiveStart(lines: string[], index: number): number {
+        while (index > 0 && lines[index - 1].trimEnd().endsWith('\\')) {
+            index--;
+        }
+        return index;
+    }
+
+    /**
+     * A directive line starts with '#' or continues the previous line with a trailing backslash
+     */
+    private static isDirectiveLine(lines: string[], index: number): boolean {
+        return /^\s*#/.test(lines[index]) || (index > 0 && lines[index - 1].trimEnd().endsWith('\\'));
+    }
+
+    /**
+     * Drop entries on the replaced 0-based lines [start, end] and shift entries below by delta
+     * Entries carry 1-based line numbers
+     */
+    private static replaceLines<T extends { line: number }>(items: T[], start: number, end: number, delta: number): T[] {
+        return items
+            .filter(item => item.line - 1 < start || item.line - 1 > end)
+            .map(item => item.line - 1 > end && delta !== 0 ? { ...item, line: item.line + delta } : item);
+    }
+
+    private static indexByName(defs: MacroDef[]): Map<string, MacroDef[]> {
+        const byName = new Map<string, MacroDef[]>();
+        for (const def of defs) {
+            const list = byName.get(def.name);
+            if (list) {
+                list.push(def);
+            } else {
+                byName.set(def.name, [def]);
+            }
+        }
+        return byName;
+    }
+
+    private static sameEntries<T extends object>(before: T[], after: T[]): boolean {
+        return before.length === after.length &&
+            before.every((entry, i) => entry === after[i] || DocumentOverlay.sameEntry(entry, after[i]));
+    }
+
+    /**
+     * Compare the fields of two parsed entries; parameter lists are compared element-wise
+     */
+    private static sameEntry(before: object, after: object): boolean {
+        const a = before as Record<string, unknown>;
+        const b = after as Record<string, unknown>;
+        const keys = Object.keys(a);
+        return keys.length === Object.keys(b).length && keys.every(key => {
+            const x = a[key];
+            const y = b[key];
+            return x === y || (Array.isArray(x) && Array.isArray(y) &&
+                x.length === y.length && x.every((value, i) => value === y[i]));
+        });
+    }
+
+    private static mergeRanges(ranges: Array<[number, number]>): Array<[number, number]> {
+        const sorted = ranges.slice().sort((a, b) => a[0] - b[0]);
+        const merged: Array<[number, number]> = [];
+        for (const range of sorted) {
+            const last = merged[merged.length - 1];
+            if (last && range[0] <= last[1] + 1) {
+                last[1] = Math.max(last[1], range[1]);
+            } else {
+                merged.push([range[0], range[1]]);
+            }
+        }
+        return merged;
+    }
+
+    /**
+     * Mark lines that start inside a block comment, a type declaration body or an unterminated typedef
+     * Such lines cannot be re-parsed in isolation; ordinary function bodies stay transparent
+     */
+    private static computeOpaqueLines(lines: string[]): boolean[] {
+        const opaque: boolean[] = new Array(lines.length);
+        const blockIsType: boolean[] = [];
+        let typeBlocks = 0;
+        let inBlockComment = false;
+        let inTypedef = false;
+        let statementIsType = false;
+
+        for (let i = 0; i < lines.length; i++) {
+            opaque[i] = inBlockComment || inTypedef || typeBlocks > 0;
+            const line = lines[i];
+            let quote = '';
+
+            // Braces and semicolons inside #define bodies do not open declarations
+            if (!inBlockComment && DocumentOverlay.isDirectiveLine(lines, i)) {
+                if (line.includes('/*') && !line.includes('*/', line.lastIndexOf('/*'))) {
+                    inBlockComment = true;
+                }
+                continue;
+            }
+
+            for (let j = 0; j < line.length; j++) {
+                const char = line[j];
+                if (inBlockComment) {
+                    if (char === '*' && line[j + 1] === '/') {
+                        inBlockComment = false;
+                        j++;
+                    }
+                } else if (quote) {
+                    if (char === '\\') {
+                        j++;
+                    } else if (char === quote) {
+                        quote = '';
+                    }
+                } else if (char === '"' || char === "'") {
+                    quote = char;
+                } else if (char === '/' && line[j + 1] === '*') {
+                    inBlockComment = true;
+                    j++;
+                } else if (char === '/' && line[j + 1] === '/') {
+                    break;
+                } else if (char === '{') {
+                    const isType = statementIsType || typeBlocks > 0;
+                    blockIsType.push(isType);
+                    typeBlocks += isType ? 1 : 0;
+                    statementIsType = false;
+                } else if (char === '}') {
+                    if (blockIsType.pop()) {
+                        typeBlocks--;
+                    }
+                    statementIsType = false;
+                } else if (char === ';') {
+                    if (blockIsType.length === 0) {
+                        inTypedef = false;
+                    }
+                    statementIsType = false;
+                } else if (/[A-Za-z_]/.test(char) && !/\w/.test(line[j - 1] || '')) {
+                    const word = /^\w+/.exec(line.substring(j))![0];
+                    if (word === 'typedef' || word === 'struct' || word === 'union' || word === 'enum') {
+                        statementIsType = true;
+                        inTypedef = inTypedef || word === 'typedef';
+                    }
+                    j += word.length - 1;
+                }
+            }
+        }
+
+        return opaque;
+    }
+}
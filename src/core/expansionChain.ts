@@ -0,0 +1,68 @@
+import { InternTable } from './internTable';
+import { MacroUtils } from '../utils/macroUtils';
+
+/**
+ * One macro being expanded, linked to the expansion it occurs in
+ * Links are never modified, so argument pre-expansion shares the chain instead of copying it.
+ */
+export interface ExpansionLink {
+    readonly nameId: number;
+    readonly name: string;
+    readonly args: string[] | undefined;
+    readonly parent: ExpansionLink | null;
+}
+
+/**
+ * Macros being expanded, for circular reference detection
+ *
+ * Names are interned to integers and the links on the chain are counted per name, so a
+ * macro that is not being expanded, which is nearly every check, is recognized with one
+ * array read and no allocation. Only a name already on the chain walks the links to
+ * compare arguments.
+ */
+export class ExpansionChain {
+    private active: number[] = [];
+
+    constructor(private names: InternTable) {}
+
+    /**
+     * Link for a macro expanded inside parent; leave() it once its expansion is done
+     */
+    enter(parent: ExpansionLink | null, name: string, args: string[] | undefined): ExpansionLink {
+        const nameId = this.names.intern(name);
+        this.active[nameId] = (this.active[nameId] ?? 0) + 1;
+        return { nameId, name, args, parent };
+    }
+
+    leave(link: ExpansionLink): void {
+        this.active[link.nameId]--;
+    }
+
+    contains(link: ExpansionLink | null, name: string, args: string[] | undefined): boolean {
+        const nameId = this.names.get(name);
+        if (nameId === undefined || !this.active[nameId]) {
+            return false;
+        }
+        for (let current = link; current; current = current.parent) {
+            if (current.nameId === nameId && MacroUtils.sameArguments(current.args, args)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * The chain from the outermost macro, followed by the given one
+     */
+    describe(link: ExpansionLink | null, name: string, args: string[] | undefined): string {
+        const ids = [ExpansionChain.format(name, args)];
+        for (let current = link; current; current = current.parent) {
+            ids.push(ExpansionChain.format(current.name, current.args));
+        }
+        return ids.reverse().join(' → ');
+    }
+
+    private static format(name: string, args: string[] | undefined): string {
+        return args ? `${name}(${args.join(',')})` : name;
+    }
+}
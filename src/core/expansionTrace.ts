@@ -0,0 +1,89 @@
+/**
+ * Replacement of a range of text by a substitution
+ */
+export interface TextEdit {
+    offset: number;
+    removed: number;
+    inserted: string;
+}
+
+/**
+ * One step of an expansion
+ * The texts before and after the step are rebuilt from the edits when first read.
+ */
+export class ExpansionStep {
+    constructor(
+        private trace: ExpansionTrace,
+        private index: number,
+        readonly macro: string,
+        readonly note: string | undefined,
+        readonly level: number,
+        readonly edits: readonly TextEdit[]
+    ) {}
+
+    get from(): string {
+        return this.index === 0 ? this.trace.initialText : this.trace.textAfter(this.index - 1);
+    }
+
+    get to(): string {
+        return this.trace.textAfter(this.index);
+    }
+}
+
+/**
+ * Steps of an expansion, recorded as edits of the previous step's text
+ *
+ * Each step only keeps the substitutions it made, so memory grows with the text
+ * inserted rather than with levels × output size. Full texts are rebuilt on demand,
+ * continuing from the last one rebuilt so reading the steps in order stays linear.
+ */
+export class ExpansionTrace {
+    readonly steps: ExpansionStep[] = [];
+    private rebuiltIndex = -1;
+    private rebuiltText: string;
+
+    constructor(readonly initialText: string) {
+        this.rebuiltText = initialText;
+    }
+
+    /**
+     * Record a step; edits are in descending offset order, so each offset is valid
+     * both in the step's original text and after the edits before it
+     */
+    record(macro: string, note: string | undefined, level: number, edits: TextEdit[]): void {
+        this.steps.push(new ExpansionStep(this, this.steps.length, macro, note, level, edits));
+    }
+
+    /**
+     * Apply edits given in descending offset order, as expansions record them
+     * The result is assembled in one pass, so the text is copied once however many
+     * macros a step replaced, instead of once per replaced macro.
+     */
+    static applyEdits(text: string, edits: readonly TextEdit[]): string {
+        if (edits.length === 0) {
+            return text;
+        }
+        const pieces: string[] = [];
+        let end = text.length;
+        for (const edit of edits) {
+            pieces.push(text.substring(edit.offset + edit.removed, end), edit.inserted);
+            end = edit.offset;
+        }
+        pieces.push(text.substring(0, end));
+        return pieces.reverse().join('');
+    }
+
+    textAfter(index: number): string {
+        if (index < this.rebuiltIndex) {
+            this.rebuiltIndex = -1;
+            this.rebuiltText = this.initialText;
+        }
+        let text = this.rebuiltText;
+        for (let i = this.rebuiltIndex + 1; i <= index; i++) {
+            text = ExpansionTrace.applyEdits(text, this.steps[i].edits);
+        }
+        this.rebuiltIndex = index;
+        this.rebuiltText = text;
+        return text;
+    }
+}
@@ -0,0 +1,206 @@
+import * as fs from 'fs';
+import * as path from 'path';
+import { GlobMatcher } from '../utils/globMatcher';
+
+/**
+ * A file found by the walker, with the stat data needed to decide whether to parse it
+ */
+export interface WalkedFile {
+    path: string;   // Absolute
+    size: number;
+    mtime: number;  // Milliseconds, truncated like vscode.FileStat.mtime
+}
+
+/**
+ * A running walk: batches of files, and how many files were found so far
+ */
+export interface FileWalk extends AsyncIterable<WalkedFile[]> {
+    readonly found: number;
+}
+
+export interface WalkOptions {
+    include: GlobMatcher;
+    exclude: GlobMatcher;
+    useGitignore: boolean;
+    concurrency?: number;
+}
+
+/** A .gitignore line translated to a root-relative glob; the last matching rule wins */
+interface IgnoreRule {
+    matcher: GlobMatcher;
+    negate: boolean;
+    directoryOnly: boolean;
+}
+
+interface PendingDirectory {
+    absolute: string;
+    relative: string;   // '' for the root, '/' separated otherwise
+    rules: readonly IgnoreRule[];
+}
+
+const DEFAULT_CONCURRENCY = 16;
+const STAT_BATCH_SIZE = 64;
+
+/**
+ * Parallel directory walker streaming matching files as directories are read
+ *
+ * Up to `concurrency` directories are listed at once with readdir(withFileTypes), so
+ * only candidate files are stat'ed (in batches). Each directory's files are yielded as
+ * soon as they are stat'ed, which lets the consumer parse while the walk continues.
+ * Excluded and git-ignored directories are pruned without being listed.
+ */
+export class FileWalker {
+    private directories: PendingDirectory[] = [];
+    private results: WalkedFile[][] = [];
+    private active = 0;
+    private wake: (() => void) | null = null;
+    private found = 0;
+    private readonly concurrency: number;
+
+    private constructor(private options: WalkOptions) {
+        this.concurrency = Math.max(1, options.concurrency ?? DEFAULT_CONCURRENCY);
+    }
+
+    /**
+     * Walk a directory tree, yielding batches of matching files in no particular order
+     * The found count includes files stat'ed but not yet yielded, so it runs ahead of the
+     * consumer while directories are still being listed.
+     */
+    static walk(root: string, options: WalkOptions): FileWalk {
+        const walker = new FileWalker(options);
+        const batches = walker.run(root);
+        return {
+            [Symbol.asyncIterator]: () => batches,
+            get found() { return walker.found; }
+        };
+    }
+
+    private async *run(root: string): AsyncGenerator<WalkedFile[]> {
+        this.directories.push({ absolute: root, relative: '', rules: [] });
+        this.pump();
+
+        for (;;) {
+            const batch = this.results.shift();
+            if (batch) {
+                yield batch;
+            } else if (this.active === 0 && this.directories.length === 0) {
+                return;
+            } else {
+                await new Promise<void>(resolve => this.wake = resolve);
+            }
+        }
+    }
+
+    private pump(): void {
+        while (this.active < this.concurrency && this.directories.length > 0) {
+            const directory = this.directories.pop()!;
+            this.active++;
+            this.readDirectory(directory)
+                .catch(error => console.warn(`MacroLens: Failed to read directory ${directory.absolute}:`, error))
+                .finally(() => {
+                    this.active--;
+                    this.pump();
+                    this.notify();
+                });
+        }
+    }
+
+    private notify(): void {
+        const wake = this.wake;
+        this.wake = null;
+        wake?.();
+    }
+
+    private async readDirectory(directory: PendingDirectory): Promise<void> {
+        const entries = await fs.promises.readdir(directory.absolute, { withFileTypes: true });
+
+        let rules = directory.rules;
+        if (this.options.useGitignore && entries.some(entry => entry.name === '.gitignore' && entry.isFile())) {
+            try {
+                const content = await fs.promises.readFile(path.join(directory.absolute, '.gitignore'), 'utf8');
+                rules = rules.concat(FileWalker.parseGitignore(content, directory.relative));
+            } catch (error) {
+                console.warn(`MacroLens: Failed to read .gitignore in ${directory.absolute}:`, error);
+            }
+        }
+
+        const candidates: string[] = [];
+        for (const entry of entries) {
+            const relative = directory.relative ? `${directory.relative}/${entry.name}` : entry.name;
+
+            // Symbolic links are followed for files only, so cycles cannot occur
+            if (entry.isDirectory()) {
+                if (entry.name !== '.git' && !this.options.exclude.matches(relative + '/') &&
+                    !FileWalker.isIgnored(rules, relative, true)) {
+                    this.directories.push({ absolute: path.join(directory.absolute, entry.name), relative, rules });
+                }
+            } else if ((entry.isFile() || entry.isSymbolicLink()) && this.options.include.matches(relative) &&
+                !this.options.exclude.matches(relative) && !FileWalker.isIgnored(rules, relative, false)) {
+                candidates.push(path.join(directory.absolute, entry.name));
+            }
+        }
+
+        // Keep the traversal going while this directory's files are stat'ed
+        this.pump();
+
+        for (let i = 0; i < candidates.length; i += STAT_BATCH_SIZE) {
+            const stats = await Promise.all(candidates.slice(i, i + STAT_BATCH_SIZE).map(file =>
+                fs.promises.stat(file).then(
+                    stat => stat.isFile() ? { path: file, size: stat.size, mtime: Math.floor(stat.mtimeMs) } : null,
+                    () => null
+                )));
+            const files = stats.filter((file): file is WalkedFile => file !== null);
+            if (files.length > 0) {
+                this.found += files.length;
+                this.results.push(files);
+                this.notify();
+            }
+        }
+    }
+
+    private static isIgnored(rules: readonly IgnoreRule[], relative: string, isDirectory: boolean): boolean {
+        let ignored = false;
+        for (const rule of rules) {
+            if ((isDirectory || !rule.directoryOnly) && ignored === rule.negate && rule.matcher.matches(relative)) {
+                ignored = !rule.negate;
+            }
+        }
+        return ignored;
+    }
+
+    /**
+     * Translate .gitignore lines into globs relative to the walk root
+     * @param base Root-relative directory containing the .gitignore ('' for the root)
+     */
+    private static parseGitignore(content: string, base: string): IgnoreRule[] {
+        const rules: IgnoreRule[] = [];
+        const prefix = base ? `${base}/` : '';
+
+        for (const rawLine of content.split(/\r?\n/)) {
+            let line = rawLine.replace(/(?<!\\)\s+$/, '');
+            if (line === '' || line.startsWith('#')) {
+                continue;
+            }
+
+            const negate = line.startsWith('!');
+            if (negate) {
+                line = line.substring(1);
+            }
+            line = line.replace(/^\\([#!])/, '$1');
+
+            const directoryOnly = line.endsWith('/');
+            if (directoryOnly) {
+                line = line.substring(0, line.length - 1);
+            }
+            if (line === '') {
+                continue;
+            }
+
+            // A slash other than a trailing one anchors the pattern to the .gitignore directory
+            const anchored = line.includes('/');
+            const glob = anchored ? prefix + line.replace(/^\//, '') : `${prefix}**/${line}`;
+            rules.push({ matcher: new GlobMatcher([glob]), negate, directoryOnly });
+        }
+        return rules;
+    }
+}
@@ -0,0 +1,89 @@
+import { execFile } from 'child_process';
+import * as path from 'path';
+
+/** Git output for large trees (40k+ paths) fits comfortably */
+const MAX_OUTPUT = 64 * 1024 * 1024;
+const GIT_TIMEOUT = 30000;
+
+/**
+ * Queries the local git repository containing the workspace
+ *
+ * Used to find the files changed since the index was built (a pull, a branch switch)
+ * without stat'ing the whole tree. All paths returned are absolute. Only local data
+ * is read; no command touches the network.
+ */
+export class GitReconciler {
+    private constructor(readonly topLevel: string) {}
+
+    /**
+     * Open the repository containing a directory, or null when git or the repository is unavailable
+     */
+    static async open(directory: string): Promise<GitReconciler | null> {
+        try {
+            const topLevel = (await GitReconciler.git(directory, ['rev-parse', '--show-toplevel'])).trim();
+            return topLevel ? new GitReconciler(path.resolve(topLevel)) : null;
+        } catch {
+            return null;
+        }
+    }
+
+    /**
+     * Commit id of HEAD, or undefined for a repository without commits
+     */
+    async getHead(): Promise<string | undefined> {
+        try {
+            return (await GitReconciler.git(this.topLevel, ['rev-parse', '--verify', '-q', 'HEAD'])).trim() || undefined;
+        } catch {
+            return undefined;
+        }
+    }
+
+    /**
+     * Files added, modified, deleted or renamed between two commits
+     * Returns undefined when a commit is no longer known (history rewritten, shallow clone)
+     */
+    async getChangedFiles(from: string, to: string): Promise<string[] | undefined> {
+        try {
+            const output = await GitReconciler.git(this.topLevel, ['diff', '--name-only', '--no-renames', '-z', from, to, '--']);
+            return this.toAbsolute(output.split('\0'));
+        } catch {
+            return undefined;
+        }
+    }
+
+    /**
+     * Files differing from HEAD in the index or working tree, plus untracked files (not ignored ones)
+     */
+    async getDirtyFiles(): Promise<string[] | undefined> {
+        try {
+            const output = await GitReconciler.git(this.topLevel, ['status', '--porcelain', '-z', '--untracked-files=all']);
+            // Entries are "XY path"; renames and copies are followed by the original path
+            const entries = output.split('\0');
+            const files: string[] = [];
+            for (let i = 0; i < entries.length; i++) {
+                const entry = entries[i];
+                if (entry.length < 4) {
+                    continue;
+                }
+                files.push(entry.substring(3));
+                if (entry[0] === 'R' || entry[0] === 'C') {
+                    files.push(entries[++i]);
+                }
+            }
+            return this.toAbsolute(files);
+        } catch {
+            return undefined;
+        }
+    }
+
+    private toAbsolute(files: string[]): string[] {
+        return files.filter(file => file !== '').map(file => path.join(this.topLevel, file));
+    }
+
+    private static git(cwd: string, args: string[]): Promise<string> {
+        return new Promise((resolve, reject) => {
+            execFile('git', ['-c', 'core.quotepath=off', ...args], { cwd, maxBuffer: MAX_OUTPUT, timeout: GIT_TIMEOUT, windowsHide: true },
+                (error, stdout) => error ? reject(error) : resolve(stdout));
+        });
+    }
+}
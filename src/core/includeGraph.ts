@@ -0,0 +1,273 @@
+import * as path from 'path';
+
+/**
+ * An #include directive as written in a file
+ */
+export interface IncludeDirective {
+    target: string;   // Path between the quotes or angle brackets
+    system: boolean;  // true for <...>, false for "..."
+    line: number;
+}
+
+/**
+ * File-level include graph with cached transitive closures
+ *
+ * Files get dense integer ids so that the set of files reachable from a translation
+ * unit can be stored as a bitset (one bit per file). Include targets are resolved
+ * lazily against the indexed files: relative to the including file for "..." includes,
+ * then against the configured include directories, then by path suffix.
+ */
+export class IncludeGraph {
+    private ids = new Map<string, number>();
+    private paths: string[] = [];
+    private includes: Array<IncludeDirective[] | undefined> = [];
+    private byBasename = new Map<string, number[]>();
+    private includeDirectories: string[] = [];
+    private forcedIncludes = new Map<string, string[]>();
+
+    // Derived state, rebuilt lazily after any change
+    private edges: Array<Int32Array | undefined> = [];
+    private closures = new Map<number, Uint32Array>();
+    private includers: number[][] | null = null;
+
+    /**
+     * Replace the include directives of a file (registers the file if it is new)
+     */
+    setIncludes(file: string, includes: IncludeDirective[]): void {
+        const id = this.getOrCreateId(file);
+        this.includes[id] = includes;
+        this.invalidate();
+    }
+
+    removeFile(file: string): void {
+        const id = this.ids.get(file);
+        if (id === undefined) {
+            return;
+        }
+
+        // Keep the id slot so that other ids stay dense and stable
+        this.ids.delete(file);
+        this.includes[id] = undefined;
+        const basename = IncludeGraph.basename(file);
+        const candidates = this.byBasename.get(basename)?.filter(candidate => candidate !== id);
+        if (candidates && candidates.length > 0) {
+            this.byBasename.set(basename, candidates);
+        } else {
+            this.byBasename.delete(basename);
+        }
+        this.invalidate();
+    }
+
+    clear(): void {
+        this.ids.clear();
+        this.paths = [];
+        this.includes = [];
+        this.byBasename.clear();
+        this.invalidate();
+    }
+
+    /**
+     * Directories searched for include targets after the including file's directory
+     */
+    setIncludeDirectories(directories: string[]): void {
+        this.includeDirectories = directories.map(directory => path.normalize(directory));
+        this.invalidate();
+    }
+
+    /**
+     * Files included ahead of a translation unit's own content (-include on the command line)
+     */
+    setForcedIncludes(forcedIncludes: Map<string, string[]>): void {
+        this.forcedIncludes = forcedIncludes;
+        this.invalidate();
+    }
+
+    has(file: string): boolean {
+        return this.ids.has(file);
+    }
+
+    /**
+     * Check whether a definition file is reachable from a translation unit
+     * (the unit itself included). Returns undefined when the unit is not indexed.
+     */
+    isReachable(translationUnit: string, file: string): boolean | undefined {
+        const unitId = this.ids.get(translationUnit);
+        if (unitId === undefined) {
+            return undefined;
+        }
+        const fileId = this.ids.get(file);
+        if (fileId === undefined) {
+            return false;
+        }
+        const closure = this.getClosure(unitId);
+        return (closure[fileId >>> 5] & (1 << (fileId & 31))) !== 0;
+    }
+
+    /**
+     * Files including a file directly or through other headers (the file itself excluded)
+     */
+    getIncluders(file: string): string[] {
+        const id = this.ids.get(file);
+        if (id === undefined) {
+            return [];
+        }
+
+        const includers = this.getReverseEdges();
+        const seen = new Set([id]);
+        const stack = [id];
+        const result: string[] = [];
+        while (stack.length > 0) {
+            for (const includer of includers[stack.pop()!] ?? []) {
+                if (!seen.has(includer)) {
+                    seen.add(includer);
+                    stack.push(includer);
+                    result.push(this.paths[includer]);
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Files reachable from a translation unit, as a bitset indexed by file id
+     */
+    private getClosure(unitId: number): Uint32Array {
+        let closure = this.closures.get(unitId);
+        if (closure) {
+            return closure;
+        }
+
+        closure = new Uint32Array((this.paths.length + 31) >>> 5);
+        const stack = [unitId];
+        closure[unitId >>> 5] |= 1 << (unitId & 31);
+
+        while (stack.length > 0) {
+            const edges = this.getEdges(stack.pop()!);
+            for (let i = 0; i < edges.length; i++) {
+                const target = edges[i];
+                const mask = 1 << (target & 31);
+                if ((closure[target >>> 5] & mask) === 0) {
+                    closure[target >>> 5] |= mask;
+                    stack.push(target);
+                }
+            }
+        }
+
+        this.closures.set(unitId, closure);
+        return closure;
+    }
+
+    private getEdges(id: number): Int32Array {
+        let edges = this.edges[id];
+        if (!edges) {
+            const targets: number[] = [];
+            for (const forced of this.forcedIncludes.get(this.paths[id]) || []) {
+                const target = this.ids.get(forced);
+                if (target !== undefined) {
+                    targets.push(target);
+                }
+            }
+            for (const include of this.includes[id] || []) {
+                const target = this.resolve(this.paths[id], include);
+                if (target !== undefined) {
+                    targets.push(target);
+                }
+            }
+            edges = Int32Array.from(targets);
+            this.edges[id] = edges;
+        }
+        return edges;
+    }
+
+    /**
+     * Includers per file id, built from every registered file's edges on first use
+     */
+    private getReverseEdges(): number[][] {
+        if (!this.includers) {
+            const includers: number[][] = [];
+            for (const id of this.ids.values()) {
+                for (const target of this.getEdges(id)) {
+                    (includers[target] ??= []).push(id);
+                }
+            }
+            this.includers = includers;
+        }
+        return this.includers;
+    }
+
+    private resolve(includer: string, include: IncludeDirective): number | undefined {
+        const target = include.target;
+
+        if (!include.system) {
+            const relative = this.ids.get(path.join(path.dirname(includer), target));
+            if (relative !== undefined) {
+                return relative;
+            }
+        }
+
+        for (const directory of this.includeDirectories) {
+            const candidate = this.ids.get(path.join(directory, target));
+            if (candidate !== undefined) {
+                return candidate;
+            }
+        }
+
+        // Fall back to any indexed file whose path ends with the include target,
+        // preferring the one closest to the including file
+        const candidates = this.byBasename.get(IncludeGraph.basename(target));
+        if (!candidates) {
+            return undefined;
+        }
+        const suffix = path.sep + path.normalize(target);
+        let best: number | undefined;
+        let bestShared = -1;
+        for (const candidate of candidates) {
+            const candidatePath = this.paths[candidate];
+            if (!candidatePath.endsWith(suffix)) {
+                continue;
+            }
+            const shared = IncludeGraph.sharedPrefixLength(candidatePath, includer);
+            if (shared > bestShared) {
+                best = candidate;
+                bestShared = shared;
+            }
+        }
+        return best;
+    }
+
+    private getOrCreateId(file: string): number {
+        let id = this.ids.get(file);
+        if (id === undefined) {
+            id = this.paths.length;
+            this.ids.set(file, id);
+            this.paths.push(file);
+            const basename = IncludeGraph.basename(file);
+            const candidates = this.byBasename.get(basename);
+            if (candidates) {
+                candidates.push(id);
+            } else {
+                this.byBasename.set(basename, [id]);
+            }
+        }
+        return id;
+    }
+
+    private invalidate(): void {
+        this.edges = [];
+        this.closures.clear();
+        this.includers = null;
+    }
+
+    private static basename(file: string): string {
+        return file.substring(Math.max(file.lastIndexOf('/'), file.lastIndexOf('\\')) + 1);
+    }
+
+    private static sharedPrefixLength(a: string, b: string): number {
+        const length = Math.min(a.length, b.length);
+        let i = 0;
+        while (i < length && a.charCodeAt(i) === b.charCodeAt(i)) {
+            i++;
+        }
+        return i;
+    }
+}
@@ -0,0 +1,85 @@
+import * as vscode from 'vscode';
+import { MacroDatabase } from './macroDb';
+import { DATABASE_CONSTANTS } from '../utils/constants';
+
+/**
+ * Runs index maintenance while the editor is idle
+ *
+ * A pass is due at startup and whenever the index changed. It starts once nothing has
+ * happened for MAINTENANCE_IDLE_DELAY and runs one short step at a time, so editing,
+ * moving the cursor or switching editors stops it between two steps; it resumes at the
+ * next idle period.
+ */
+export class IndexMaintenance implements vscode.Disposable {
+    private disposables: vscode.Disposable[] = [];
+    private timer: NodeJS.Timeout | undefined;
+    private lastActivity = Date.now();
+    private due = true;
+    private running = false;
+    private disposed = false;
+
+    constructor(private db: MacroDatabase) {
+        this.disposables.push(
+            db.onDidChange(() => {
+                this.due = true;
+                this.notifyActivity();
+            }),
+            vscode.workspace.onDidChangeTextDocument(() => this.notifyActivity()),
+            vscode.window.onDidChangeTextEditorSelection(() => this.notifyActivity()),
+            vscode.window.onDidChangeActiveTextEditor(() => this.notifyActivity())
+        );
+        this.schedule();
+    }
+
+    /**
+     * Postpone maintenance until the editor is idle again
+     */
+    notifyActivity(): void {
+        this.lastActivity = Date.now();
+        this.schedule();
+    }
+
+    private schedule(): void {
+        if (!this.due || this.running || this.disposed) {
+            return;
+        }
+        if (this.timer) {
+            clearTimeout(this.timer);
+        }
+        const wait = Math.max(0, this.lastActivity + DATABASE_CONSTANTS.MAINTENANCE_IDLE_DELAY - Date.now());
+        this.timer = setTimeout(() => this.run(), wait);
+        // Never keep the process alive for maintenance
+        this.timer.unref?.();
+    }
+
+    private async run(): Promise<void> {
+        this.timer = undefined;
+        this.running = true;
+        try {
+            // Changes made during the pass make another pass due
+            this.due = false;
+            let remaining = true;
+            while (remaining && !this.disposed) {
+                if (Date.now() - this.lastActivity < DATABASE_CONSTANTS.MAINTENANCE_IDLE_DELAY) {
+                    // Activity since the pass started: finish the pass at the next idle period
+                    this.due = true;
+                    break;
+                }
+                remaining = await this.db.runMaintenanceStep();
+            }
+        } catch (error) {
+            console.warn('MacroLens: Index maintenance failed:', error);
+        } finally {
+            this.running = false;
+        }
+        this.schedule();
+    }
+
+    dispose(): void {
+        this.disposed = true;
+        if (this.timer) {
+            clearTimeout(this.timer);
+        }
+        this.disposables.forEach(disposable => disposable.dispose());
+    }
+}
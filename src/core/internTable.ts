@@ -0,0 +1,41 @@
+/**
+ * Mirror of a table mapping distinct strings to integer ids
+ *
+ * Ids are allocated here rather than by the database, so the statements writing a
+ * file can reference them without waiting for an insert to return its rowid.
+ */
+export class InternTable {
+    private ids = new Map<string, number>();
+    private nextId = 1;
+
+    constructor(rows: Iterable<{ id: number; key: string }> = []) {
+        for (const row of rows) {
+            this.ids.set(row.key, row.id);
+            this.nextId = Math.max(this.nextId, row.id + 1);
+        }
+    }
+
+    get(key: string): number | undefined {
+        return this.ids.get(key);
+    }
+
+    /**
+     * Id of a string; a string seen for the first time gets a new id, passed to onAdd
+     * so the caller can queue the row inserting it
+     */
+    intern(key: string, onAdd?: (id: number) => void): number {
+        let id = this.ids.get(key);
+        if (id === undefined) {
+            id = this.nextId++;
+            this.ids.set(key, id);
+            onAdd?.(id);
+        }
+        return id;
+    }
+
+    delete(key: string): number | undefined {
+        const id = this.ids.get(key);
+        this.ids.delete(key);
+        return id;
+    }
+}
@@ -1,8 +1,20 @@
 import * as vscode from 'vscode';
 import * as path from 'path';
 import * as fs from 'fs';
-import { MacroParser } from './macroParser';
+import * as crypto from 'crypto';
+import { MacroParser, ParsedSource } from './macroParser';
+import { StreamingParser } from './streamingParser';
+import { DocumentOverlay } from './documentOverlay';
+import { FileDefinitions, SnapshotBuilder } from './definitionSnapshot';
+import { ConditionEvaluator } from './conditionEvaluator';
+import { IncludeDirective, IncludeGraph } from './includeGraph';
+import { CompileCommands } from './compileCommands';
+import { FileWalk, FileWalker } from './fileWalker';
+import { GitReconciler } from './gitReconciler';
+import { DatabaseClient, DatabaseInterface, SqlStatement } from './databaseClient';
+import { InternTable } from './internTable';
 import { DATABASE_CONSTANTS, FILE_PATTERNS, REGEX_PATTERNS } from '../utils/constants';
+import { GlobMatcher } from '../utils/globMatcher';
 
 export interface MacroDef {
     name: string;
@@ -11,17 +23,96 @@ export interface MacroDef {
     file: string;
     line: number;
     isDefine?: boolean;  // true = #define macro, false/undefined = typedef/struct/enum/etc
+    condition?: string;  // #if/#ifdef condition guarding the definition (undefined = unconditional)
+    endLine?: number;    // Line of the #undef ending this definition in its file (undefined = end of file)
 }
 
-interface DatabaseInterface {
-    prepare(sql: string): any;
-    exec(sql: string): any;
-    close(): void;
+/**
+ * An #undef directive; the macro is not defined after this line of the file
+ */
+export interface MacroUndef {
+    name: string;
+    file: string;
+    line: number;
+    condition?: string;
 }
 
-class InMemoryDatabase implements DatabaseInterface {
-    private macros: Map<string, MacroDef[]> = new Map();
+/**
+ * Definitions (null = #undef) of one macro name within one file, sorted by line
+ * Lines are kept in a parallel array so lookups are a binary search
+ */
+interface FileTimeline {
+    lines: number[];
+    defs: Array<MacroDef | null>;
+    conditions: Array<string | undefined>;  // #if condition guarding each event
+    external?: MacroDef[];  // Definitions from other files, computed on first use
+}
+
+/**
+ * Statements replacing the stored rows of a single file
+ * File ids and interned string ids are allocated by MacroDatabase, so writes never wait
+ * for the database
+ */
+const FILE_SQL = {
+    insertFile: 'INSERT INTO files (id, path, mtime) VALUES (?, ?, ?)',
+    updateFileMtime: 'UPDATE files SET mtime = ? WHERE id = ?',
+    deleteFile: 'DELETE FROM files WHERE id = ?',
+    insertName: 'INSERT INTO names (id, name) VALUES (?, ?)',
+    insertParams: 'INSERT INTO param_lists (id, params) VALUES (?, ?)',
+    insertBody: 'INSERT INTO bodies (id, digest, text) VALUES (?, ?, ?)',
+    deleteMacros: 'DELETE FROM macros WHERE file_id = ?',
+    insertMacro: 'INSERT INTO macros (name_id, params_id, body_id, file_id, line, isDefine, condition, endLine) VALUES (?, ?, ?, ?, ?, ?, ?, ?)',
+    deleteUndefs: 'DELETE FROM undefs WHERE file_id = ?',
+    insertUndef: 'INSERT INTO undefs (name_id, file_id, line, condition) VALUES (?, ?, ?, ?)',
+    deleteIncludes: 'DELETE FROM include_edges WHERE file_id = ?',
+    insertInclude: 'INSERT INTO include_edges (file_id, target, system, line) VALUES (?, ?, ?, ?)',
+    deleteReferences: 'DELETE FROM macro_refs WHERE file_id = ?',
+    insertReference: 'INSERT INTO macro_refs (name_id, file_id) VALUES (?, ?)'
+} as const;
+
+/**
+ * Tables covered by the integrity check of index maintenance, one per step
+ */
+const INDEX_TABLES = ['files', 'names', 'param_lists', 'bodies', 'macros', 'undefs', 'include_edges', 'macro_refs', 'meta'];
+
+/**
+ * Mirrors of the files table and of the interned strings (macro names, parameter lists
+ * and bodies), loaded once per connection
+ */
+interface IndexIds {
+    files: InternTable;
+    names: InternTable;
+    params: InternTable;
+    bodies: InternTable;
+}
+
+/**
+ * A file to consider during a project scan, with the stat data used to skip unchanged files
+ */
+interface ScanEntry {
+    uri: vscode.Uri;
+    size: number;
+    mtime: number;
+}
+
+/**
+ * Files to scan in batches, with the number found so far (final once the batches end)
+ */
+interface ScanSource {
+    batches: AsyncIterable<ScanEntry[]>;
+    found(): number;
+}
+
+/**
+ * Git commit the index was built from, for reconciling with git instead of a full scan
+ */
+interface IndexedGitState {
+    head: string;
+    settings: string;       // Scan settings the index was built with
+    touched: Set<string>;   // Absolute paths dirty at that commit or updated since
+}
 
+class InMemoryDatabase implements DatabaseInterface {
     prepare(sql: string): any {
         // Return a prepared statement object that mimics SQLite API
         return {
@@ -44,28 +135,30 @@ class InMemoryDatabase implements DatabaseInterface {
     }
 
     close(): void {
-        this.macros.clear();
+        this.macros = [];
+        this.interned.clear();
     }
 
     private executeQuery(sql: string, args: any[], type: string): any {
         try {
-            // Normalize arguments - handle both array and object parameters
-            const params = this.normalizeParams(args);
-            
-            if (sql.includes('INSERT INTO macros')) {
-                return this.handleInsert(params);
-            } else if (sql.includes('SELECT') && sql.includes('FROM macros')) {
-                return this.handleSelect(params, type);
-            } else if (sql.includes('DELETE FROM macros')) {
-                return this.handleDelete(sql, params);
-            } else if (sql.includes('INSERT INTO files')) {
-                return this.handleInsertFile(params);
-            } else if (sql.includes('UPDATE files')) {
-                return this.handleUpdateFile(params);
-            } else if (sql.includes('SELECT') && sql.includes('FROM files')) {
-                return this.handleSelectFile(params, type);
-            } else if (sql.includes('DELETE FROM files')) {
-                return this.handleDeleteFile(sql, params);
+            if (sql.includes('undefs')) {
+                return this.handleUndefs(sql, args, type);
+            }
+            if (sql.includes('include_edges')) {
+                return this.handleIncludeEdges(sql, args, type);
+            }
+            if (sql.includes('macro_refs')) {
+                return this.handleReferences(sql, args, type);
+            }
+            const internedTable = /(?:INTO|FROM) (names|param_lists|bodies)\b/.exec(sql);
+            if (internedTable) {
+                return this.handleInterned(internedTable[1], sql, args, type);
+            }
+            if (/(?:INTO|UPDATE|FROM) files\b/.test(sql)) {
+                return this.handleFiles(sql, args, type);
+            }
+            if (sql.includes('macros')) {
+                return this.handleMacros(sql, args, type);
             }
             
             // Unknown query type - return safe defaults
@@ -76,278 +169,231 @@ class InMemoryDatabase implements DatabaseInterface {
         }
     }
 
-    /**
-     * Normalize parameters from various formats to a consistent object
-     */
-    private normalizeParams(args: any[]): any {
-        if (args.length === 0) {
-            return {};
+    // Interned strings per table (names, param_lists, bodies): id -> row
+    private interned = new Map<string, Map<number, Record<string, any>>>();
+
+    private handleInterned(table: string, sql: string, args: any[], type: string): any {
+        let rows = this.interned.get(table);
+        if (!rows) {
+            rows = new Map();
+            this.interned.set(table, rows);
         }
-        
-        // If first argument is an object with named properties, use it directly
-        if (args.length === 1 && typeof args[0] === 'object' && !Array.isArray(args[0])) {
-            return args[0];
+        const insert = /INSERT INTO \w+ \(([^)]*)\)/.exec(sql);
+        if (insert) {
+            // INSERT INTO names (id, name) VALUES (?, ?), and likewise for param_lists and bodies
+            const row: Record<string, any> = {};
+            insert[1].split(',').forEach((column, index) => row[column.trim()] = args[index]);
+            rows.set(Number(row.id), row);
+            return { changes: 1, lastInsertRowid: row.id };
         }
-        
-        // Convert positional parameters to named parameters for INSERT
-        // Expected order: name, params, body, file, line, isDefine
-        if (args.length >= 4) {
-            return {
-                name: args[0],
-                params: args[1],
-                body: args[2],
-                file: args[3], // This might be file_id now
-                file_id: args[3],
-                line: args[4] || 0,
-                isDefine: args[5]
-            };
+        if (sql.includes('DELETE')) {
+            // DELETE FROM names WHERE id = ?
+            return { changes: rows.delete(Number(args[0])) ? 1 : 0 };
         }
 
-        // For files table operations (path, mtime) or (mtime, id)
-        if (args.length === 2) {
-            // Heuristic: if second arg is number, it could be mtime or id
-            // INSERT INTO files (path, mtime)
-            // UPDATE files SET mtime = ? WHERE id = ?
-            return {
-                arg0: args[0],
-                arg1: args[1]
-            };
-        }
-        
-        // For SELECT/DELETE queries with single parameter
-        // Could be a macro name or a file path - use generic 'file' key
-        // The handleDelete method will check the SQL to determine usage
-        if (args.length === 1) {
-            return { 
-                name: args[0],  // For SELECT queries by name
-                file: args[0],   // For DELETE queries by file path
-                id: args[0],     // For queries by ID
-                path: args[0]    // For queries by path
-            };
-        }
-        
-        return {};
+        // SELECT id, name FROM names
+        const all = Array.from(rows.values());
+        return type === 'get' ? all[0] : all;
     }
 
-    private handleInsert(params: any): any {
-        const name = params.name;
-        if (!name || typeof name !== 'string') {
-            console.warn('InMemoryDatabase: Invalid macro name in INSERT');
-            return { changes: 0 };
-        }
+    private internedName(id: number): string {
+        return this.interned.get('names')?.get(Number(id))?.name ?? '';
+    }
 
-        if (!this.macros.has(name)) {
-            this.macros.set(name, []);
-        }
+    private macros: Array<{
+        name_id: number, params_id: number | null, body_id: number, file_id: number,
+        line: number, isDefine: number | null, condition: string | null, endLine: number | null
+    }> = [];
 
-        // Parse params field - could be comma-separated string or null
-        let paramsList: string[] | undefined;
-        if (params.params !== undefined && params.params !== null) {
-            if (typeof params.params === 'string') {
-                paramsList = params.params.split(',').map((p: string) => p.trim()).filter(Boolean);
-            } else if (Array.isArray(params.params)) {
-                paramsList = params.params;
-            }
+    private handleMacros(sql: string, args: any[], type: string): any {
+        if (sql.includes('INSERT INTO macros')) {
+            // INSERT INTO macros (name_id, params_id, body_id, file_id, line, isDefine, condition, endLine) VALUES (...)
+            const [name_id, params_id, body_id, file_id, line, isDefine, condition, endLine] = args;
+            this.macros.push({ name_id, params_id, body_id, file_id: Number(file_id), line, isDefine, condition, endLine });
+            return { changes: 1 };
         }
-
-        // In InMemoryDatabase, we still store 'file' as string in MacroDef for compatibility with existing logic
-        // But we receive file_id. We need to look up the path.
-        let filePath = '';
-        if (params.file_id) {
-            const fileRecord = this.files.get(Number(params.file_id));
-            if (fileRecord) {
-                filePath = fileRecord.path;
-            }
-        } else {
-            filePath = String(params.file || '');
+        if (sql.includes('DELETE FROM macros')) {
+            // DELETE FROM macros WHERE file_id = ?
+            const before = this.macros.length;
+            this.macros = this.macros.filter(macro => macro.file_id !== Number(args[0]));
+            return { changes: before - this.macros.length };
         }
 
-        const def = {
-            name: name,
-            params: paramsList,
-            body: String(params.body || ''),
-            file: filePath,
-            line: Number(params.line) || 0,
-            isDefine: params.isDefine !== undefined ? Boolean(params.isDefine) : undefined
-        };
-        
-        this.macros.get(name)!.push(def);
-
-        return { changes: 1 };
+        // SELECT m.name_id, m.params_id, ... FROM macros m JOIN names n ... JOIN files f ... ORDER BY n.name, f.path, m.line
+        const rows = this.macros
+            .filter(macro => this.files.has(macro.file_id))
+            .sort((a, b) => this.internedName(a.name_id).localeCompare(this.internedName(b.name_id))
+                || this.files.get(a.file_id)!.path.localeCompare(this.files.get(b.file_id)!.path)
+                || a.line - b.line);
+        return type === 'get' ? rows[0] : rows;
     }
 
-    private handleInsertFile(params: any): any {
-        // INSERT OR IGNORE INTO files (path, mtime) VALUES (?, ?)
-        const path = params.arg0;
-        const mtime = params.arg1;
-        
-        if (this.filePathToId.has(path)) {
-            return { changes: 0 }; // Already exists (IGNORE)
+    private handleFiles(sql: string, args: any[], type: string): any {
+        if (sql.includes('INTO files')) {
+            // INSERT INTO files (id, path, mtime) VALUES (?, ?, ?), or (path, mtime) with a generated id
+            const [id, filePath, mtime] = args.length >= 3 ? [Number(args[0]), args[1], args[2]] : [this.nextFileId, args[0], args[1]];
+            if (this.filePathToId.has(filePath) || this.files.has(id)) {
+                return { changes: 0 }; // Already exists (IGNORE)
+            }
+            this.files.set(id, { path: filePath, mtime });
+            this.filePathToId.set(filePath, id);
+            this.nextFileId = Math.max(this.nextFileId, id + 1);
+            return { changes: 1, lastInsertRowid: id };
         }
-        
-        const id = this.nextFileId++;
-        this.files.set(id, { path, mtime });
-        this.filePathToId.set(path, id);
-        
-        return { changes: 1, lastInsertRowid: id };
-    }
 
-    private handleUpdateFile(params: any): any {
-        // UPDATE files SET mtime = ? WHERE id = ?
-        const mtime = params.arg0;
-        const id = params.arg1;
-        
-        if (this.files.has(id)) {
-            const record = this.files.get(id)!;
-            record.mtime = mtime;
-            this.files.set(id, record);
-            return { changes: 1 };
+        if (sql.includes('UPDATE files')) {
+            // UPDATE files SET mtime = ? WHERE id = ?
+            const record = this.files.get(Number(args[1]));
+            if (record) {
+                record.mtime = args[0];
+                return { changes: 1 };
+            }
+            return { changes: 0 };
         }
-        return { changes: 0 };
-    }
 
-    private handleSelectFile(params: any, type: string): any {
-        // SELECT id, mtime FROM files WHERE path = ?
-        // SELECT path FROM files
-        
-        if (params.path && this.filePathToId.has(params.path)) {
-            const id = this.filePathToId.get(params.path)!;
-            const record = this.files.get(id)!;
-            return type === 'get' ? { id, mtime: record.mtime } : [{ id, mtime: record.mtime }];
-        }
-        
-        // Select all paths
-        if (!params.path && !params.id) {
-            const results: any[] = [];
-            for (const [id, record] of this.files.entries()) {
-                results.push({ path: record.path });
+        if (sql.includes('DELETE FROM files')) {
+            // DELETE FROM files WHERE path = ? / WHERE id = ?
+            const id = sql.includes('WHERE path') ? this.filePathToId.get(args[0]) : Number(args[0]);
+            const record = id !== undefined ? this.files.get(id) : undefined;
+            if (id === undefined || !record) {
+                return { changes: 0 };
             }
-            return results;
+            // Emulate ON DELETE CASCADE
+            this.files.delete(id);
+            this.filePathToId.delete(record.path);
+            this.handleMacros('DELETE FROM macros', [id], 'run');
+            this.handleUndefs('DELETE FROM undefs', [id], 'run');
+            this.handleIncludeEdges('DELETE FROM include_edges', [id], 'run');
+            this.handleReferences('DELETE FROM macro_refs', [id], 'run');
+            return { changes: 1 };
         }
-        
-        return type === 'get' ? undefined : [];
-    }
 
-    private handleDeleteFile(sql: string, params: any): any {
-        // DELETE FROM files WHERE path = ?
-        // DELETE FROM files WHERE id = ?
-        
-        let idToDelete: number | undefined;
-        
+        // SELECT id, path, mtime FROM files [WHERE path = ?]
         if (sql.includes('WHERE path')) {
-            const path = params.path;
-            if (this.filePathToId.has(path)) {
-                idToDelete = this.filePathToId.get(path);
-            }
-        } else if (sql.includes('WHERE id')) {
-            idToDelete = params.id;
+            const id = this.filePathToId.get(args[0]);
+            const row = id !== undefined ? { id, path: args[0], mtime: this.files.get(id)!.mtime } : undefined;
+            return type === 'get' ? row : row ? [row] : [];
         }
-        
-        if (idToDelete !== undefined && this.files.has(idToDelete)) {
-            const record = this.files.get(idToDelete)!;
-            this.files.delete(idToDelete);
-            this.filePathToId.delete(record.path);
+        const rows = Array.from(this.files.entries()).map(([id, record]) => ({ id, path: record.path, mtime: record.mtime }));
+        return type === 'get' ? rows[0] : rows;
+    }
+
+    private handleUndefs(sql: string, args: any[], type: string): any {
+        if (sql.includes('INSERT INTO undefs')) {
+            // INSERT INTO undefs (name_id, file_id, line, condition) VALUES (?, ?, ?, ?)
+            this.undefs.push({ name_id: Number(args[0]), file_id: Number(args[1]), line: Number(args[2]), condition: args[3] ?? null });
             return { changes: 1 };
         }
-        
-        return { changes: 0 };
-    }
+        if (sql.includes('DELETE FROM undefs')) {
+            // DELETE FROM undefs WHERE file_id = ?
+            const before = this.undefs.length;
+            this.undefs = this.undefs.filter(undef => undef.file_id !== Number(args[0]));
+            return { changes: before - this.undefs.length };
+        }
 
-    // In-memory storage for files table
-    private files: Map<number, { path: string, mtime: number }> = new Map();
-    private nextFileId = 1;
-    private filePathToId: Map<string, number> = new Map();
+        // SELECT n.name, f.path as file, u.line, u.condition FROM undefs u JOIN names n ... JOIN files f ...
+        const rows = this.undefs
+            .filter(undef => this.files.has(undef.file_id))
+            .map(undef => ({ name: this.internedName(undef.name_id), file: this.files.get(undef.file_id)!.path, line: undef.line, condition: undef.condition }));
+        return type === 'get' ? rows[0] : rows;
+    }
 
+    private undefs: Array<{ name_id: number, file_id: number, line: number, condition: string | null }> = [];
 
-    private handleSelect(params: any, type: string): any {
-        const name = params.name;
-        
-        // SELECT all macros (no WHERE clause)
-        if (!name) {
-            const allResults: any[] = [];
-            for (const [macroName, defs] of this.macros.entries()) {
-                for (const def of defs) {
-                    allResults.push({
-                        name: def.name,
-                        params: def.params?.join(',') || null,
-                        body: def.body,
-                        file: def.file,
-                        line: def.line,
-                        isDefine: def.isDefine
-                    });
-                }
-            }
-            return type === 'get' ? allResults[0] : allResults;
+    private handleIncludeEdges(sql: string, args: any[], type: string): any {
+        if (sql.includes('INSERT INTO include_edges')) {
+            // INSERT INTO include_edges (file_id, target, system, line) VALUES (?, ?, ?, ?)
+            this.includeEdges.push({ file_id: Number(args[0]), target: args[1], system: Number(args[2]), line: Number(args[3]) });
+            return { changes: 1 };
         }
-        
-        // SELECT specific macro by name
-        if (this.macros.has(name)) {
-            const results = this.macros.get(name)!.map(def => ({
-                name: def.name,
-                params: def.params?.join(',') || null,
-                body: def.body,
-                file: def.file,
-                line: def.line,
-                isDefine: def.isDefine
-            }));
-            return type === 'get' ? results[0] : results;
+        if (sql.includes('DELETE FROM include_edges')) {
+            // DELETE FROM include_edges WHERE file_id = ?
+            const before = this.includeEdges.length;
+            this.includeEdges = this.includeEdges.filter(edge => edge.file_id !== Number(args[0]));
+            return { changes: before - this.includeEdges.length };
         }
-        
-        return type === 'get' ? undefined : [];
+
+        // SELECT f.path as file, i.target, i.system, i.line FROM include_edges i JOIN files f ...
+        const rows = this.includeEdges
+            .filter(edge => this.files.has(edge.file_id))
+            .map(edge => ({ file: this.files.get(edge.file_id)!.path, target: edge.target, system: edge.system, line: edge.line }));
+        return type === 'get' ? rows[0] : rows;
     }
 
-    private handleDelete(sql: string, params: any): any {
-        if (sql.includes('WHERE file')) {
-            // DELETE FROM macros WHERE file = ?
-            // Delete all macros from a specific file
-            const fileToDelete = params.file || (Array.isArray(params) ? params[0] : params);
-            let deletedCount = 0;
-            
-            if (fileToDelete) {
-                // Iterate through all macros and remove those matching the file
-                for (const [name, defs] of this.macros.entries()) {
-                    const initialLength = defs.length;
-                    const filtered = defs.filter(def => def.file !== fileToDelete);
-                    
-                    if (filtered.length === 0) {
-                        // No definitions left for this macro, remove the entire entry
-                        this.macros.delete(name);
-                        deletedCount += initialLength;
-                    } else if (filtered.length < initialLength) {
-                        // Some definitions removed
-                        this.macros.set(name, filtered);
-                        deletedCount += (initialLength - filtered.length);
+    private includeEdges: Array<{ file_id: number, target: string, system: number, line: number }> = [];
+
+    private handleReferences(sql: string, args: any[], type: string): any {
+        if (sql.includes('INSERT INTO macro_refs')) {
+            // INSERT INTO macro_refs (name_id, file_id) VALUES (?, ?)
+            const name = this.internedName(args[0]);
+            let files = this.references.get(name);
+            if (!files) {
+                files = new Set();
+                this.references.set(name, files);
+            }
+            files.add(Number(args[1]));
+            return { changes: 1 };
+        }
+        if (sql.includes('DELETE FROM macro_refs')) {
+            // DELETE FROM macro_refs WHERE file_id = ?
+            let changes = 0;
+            for (const [name, files] of this.references) {
+                if (files.delete(Number(args[0]))) {
+                    changes++;
+                    if (files.size === 0) {
+                        this.references.delete(name);
                     }
                 }
             }
-            
-            return { changes: deletedCount };
-        } else if (sql.includes('WHERE name')) {
-            // DELETE FROM macros WHERE name = ?
-            // Delete all definitions of a specific macro name
-            const name = params.name || (Array.isArray(params) ? params[0] : params);
-            if (name && this.macros.has(name)) {
-                const count = this.macros.get(name)!.length;
-                this.macros.delete(name);
-                return { changes: count };
-            }
-            return { changes: 0 };
-        } else if (sql.includes('WHERE')) {
-            // Generic WHERE clause - for safety, don't delete anything
-            console.warn('InMemoryDatabase: Unsupported WHERE clause in DELETE:', sql);
-            return { changes: 0 };
-        } else {
-            // DELETE without WHERE - clear all
-            const count = Array.from(this.macros.values()).reduce((sum, defs) => sum + defs.length, 0);
-            this.macros.clear();
-            return { changes: count };
+            return { changes };
         }
+
+        // SELECT DISTINCT f.path FROM macro_refs r JOIN names n ... JOIN files f ... WHERE n.name IN (?, ?)
+        const ids = new Set([...this.references.get(args[0]) ?? [], ...this.references.get(args[1]) ?? []]);
+        const rows = Array.from(ids)
+            .filter(id => this.files.has(id))
+            .map(id => ({ path: this.files.get(id)!.path }));
+        return type === 'get' ? rows[0] : rows;
     }
+
+    private references = new Map<string, Set<number>>();
+
+    // In-memory storage for files table
+    private files: Map<number, { path: string, mtime: number }> = new Map();
+    private nextFileId = 1;
+    private filePathToId: Map<string, number> = new Map();
 }
 
 export class MacroDatabase {
-    private db: DatabaseInterface | null = null;
+    private db: DatabaseClient | null = null;
+    private initializing: Promise<void> | null = null;
+    // Write transactions run one after another on the shared connection
+    private transactionQueue: Promise<void> = Promise.resolve();
+    // Project scans run one at a time; a scan requested while another runs waits in
+    // queuedScan, which later requests join
+    private scanQueue: Promise<void> = Promise.resolve();
+    private queuedScan: { promise: Promise<void>; forceRebuild: boolean } | null = null;
+    private scanning = false;
+    // Mirrors of the files table and the interned strings, so writes never wait for a lookup
+    private ids: Promise<IndexIds> | null = null;
+    // Published definitions: never modified in place, replaced as a whole by publish()
     private definitions: Map<string, MacroDef[]> = new Map();
+    private undefs: Map<string, MacroUndef[]> = new Map();
+    // Incremented whenever lookups may return different results (see getGeneration)
+    private generation = 0;
+    private indexing = false;
+    private includeGraph = new IncludeGraph();
+    private compileCommands: CompileCommands | null = null;
+    private scopeToIncludes = false;
+    // Indexed files (macrolens.includeGlob / excludeGlobs) and size limits in bytes (0 = none)
+    private includeGlob: string = FILE_PATTERNS.C_CPP_GLOB;
+    private excludeGlobs: string[] = [...FILE_PATTERNS.EXCLUDE_GLOBS];
+    private includeMatcher = new GlobMatcher([FILE_PATTERNS.C_CPP_GLOB]);
+    private excludeMatcher = new GlobMatcher(FILE_PATTERNS.EXCLUDE_GLOBS);
+    private streamingThreshold = DATABASE_CONSTANTS.DEFAULT_STREAMING_THRESHOLD_MB * 1024 * 1024;
+    private maxFileSize = DATABASE_CONSTANTS.DEFAULT_MAX_FILE_SIZE_MB * 1024 * 1024;
+    private useGitignore = true;
+    private gitState: IndexedGitState | null = null;
     private static instance: MacroDatabase;
     private dbPath: string;
     private context: vscode.ExtensionContext | null = null;
@@ -367,6 +413,27 @@ export class MacroDatabase {
     private debounceDelay: number = DATABASE_CONSTANTS.DEFAULT_DEBOUNCE_DELAY;
     private maxDelay: number = DATABASE_CONSTANTS.DEFAULT_MAX_DELAY;
     private workspaceRoot: string | null = null;
+
+    // Unsaved editor buffers layered over the persisted definitions (keyed by absolute path)
+    private overlays = new Map<string, DocumentOverlay>();
+    // Per-name views combining overlays and the active configuration filter
+    private viewCache = new Map<string, MacroDef[]>();
+    private timelineCache = new Map<string, Map<string, FileTimeline>>();
+    private scopedCache = new Map<string, MacroDef[]>();
+    private viewSource: Map<string, MacroDef[]> | null = null;
+    // Evaluates #if conditions for macrolens.activeConfiguration (null = no filtering)
+    private conditionEvaluator: ConditionEvaluator | null = null;
+    private activeConfigurationKey = '';
+    // Files committed from an overlay on save, with the mtime written, so the watcher event can be skipped
+    private committedMtimes = new Map<string, number>();
+    // Names whose definitions changed per file since the last getAffectedFiles call
+    private changedNames = new Map<string, Set<string>>();
+    private dependents: Map<string, Set<string>> | null = null;
+    // Idle-time maintenance: steps left in the current pass and the latest results
+    private maintenanceSteps: string[] = [];
+    private lastMaintenance: number | null = null;
+    private lastIntegrityCheck: { time: number; result: string } | null = null;
+    private indexSize: { sizeBytes: number; freeBytes: number } | null = null;
     
     // Event emitter for database updates
     private _onDidChange = new vscode.EventEmitter<vscode.Uri>();
@@ -419,11 +486,12 @@ export class MacroDatabase {
         return path.join(this.workspaceRoot, relativePath);
     }
 
-    initialize(context: vscode.ExtensionContext): void {
-        if (this.initialized) {
-            return;
-        }
+    initialize(context: vscode.ExtensionContext): Promise<void> {
+        this.initializing ??= this.open(context);
+        return this.initializing;
+    }
 
+    private async open(context: vscode.ExtensionContext): Promise<void> {
         this.context = context;
         this.dbPath = this.getDbPath(context);
         
@@ -432,10 +500,12 @@ export class MacroDatabase {
         this.workspaceRoot = workspaceFolder?.uri.fsPath || null;
         console.log(`MacroLens: Workspace root: ${this.workspaceRoot}`);
 
-        this.initializeDatabase();
+        await this.initializeDatabase();
 
-        this.initDatabase();
+        await this.initDatabase();
         this.updateConfigurationSettings();
+        await this.loadGitState();
+        await this.loadIntegrityCheck();
         this.initialized = true;
     }
 
@@ -459,11 +529,93 @@ export class MacroDatabase {
             );
             
             console.log(`MacroLens: Updated debounce settings - delay: ${this.debounceDelay}ms, max: ${this.maxDelay}ms`);
+
+            this.setActiveConfiguration(config.get<string[]>('activeConfiguration', []));
+
+            this.includeGlob = config.get<string>('includeGlob', FILE_PATTERNS.C_CPP_GLOB) || FILE_PATTERNS.C_CPP_GLOB;
+            this.excludeGlobs = config.get<string[]>('excludeGlobs', [...FILE_PATTERNS.EXCLUDE_GLOBS]);
+            this.includeMatcher = new GlobMatcher([this.includeGlob]);
+            this.excludeMatcher = new GlobMatcher(this.excludeGlobs);
+            this.useGitignore = config.get<boolean>('useGitignore', true);
+            const megabyte = 1024 * 1024;
+            this.streamingThreshold = Math.max(0, config.get('streamingThreshold', DATABASE_CONSTANTS.DEFAULT_STREAMING_THRESHOLD_MB)) * megabyte;
+            this.maxFileSize = Math.max(0, config.get('maxFileSize', DATABASE_CONSTANTS.DEFAULT_MAX_FILE_SIZE_MB)) * megabyte;
+
+            const scopeToIncludes = config.get<boolean>('scopeToIncludes', false);
+            if (scopeToIncludes !== this.scopeToIncludes) {
+                this.scopeToIncludes = scopeToIncludes;
+                this.invalidateViews();
+                if (this.initialized && this.workspaceRoot) {
+                    this._onDidChange.fire(vscode.Uri.file(this.workspaceRoot));
+                }
+            }
         } catch (error) {
             console.warn('MacroLens: Failed to update configuration settings:', error);
         }
     }
 
+    /**
+     * Select the predefined macros used to decide which conditional branches are active
+     * An empty configuration disables filtering
+     */
+    private setActiveConfiguration(entries: string[]): void {
+        const key = entries.join('\n');
+        if (key === this.activeConfigurationKey) {
+            return;
+        }
+
+        this.activeConfigurationKey = key;
+        this.conditionEvaluator = entries.length > 0
+            ? new ConditionEvaluator(entries, name => this.definitions.has(name))
+            : null;
+        this.invalidateViews();
+
+        if (this.initialized && this.workspaceRoot) {
+            this._onDidChange.fire(vscode.Uri.file(this.workspaceRoot));
+        }
+    }
+
+    /**
+     * (Re)load the compilation database for command line definitions, include directories
+     * and forced includes. A missing or malformed file disables the command line layer.
+     */
+    async loadCompileCommands(): Promise<void> {
+        if (!this.workspaceRoot) {
+            return;
+        }
+
+        const configured = vscode.workspace.getConfiguration('macrolens').get<string>('compileCommandsPath', '');
+        const candidates = configured
+            ? [path.resolve(this.workspaceRoot, configured)]
+            : FILE_PATTERNS.COMPILE_COMMANDS_LOCATIONS.map(location => path.join(this.workspaceRoot!, location));
+
+        let commands: CompileCommands | null = null;
+        for (const candidate of candidates) {
+            let content: Uint8Array;
+            try {
+                content = await vscode.workspace.fs.readFile(vscode.Uri.file(candidate));
+            } catch {
+                continue;
+            }
+            try {
+                commands = CompileCommands.parse(Buffer.from(content).toString('utf8'), candidate);
+                console.log(`MacroLens: Loaded ${commands.unitCount} compile commands (${commands.configurationCount} distinct flag sets) from ${candidate}`);
+            } catch (error) {
+                console.warn(`MacroLens: Failed to parse ${candidate}:`, error);
+            }
+            break;
+        }
+
+        this.compileCommands = commands;
+        this.includeGraph.setIncludeDirectories(commands ? commands.getIncludeDirectories() : []);
+        this.includeGraph.setForcedIncludes(commands ? commands.getForcedIncludesByFile() : new Map());
+        this.invalidateViews();
+
+        if (this.initialized) {
+            this._onDidChange.fire(vscode.Uri.file(this.workspaceRoot));
+        }
+    }
+
     private getDbPath(context: vscode.ExtensionContext): string {
         const workspaceFolder = vscode.workspace.workspaceFolders?.[0];
         
@@ -484,17 +636,25 @@ export class MacroDatabase {
         }
     }
 
-    private initializeDatabase(): void {
+    private async initializeDatabase(): Promise<void> {
+        this.ids = null;
+        try {
+            // Node.js built-in SQLite (Node.js 22+) in a worker thread, so queries never block the extension host
+            this.db = await DatabaseClient.openWorker(this.dbPath);
+            console.log(`MacroLens: Using Node.js built-in SQLite in a worker thread at: ${this.dbPath}`);
+            return;
+        } catch (error) {
+            console.warn('MacroLens: Database worker unavailable, opening SQLite on the extension host thread:', error);
+        }
         try {
-            // Try Node.js built-in SQLite (Node.js 22+)
             const { DatabaseSync } = require('node:sqlite');
-            this.db = new DatabaseSync(this.dbPath);
+            this.db = DatabaseClient.local(new DatabaseSync(this.dbPath));
             console.log(`MacroLens: Using Node.js built-in SQLite at: ${this.dbPath}`);
         } catch (error) {
             console.warn('MacroLens: Node.js built-in SQLite not available, using in-memory fallback');
             console.warn('MacroLens: Requires Node.js 22.5.0+ for persistent storage');
             this.useInMemory = true;
-            this.db = new InMemoryDatabase();
+            this.db = DatabaseClient.local(new InMemoryDatabase());
             console.log('MacroLens: Using in-memory database fallback');
         }
     }
@@ -517,10 +677,10 @@ export class MacroDatabase {
      * Completely reset the database: close connection, delete file, and re-initialize.
      * This ensures a clean state and recovers disk space.
      */
-    private resetDatabase(): void {
+    private async resetDatabase(): Promise<void> {
         if (this.db) {
             try {
-                this.db.close();
+                await this.db.close();
             } catch (e) {
                 console.warn('MacroLens: Error closing database during reset:', e);
             }
@@ -537,10 +697,10 @@ export class MacroDatabase {
         }
 
         // Re-initialize the connection
-        this.initializeDatabase();
+        await this.initializeDatabase();
     }
 
-    private initDatabase() {
+    private async initDatabase(): Promise<void> {
         if (!this.db) {
             throw new Error('Database not initialized');
         }
@@ -551,25 +711,34 @@ export class MacroDatabase {
             let needRebuild = false;
             try {
                 // Check if 'files' table exists
-                const filesTable = this.db.prepare("SELECT name FROM sqlite_master WHERE type='table' AND name='files'").get();
+                const filesTable = await this.db.get("SELECT name FROM sqlite_master WHERE type='table' AND name='files'");
                 
                 // Check if 'macros' table exists and has 'file_id' column
                 let macrosTableValid = false;
-                const macrosTable = this.db.prepare("SELECT name FROM sqlite_master WHERE type='table' AND name='macros'").get();
+                const macrosTable = await this.db.get("SELECT name FROM sqlite_master WHERE type='table' AND name='macros'");
                 
                 if (macrosTable) {
                     try {
-                        // Check columns in macros table
-                        const columns = this.db.prepare("PRAGMA table_info(macros)").all() as any[];
-                        macrosTableValid = columns.some((col: any) => col.name === 'file_id');
+                        // Check columns in macros table (file_id: v2, condition: v3, endLine: v4, interned ids: v5)
+                        const columns = await this.db.all<any>("PRAGMA table_info(macros)");
+                        macrosTableValid = ['file_id', 'condition', 'endLine', 'name_id', 'body_id']
+                            .every(column => columns.some((col: any) => col.name === column));
                     } catch (e) {
                         // If PRAGMA fails, assume invalid
                         macrosTableValid = false;
                     }
                 }
 
+                // Files indexed before include or reference tracking must be re-parsed
+                const includesTable = await this.db.get("SELECT name FROM sqlite_master WHERE type='table' AND name='include_edges'");
+                const referenceColumns = await this.db.all<any>("PRAGMA table_info(macro_refs)");
+                const referencesTableValid = referenceColumns.some((col: any) => col.name === 'name_id');
+                // Bodies are keyed by a sha256 digest; earlier tables had a truncated hash or none
+                const bodyColumns = await this.db.all<any>("PRAGMA table_info(bodies)");
+                const bodiesTableValid = bodyColumns.some((col: any) => col.name === 'digest');
+
                 // If files table missing OR macros table exists but is invalid (old schema)
-                if (!filesTable || (macrosTable && !macrosTableValid)) {
+                if (!filesTable || (macrosTable && (!macrosTableValid || !includesTable || !referencesTableValid || !bodiesTableValid))) {
                     console.log('MacroLens: Schema mismatch detected.');
                     needRebuild = true;
                 }
@@ -580,346 +749,1027 @@ export class MacroDatabase {
 
             if (needRebuild) {
                 console.log('MacroLens: Performing full database rebuild...');
-                this.resetDatabase();
+                await this.resetDatabase();
                 // After reset, this.db is a fresh connection to a new (missing) file
             }
         }
         
+        // Let maintenance return free pages to the file system without rewriting the file
+        // (only takes effect while the database is still empty)
+        await this.db.exec('PRAGMA auto_vacuum = INCREMENTAL');
+
         // Create files table to track file metadata (mtime) and normalize paths
-        this.db.exec(`
+        await this.db.exec(`
             CREATE TABLE IF NOT EXISTS files (
                 id INTEGER PRIMARY KEY AUTOINCREMENT,
                 path TEXT NOT NULL UNIQUE,
                 mtime REAL NOT NULL
             )
         `);
-        this.db.exec('CREATE INDEX IF NOT EXISTS idx_files_path ON files(path)');
+        await this.db.exec('CREATE INDEX IF NOT EXISTS idx_files_path ON files(path)');
+
+        // Interned strings: the same names, parameter lists and bodies recur across thousands
+        // of rows, so rows store ids. Bodies are looked up by the sha256 digest of their text
+        // rather than the text itself. Strings no longer used by any row are deleted by pruneStrings.
+        await this.db.exec(`
+            CREATE TABLE IF NOT EXISTS names (
+                id INTEGER PRIMARY KEY,
+                name TEXT NOT NULL UNIQUE
+            )
+        `);
+        await this.db.exec(`
+            CREATE TABLE IF NOT EXISTS param_lists (
+                id INTEGER PRIMARY KEY,
+                params TEXT NOT NULL UNIQUE
+            )
+        `);
+        await this.db.exec(`
+            CREATE TABLE IF NOT EXISTS bodies (
+                id INTEGER PRIMARY KEY,
+                digest TEXT NOT NULL UNIQUE,
+                text TEXT NOT NULL
+            )
+        `);
 
         // Update macros table to reference file_id instead of storing path string
-        this.db.exec(`
+        await this.db.exec(`
             CREATE TABLE IF NOT EXISTS macros (
-                name TEXT NOT NULL,
-                params TEXT,
-                body TEXT NOT NULL,
+                name_id INTEGER NOT NULL,
+                params_id INTEGER,
+                body_id INTEGER NOT NULL,
                 file_id INTEGER NOT NULL,
                 line INTEGER NOT NULL,
                 isDefine INTEGER,
+                condition TEXT,
+                endLine INTEGER,
+                FOREIGN KEY(file_id) REFERENCES files(id) ON DELETE CASCADE
+            )
+        `);
+        await this.db.exec('CREATE INDEX IF NOT EXISTS idx_macro_name ON macros(name_id)');
+        await this.db.exec('CREATE INDEX IF NOT EXISTS idx_macro_file_id ON macros(file_id)');
+
+        // #undef directives, which end the validity range of definitions within a file
+        await this.db.exec(`
+            CREATE TABLE IF NOT EXISTS undefs (
+                name_id INTEGER NOT NULL,
+                file_id INTEGER NOT NULL,
+                line INTEGER NOT NULL,
+                condition TEXT,
+                FOREIGN KEY(file_id) REFERENCES files(id) ON DELETE CASCADE
+            )
+        `);
+        await this.db.exec('CREATE INDEX IF NOT EXISTS idx_undef_file_id ON undefs(file_id)');
+
+        // #include directives per file, resolved into the include graph in memory
+        await this.db.exec(`
+            CREATE TABLE IF NOT EXISTS include_edges (
+                file_id INTEGER NOT NULL,
+                target TEXT NOT NULL,
+                system INTEGER NOT NULL,
+                line INTEGER NOT NULL,
+                FOREIGN KEY(file_id) REFERENCES files(id) ON DELETE CASCADE
+            )
+        `);
+        await this.db.exec('CREATE INDEX IF NOT EXISTS idx_include_file_id ON include_edges(file_id)');
+
+        // Reference postings: one row per macro-style name used in a file
+        await this.db.exec(`
+            CREATE TABLE IF NOT EXISTS macro_refs (
+                name_id INTEGER NOT NULL,
+                file_id INTEGER NOT NULL,
                 FOREIGN KEY(file_id) REFERENCES files(id) ON DELETE CASCADE
             )
         `);
-        this.db.exec('CREATE INDEX IF NOT EXISTS idx_macro_name ON macros(name)');
-        this.db.exec('CREATE INDEX IF NOT EXISTS idx_macro_file_id ON macros(file_id)');
+        await this.db.exec('CREATE INDEX IF NOT EXISTS idx_ref_name ON macro_refs(name_id)');
+        await this.db.exec('CREATE INDEX IF NOT EXISTS idx_ref_file_id ON macro_refs(file_id)');
+
+        // Index-wide state such as the git commit the index was built from
+        await this.db.exec(`
+            CREATE TABLE IF NOT EXISTS meta (
+                key TEXT PRIMARY KEY,
+                value TEXT NOT NULL
+            )
+        `);
     }
 
-    async scanProject(forceRebuild: boolean = false): Promise<void> {
+    /**
+     * Bring the index up to date with the workspace
+     * Lookups answer from what is indexed while this runs: a stored index is loaded
+     * first, and a cold scan first indexes the files the user has open.
+     * Scans never overlap: a call made while a scan runs waits for it, and calls made
+     * meanwhile share that next scan (which rebuilds if any of them asked to).
+     * @param location Where the progress is shown (a status bar item while activating)
+     */
+    async scanProject(
+        forceRebuild: boolean = false,
+        location: vscode.ProgressLocation = vscode.ProgressLocation.Notification
+    ): Promise<void> {
         if (!this.db || !this.initialized) {
             throw new Error('Database not initialized. Call initialize() first.');
         }
 
+        if (this.queuedScan) {
+            this.queuedScan.forceRebuild ||= forceRebuild;
+            return this.queuedScan.promise;
+        }
+
+        const queued = { promise: Promise.resolve(), forceRebuild };
+        queued.promise = this.scanQueue.then(async () => {
+            this.queuedScan = null;
+            this.scanning = true;
+            try {
+                await this.runScan(queued.forceRebuild, location);
+            } finally {
+                this.scanning = false;
+            }
+        });
+        this.queuedScan = queued;
+        this.scanQueue = queued.promise.then(() => undefined, () => undefined);
+        return queued.promise;
+    }
+
+    private async runScan(forceRebuild: boolean, location: vscode.ProgressLocation): Promise<void> {
         if (forceRebuild) {
             console.log('MacroLens: Force rebuild requested. Resetting database...');
-            this.resetDatabase();
-            this.initDatabase(); // Ensure tables are created
+            // Wait for pending writes (saves, watcher updates) so no transaction is open on
+            // the connection being replaced
+            await this.serialized(async () => {
+                await this.resetDatabase();
+                await this.initDatabase(); // Ensure tables are created
+            });
         }
 
-        const files = await vscode.workspace.findFiles(
-            FILE_PATTERNS.C_CPP_GLOB,
-            FILE_PATTERNS.EXCLUDE_PATTERNS
-        );
+        await this.loadCompileCommands();
 
-        // Always show progress indicator to inform user about scanning activity
-        await vscode.window.withProgress({
-            location: vscode.ProgressLocation.Notification,
-            title: "MacroLens Scanning project",
-            cancellable: false
-        }, async (progress) => {
-            await this.scanProjectWithProgress(files, progress);
-        });
-    }
+        if (!forceRebuild && await this.reconcileWithGit(true)) {
+            return;
+        }
+
+        // Walk the file system directly when possible so parsing overlaps the traversal
+        const workspaceFolder = vscode.workspace.workspaceFolders?.[0];
+        const files = this.workspaceRoot && workspaceFolder?.uri.scheme === 'file'
+            ? this.walkWorkspace(this.workspaceRoot)
+            : this.findWorkspaceFiles();
+
+        // A warm scan starts from the stored index, so lookups are complete but for the
+        // files changed since; only a cold scan leaves them missing definitions
+        const warm = !!(await this.db!.get('SELECT 1 FROM files LIMIT 1'));
 
-    private async scanProjectWithProgress(files: vscode.Uri[], progress: vscode.Progress<{message?: string; increment?: number}>): Promise<void> {
-        this.db!.exec('BEGIN TRANSACTION');
+        // Always show progress indicator to inform user about scanning activity
+        this.indexing = !warm;
         try {
-            // We don't delete all macros anymore. We do incremental updates.
-            // However, for a "full scan" request, we might want to verify everything.
-            // But let's optimize: check mtime for each file.
-            
-            const insertFileStmt = this.db!.prepare('INSERT OR IGNORE INTO files (path, mtime) VALUES (?, ?)');
-            const updateFileMtimeStmt = this.db!.prepare('UPDATE files SET mtime = ? WHERE id = ?');
-            const getFileStmt = this.db!.prepare('SELECT id, mtime FROM files WHERE path = ?');
-            const deleteMacrosStmt = this.db!.prepare('DELETE FROM macros WHERE file_id = ?');
-            const insertMacroStmt = this.db!.prepare(
-                'INSERT INTO macros (name, params, body, file_id, line, isDefine) VALUES (?, ?, ?, ?, ?, ?)'
-            );
-            
-            const increment = 100 / files.length;
-            const processedFiles = new Set<string>();
+            await vscode.window.withProgress({
+                location,
+                title: "MacroLens Scanning project",
+                cancellable: false
+            }, async (progress) => {
+                if (warm) {
+                    progress.report({ message: 'Loading index...' });
+                    await this.loadDefinitions();
+                } else {
+                    const priorityFiles = await this.findPriorityFiles();
+                    progress.report({ message: `Indexing ${priorityFiles.length} open and related files...` });
+                    await this.updateFiles(priorityFiles, []);
+                }
+                await this.scanProjectWithProgress(files, progress, warm);
+            });
+        } finally {
+            this.indexing = false;
+        }
+        await this.recordGitState();
+    }
 
-            for (let i = 0; i < files.length; i++) {
-                const file = files[i];
-                const fileName = file.fsPath.split(/[/\\]/).pop() || file.fsPath;
-                const relativePath = this.toRelativePath(file.fsPath);
-                processedFiles.add(relativePath);
-                
-                progress.report({ 
-                    message: ` ${fileName} (${i + 1}/${files.length})`,
-                    increment: increment
-                });
-                
-                try {
-                    const stat = await vscode.workspace.fs.stat(file);
-                    const mtime = stat.mtime;
+    /**
+     * Whether a cold project scan is running, so the index may lack definitions
+     * (a warm scan starts from the stored index and is not reported)
+     */
+    isIndexing(): boolean {
+        return this.indexing;
+    }
 
-                    // Check if file exists in DB
-                    const fileRecord = getFileStmt.get(relativePath) as { id: number, mtime: number } | undefined;
+    /**
+     * Files to index ahead of a cold scan: the files open in editors (the active one
+     * first), the headers they include and the files next to them
+     */
+    private async findPriorityFiles(): Promise<vscode.Uri[]> {
+        const files = new Map<string, vscode.Uri>();
+        const add = (uri: vscode.Uri) => {
+            if (files.size < DATABASE_CONSTANTS.PRIORITY_SCAN_LIMIT && !files.has(uri.fsPath) && this.isIndexed(uri)) {
+                files.set(uri.fsPath, uri);
+            }
+        };
 
-                    if (fileRecord) {
-                        if (fileRecord.mtime === mtime) {
-                            // File unchanged, skip parsing
-                            continue;
-                        }
-                        // File changed: update mtime and re-parse
-                        updateFileMtimeStmt.run(mtime, fileRecord.id);
-                        deleteMacrosStmt.run(fileRecord.id); // Clear old macros
-                        
-                        // Parse and insert new macros
-                        const content = await vscode.workspace.fs.readFile(file);
-                        const defs = MacroParser.parseMacros(content.toString(), file.fsPath);
-                        for (const def of defs) {
-                            insertMacroStmt.run(
-                                def.name,
-                                def.params !== undefined ? def.params.join(',') : null,
-                                def.body,
-                                fileRecord.id,
-                                def.line,
-                                def.isDefine !== undefined ? (def.isDefine ? 1 : 0) : null
-                            );
-                        }
-                    } else {
-                        // New file
-                        insertFileStmt.run(relativePath, mtime);
-                        // Get the ID of the newly inserted file
-                        const newFileRecord = getFileStmt.get(relativePath) as { id: number };
-                        
-                        const content = await vscode.workspace.fs.readFile(file);
-                        const defs = MacroParser.parseMacros(content.toString(), file.fsPath);
-                        for (const def of defs) {
-                            insertMacroStmt.run(
-                                def.name,
-                                def.params !== undefined ? def.params.join(',') : null,
-                                def.body,
-                                newFileRecord.id,
-                                def.line,
-                                def.isDefine !== undefined ? (def.isDefine ? 1 : 0) : null
-                            );
-                        }
-                    }
-                } catch (error) {
-                    console.warn(`Failed to parse file ${file.fsPath}:`, error);
+        const documents = [vscode.window.activeTextEditor, ...vscode.window.visibleTextEditors]
+            .map(editor => editor?.document)
+            .filter((document): document is vscode.TextDocument => document?.uri.scheme === 'file');
+        const directories = new Set<string>();
+        const unresolved = new Set<string>();
+        for (const document of documents) {
+            add(document.uri);
+            const directory = path.dirname(document.uri.fsPath);
+            directories.add(directory);
+            for (const line of document.getText().split('\n')) {
+                const match = REGEX_PATTERNS.INCLUDE_DIRECTIVE.exec(line);
+                if (!match) {
+                    continue;
+                }
+                const candidate = path.resolve(directory, match[2]);
+                if (fs.existsSync(candidate)) {
+                    add(vscode.Uri.file(candidate));
+                } else {
+                    unresolved.add(path.basename(match[2]));
                 }
             }
+        }
 
-            // Cleanup: Remove files from DB that are no longer in the workspace
-            // This is important if files were deleted outside of VS Code
-            const allDbFiles = this.db!.prepare('SELECT path FROM files').all() as Array<{ path: string }>;
-            const deleteFileStmt = this.db!.prepare('DELETE FROM files WHERE path = ?');
-            
-            for (const dbFile of allDbFiles) {
-                if (!processedFiles.has(dbFile.path)) {
-                    deleteFileStmt.run(dbFile.path);
-                    // Cascade delete will handle macros if foreign keys are enabled, 
-                    // but InMemoryDatabase might need manual help or we rely on the DELETE trigger/logic if supported.
-                    // Since we are using a custom InMemoryDatabase or simple SQLite, let's ensure macros are deleted.
-                    // If using real SQLite with FKs enabled, it's automatic. 
-                    // For safety in this hybrid env, let's manually delete macros for this file path if needed, 
-                    // but we don't have the ID easily here without another query.
-                    // Actually, let's just rely on the fact that we should probably enable FK support in SQLite or handle it.
-                    // For now, let's assume the user might be using the InMemory one which needs manual cleanup.
-                    // But wait, InMemoryDatabase doesn't support FKs or Cascade.
-                    // We need to handle deletion manually for InMemory.
-                    if (this.useInMemory) {
-                         // We need to find the ID first to delete macros
-                         // But wait, the InMemoryDatabase implementation of DELETE FROM macros WHERE file_id = ? needs to be supported.
-                         // Currently it supports WHERE file = ?. We changed the schema.
-                         // We need to update InMemoryDatabase to support the new schema.
+        // Headers found through include directories: look them up by name
+        if (unresolved.size > 0) {
+            try {
+                const found = await vscode.workspace.findFiles(
+                    `**/{${Array.from(unresolved).join(',')}}`,
+                    GlobMatcher.join(this.excludeGlobs),
+                    DATABASE_CONSTANTS.PRIORITY_SCAN_LIMIT
+                );
+                found.forEach(add);
+            } catch (error) {
+                console.warn('MacroLens: Failed to look up included headers:', error);
+            }
+        }
+
+        for (const directory of directories) {
+            try {
+                for (const entry of await fs.promises.readdir(directory, { withFileTypes: true })) {
+                    if (entry.isFile()) {
+                        add(vscode.Uri.file(path.join(directory, entry.name)));
                     }
                 }
+            } catch {
+                // The directory may be gone; the full scan handles it
             }
-            
-            progress.report({ message: 'Finalizing...' });
-            this.db!.exec('COMMIT');
-            await this.loadDefinitions();
-            
-            // Notify listeners that a full scan completed (pass undefined or a special URI?)
-            // Since we don't track individual files easily here, we can just fire for the workspace root
-            // or let the listener handle a "general update".
-            // For now, let's not fire individual events for a full scan to avoid flooding.
-            // But we should probably fire *something*.
-            // Let's fire a dummy event or just rely on the fact that full scan is rare.
-            // Actually, let's fire for each file if it's not too many, or just one "workspace" event.
-            // Given the API is onDidChange(Uri), let's fire one for the workspace root if possible.
-            if (this.workspaceRoot) {
-                this._onDidChange.fire(vscode.Uri.file(this.workspaceRoot));
-            }
-        } catch (error) {
-            this.db!.exec('ROLLBACK');
-            throw error;
         }
+        return Array.from(files.values());
     }
 
     /**
-     * Scan and update only specific files (incremental update)
+     * Bring the index up to date by re-parsing only the files git reports as changed
+     * since the indexed commit, plus files that were dirty then or updated since.
+     * Returns false when a full scan is needed (no git, unknown commit, different settings).
+     * @param load Load the stored definitions first (activation) instead of updating the live caches
      */
-    async scanFiles(fileUris: vscode.Uri[]): Promise<void> {
-        if (!this.db || !this.initialized) {
-            throw new Error('Database not initialized. Call initialize() first.');
+    private async reconcileWithGit(load: boolean): Promise<boolean> {
+        const state = this.gitState;
+        if (!state || !this.workspaceRoot || !this.useGitignore || state.settings !== this.getScanSettingsKey()) {
+            return false;
         }
 
-        if (fileUris.length === 0) {
-            return;
+        const git = await GitReconciler.open(this.workspaceRoot);
+        const head = await git?.getHead();
+        if (!git || !head) {
+            return false;
+        }
+        const changed = head === state.head ? [] : await git.getChangedFiles(state.head, head);
+        const dirty = await git.getDirtyFiles();
+        if (!changed || !dirty) {
+            return false;
         }
 
-        this.db.exec('BEGIN TRANSACTION');
-        try {
-            const getFileStmt = this.db.prepare('SELECT id FROM files WHERE path = ?');
-            const insertFileStmt = this.db.prepare('INSERT INTO files (path, mtime) VALUES (?, ?)');
-            const updateFileMtimeStmt = this.db.prepare('UPDATE files SET mtime = ? WHERE id = ?');
-            const deleteMacrosStmt = this.db.prepare('DELETE FROM macros WHERE file_id = ?');
-            const insertMacroStmt = this.db.prepare(
-                'INSERT INTO macros (name, params, body, file_id, line, isDefine) VALUES (?, ?, ?, ?, ?, ?)'
-            );
+        const root = this.workspaceRoot + path.sep;
+        const existing: vscode.Uri[] = [];
+        const removed: vscode.Uri[] = [];
+        for (const file of new Set([...changed, ...dirty, ...state.touched])) {
+            const uri = vscode.Uri.file(file);
+            if (!file.startsWith(root) || !this.isIndexed(uri)) {
+                continue;
+            }
+            (fs.existsSync(file) ? existing : removed).push(uri);
+        }
 
-            for (const fileUri of fileUris) {
-                const relativePath = this.toRelativePath(fileUri.fsPath);
-                
-                try {
-                    // Perform I/O and parsing first to minimize cache downtime
-                    // This prevents "undefined macro" errors during the async I/O window
-                    const stat = await vscode.workspace.fs.stat(fileUri);
-                    const content = await vscode.workspace.fs.readFile(fileUri);
-                    const defs = MacroParser.parseMacros(content.toString(), fileUri.fsPath);
-                    const mtime = stat.mtime;
-                    
-                    // Now update cache and DB synchronously
-                    // Remove old entries from cache only when we have new ones ready
-                    this.removeFromCache(relativePath);
-
-                    let fileId: number;
-                    const fileRecord = getFileStmt.get(relativePath) as { id: number } | undefined;
-
-                    if (fileRecord) {
-                        fileId = fileRecord.id;
-                        updateFileMtimeStmt.run(mtime, fileId);
-                        deleteMacrosStmt.run(fileId);
-                    } else {
-                        insertFileStmt.run(relativePath, mtime);
-                        const newRecord = getFileStmt.get(relativePath) as { id: number };
-                        fileId = newRecord.id;
-                    }
+        const startTime = Date.now();
+        if (load) {
+            await this.loadDefinitions();
+        }
+        await this.updateFiles(existing, removed);
+        await this.saveGitState(head, dirty);
+        console.log(`MacroLens: Reconciled ${existing.length + removed.length} files changed since ${state.head.substring(0, 8)} with git in ${Date.now() - startTime}ms`);
 
-                    for (const def of defs) {
-                        insertMacroStmt.run(
-                            def.name,
-                            def.params !== undefined ? def.params.join(',') : null,
-                            def.body,
-                            fileId,
-                            def.line,
-                            def.isDefine !== undefined ? (def.isDefine ? 1 : 0) : null
-                        );
-                        
-                        // Add to in-memory cache
-                        const defWithAbsPath = {
-                            ...def,
-                            file: fileUri.fsPath  // Use absolute path in memory
-                        };
-                        this.addToCache(defWithAbsPath);
-                    }
-                } catch (error) {
-                    console.warn(`Failed to parse file ${fileUri.fsPath}:`, error);
-                }
-            }
-            
-            this.db.exec('COMMIT');
-            // No need to call loadDefinitions() - we updated cache incrementally
-            
-            // Notify listeners about updates
-            for (const fileUri of fileUris) {
-                this._onDidChange.fire(fileUri);
-            }
-        } catch (error) {
-            this.db.exec('ROLLBACK');
-            throw error;
+        if (this.workspaceRoot) {
+            this._onDidChange.fire(vscode.Uri.file(this.workspaceRoot));
         }
+        return true;
     }
 
     /**
-     * Remove macros from deleted files
+     * Remember the commit a full scan was built from (cleared outside git repositories)
      */
-    async removeFile(fileUri: vscode.Uri): Promise<void> {
-        if (!this.db || !this.initialized) {
-            return;
+    private async recordGitState(): Promise<void> {
+        const git = this.workspaceRoot ? await GitReconciler.open(this.workspaceRoot) : null;
+        const head = await git?.getHead();
+        const dirty = await git?.getDirtyFiles();
+        if (head && dirty) {
+            await this.saveGitState(head, dirty);
+        } else if (this.gitState) {
+            this.gitState = null;
+            if (this.db) {
+                const db = this.db;
+                await this.serialized(() => db.run('DELETE FROM meta WHERE key = ?', 'git_state'));
+            }
         }
+    }
 
+    /**
+     * Store the git state outside any transaction; serialized, so the write is never
+     * issued on the shared connection while a scan transaction is open
+     */
+    private async saveGitState(head: string, dirty: string[]): Promise<void> {
+        this.gitState = { head, settings: this.getScanSettingsKey(), touched: new Set(dirty) };
+        const db = this.db;
+        if (db) {
+            await this.serialized(() => db.batch([this.gitStateStatement()]));
+        }
+    }
+
+    private gitStateStatement(): SqlStatement {
+        const value = JSON.stringify({
+            head: this.gitState!.head,
+            settings: this.gitState!.settings,
+            touched: Array.from(this.gitState!.touched)
+        });
+        return { sql: 'INSERT OR REPLACE INTO meta (key, value) VALUES (?, ?)', params: ['git_state', value] };
+    }
+
+    private async loadGitState(): Promise<void> {
         try {
-            const relativePath = this.toRelativePath(fileUri.fsPath);
-            
-            // Get file ID first
-            const getFileStmt = this.db.prepare('SELECT id FROM files WHERE path = ?');
-            const fileRecord = getFileStmt.get(relativePath) as { id: number } | undefined;
+            const row = await this.db?.get<{ value: string }>('SELECT value FROM meta WHERE key = ?', 'git_state');
+            if (row) {
+                const stored = JSON.parse(row.value) as { head: string; settings: string; touched: string[] };
+                this.gitState = { head: stored.head, settings: stored.settings, touched: new Set(stored.touched) };
+            }
+        } catch (error) {
+            console.warn('MacroLens: Failed to load indexed git state:', error);
+        }
+    }
+
+    /**
+     * Record files written by the current transaction in the git state (part of that transaction).
+     * Files updated outside a full scan must be re-checked on the next reconciliation,
+     * since git may no longer report them (e.g. a stash restoring the committed content)
+     */
+    private async markTouched(files: string[]): Promise<void> {
+        if (!this.gitState || !this.db) {
+            return;
+        }
+        const count = this.gitState.touched.size;
+        for (const file of files) {
+            this.gitState.touched.add(file);
+        }
+        if (this.gitState.touched.size !== count) {
+            this.db.write([this.gitStateStatement()]);
+        }
+    }
+
+    /**
+     * Settings deciding which files are indexed and how; an index built with others needs a full scan
+     */
+    private getScanSettingsKey(): string {
+        return JSON.stringify([this.includeGlob, this.excludeGlobs, this.useGitignore, this.maxFileSize, this.streamingThreshold]);
+    }
+
+    /**
+     * Stream the indexed files of the workspace with their size and mtime
+     */
+    private walkWorkspace(root: string): ScanSource {
+        const walk = FileWalker.walk(root, {
+            include: this.includeMatcher,
+            exclude: this.excludeMatcher,
+            useGitignore: this.useGitignore
+        });
+        return { batches: MacroDatabase.toScanEntries(walk), found: () => walk.found };
+    }
+
+    private static async *toScanEntries(walk: FileWalk): AsyncGenerator<ScanEntry[]> {
+        for await (const batch of walk) {
+            yield batch.map(file => ({ uri: vscode.Uri.file(file.path), size: file.size, mtime: file.mtime }));
+        }
+    }
+
+    /**
+     * Fallback for non-file workspaces: findFiles, then stat each file
+     */
+    private findWorkspaceFiles(): ScanSource {
+        let found = 0;
+        return { batches: this.statWorkspaceFiles(count => found = count), found: () => found };
+    }
+
+    private async *statWorkspaceFiles(listed: (count: number) => void): AsyncGenerator<ScanEntry[]> {
+        const files = await vscode.workspace.findFiles(this.includeGlob, GlobMatcher.join(this.excludeGlobs));
+        listed(files.length);
+        for (const uri of files) {
+            try {
+                const stat = await vscode.workspace.fs.stat(uri);
+                yield [{ uri, size: stat.size, mtime: stat.mtime }];
+            } catch (error) {
+                console.warn(`Failed to stat file ${uri.fsPath}:`, error);
+            }
+        }
+    }
+
+    /**
+     * @param loaded The stored definitions are already loaded: publish only the files
+     * this scan changes instead of loading the whole index again
+     */
+    private async scanProjectWithProgress(
+        files: ScanSource,
+        progress: vscode.Progress<{message?: string; increment?: number}>,
+        loaded: boolean = false
+    ): Promise<void> {
+        const updates = new Map<string, FileDefinitions | null>();
+        await this.transaction(async () => {
+            // Incremental update: only files whose mtime changed are re-parsed
+            const ids = await this.getIds();
+            const storedMtimes = new Map<string, number>();
+            for (const row of await this.db!.all<{ path: string; mtime: number }>('SELECT path, mtime FROM files')) {
+                storedMtimes.set(row.path, row.mtime);
+            }
             
-            if (fileRecord) {
-                // Delete macros first (if no cascade)
-                const deleteMacrosStmt = this.db.prepare('DELETE FROM macros WHERE file_id = ?');
-                deleteMacrosStmt.run(fileRecord.id);
+            const processedFiles = new Set<string>();
+            // Share of the files done so far; the total grows while the walk runs, and the
+            // files already indexed bound it from below
+            let reported = 0;
+
+            // Files arrive in batches while the walk is still running
+            for await (const batch of files.batches) {
+                for (const entry of batch) {
+                    const file = entry.uri;
+                    const fileName = file.fsPath.split(/[/\\]/).pop() || file.fsPath;
+                    const relativePath = this.toRelativePath(file.fsPath);
+                    processedFiles.add(relativePath);
+
+                    const total = Math.max(files.found(), storedMtimes.size, processedFiles.size);
+                    const percent = processedFiles.size / total * 100;
+                    progress.report({ message: ` ${fileName} (${processedFiles.size}/${total})`, increment: Math.max(0, percent - reported) });
+                    reported = Math.max(reported, percent);
                 
-                // Delete file record
-                const deleteFileStmt = this.db.prepare('DELETE FROM files WHERE id = ?');
-                deleteFileStmt.run(fileRecord.id);
+                    try {
+                        if (storedMtimes.get(relativePath) === entry.mtime) {
+                            // File unchanged, skip parsing
+                            continue;
+                        }
+
+                        // New or changed file: the writes are sent without waiting, so parsing goes on
+                        const parsed = await this.parseFile(file, entry.size);
+                        this.db!.write(this.fileWriteStatements(ids, relativePath, entry.mtime, parsed));
+                        if (loaded) {
+                            updates.set(file.fsPath, MacroDatabase.toFileDefinitions(file.fsPath, parsed));
+                        }
+                    } catch (error) {
+                        console.warn(`Failed to parse file ${file.fsPath}:`, error);
+                    }
+                }
+            }
+
+            // Cleanup: Remove files from DB that are no longer in the workspace
+            // (files deleted outside of VS Code); their rows are deleted with them
+            for (const relativePath of storedMtimes.keys()) {
+                if (!processedFiles.has(relativePath)) {
+                    this.db!.write(this.fileDeleteStatements(ids, relativePath));
+                    updates.set(this.toAbsolutePath(relativePath), null);
+                }
             }
             
-            // Remove from in-memory cache
-            this.removeFromCache(relativePath);
-            
-            // Notify listeners
+            progress.report({ message: 'Finalizing...', increment: 100 - reported });
+        });
+        if (loaded) {
+            this.publish(updates);
+        } else {
+            await this.loadDefinitions();
+        }
+        
+        // Notify listeners that a full scan completed with one event for the workspace root
+        // rather than one per file
+        if (this.workspaceRoot) {
+            this._onDidChange.fire(vscode.Uri.file(this.workspaceRoot));
+        }
+    }
+
+    /**
+     * Run a write transaction
+     * The connection is shared, so transactions are serialized instead of failing to nest.
+     * Writes queued with DatabaseClient.write() are checked before committing.
+     */
+    private transaction<T>(body: () => Promise<T>): Promise<T> {
+        return this.serialized(async () => {
+            const db = this.db!;
+            await db.exec('BEGIN TRANSACTION');
+            try {
+                const result = await body();
+                await db.sync();
+                await db.exec('COMMIT');
+                return result;
+            } catch (error) {
+                // The id mirrors may hold rows that are rolled back
+                this.ids = null;
+                await db.sync().catch(() => undefined);
+                await db.exec('ROLLBACK');
+                throw error;
+            }
+        });
+    }
+
+    /**
+     * Run work that needs the connection to itself (a transaction, VACUUM) after the work
+     * queued before it
+     */
+    private serialized<T>(work: () => Promise<T>): Promise<T> {
+        const result = this.transactionQueue.then(work, work);
+        this.transactionQueue = result.then(() => undefined, () => undefined);
+        return result;
+    }
+
+    /**
+     * Mirrors of the files table and the interned strings, loaded once per connection
+     */
+    private getIds(): Promise<IndexIds> {
+        this.ids ??= Promise.all([
+            this.db!.all<{ id: number; path: string }>('SELECT id, path FROM files'),
+            this.db!.all<{ id: number; name: string }>('SELECT id, name FROM names'),
+            this.db!.all<{ id: number; params: string }>('SELECT id, params FROM param_lists'),
+            this.db!.all<{ id: number; digest: string }>('SELECT id, digest FROM bodies')
+        ]).then(([files, names, params, bodies]) => ({
+            files: new InternTable(files.map(row => ({ id: row.id, key: row.path }))),
+            names: new InternTable(names.map(row => ({ id: row.id, key: row.name }))),
+            params: new InternTable(params.map(row => ({ id: row.id, key: row.params }))),
+            bodies: new InternTable(bodies.map(row => ({ id: row.id, key: row.digest })))
+        }));
+        return this.ids;
+    }
+
+    /**
+     * Delete interned strings no row uses any more (left over from deleted or re-parsed files)
+     * The mirrors are reloaded afterwards, so the ids of deleted strings are not handed out again
+     */
+    private async pruneStrings(): Promise<void> {
+        const db = this.db!;
+        await this.transaction(async () => {
+            await db.exec('DELETE FROM names WHERE id NOT IN (SELECT name_id FROM macros UNION ALL SELECT name_id FROM undefs UNION ALL SELECT name_id FROM macro_refs)');
+            await db.exec('DELETE FROM param_lists WHERE id NOT IN (SELECT params_id FROM macros WHERE params_id IS NOT NULL)');
+            await db.exec('DELETE FROM bodies WHERE id NOT IN (SELECT body_id FROM macros)');
+            this.ids = null;
+        });
+    }
+
+    /**
+     * Scan and update only specific files (incremental update)
+     */
+    async scanFiles(fileUris: vscode.Uri[]): Promise<void> {
+        if (!this.db || !this.initialized) {
+            throw new Error('Database not initialized. Call initialize() first.');
+        }
+        await this.updateFiles(fileUris, []);
+    }
+
+    /**
+     * Re-parse changed files and drop removed ones in one transaction
+     * Readers keep seeing the previous generation until the whole batch is published
+     */
+    private async updateFiles(changed: vscode.Uri[], removed: vscode.Uri[]): Promise<void> {
+        if (changed.length === 0 && removed.length === 0) {
+            return;
+        }
+
+        const updates = new Map<string, FileDefinitions | null>();
+        await this.transaction(async () => {
+            const ids = await this.getIds();
+
+            for (const fileUri of changed) {
+                try {
+                    const stat = await vscode.workspace.fs.stat(fileUri);
+                    const parsed = await this.parseFile(fileUri, stat.size);
+                    this.db!.write(this.fileWriteStatements(ids, this.toRelativePath(fileUri.fsPath), stat.mtime, parsed));
+                    updates.set(fileUri.fsPath, MacroDatabase.toFileDefinitions(fileUri.fsPath, parsed));
+                } catch (error) {
+                    console.warn(`Failed to parse file ${fileUri.fsPath}:`, error);
+                }
+            }
+            for (const fileUri of removed) {
+                this.db!.write(this.fileDeleteStatements(ids, this.toRelativePath(fileUri.fsPath)));
+                updates.set(fileUri.fsPath, null);
+            }
+            await this.markTouched([...changed, ...removed].map(fileUri => fileUri.fsPath));
+        });
+
+        this.publish(updates);
+        for (const fileUri of [...changed, ...removed]) {
             this._onDidChange.fire(fileUri);
+        }
+    }
+
+    /**
+     * Parse a file according to its size: files above the streaming threshold are read
+     * in chunks keeping only directives, files above the size limit are not indexed
+     */
+    private async parseFile(fileUri: vscode.Uri, size: number): Promise<ParsedSource> {
+        if (this.maxFileSize > 0 && size > this.maxFileSize) {
+            console.log(`MacroLens: Skipping ${fileUri.fsPath} (${size} bytes exceeds macrolens.maxFileSize)`);
+            return { defs: [], undefs: [], includes: [], directives: [], guardLine: -1 };
+        }
+        if (this.streamingThreshold > 0 && size > this.streamingThreshold && fileUri.scheme === 'file') {
+            const stream = fs.createReadStream(fileUri.fsPath, { highWaterMark: DATABASE_CONSTANTS.STREAM_CHUNK_SIZE });
+            return StreamingParser.parse(stream, fileUri.fsPath);
+        }
+        const content = await vscode.workspace.fs.readFile(fileUri);
+        return MacroParser.parseBuffer(content, fileUri.fsPath);
+    }
+
+    /**
+     * Check whether a file matches macrolens.includeGlob and none of macrolens.excludeGlobs
+     */
+    isIndexed(fileUri: vscode.Uri): boolean {
+        const relativePath = this.toRelativePath(fileUri.fsPath);
+        return this.includeMatcher.matches(relativePath) && !this.excludeMatcher.matches(relativePath);
+    }
+
+    /**
+     * Full-width sha256 of a body, the key bodies are stored and looked up by
+     */
+    private static bodyDigest(body: string): string {
+        return crypto.createHash('sha256').update(body).digest('base64');
+    }
+
+    /**
+     * Statements replacing the stored rows of one file, allocating ids for a new file
+     * and for strings not stored yet
+     */
+    private fileWriteStatements(
+        ids: IndexIds,
+        relativePath: string,
+        mtime: number,
+        parsed: Pick<ParsedSource, 'defs' | 'undefs' | 'includes' | 'references'>
+    ): SqlStatement[] {
+        const statements: SqlStatement[] = [];
+        let added = false;
+        const fileId = ids.files.intern(relativePath, id => {
+            added = true;
+            statements.push({ sql: FILE_SQL.insertFile, params: [id, relativePath, mtime] });
+        });
+        if (!added) {
+            statements.push({ sql: FILE_SQL.updateFileMtime, params: [mtime, fileId] });
+            for (const sql of [FILE_SQL.deleteMacros, FILE_SQL.deleteUndefs, FILE_SQL.deleteIncludes, FILE_SQL.deleteReferences]) {
+                statements.push({ sql, params: [fileId] });
+            }
+        }
+
+        const nameId = (name: string) => ids.names.intern(name, id => {
+            statements.push({ sql: FILE_SQL.insertName, params: [id, name] });
+        });
+        for (const def of parsed.defs) {
+            const params = def.params?.join(',');
+            const paramsId = params === undefined ? null : ids.params.intern(params, id => {
+                statements.push({ sql: FILE_SQL.insertParams, params: [id, params] });
+            });
+            // The mirror holds only digests, never the body text; equal bodies share one row
+            const digest = MacroDatabase.bodyDigest(def.body);
+            const bodyId = ids.bodies.intern(digest, id => {
+                statements.push({ sql: FILE_SQL.insertBody, params: [id, digest, def.body] });
+            });
+            statements.push({
+                sql: FILE_SQL.insertMacro,
+                params: [
+                    nameId(def.name),
+                    paramsId,
+                    bodyId,
+                    fileId,
+                    def.line,
+                    def.isDefine !== undefined ? (def.isDefine ? 1 : 0) : null,
+                    def.condition ?? null,
+                    def.endLine ?? null
+                ]
+            });
+        }
+        for (const undef of parsed.undefs) {
+            statements.push({ sql: FILE_SQL.insertUndef, params: [nameId(undef.name), fileId, undef.line, undef.condition ?? null] });
+        }
+        for (const include of parsed.includes) {
+            statements.push({ sql: FILE_SQL.insertInclude, params: [fileId, include.target, include.system ? 1 : 0, include.line] });
+        }
+        for (const name of parsed.references ?? []) {
+            statements.push({ sql: FILE_SQL.insertReference, params: [nameId(name), fileId] });
+        }
+        return statements;
+    }
+
+    /**
+     * Statements deleting the stored rows of a file (no cascade in the in-memory fallback)
+     * Interned strings stay, as other files may still use them; pruneStrings deletes unused ones
+     */
+    private fileDeleteStatements(ids: IndexIds, relativePath: string): SqlStatement[] {
+        const fileId = ids.files.delete(relativePath);
+        if (fileId === undefined) {
+            return [];
+        }
+        return [FILE_SQL.deleteMacros, FILE_SQL.deleteUndefs, FILE_SQL.deleteIncludes, FILE_SQL.deleteReferences, FILE_SQL.deleteFile]
+            .map(sql => ({ sql, params: [fileId] }));
+    }
+
+    /**
+     * In-memory contents of a parsed file for publish(), with absolute paths
+     */
+    private static toFileDefinitions(absolutePath: string, parsed: Pick<ParsedSource, 'defs' | 'undefs' | 'includes'>): FileDefinitions {
+        return {
+            defs: parsed.defs.map(def => ({ ...def, file: absolutePath })),
+            undefs: parsed.undefs.map(undef => ({ ...undef, file: absolutePath })),
+            includes: parsed.includes
+        };
+    }
+
+    /**
+     * Update the unsaved-buffer overlay of a C/C++ document from a change event
+     * Only the edited lines are re-parsed when possible
+     */
+    updateOverlay(event: vscode.TextDocumentChangeEvent): void {
+        const document = event.document;
+        if (document.uri.scheme !== 'file' || !this.isCppFile(document.uri) || event.contentChanges.length === 0) {
+            return;
+        }
+
+        const filePath = document.uri.fsPath;
+        if (!document.isDirty) {
+            // Buffer is back to the saved state - the persisted definitions are current
+            this.discardOverlay(document.uri);
+            return;
+        }
+
+        // Lookups only change when the edit changed definitions; typing in ordinary
+        // code keeps the generation and the caches keyed on it
+        const overlay = this.overlays.get(filePath);
+        if (overlay && overlay.applyChanges(document, event.contentChanges)) {
+            if (!overlay.hasChangedDefinitions()) {
+                return;
+            }
+        } else {
+            const rebuilt = DocumentOverlay.fromDocument(document);
+            this.overlays.set(filePath, rebuilt);
+            if (overlay && rebuilt.hasSameDefinitions(overlay)) {
+                return;
+            }
+        }
+        this.invalidateViews();
+    }
+
+    /**
+     * Drop the overlay of a document whose unsaved edits were abandoned
+     */
+    discardOverlay(fileUri: vscode.Uri): void {
+        if (this.overlays.delete(fileUri.fsPath)) {
+            this.invalidateViews();
+        }
+    }
+
+    /**
+     * Persist the overlay of a saved document without re-parsing the file
+     * Falls back to a queued scan when the overlay does not match the saved buffer
+     */
+    async commitOverlay(document: vscode.TextDocument): Promise<void> {
+        const filePath = document.uri.fsPath;
+        const overlay = this.overlays.get(filePath);
+        if (!overlay || !this.db || !this.initialized) {
+            return;
+        }
+
+        if (overlay.version !== document.version) {
+            this.discardOverlay(document.uri);
+            this.queueFileForScan(document.uri);
+            return;
+        }
+
+        try {
+            const stat = await vscode.workspace.fs.stat(document.uri);
+
+            // The buffer may have changed again while we were waiting for the stat
+            if (this.overlays.get(filePath) !== overlay || overlay.version !== document.version) {
+                return;
+            }
+
+            const parsed = {
+                defs: overlay.getAllDefinitions(),
+                undefs: overlay.getUndefs(),
+                includes: overlay.getIncludes(),
+                references: MacroParser.findReferences(Buffer.from(document.getText()))
+            };
+            await this.transaction(async () => {
+                this.db!.write(this.fileWriteStatements(await this.getIds(), this.toRelativePath(filePath), stat.mtime, parsed));
+                await this.markTouched([filePath]);
+            });
+
+            // The overlay and the definitions it becomes are swapped in one generation
+            // (unless the buffer was edited again during the commit)
+            if (this.overlays.get(filePath) === overlay) {
+                this.overlays.delete(filePath);
+            }
+            this.publish(new Map([[filePath, MacroDatabase.toFileDefinitions(filePath, parsed)]]));
+            this.committedMtimes.set(filePath, stat.mtime);
+            this._onDidChange.fire(document.uri);
+        } catch (error) {
+            console.warn(`MacroLens: Failed to commit unsaved definitions for ${filePath}:`, error);
+            this.discardOverlay(document.uri);
+            this.queueFileForScan(document.uri);
+        }
+    }
+
+    /**
+     * Remove macros from deleted files
+     */
+    async removeFile(fileUri: vscode.Uri): Promise<void> {
+        if (!this.db || !this.initialized) {
+            return;
+        }
+
+        try {
+            await this.updateFiles([], [fileUri]);
         } catch (error) {
             console.warn(`Failed to remove file ${fileUri.fsPath}:`, error);
         }
     }
 
     /**
-     * Remove macros from a specific file from the in-memory cache
+     * Swap in the next generation of definitions with the given files replaced (null = removed)
+     * Runs synchronously against the current generation, so concurrent writers cannot lose updates
      */
-    private removeFromCache(relativePath: string): void {
-        const absolutePath = this.toAbsolutePath(relativePath);
-        
-        // Iterate through all macro definitions and remove those from this file
-        for (const [name, defs] of this.definitions.entries()) {
-            const filtered = defs.filter(def => def.file !== absolutePath);
-            
-            if (filtered.length === 0) {
-                // No definitions left, remove the entry
-                this.definitions.delete(name);
-            } else if (filtered.length !== defs.length) {
-                // Some definitions removed, update the entry
-                this.definitions.set(name, filtered);
+    private publish(updates: Map<string, FileDefinitions | null>): void {
+        if (updates.size === 0) {
+            return;
+        }
+
+        const builder = new SnapshotBuilder(this.definitions, this.undefs);
+        for (const [file, contents] of updates) {
+            const previous = builder.replaceFile(file, contents);
+            this.recordChangedNames(file, previous, contents?.defs ?? []);
+            if (contents) {
+                this.includeGraph.setIncludes(file, contents.includes);
+            } else {
+                this.includeGraph.removeFile(file);
+            }
+        }
+
+        const next = builder.build();
+        this.definitions = next.definitions;
+        this.undefs = next.undefs;
+        this.invalidateViews();
+    }
+
+    /**
+     * Remember which names changed meaning in a file (added, removed or different definitions),
+     * until the listeners of onDidChange ask for the affected files
+     */
+    private recordChangedNames(absolutePath: string, previous: MacroDef[], current: MacroDef[]): void {
+        const signatures = (defs: MacroDef[]) => {
+            const byName = new Map<string, string[]>();
+            for (const def of defs) {
+                const signature = [def.params?.join(',') ?? '', def.body, def.condition ?? '', def.isDefine ? 1 : 0].join('\0');
+                byName.set(def.name, (byName.get(def.name) ?? []).concat(signature));
+            }
+            return byName;
+        };
+        const before = signatures(previous);
+        const after = signatures(current);
+
+        let changed = this.changedNames.get(absolutePath);
+        for (const name of new Set([...before.keys(), ...after.keys()])) {
+            const a = before.get(name)?.sort().join('\n');
+            const b = after.get(name)?.sort().join('\n');
+            if (a !== b) {
+                if (!changed) {
+                    changed = new Set();
+                    this.changedNames.set(absolutePath, changed);
+                }
+                changed.add(name);
+            }
+        }
+        if (changed && changed.size > 0) {
+            this.dependents = null;
+        }
+    }
+
+    /**
+     * Files using a macro name according to the reference index (absolute paths)
+     * Names the index does not record (see MacroParser.isReferenceIndexed) may be used by
+     * any file, so every indexed file is returned for the caller to search; so are files
+     * whose uses were not recorded (MacroParser.ANY_REFERENCE)
+     */
+    async getReferencingFiles(name: string): Promise<string[]> {
+        if (!this.db || !this.initialized) {
+            return [];
+        }
+        if (!MacroParser.isReferenceIndexed(name)) {
+            const files = await this.db.all<{ path: string }>('SELECT path FROM files');
+            return files.map(row => this.toAbsolutePath(row.path));
+        }
+        const rows = await this.db.all<{ path: string }>(
+            'SELECT DISTINCT f.path FROM macro_refs r JOIN names n ON n.id = r.name_id JOIN files f ON f.id = r.file_id WHERE n.name IN (?, ?)',
+            name, MacroParser.ANY_REFERENCE
+        );
+        return rows.map(row => this.toAbsolutePath(row.path));
+    }
+
+    /**
+     * Files whose macro usage is affected by the last update of a file: the file itself,
+     * the files including it (transitively) and every file referencing a name whose
+     * definition changed there, directly or through macros expanding to it. Returns
+     * undefined when every file may be affected, as when a changed macro has a name the
+     * reference index does not record. The changes of the file are consumed.
+     */
+    async getAffectedFiles(fileUri: vscode.Uri): Promise<Set<string> | undefined> {
+        const changed = this.changedNames.get(fileUri.fsPath);
+        this.changedNames.delete(fileUri.fsPath);
+        if (this.scopeToIncludes || fileUri.fsPath === this.workspaceRoot) {
+            return undefined;
+        }
+
+        const affected = new Set<string>([fileUri.fsPath]);
+        if (!changed) {
+            return affected;
+        }
+
+        // Names whose expansion can reach a changed name
+        const dependents = this.getDependents();
+        const names = new Set(changed);
+        const pending = Array.from(changed);
+        while (pending.length > 0) {
+            for (const dependent of dependents.get(pending.pop()!) ?? []) {
+                if (!names.has(dependent)) {
+                    names.add(dependent);
+                    pending.push(dependent);
+                }
+            }
+        }
+
+        // Uses of other names are not indexed; type names are not looked up as macros
+        const unindexed = (name: string) => !MacroParser.isReferenceIndexed(name) &&
+            !(this.definitions.get(name)?.every(def => def.isDefine === false) ?? false);
+        if (Array.from(names).some(unindexed)) {
+            return undefined;
+        }
+
+        for (const includer of this.includeGraph.getIncluders(fileUri.fsPath)) {
+            affected.add(includer);
+        }
+
+        // The queries are issued together and answered in one round trip
+        for (const files of await Promise.all(Array.from(names, name => this.getReferencingFiles(name)))) {
+            for (const file of files) {
+                affected.add(file);
             }
         }
+        return affected;
     }
 
     /**
-     * Add a macro definition to the in-memory cache
+     * Reverse macro dependencies: name -> names of macros whose body uses it (any
+     * identifier, so lowercase macros are followed too)
+     * Built on first use after the definitions change
      */
-    private addToCache(def: MacroDef): void {
-        const defs = this.definitions.get(def.name) || [];
-        defs.push(def);
-        this.definitions.set(def.name, defs);
+    private getDependents(): Map<string, Set<string>> {
+        if (this.dependents) {
+            return this.dependents;
+        }
+        const dependents = new Map<string, Set<string>>();
+        for (const [name, defs] of this.definitions) {
+            for (const def of defs) {
+                if (def.isDefine === false) {
+                    continue;
+                }
+                for (const used of def.body.match(REGEX_PATTERNS.IDENTIFIER) ?? []) {
+                    let users = dependents.get(used);
+                    if (!users) {
+                        users = new Set();
+                        dependents.set(used, users);
+                    }
+                    users.add(name);
+                }
+            }
+        }
+        this.dependents = dependents;
+        return dependents;
+    }
+
+    /**
+     * Drop derived per-name views after the persisted definitions or overlays change
+     */
+    private invalidateViews(): void {
+        this.generation++;
+        this.viewSource = this.definitions;
+        this.viewCache.clear();
+        this.timelineCache.clear();
+        this.scopedCache.clear();
+        this.conditionEvaluator?.reset();
     }
 
     /**
      * Queue files for incremental scanning with intelligent debounce
      */
     queueFileForScan(fileUri: vscode.Uri): void {
+        if (!this.isIndexed(fileUri)) {
+            return;
+        }
         this.pendingFiles.add(fileUri.fsPath);
         const now = Date.now();
         
@@ -989,11 +1839,19 @@ export class MacroDatabase {
             this.forceUpdateTimer = null;
         }
 
-        const filesToScan = Array.from(this.pendingFiles)
+        const candidates = Array.from(this.pendingFiles)
             .map(path => vscode.Uri.file(path))
             .filter(uri => uri.fsPath.match(/\.(c|cpp|cc|h|hpp|hh)$/i));
         
         this.pendingFiles.clear();
+
+        // A storm of events (pull, branch switch): git knows exactly which files changed
+        if (candidates.length >= DATABASE_CONSTANTS.GIT_STORM_THRESHOLD && await this.reconcileWithGit(false)) {
+            this.updateScanStatistics(candidates.length, Date.now() - startTime, true);
+            this.lastScanTime = Date.now();
+            return;
+        }
+        const filesToScan = await this.skipCommittedFiles(candidates);
         
         if (filesToScan.length > 0) {
             try {
@@ -1011,6 +1869,35 @@ export class MacroDatabase {
         }
     }
 
+    /**
+     * Skip watcher events caused by our own overlay commits (file saved with the mtime we stored)
+     */
+    private async skipCommittedFiles(fileUris: vscode.Uri[]): Promise<vscode.Uri[]> {
+        if (this.committedMtimes.size === 0) {
+            return fileUris;
+        }
+
+        const result: vscode.Uri[] = [];
+        for (const uri of fileUris) {
+            const committedMtime = this.committedMtimes.get(uri.fsPath);
+            if (committedMtime === undefined) {
+                result.push(uri);
+                continue;
+            }
+            this.committedMtimes.delete(uri.fsPath);
+            try {
+                const stat = await vscode.workspace.fs.stat(uri);
+                if (stat.mtime === committedMtime) {
+                    continue;
+                }
+            } catch {
+                // Let the scan report the error
+            }
+            result.push(uri);
+        }
+        return result;
+    }
+
     /**
      * Update scan statistics
      */
@@ -1061,6 +1948,12 @@ export class MacroDatabase {
             definitionsMapBytes: number;
             totalDefinitions: number;
         };
+        index: {
+            sizeBytes: number;
+            freeBytes: number;
+            lastMaintenance: number | null;
+            integrity: string | null;
+        } | null;
     } {
         // Calculate memory usage for definitions Map
         let totalDefinitions = 0;
@@ -1087,7 +1980,7 @@ export class MacroDatabase {
         
         return {
             ...this.scanStats,
-            databaseType: this.useInMemory ? 'In-Memory' : 'SQLite',
+            databaseType: this.useInMemory ? 'In-Memory' : this.db?.isWorker ? 'SQLite (worker thread)' : 'SQLite',
             debounceSettings: {
                 delay: this.debounceDelay,
                 maxDelay: this.maxDelay
@@ -1096,10 +1989,129 @@ export class MacroDatabase {
                 definitionsMapSize: this.definitions.size,
                 definitionsMapBytes: estimatedBytes,
                 totalDefinitions
+            },
+            // Index file size as of the last measureIndex() (null for the in-memory fallback)
+            index: this.indexSize && {
+                ...this.indexSize,
+                lastMaintenance: this.lastMaintenance,
+                integrity: this.lastIntegrityCheck?.result ?? null
             }
         };
     }
 
+    /**
+     * Measure the index file: its size and the free pages inside it
+     */
+    async measureIndex(): Promise<void> {
+        if (!this.db || this.useInMemory) {
+            return;
+        }
+        const pragma = async (name: string) => (await this.db!.get<Record<string, number>>(`PRAGMA ${name}`))?.[name] ?? 0;
+        const [pageCount, pageSize, freePages] = await Promise.all([pragma('page_count'), pragma('page_size'), pragma('freelist_count')]);
+        this.indexSize = { sizeBytes: pageCount * pageSize, freeBytes: freePages * pageSize };
+    }
+
+    /**
+     * Run the next step of index maintenance; returns whether the pass has steps left
+     *
+     * A pass deletes interned strings no row uses any more, returns free pages to the file
+     * system VACUUM_PAGES_PER_STEP at a time, refreshes the query planner statistics with a
+     * bounded ANALYZE and, at most once per INTEGRITY_CHECK_INTERVAL, checks one table per
+     * step. A failed check rebuilds the index. An index created without incremental vacuum
+     * is rewritten only once VACUUM_CONVERSION_FREE_RATIO of it is free, and never while a
+     * project scan runs or waits. Steps run on the database connection, so the caller can
+     * stop between any two of them. All but two are short: a check step reads its whole
+     * table and that table's indexes, so it takes time in proportion to the table (the
+     * macros table is most of the index file), and the one-time conversion rewrites the file.
+     */
+    async runMaintenanceStep(): Promise<boolean> {
+        if (!this.db || this.useInMemory || !this.initialized) {
+            return false;
+        }
+        if (this.maintenanceSteps.length === 0) {
+            this.maintenanceSteps = ['prune', 'vacuum', 'analyze'];
+            if (!this.lastIntegrityCheck || Date.now() - this.lastIntegrityCheck.time >= DATABASE_CONSTANTS.INTEGRITY_CHECK_INTERVAL) {
+                this.maintenanceSteps.push(...INDEX_TABLES.map(table => `check:${table}`));
+            }
+        }
+
+        const step = this.maintenanceSteps.shift()!;
+        try {
+            await this.runMaintenance(step);
+        } catch (error) {
+            console.warn(`MacroLens: Index maintenance step ${step} failed:`, error);
+            this.maintenanceSteps = [];
+        }
+        await this.measureIndex();
+        if (this.maintenanceSteps.length === 0) {
+            this.lastMaintenance = Date.now();
+        }
+        return this.maintenanceSteps.length > 0;
+    }
+
+    private async runMaintenance(step: string): Promise<void> {
+        const db = this.db!;
+        if (step === 'prune') {
+            await this.pruneStrings();
+        } else if (step === 'vacuum') {
+            const mode = await db.get<{ auto_vacuum: number }>('PRAGMA auto_vacuum');
+            if (mode?.auto_vacuum !== 2) {
+                // Index created before incremental vacuum: switching needs a full VACUUM that
+                // rewrites the whole file in one step, only worth it once much of it is free
+                const pragma = async (name: string) => (await db.get<Record<string, number>>(`PRAGMA ${name}`))?.[name] ?? 0;
+                const [pageCount, freePages] = await Promise.all([pragma('page_count'), pragma('freelist_count')]);
+                if (freePages > pageCount * DATABASE_CONSTANTS.VACUUM_CONVERSION_FREE_RATIO) {
+                    // Checked once earlier writes drained; a scan is left to finish and the
+                    // conversion waits for a later pass
+                    await this.serialized(async () => {
+                        if (!this.scanning && !this.queuedScan) {
+                            await db.exec('PRAGMA auto_vacuum = INCREMENTAL; VACUUM');
+                        }
+                    });
+                }
+                return;
+            }
+            await this.serialized(() => db.exec(`PRAGMA incremental_vacuum(${DATABASE_CONSTANTS.VACUUM_PAGES_PER_STEP})`));
+            const free = await db.get<{ freelist_count: number }>('PRAGMA freelist_count');
+            if ((free?.freelist_count ?? 0) > 0) {
+                this.maintenanceSteps.unshift('vacuum');
+            }
+        } else if (step === 'analyze') {
+            await this.serialized(() => db.exec(`PRAGMA analysis_limit = ${DATABASE_CONSTANTS.ANALYSIS_LIMIT}; ANALYZE`));
+        } else if (step.startsWith('check:')) {
+            const table = step.substring('check:'.length);
+            const rows = await this.serialized(() => db.all<Record<string, string>>(`PRAGMA quick_check(${table})`));
+            const result = rows.map(row => Object.values(row)[0]).join('; ');
+            if (result !== 'ok') {
+                console.error(`MacroLens: Integrity check of ${table} failed (${result}), rebuilding the index`);
+                this.lastIntegrityCheck = { time: Date.now(), result };
+                this.maintenanceSteps = [];
+                this.scanProject(true).catch(error => console.error('MacroLens: Rebuild after failed integrity check failed:', error));
+            } else if (!this.maintenanceSteps.some(next => next.startsWith('check:'))) {
+                await this.saveIntegrityCheck({ time: Date.now(), result });
+            }
+        }
+    }
+
+    /**
+     * Remember when the index last passed its integrity check, across sessions, so a
+     * window reloaded more often than INTEGRITY_CHECK_INTERVAL does not check it again
+     */
+    private async saveIntegrityCheck(check: { time: number; result: string }): Promise<void> {
+        this.lastIntegrityCheck = check;
+        const db = this.db!;
+        await this.serialized(() => db.run('INSERT OR REPLACE INTO meta (key, value) VALUES (?, ?)', 'integrity_check', JSON.stringify(check)));
+    }
+
+    private async loadIntegrityCheck(): Promise<void> {
+        try {
+            const row = await this.db?.get<{ value: string }>('SELECT value FROM meta WHERE key = ?', 'integrity_check');
+            this.lastIntegrityCheck = row ? JSON.parse(row.value) as { time: number; result: string } : null;
+        } catch (error) {
+            console.warn('MacroLens: Failed to load the last integrity check:', error);
+        }
+    }
+
     /**
      * Check if a file is a C/C++ file that we should scan
      */
@@ -1113,45 +2125,346 @@ export class MacroDatabase {
         }
         
         const startTime = Date.now();
+        this.changedNames.clear();
+        this.dependents = null;
         
-        // Join with files table to get the path
-        const rows = this.db.prepare(`
-            SELECT m.name, m.params, m.body, f.path as file, m.line, m.isDefine 
-            FROM macros m
-            JOIN files f ON m.file_id = f.id
-            ORDER BY m.name, f.path, m.line
-        `).all() as Array<{
-            name: string;
-            params: string | null;
-            body: string;
-            file: string;
-            line: number;
-            isDefine: number | null;
-        }>;
-        this.definitions.clear();
+        // Rows carry ids, resolved here from the interned tables: each distinct string
+        // crosses from the database once and is shared by every definition using it
+        const [rows, nameRows, paramRows, bodyRows, fileRows] = await Promise.all([
+            this.db.all<{
+                name_id: number;
+                params_id: number | null;
+                body_id: number;
+                file_id: number;
+                line: number;
+                isDefine: number | null;
+                condition: string | null;
+                endLine: number | null;
+            }>(`
+                SELECT m.name_id, m.params_id, m.body_id, m.file_id, m.line, m.isDefine, m.condition, m.endLine
+                FROM macros m
+                JOIN names n ON n.id = m.name_id
+                JOIN files f ON f.id = m.file_id
+                ORDER BY n.name, f.path, m.line
+            `),
+            this.db.all<{ id: number; name: string }>('SELECT id, name FROM names'),
+            this.db.all<{ id: number; params: string }>('SELECT id, params FROM param_lists'),
+            this.db.all<{ id: number; text: string }>('SELECT id, text FROM bodies'),
+            this.db.all<{ id: number; path: string }>('SELECT id, path FROM files')
+        ]);
+        const names = new Map(nameRows.map(row => [row.id, row.name] as const));
+        const paramLists = new Map(paramRows.map(row => [row.id, row.params.split(',').filter(Boolean)] as const));
+        const bodies = new Map(bodyRows.map(row => [row.id, row.text] as const));
+        const files = new Map(fileRows.map(row => [row.id, this.toAbsolutePath(row.path)] as const));  // Use absolute paths in memory
+
+        // Built aside and published at once, so readers never see a partially loaded index
+        const definitions = new Map<string, MacroDef[]>();
         
         for (const row of rows) {
-            const absolutePath = this.toAbsolutePath(row.file);  // Convert to absolute path
             const def: MacroDef = {
-                name: row.name,
-                params: row.params?.split(',').filter(Boolean),
-                body: row.body,
-                file: absolutePath,  // Use absolute path in memory
+                name: names.get(row.name_id)!,
+                params: row.params_id !== null ? paramLists.get(row.params_id) : undefined,
+                body: bodies.get(row.body_id)!,
+                file: files.get(row.file_id)!,
                 line: row.line,
-                isDefine: row.isDefine !== null ? Boolean(row.isDefine) : undefined
+                isDefine: row.isDefine !== null ? Boolean(row.isDefine) : undefined,
+                condition: row.condition ?? undefined,
+                endLine: row.endLine ?? undefined
             };
             
-            const defs = this.definitions.get(def.name) || [];
+            const defs = definitions.get(def.name) || [];
             defs.push(def);
-            this.definitions.set(def.name, defs);
+            definitions.set(def.name, defs);
+        }
+        
+        const undefRows = await this.db.all<{ name: string; file: string; line: number; condition: string | null }>(`
+            SELECT n.name, f.path as file, u.line, u.condition
+            FROM undefs u
+            JOIN names n ON n.id = u.name_id
+            JOIN files f ON u.file_id = f.id
+            ORDER BY n.name, f.path, u.line
+        `);
+        const undefsByName = new Map<string, MacroUndef[]>();
+
+        for (const row of undefRows) {
+            const undefs = undefsByName.get(row.name) || [];
+            undefs.push({
+                name: row.name,
+                file: this.toAbsolutePath(row.file),
+                line: row.line,
+                condition: row.condition ?? undefined
+            });
+            undefsByName.set(row.name, undefs);
+        }
+
+        // Rebuild the include graph: register every indexed file, then its edges
+        const includesByFile = new Map<string, IncludeDirective[]>();
+        for (const file of files.values()) {
+            includesByFile.set(file, []);
         }
+        const includeRows = await this.db.all<{ file: string; target: string; system: number; line: number }>(`
+            SELECT f.path as file, i.target, i.system, i.line
+            FROM include_edges i
+            JOIN files f ON i.file_id = f.id
+            ORDER BY f.path, i.line
+        `);
+        for (const row of includeRows) {
+            includesByFile.get(this.toAbsolutePath(row.file))?.push({
+                target: row.target,
+                system: Boolean(row.system),
+                line: row.line
+            });
+        }
+        this.includeGraph.clear();
+        for (const [file, includes] of includesByFile) {
+            this.includeGraph.setIncludes(file, includes);
+        }
+
+        this.definitions = definitions;
+        this.undefs = undefsByName;
+        this.invalidateViews();
         
         // Update statistics
         this.scanStats.macrosFound = rows.length;
     }
 
+    /**
+     * Get definitions of a macro, with unsaved editor buffers taking precedence over
+     * the persisted definitions of the same file, and definitions in branches that are
+     * inactive under macrolens.activeConfiguration filtered out
+     */
     getDefinitions(name: string): MacroDef[] {
-        return this.definitions.get(name) || [];
+        return this.withCommandLine(name, undefined, this.getIndexedDefinitions(name));
+    }
+
+    /**
+     * Generation of the definitions visible to lookups
+     *
+     * Scans publish their results as a whole once committed, so a lookup sees either all
+     * or none of a scan. The generation changes with every publish and with anything else
+     * that may change a lookup result (unsaved buffer edits, active configuration,
+     * compile commands); results computed under the same generation are still valid.
+     */
+    getGeneration(): number {
+        return this.generation;
+    }
+
+    private getIndexedDefinitions(name: string): MacroDef[] {
+        const persisted = this.definitions.get(name) || [];
+        if (this.overlays.size === 0 && !this.conditionEvaluator) {
+            return persisted;
+        }
+        return this.getView(name, persisted);
+    }
+
+    /**
+     * Fall back to the -D definition of the file's compile command when no source defines the name
+     * Definitions in sources win, as they come after the command line in every translation unit
+     */
+    private withCommandLine(name: string, file: string | undefined, defs: MacroDef[]): MacroDef[] {
+        if (defs.length > 0 || !this.compileCommands) {
+            return defs;
+        }
+        return this.compileCommands.getDefinitions(file, name) || defs;
+    }
+
+    /**
+     * Get the definitions of a macro that are live at a line (1-based) of a file
+     *
+     * A #define or #undef earlier in the same file decides the result; otherwise the
+     * definitions from other files are returned. When that event sits in a conditional
+     * branch, every definition still possibly live is returned, latest first (see
+     * possiblyLiveDefinitions). Lookups are a binary search over the
+     * per-file timeline of the name. With macrolens.scopeToIncludes, definitions from
+     * other files are limited to the include closure of a source file. Names not defined
+     * in any source resolve to the -D definitions of the file's compile command.
+     */
+    getDefinitionsAt(name: string, file: string, line: number): MacroDef[] {
+        const defs = this.getIndexedDefinitions(name);
+        if (defs.length === 0 && !this.undefs.has(name) && this.overlays.size === 0) {
+            return this.withCommandLine(name, file, defs);
+        }
+
+        const timeline = this.getTimelines(name).get(file);
+        if (!timeline) {
+            return this.withCommandLine(name, file, this.scopeToTranslationUnit(name, file, defs));
+        }
+
+        // Last event at or before the line
+        let low = 0;
+        let high = timeline.lines.length;
+        while (low < high) {
+            const mid = (low + high) >>> 1;
+            if (timeline.lines[mid] <= line) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        if (low > 0) {
+            if (!this.isConditional(timeline.conditions[low - 1])) {
+                const def = timeline.defs[low - 1];
+                return def ? [def] : [];
+            }
+            return this.possiblyLiveDefinitions(name, file, timeline, low, defs);
+        }
+
+        return this.withCommandLine(name, file, this.externalDefinitions(name, file, timeline, defs));
+    }
+
+    /**
+     * Definitions possibly live after the first `count` events of a file's timeline
+     *
+     * Walking back from the last event, an event is hidden by a later one whose condition
+     * holds whenever its own does (the same branch or a branch enclosing it), and an
+     * unconditional event hides everything before it. Definitions from other files stay
+     * possibly live unless such an event, or an #if/#else pair, covers every case.
+     */
+    private possiblyLiveDefinitions(name: string, file: string, timeline: FileTimeline, count: number, defs: MacroDef[]): MacroDef[] {
+        const live: MacroDef[] = [];
+        const later: string[] = [];
+        for (let i = count - 1; i >= 0; i--) {
+            const condition = timeline.conditions[i];
+            if (condition !== undefined && later.some(hiding => condition === hiding || condition.startsWith(`${hiding} && `))) {
+                continue;
+            }
+            const def = timeline.defs[i];
+            if (def) {
+                live.push(def);
+            }
+            if (!this.isConditional(condition)) {
+                return live;
+            }
+            later.push(condition!);
+        }
+
+        // #ifdef X ... #else ... #endif: one of the two branches always applies
+        if (later.some(condition => later.includes(condition.startsWith('!defined(') ? condition.substring(1) : `!${condition}`))) {
+            return live;
+        }
+        const external = this.externalDefinitions(name, file, timeline, defs);
+        return live.length > 0 ? live.concat(external) : this.withCommandLine(name, file, external);
+    }
+
+    /**
+     * Whether an event's condition may not hold (unknown or false under the active configuration)
+     */
+    private isConditional(condition: string | undefined): boolean {
+        return condition !== undefined && !(this.conditionEvaluator?.holds(condition) ?? false);
+    }
+
+    private externalDefinitions(name: string, file: string, timeline: FileTimeline, defs: MacroDef[]): MacroDef[] {
+        if (!timeline.external) {
+            timeline.external = defs.filter(def => def.file !== file);
+        }
+        return this.scopeToTranslationUnit(name, file, timeline.external);
+    }
+
+    /**
+     * Keep the definitions whose file is reachable through the #include closure of a source file
+     * Headers, files missing from the graph and names with no reachable definition stay unfiltered
+     */
+    private scopeToTranslationUnit(name: string, file: string, defs: MacroDef[]): MacroDef[] {
+        if (!this.scopeToIncludes || defs.length <= 1 || !REGEX_PATTERNS.SOURCE_FILE_EXTENSION.test(file)) {
+            return defs;
+        }
+
+        const key = `${file}\0${name}`;
+        let scoped = this.scopedCache.get(key);
+        if (!scoped) {
+            scoped = defs.filter(def => this.includeGraph.isReachable(file, def.file) !== false);
+            if (scoped.length === 0) {
+                scoped = defs;
+            }
+            this.scopedCache.set(key, scoped);
+        }
+        return scoped;
+    }
+
+    private getTimelines(name: string): Map<string, FileTimeline> {
+        this.checkViewSource();
+
+        let timelines = this.timelineCache.get(name);
+        if (timelines) {
+            return timelines;
+        }
+
+        const events: Array<{ file: string; line: number; def: MacroDef | null; condition?: string }> = [];
+        for (const def of this.getIndexedDefinitions(name)) {
+            events.push({ file: def.file, line: def.line, def, condition: def.condition });
+        }
+        for (const undef of this.getUndefs(name)) {
+            events.push({ file: undef.file, line: undef.line, def: null, condition: undef.condition });
+        }
+        events.sort((a, b) => a.line - b.line);
+
+        timelines = new Map();
+        for (const event of events) {
+            let timeline = timelines.get(event.file);
+            if (!timeline) {
+                timeline = { lines: [], defs: [], conditions: [] };
+                timelines.set(event.file, timeline);
+            }
+            timeline.lines.push(event.line);
+            timeline.defs.push(event.def);
+            timeline.conditions.push(event.condition);
+        }
+
+        this.timelineCache.set(name, timelines);
+        return timelines;
+    }
+
+    /**
+     * #undef directives of a macro, layered and filtered like getDefinitions()
+     */
+    private getUndefs(name: string): MacroUndef[] {
+        let undefs = this.undefs.get(name) || [];
+        if (this.overlays.size > 0) {
+            undefs = undefs.filter(undef => !this.overlays.has(undef.file));
+            for (const overlay of this.overlays.values()) {
+                undefs = undefs.concat(overlay.getUndefs().filter(undef => undef.name === name));
+            }
+        }
+        return this.conditionEvaluator ? this.conditionEvaluator.filter(undefs) : undefs;
+    }
+
+    /**
+     * The definitions map may be swapped wholesale (e.g. by tests); never serve stale views
+     */
+    private checkViewSource(): void {
+        if (this.viewSource !== this.definitions) {
+            this.invalidateViews();
+            this.viewSource = this.definitions;
+        }
+    }
+
+    private getView(name: string, persisted: MacroDef[]): MacroDef[] {
+        this.checkViewSource();
+
+        const cached = this.viewCache.get(name);
+        if (cached) {
+            return cached;
+        }
+
+        let view = persisted;
+        if (this.overlays.size > 0) {
+            if (view.some(def => this.overlays.has(def.file))) {
+                view = view.filter(def => !this.overlays.has(def.file));
+            }
+            for (const overlay of this.overlays.values()) {
+                const defs = overlay.getDefinitions(name);
+                if (defs) {
+                    view = view.concat(defs);
+                }
+            }
+        }
+        if (this.conditionEvaluator) {
+            view = this.conditionEvaluator.filter(view);
+        }
+
+        this.viewCache.set(name, view);
+        return view;
     }
 
     getAllDefinitions(): Map<string, MacroDef[]> {
@@ -1171,7 +2484,7 @@ export class MacroDatabase {
         
         // Clean up database
         if (this.db) {
-            this.db.close();
+            this.db.close().catch(error => console.warn('MacroLens: Error closing database:', error));
             this.db = null;
         }
     }
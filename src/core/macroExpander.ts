@@ -1,15 +1,10 @@
 import { Configuration } from '../configuration';
-import { MacroDatabase } from './macroDb';
+import { MacroDatabase, MacroDef } from './macroDb';
 import { MacroUtils, ConcatenationEvent } from '../utils/macroUtils';
 import { BUILTIN_IDENTIFIERS, REGEX_PATTERNS } from '../utils/constants';
-
-export interface ExpansionStep {
-    from: string;
-    to: string;
-    macro: string;
-    note?: string;
-    level: number;
-}
+import { ExpansionStep, ExpansionTrace, TextEdit } from './expansionTrace';
+import { ExpansionChain, ExpansionLink } from './expansionChain';
+import { InternTable } from './internTable';
 
 export interface ExpansionResult {
     steps: ExpansionStep[];
@@ -20,24 +15,123 @@ export interface ExpansionResult {
     errorMessage?: string;
     undefinedMacros?: Set<string>;  // Macros found in final result but not defined
     concatenatedMacros?: string[];  // Macro-like tokens formed via ## during expansion
+    truncated?: ExpansionLimit;     // Limit that cut the expansion short; finalText is the text reached by then
+}
+
+/**
+ * Limits on the work of a single expansion
+ */
+export type ExpansionLimit = 'depth' | 'steps' | 'length' | 'time';
+
+interface ExpansionBudget {
+    maxSteps: number;
+    maxLength: number;  // Characters of expanded text
+    deadline: number;   // Date.now() value after which no further step is taken
+    steps: number;
+    exceeded?: ExpansionLimit;
+}
+
+/**
+ * Where an expansion happens, so that macros resolve to the definitions live at that point
+ */
+export interface ExpansionOptions {
+    file?: string;
+    line?: number;          // 1-based
+    definition?: MacroDef;  // Definition to use for the expanded macro itself
+    recordSteps?: boolean;  // false when only the final text is needed (default true)
 }
 
 type ConcatenatedMacroTracker = Map<string, number>;
 
 export class MacroExpander {
     private db: MacroDatabase;
+    private options: ExpansionOptions = {};
+    private budget: ExpansionBudget = { maxSteps: Infinity, maxLength: Infinity, deadline: Infinity, steps: 0 };
+    private chain: ExpansionChain;
+    private names = new InternTable();  // Macro names seen in expansions, shared by every chain
     private static readonly MACRO_NAME_REGEX = /^[A-Z_][A-Z0-9_]*$/;
 
     constructor() {
         this.db = MacroDatabase.getInstance();
+        this.chain = new ExpansionChain(this.names);
+    }
+
+    expand(macroName: string, args?: string[], options?: ExpansionOptions): ExpansionResult {
+        const previousOptions = this.options;
+        const previousBudget = this.budget;
+        const previousChain = this.chain;
+        this.options = options || {};
+        try {
+            return this.expandAt(macroName, args);
+        } finally {
+            this.options = previousOptions;
+            this.budget = previousBudget;
+            this.chain = previousChain;
+        }
+    }
+
+    /**
+     * Account for one more substitution producing text of the given length
+     * Returns false once a limit is reached; the first limit reached is kept, and every
+     * later call fails too, so the expansion unwinds with the text it has so far.
+     */
+    private withinBudget(length: number): boolean {
+        const budget = this.budget;
+        if (budget.exceeded) {
+            return false;
+        }
+        if (budget.steps >= budget.maxSteps) {
+            budget.exceeded = 'steps';
+        } else if (length > budget.maxLength) {
+            budget.exceeded = 'length';
+        } else if (Date.now() > budget.deadline) {
+            budget.exceeded = 'time';
+        } else {
+            budget.steps++;
+            return true;
+        }
+        return false;
     }
 
-    expand(macroName: string, args?: string[]): ExpansionResult {
+    /**
+     * Stop at the maximum depth, noting the truncation if the text could expand further
+     */
+    private stopAtDepth(text: string): string {
+        if (!this.budget.exceeded && this.findAllMacros(text).some(macro => this.lookup(macro.name).length > 0)) {
+            this.budget.exceeded = 'depth';
+        }
+        return text;
+    }
+
+    /**
+     * Resolve a macro name using the location of the current expansion, if any
+     */
+    private lookup(name: string): MacroDef[] {
+        const { file, line, definition } = this.options;
+        if (definition && definition.name === name) {
+            return [definition];
+        }
+        if (file !== undefined && line !== undefined) {
+            return this.db.getDefinitionsAt(name, file, line);
+        }
+        return this.db.getDefinitions(name);
+    }
+
+    private expandAt(macroName: string, args?: string[]): ExpansionResult {
         const config = Configuration.getInstance().getConfig();
-        const steps: ExpansionStep[] = [];
+        const trace = this.options.recordSteps === false ? null : new ExpansionTrace(args ? `${macroName}(${args.join(', ')})` : macroName);
+        const steps: ExpansionStep[] = trace ? trace.steps : [];
         const concatenatedMacros: ConcatenatedMacroTracker = new Map();
+        this.budget = {
+            maxSteps: config.maxExpansionSteps,
+            maxLength: config.maxExpansionLength,
+            deadline: Date.now() + config.expansionTimeout,
+            steps: 0
+        };
+        // A fresh chain, so that counts left by an expansion that threw are dropped
+        this.chain = new ExpansionChain(this.names);
         
-        const defs = this.db.getDefinitions(macroName);
+        const defs = this.lookup(macroName);
         
         // Skip if this is not a #define macro (typedef, struct, enum, union, etc.)
         if (defs.length > 0 && defs[0].isDefine === false) {
@@ -50,13 +144,11 @@ export class MacroExpander {
         }
         
         try {
-            // Track expansion chain for circular reference detection
-            const expansionChain = new Set<string>();
             const result = this.expandRecursive(
-                macroName, args, steps, 
+                macroName, args, trace, 
                 0,  // Initial depth level
                 config.maxExpansionDepth, 
-                expansionChain,
+                null,  // Nothing is being expanded yet
                 concatenatedMacros
             );
             
@@ -75,10 +167,11 @@ export class MacroExpander {
             return {
                 steps,
                 finalText,
-                isComplete: steps.length > 0,
+                isComplete: this.budget.steps > 0,
                 hasErrors: false,
                 undefinedMacros: undefinedMacros.size > 0 ? undefinedMacros : undefined,
-                concatenatedMacros: concatenatedList
+                concatenatedMacros: concatenatedList,
+                truncated: this.budget.exceeded
             };
         } catch (error) {
             return {
@@ -100,7 +193,7 @@ export class MacroExpander {
         const undefined = new Set<string>();
         
         // Precompute string literal ranges so we can ignore uppercase tokens inside quotes
-        const stringLiteralRanges = MacroUtils.getStringLiteralRanges(text);
+        const isInsideLiteral = MacroUtils.literalRangeScanner(MacroUtils.getStringLiteralRanges(text));
 
         // Match uppercase identifiers (potential macros)
         // Pattern: word starting with uppercase, containing at least one more uppercase or underscore
@@ -112,7 +205,7 @@ export class MacroExpander {
             const matchIndex = match.index ?? text.indexOf(name);
 
             // Ignore names that occur inside string literals
-            if (MacroUtils.isIndexWithinRanges(matchIndex, stringLiteralRanges)) {
+            if (isInsideLiteral(matchIndex)) {
                 continue;
             }
             
@@ -127,7 +220,7 @@ export class MacroExpander {
             }
             
             // Check if it's defined in database
-            const defs = this.db.getDefinitions(name);
+            const defs = this.lookup(name);
             if (defs.length === 0) {
                 undefined.add(name);
             }
@@ -139,26 +232,23 @@ export class MacroExpander {
     private expandRecursive(
         macroName: string, 
         args: string[] | undefined, 
-        steps: ExpansionStep[], 
+        trace: ExpansionTrace | null, 
         level: number, 
         maxDepth: number,
-        expansionChain: Set<string>,
+        expansionChain: ExpansionLink | null,
         concatenatedMacros: ConcatenatedMacroTracker
     ): string {
         if (level >= maxDepth) {
-            throw new Error('Maximum expansion depth reached - possible infinite recursion');
+            this.budget.exceeded ??= 'depth';
+            return args ? `${macroName}(${args.join(', ')})` : macroName;
         }
 
-        // Create unique identifier for this macro expansion
-        const macroId = args ? `${macroName}(${args.join(',')})` : macroName;
-        
         // Check for circular reference
-        if (expansionChain.has(macroId)) {
-            const chain = Array.from(expansionChain).concat(macroId).join(' → ');
-            throw new Error(`Circular macro reference detected: ${chain}`);
+        if (this.chain.contains(expansionChain, macroName, args)) {
+            throw new Error(`Circular macro reference detected: ${this.chain.describe(expansionChain, macroName, args)}`);
         }
 
-        const defs = this.db.getDefinitions(macroName);
+        const defs = this.lookup(macroName);
         if (defs.length === 0) {
             return macroName;
         }
@@ -178,7 +268,7 @@ export class MacroExpander {
         let expanded = def.body;
 
         // Add current macro to expansion chain
-        expansionChain.add(macroId);
+        const link = this.chain.enter(expansionChain, macroName, args);
 
         // Handle macros with parameters
         if (def.params && def.params.length > 0 && args) {
@@ -188,10 +278,10 @@ export class MacroExpander {
                 // Expand macros in the argument
                 return this.expandMacrosInText(
                     arg,
-                    [],
+                    null,  // Argument pre-expansion is not shown as steps
                     level + 1,
                     maxDepth,
-                    new Set(expansionChain),
+                    link,
                     concatenatedMacros
                 );
             };
@@ -217,41 +307,44 @@ export class MacroExpander {
 
         // Record this expansion step
         const inputText = args ? `${macroName}(${args.join(', ')})` : macroName;
-        steps.push({
-            from: inputText,
-            to: expanded,
-            macro: macroName,
-            note: args ? 'Function-like macro expansion' : 'Object-like macro expansion',
-            level
-        });
+        if (!this.withinBudget(expanded.length)) {
+            this.chain.leave(link);
+            return inputText;
+        }
+        trace?.record(
+            macroName,
+            args ? 'Function-like macro expansion' : 'Object-like macro expansion',
+            level,
+            [{ offset: 0, removed: inputText.length, inserted: expanded }]
+        );
 
         // Find macros that need further expansion, passing the chain
         // This is the "rescan" step in standard preprocessing
         const furtherExpanded = this.expandMacrosInText(
             expanded,
-            steps,
+            trace,
             level + 1,
             maxDepth,
-            expansionChain,
+            link,
             concatenatedMacros
         );
         
         // Remove current macro from chain (backtrack for parallel expansions)
-        expansionChain.delete(macroId);
+        this.chain.leave(link);
         
         return furtherExpanded;
     }
 
     private expandMacrosInText(
         text: string, 
-        steps: ExpansionStep[], 
+        trace: ExpansionTrace | null, 
         level: number, 
         maxDepth: number,
-        expansionChain: Set<string>,
+        expansionChain: ExpansionLink | null,
         concatenatedMacros: ConcatenatedMacroTracker
     ): string {
         if (level >= maxDepth) {
-            return text;
+            return this.stopAtDepth(text);
         }
 
         const config = Configuration.getInstance().getConfig();
@@ -259,15 +352,18 @@ export class MacroExpander {
         
         while (true) {
             const expandedText = config.expansionMode === 'single-layer' 
-                ? this.expandSingleLayer(currentText, steps, level, maxDepth, expansionChain, concatenatedMacros)
-                : this.expandSingleMacro(currentText, steps, level, maxDepth, expansionChain, concatenatedMacros);
+                ? this.expandSingleLayer(currentText, trace, level, maxDepth, expansionChain, concatenatedMacros)
+                : this.expandSingleMacro(currentText, trace, level, maxDepth, expansionChain, concatenatedMacros);
             
-            if (expandedText === currentText || level >= maxDepth) {
-                break; // No more expansions possible or max depth reached
+            if (expandedText === currentText) {
+                break; // No more expansions possible (or a limit was reached)
             }
             
             currentText = expandedText;
             level++;
+            if (level >= maxDepth) {
+                return this.stopAtDepth(currentText);
+            }
         }
         
         return currentText;
@@ -278,14 +374,14 @@ export class MacroExpander {
      */
     private expandSingleLayer(
         text: string, 
-        steps: ExpansionStep[], 
+        trace: ExpansionTrace | null, 
         level: number, 
         maxDepth: number,
-        expansionChain: Set<string>,
+        expansionChain: ExpansionLink | null,
         concatenatedMacros: ConcatenatedMacroTracker
     ): string {
         if (level >= maxDepth) {
-            return text;
+            return this.stopAtDepth(text);
         }
 
         // Find all expandable macros at the deepest level
@@ -298,18 +394,19 @@ export class MacroExpander {
         // Sort by position (descending) to avoid index shifting issues
         macros.sort((a, b) => b.startIndex - a.startIndex);
         
-        let expandedText = text;
         const expandedMacros: string[] = [];
+        // Positions are descending, so each edit leaves the next one's offset valid
+        const edits: TextEdit[] = [];
+        let expandedLength = text.length;
         
         for (const macro of macros) {
             // Check for circular reference
-            const macroId = macro.args ? `${macro.name}(${macro.args.join(',')})` : macro.name;
-            if (expansionChain.has(macroId)) {
-                console.warn(`MacroLens: Skipping circular reference: ${macroId}`);
+            if (this.chain.contains(expansionChain, macro.name, macro.args)) {
+                console.warn(`MacroLens: Skipping circular reference: ${this.chain.describe(expansionChain, macro.name, macro.args)}`);
                 continue;
             }
 
-            const defs = this.db.getDefinitions(macro.name);
+            const defs = this.lookup(macro.name);
             if (defs.length === 0) {
                 continue;
             }
@@ -367,25 +464,24 @@ export class MacroExpander {
                 );
             }
             
-            // Replace in text
-            expandedText = expandedText.substring(0, macro.startIndex) + 
-                         substituted + 
-                         expandedText.substring(macro.endIndex);
+            // Stop before the substitution exceeding a limit; the ones made so far are kept
+            const removed = macro.endIndex - macro.startIndex;
+            if (!this.withinBudget(expandedLength - removed + substituted.length)) {
+                break;
+            }
+
+            // Replaced all at once below, rather than copying the whole text per macro
+            expandedLength += substituted.length - removed;
+            edits.push({ offset: macro.startIndex, removed, inserted: substituted });
             
             expandedMacros.push(macro.args ? `${macro.name}(${macro.args.join(', ')})` : macro.name);
         }
         
         if (expandedMacros.length > 0) {
-            steps.push({
-                from: text,
-                to: expandedText,
-                macro: expandedMacros.join(', '),
-                note: `Expand macros at same level: ${expandedMacros.join(', ')}`,
-                level
-            });
+            trace?.record(expandedMacros.join(', '), `Expand macros at same level: ${expandedMacros.join(', ')}`, level, edits);
         }
         
-        return expandedText;
+        return ExpansionTrace.applyEdits(text, edits);
     }
 
     /**
@@ -393,14 +489,14 @@ export class MacroExpander {
      */
     private expandSingleMacro(
         text: string, 
-        steps: ExpansionStep[], 
+        trace: ExpansionTrace | null, 
         level: number, 
         maxDepth: number,
-        expansionChain: Set<string>,
+        expansionChain: ExpansionLink | null,
         concatenatedMacros: ConcatenatedMacroTracker
     ): string {
         if (level >= maxDepth) {
-            return text;
+            return this.stopAtDepth(text);
         }
 
         // Find the innermost expandable macro
@@ -411,13 +507,12 @@ export class MacroExpander {
         }
 
         // Check for circular reference
-        const macroId = macro.args ? `${macro.name}(${macro.args.join(',')})` : macro.name;
-        if (expansionChain.has(macroId)) {
-            console.warn(`MacroLens: Skipping circular reference: ${macroId}`);
+        if (this.chain.contains(expansionChain, macro.name, macro.args)) {
+            console.warn(`MacroLens: Skipping circular reference: ${this.chain.describe(expansionChain, macro.name, macro.args)}`);
             return text;
         }
 
-        const defs = this.db.getDefinitions(macro.name);
+        const defs = this.lookup(macro.name);
         if (defs.length === 0) {
             return text;
         }
@@ -475,19 +570,21 @@ export class MacroExpander {
             );
         }
         
+        if (!this.withinBudget(text.length - (macro.endIndex - macro.startIndex) + substituted.length)) {
+            return text;
+        }
+
         // Replace in text
         const expandedText = text.substring(0, macro.startIndex) + 
                            substituted + 
                            text.substring(macro.endIndex);
         
-        const macroDisplay = macro.args ? `${macro.name}(${macro.args.join(', ')})` : macro.name;
-        steps.push({
-            from: text,
-            to: expandedText,
-            macro: macro.name,
-            note: `Expand ${macroDisplay}`,
-            level
-        });
+        if (trace) {
+            const macroDisplay = macro.args ? `${macro.name}(${macro.args.join(', ')})` : macro.name;
+            trace.record(macro.name, `Expand ${macroDisplay}`, level, [
+                { offset: macro.startIndex, removed: macro.endIndex - macro.startIndex, inserted: substituted }
+            ]);
+        }
         
         return expandedText;
     }
@@ -584,7 +681,7 @@ export class MacroExpander {
         const macros = MacroUtils.findAllMacros(text, {
             calculateDepth: true,
             validateWithDb: (macroName: string) => {
-                const defs = this.db.getDefinitions(macroName);
+                const defs = this.lookup(macroName);
                 if (defs.length === 0) {
                     return false;
                 }
@@ -598,7 +695,7 @@ export class MacroExpander {
         // Convert to expected format and filter based on parameter expectations
         return macros
             .filter(macro => {
-                const defs = this.db.getDefinitions(macro.name);
+                const defs = this.lookup(macro.name);
                 if (defs.length === 0) {
                     return false;
                 }
@@ -1,9 +1,55 @@
 import * as vscode from 'vscode';
-import { MacroDef } from './macroDb';
+import { MacroDef, MacroUndef } from './macroDb';
 import { REGEX_PATTERNS } from '../utils/constants';
 import { MacroUtils } from '../utils/macroUtils';
+import { ConditionalDirective, ConditionStack } from './conditionEvaluator';
+import { IncludeDirective } from './includeGraph';
+import { ByteClass, ByteClassifier, ByteMasks } from './byteClassifier';
+
+export interface ParseOptions {
+    /** Condition state at the first line, for parsing a region of a larger file */
+    conditions?: ConditionStack;
+    /** Comments are already blanked (see parseBuffer) */
+    commentsRemoved?: boolean;
+}
+
+/**
+ * Result of parsing a source file
+ */
+export interface ParsedSource {
+    defs: MacroDef[];
+    undefs: MacroUndef[];
+    includes: IncludeDirective[];
+    directives: ConditionalDirective[]; // Conditional directives (#if/#else/...) in file order
+    guardLine: number;                  // Line of the include guard directive, or -1
+    references?: string[];              // Macro-style names used in the file (parseBuffer and StreamingParser)
+}
+
+const CONDITIONAL_HINT = /^[ \t]*#[ \t]*(?:if|ifdef|ifndef)\b/m;
+const CONDITIONAL_DIRECTIVE = /^\s*#\s*(?:if|ifdef|ifndef|elif|else|endif)\b/;
+
+/** Keywords that start a line producing a definition (after optional '#' for directives) */
+const DIRECTIVE_KEYWORDS = [Buffer.from('define'), Buffer.from('undef')];
+const TYPE_KEYWORDS = [Buffer.from('typedef'), Buffer.from('struct'), Buffer.from('union'), Buffer.from('enum')];
+const INCLUDE_KEYWORD = Buffer.from('include');
+
+/** Files from this size on are classified with the SIMD kernel before scanning for comments */
+const SIMD_SCAN_THRESHOLD = 4096;
+
+const enum Byte {
+    Tab = 0x09, LineFeed = 0x0a, VerticalTab = 0x0b, FormFeed = 0x0c, CarriageReturn = 0x0d,
+    Space = 0x20, DoubleQuote = 0x22, Hash = 0x23, Quote = 0x27, Star = 0x2a, Slash = 0x2f,
+    Digit0 = 0x30, Digit9 = 0x39, Less = 0x3c, Greater = 0x3e, UpperA = 0x41, UpperZ = 0x5a,
+    Backslash = 0x5c, Underscore = 0x5f, LowerA = 0x61, LowerZ = 0x7a
+}
+
+/** Directives whose operand is a path, not code */
+const INCLUDE_DIRECTIVES = new Set(['include', 'include_next', 'import']);
 
 export class MacroParser {
+    /** Reference recorded for a file whose uses are not known, which may use any name */
+    static readonly ANY_REFERENCE = '*';
+
     /**
      * Remove C/C++ comments from source code using regex
      * 
@@ -290,16 +336,624 @@ export class MacroParser {
      * Parse C/C++ macro definitions and type declarations from source code
      * Includes: #define macros, typedef, struct, enum, union
      */
-    static parseMacros(content: string, filePath: string): MacroDef[] {
+    static parseMacros(content: string, filePath: string, options?: ParseOptions): MacroDef[] {
+        return this.parseSource(content, filePath, options).defs;
+    }
+
+    /**
+     * Collect conditional directives from comment-free lines, joining continuation lines
+     */
+    static collectConditionalDirectives(lines: string[]): ConditionalDirective[] {
+        const directives: ConditionalDirective[] = [];
+        for (let i = 0; i < lines.length; i++) {
+            let line = lines[i].replace(/[ \t]+/g, ' ').trim();
+            if (!line.startsWith('#')) {
+                continue;
+            }
+            const start = i;
+            while (line.endsWith('\\') && i + 1 < lines.length) {
+                line = line.slice(0, -1) + ' ' + lines[++i].replace(/[ \t]+/g, ' ').trim();
+            }
+            const directive = ConditionStack.parseDirective(line, start);
+            if (directive) {
+                directives.push(directive);
+            }
+        }
+        return directives;
+    }
+
+    /**
+     * Parse a file from its raw bytes
+     *
+     * A byte-level prefilter looks for lines starting with a definition keyword
+     * (#define, #undef and, with type detection, typedef/struct/union/enum). Files without
+     * any are never decoded: their #include directives are extracted from the bytes and
+     * only the include targets are decoded. In the other files only the lines parseSource
+     * reads are decoded (see decodeParsedLines).
+     */
+    static parseBuffer(content: Uint8Array, filePath: string): ParsedSource {
+        const bytes = Buffer.isBuffer(content)
+            ? content
+            : Buffer.from(content.buffer, content.byteOffset, content.byteLength);
+
+        const detectTypes = vscode.workspace.getConfiguration('macrolens').get('detectTypeDeclarations', true);
+        const hasDefinitions = this.hasDefinitionCandidates(bytes, detectTypes);
+        const comments = this.findCommentSpans(bytes);
+        const references = this.scanReferences(bytes, comments);
+        if (!hasDefinitions && bytes.indexOf(INCLUDE_KEYWORD) === -1) {
+            return { defs: [], undefs: [], includes: [], directives: [], guardLine: -1, references };
+        }
+
+        if (!hasDefinitions) {
+            const includes = this.scanIncludes(bytes, comments);
+            if (includes) {
+                return { defs: [], undefs: [], includes, directives: [], guardLine: -1, references };
+            }
+        }
+
+        // Blank comments on the bytes so the decoded text skips the comment regex
+        const text = this.decodeParsedLines(comments.length > 0 ? this.blankSpans(bytes, comments) : bytes, detectTypes);
+        return { ...this.parseSource(text, filePath, { commentsRemoved: true }), references };
+    }
+
+    /**
+     * Decode only the lines parseSource reads: directives and their continuation lines,
+     * type declarations up to where parseSource stops collecting them, and the line after
+     * the first conditional directive (include guard detection). Other lines are left
+     * empty, so line numbers and the parse result are those of the whole text.
+     * @param bytes Content with comments blanked
+     */
+    private static decodeParsedLines(bytes: Buffer, detectTypes: boolean): string {
+        const parts: string[] = [];
+        const length = bytes.length;
+        let skipped = 0;                // Empty lines not yet added to parts
+        let directive = false;          // The line continues a directive
+        let define = false;             // The line continues a #define (read as part of it)
+        let declaration: { kind: 'typedef' | 'enum'; depth: number; semicolon: boolean } | null = null;
+        let guard: 'first' | 'follower' | 'done' = 'first';
+
+        let lineStart = 0;
+        let first = this.hasByteOrderMark(bytes) ? 3 : 0;
+        while (lineStart <= length) {
+            let lineFeed = bytes.indexOf(Byte.LineFeed, lineStart);
+            if (lineFeed === -1) {
+                lineFeed = length;
+            }
+            const end = lineFeed > lineStart && bytes[lineFeed - 1] === Byte.CarriageReturn ? lineFeed - 1 : lineFeed;
+            while (first < end && this.isBlank(bytes[first])) {
+                first++;
+            }
+            let last = end - 1;
+            while (last >= first && this.isBlank(bytes[last])) {
+                last--;
+            }
+            const byte = first < end ? bytes[first] : -1;
+            const continues = last >= first && bytes[last] === Byte.Backslash;
+
+            let text: string | undefined;
+            const decode = () => text ??= bytes.toString('utf8', lineStart, end);
+            let keep = directive || byte === Byte.Hash || byte >= 0x80;
+
+            // Conditional directives and the include guard are found in a pass of their own
+            if (guard === 'follower' && byte !== -1) {
+                keep = true;
+                guard = 'done';
+            }
+            if (byte === Byte.Hash && !directive && guard === 'first' && CONDITIONAL_DIRECTIVE.test(decode())) {
+                guard = 'follower';
+            }
+            directive = (directive || byte === Byte.Hash) && continues;
+
+            // Lines read by the definition pass: a #define with its continuation lines, and
+            // declarations up to where the pass stops collecting them
+            if (define) {
+                keep = true;
+                define = continues;
+            } else if (declaration) {
+                keep = true;
+                const line = decode();
+                if (declaration.kind === 'enum') {
+                    declaration = line.includes('}') ? null : declaration;
+                } else {
+                    declaration.depth += this.count(line, '{') - this.count(line, '}');
+                    declaration.semicolon ||= line.includes(';');
+                    declaration = declaration.depth === 0 && declaration.semicolon ? null : declaration;
+                }
+            } else if (byte === Byte.Hash) {
+                define = continues && REGEX_PATTERNS.DEFINE_DIRECTIVE.test(decode().trim());
+            } else if (detectTypes && byte !== -1 && TYPE_KEYWORDS.some(keyword => this.startsWithWord(bytes, first, end, keyword))) {
+                const line = decode().replace(/[ \t]+/g, ' ').trim();
+                if (REGEX_PATTERNS.TYPEDEF_DIRECTIVE.test(line)) {
+                    keep = true;
+                    const depth = this.count(line, '{') - this.count(line, '}');
+                    declaration = depth === 0 && line.includes(';') ? null : { kind: 'typedef', depth, semicolon: line.includes(';') };
+                } else if (REGEX_PATTERNS.STRUCT_DECLARATION.test(line) || REGEX_PATTERNS.UNION_DECLARATION.test(line)) {
+                    keep = true;
+                } else if (REGEX_PATTERNS.ENUM_DECLARATION.test(line) || REGEX_PATTERNS.ANONYMOUS_ENUM_DECLARATION.test(line) || line === 'enum') {
+                    keep = true;
+                    declaration = line.includes('}') ? null : { kind: 'enum', depth: 0, semicolon: false };
+                }
+            }
+
+            if (keep) {
+                if (skipped > 0) {
+                    parts.push('\n'.repeat(skipped - 1));
+                    skipped = 0;
+                }
+                parts.push(decode());
+            } else {
+                skipped++;
+            }
+            lineStart = lineFeed + 1;
+            first = lineStart;
+        }
+        if (skipped > 0) {
+            parts.push('\n'.repeat(skipped - 1));
+        }
+        return parts.join('\n');
+    }
+
+    /**
+     * Whether a line starts with a keyword followed by a non-identifier byte
+     */
+    private static startsWithWord(bytes: Buffer, index: number, end: number, keyword: Buffer): boolean {
+        const after = index + keyword.length;
+        return after <= end && keyword.compare(bytes, index, after) === 0 &&
+            (after === end || !this.isIdentifierByte(bytes[after]));
+    }
+
+    private static count(text: string, char: string): number {
+        let count = 0;
+        for (let i = text.indexOf(char); i !== -1; i = text.indexOf(char, i + 1)) {
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * Macro-style names used in a file (see scanReferences)
+     */
+    static findReferences(content: Buffer): string[] {
+        return this.scanReferences(content, this.findCommentSpans(content));
+    }
+
+    /**
+     * Whether uses of a name are recorded by findReferences; other names (lowercase
+     * macros, for instance) must be searched for in the text
+     */
+    static isReferenceIndexed(name: string): boolean {
+        return /^[A-Z_][A-Z0-9_]*$/.test(name);
+    }
+
+    /**
+     * Distinct macro-style names (as REGEX_PATTERNS.MACRO_NAME) used in a file, skipping
+     * comments, literals and #include operands. The name introduced by #define or removed
+     * by #undef is not a use; names in definition bodies and #if conditions are.
+     * @param comments Comment spans from findCommentSpans
+     */
+    private static scanReferences(bytes: Buffer, comments: number[]): string[] {
+        const names = new Set<string>();
+        const length = bytes.length;
+        let commentIndex = 0;
+        let lineStart = true;       // Only blanks since the start of the (logical) line
+        let afterHash = false;      // Next identifier is a directive name
+        let definedName = false;    // Next identifier is the operand of #define or #undef
+        let lastByte = 0;           // Last non-blank byte, to detect continuation lines
+
+        let i = 0;
+        while (i < length) {
+            while (commentIndex < comments.length && comments[commentIndex + 1] <= i) {
+                commentIndex += 2;
+            }
+            if (commentIndex < comments.length && comments[commentIndex] <= i) {
+                // A block comment spanning lines ends the logical line
+                const end = comments[commentIndex + 1];
+                const lineFeed = bytes.indexOf(Byte.LineFeed, i);
+                if (lineFeed !== -1 && lineFeed < end) {
+                    lineStart = true;
+                    afterHash = false;
+                    definedName = false;
+                }
+                i = end;
+                continue;
+            }
+
+            const byte = bytes[i];
+            if (byte === Byte.LineFeed) {
+                if (lastByte !== Byte.Backslash) {
+                    lineStart = true;
+                    afterHash = false;
+                    definedName = false;
+                }
+                lastByte = byte;
+                i++;
+                continue;
+            }
+            if (MacroParser.isBlank(byte)) {
+                i++;
+                continue;
+            }
+            lastByte = byte;
+
+            if (byte === Byte.Hash && lineStart) {
+                lineStart = false;
+                afterHash = true;
+                i++;
+            } else if (byte === Byte.DoubleQuote || byte === Byte.Quote) {
+                lineStart = false;
+                afterHash = false;
+                const end = this.skipLiteral(bytes, i, byte);
+                i = end === -1 ? i + 1 : end;
+            } else if (MacroParser.isIdentifierByte(byte)) {
+                lineStart = false;
+                let end = i + 1;
+                let macroStyle = byte < Byte.Digit0 || byte > Byte.Digit9;
+                while (end < length && MacroParser.isIdentifierByte(bytes[end])) {
+                    const next = bytes[end];
+                    macroStyle = macroStyle && (next === Byte.Underscore || (next >= Byte.UpperA && next <= Byte.UpperZ) ||
+                        (next >= Byte.Digit0 && next <= Byte.Digit9));
+                    end++;
+                }
+                macroStyle = macroStyle && (byte === Byte.Underscore || (byte >= Byte.UpperA && byte <= Byte.UpperZ));
+
+                if (afterHash) {
+                    afterHash = false;
+                    const directive = bytes.toString('latin1', i, end);
+                    if (INCLUDE_DIRECTIVES.has(directive)) {
+                        const lineEnd = bytes.indexOf(Byte.LineFeed, end);
+                        end = lineEnd === -1 ? length : lineEnd;
+                    }
+                    definedName = directive === 'define' || directive === 'undef';
+                } else if (definedName) {
+                    definedName = false;
+                } else if (macroStyle) {
+                    names.add(bytes.toString('latin1', i, end));
+                }
+                i = end;
+            } else {
+                lineStart = false;
+                afterHash = false;
+                definedName = false;
+                i++;
+            }
+        }
+        return Array.from(names);
+    }
+
+    /**
+     * Identifier characters; bytes of multi-byte UTF-8 sequences count as identifier characters
+     */
+    private static isIdentifierByte(byte: number): boolean {
+        return (byte >= Byte.LowerA && byte <= Byte.LowerZ) || (byte >= Byte.UpperA && byte <= Byte.UpperZ) ||
+            (byte >= Byte.Digit0 && byte <= Byte.Digit9) || byte === Byte.Underscore || byte >= 0x80;
+    }
+
+    /**
+     * Check whether any definition keyword starts a line (conservatively: a preceding
+     * block comment end also counts, since comments are blanked before parsing)
+     */
+    private static hasDefinitionCandidates(bytes: Buffer, detectTypes: boolean): boolean {
+        const keywords = detectTypes ? DIRECTIVE_KEYWORDS.concat(TYPE_KEYWORDS) : DIRECTIVE_KEYWORDS;
+        for (const keyword of keywords) {
+            const isDirective = DIRECTIVE_KEYWORDS.includes(keyword);
+            for (let index = bytes.indexOf(keyword); index !== -1; index = bytes.indexOf(keyword, index + 1)) {
+                if (this.startsLine(bytes, index, isDirective)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Check that only whitespace (and '#' for directives) precedes a keyword on its line
+     */
+    private static startsLine(bytes: Buffer, index: number, isDirective: boolean): boolean {
+        let hashSeen = !isDirective;
+        for (let i = index - 1; i >= 0; i--) {
+            const byte = bytes[i];
+            if (byte === Byte.LineFeed) {
+                break;
+            }
+            // A lone carriage return can end a line comment without starting a new line
+            if (byte === Byte.CarriageReturn && bytes[i + 1] !== Byte.LineFeed) {
+                return true;
+            }
+            if (MacroParser.isBlank(byte)) {
+                continue;
+            }
+            if (byte === Byte.Hash && !hashSeen) {
+                hashSeen = true;
+                continue;
+            }
+            if (byte === Byte.Slash && bytes[i - 1] === Byte.Star) {
+                return true;
+            }
+            // A UTF-8 byte order mark is trimmed like whitespace
+            if (i === 2 && MacroParser.hasByteOrderMark(bytes)) {
+                break;
+            }
+            return false;
+        }
+        return hashSeen;
+    }
+
+    /**
+     * Check that only blanks, '#' and blanks precede a directive name on its line,
+     * treating comments (blanked by the parser) as blanks
+     * @param commentIndex Index in comments of the first span ending after index
+     */
+    private static followsHash(bytes: Buffer, index: number, comments: number[], commentIndex: number): boolean {
+        let hashSeen = false;
+        let i = index - 1;
+        while (i >= 0) {
+            const byte = bytes[i];
+            if (byte === Byte.LineFeed) {
+                break;
+            }
+            if (commentIndex >= 2 && i < comments[commentIndex - 1] && i >= comments[commentIndex - 2]) {
+                // A comment spanning lines: this line starts inside it
+                const start = comments[commentIndex - 2];
+                if (bytes.lastIndexOf(Byte.LineFeed, i) >= start) {
+                    break;
+                }
+                i = start - 1;
+                commentIndex -= 2;
+            } else if (MacroParser.isBlank(byte)) {
+                i--;
+            } else if (byte === Byte.Hash && !hashSeen) {
+                hashSeen = true;
+                i--;
+            } else if (i === 2 && this.hasByteOrderMark(bytes)) {
+                break;
+            } else {
+                return false;
+            }
+        }
+        return hashSeen;
+    }
+
+    private static hasByteOrderMark(bytes: Buffer): boolean {
+        return bytes[0] === 0xef && bytes[1] === 0xbb && bytes[2] === 0xbf;
+    }
+
+    /**
+     * Extract #include directives from raw bytes with the same results as parseSource
+     * Returns null when a comment inside a directive makes the byte-level result uncertain
+     */
+    private static scanIncludes(bytes: Buffer, comments: number[]): IncludeDirective[] | null {
+        const includes: IncludeDirective[] = [];
+        let commentIndex = 0;
+        let line = 1;
+        let lineCounted = 0;
+
+        for (let index = bytes.indexOf(INCLUDE_KEYWORD); index !== -1; index = bytes.indexOf(INCLUDE_KEYWORD, index + 1)) {
+            // Skip occurrences inside comments
+            while (commentIndex < comments.length && comments[commentIndex + 1] <= index) {
+                commentIndex += 2;
+            }
+            if (commentIndex < comments.length && comments[commentIndex] <= index) {
+                continue;
+            }
+
+            // Text before "include" on this line must be blanks, '#', blanks
+            if (!this.followsHash(bytes, index, comments, commentIndex)) {
+                continue;
+            }
+
+            // Target delimited by <...> or "..." (either closing character ends it, as in the regex)
+            let start = index + INCLUDE_KEYWORD.length;
+            while (start < bytes.length && MacroParser.isBlank(bytes[start])) {
+                start++;
+            }
+            const open = bytes[start];
+            if (open !== Byte.Less && open !== Byte.DoubleQuote) {
+                if (open === Byte.Slash) {
+                    return null;
+                }
+                continue;
+            }
+            let end = start + 1;
+            while (end < bytes.length && bytes[end] !== Byte.Greater && bytes[end] !== Byte.DoubleQuote && bytes[end] !== Byte.LineFeed) {
+                end++;
+            }
+            if (end >= bytes.length || bytes[end] === Byte.LineFeed || end === start + 1) {
+                continue;
+            }
+            if (commentIndex < comments.length && comments[commentIndex] < end) {
+                return null;
+            }
+
+            // Count lines incrementally between directives
+            for (let j = lineCounted; j < index; j++) {
+                if (bytes[j] === Byte.LineFeed) {
+                    line++;
+                }
+            }
+            lineCounted = index;
+
+            const target = this.decodeIdentifier(bytes, start + 1, end).replace(/[ \t]+/g, ' ').trim();
+            if (target) {
+                includes.push({ target, system: open === Byte.Less, line });
+            }
+        }
+        return includes;
+    }
+
+    /**
+     * Comment spans as flat [start, end) pairs, matching removeCommentsWithPlaceholders:
+     * string and character literals are skipped, unterminated literals and block comments are not
+     */
+    private static findCommentSpans(bytes: Buffer): number[] {
+        const spans: number[] = [];
+        if (bytes.indexOf('/*') === -1 && bytes.indexOf('//') === -1) {
+            return spans;
+        }
+
+        const classifier = bytes.length >= SIMD_SCAN_THRESHOLD ? ByteClassifier.getInstance() : null;
+        if (classifier) {
+            return this.findCommentSpansMasked(bytes, classifier.classify(bytes));
+        }
+
+        const length = bytes.length;
+        let i = 0;
+        while (i < length) {
+            const byte = bytes[i];
+            if (byte === Byte.DoubleQuote || byte === Byte.Quote) {
+                const end = this.skipLiteral(bytes, i, byte);
+                i = end === -1 ? i + 1 : end;
+            } else if (byte === Byte.Slash && bytes[i + 1] === Byte.Star) {
+                const close = bytes.indexOf('*/', i + 2);
+                if (close === -1) {
+                    i++;
+                } else {
+                    spans.push(i, close + 2);
+                    i = close + 2;
+                }
+            } else if (byte === Byte.Slash && bytes[i + 1] === Byte.Slash) {
+                let end = i + 2;
+                while (end < length && bytes[end] !== Byte.LineFeed && bytes[end] !== Byte.CarriageReturn) {
+                    end++;
+                }
+                spans.push(i, end);
+                i = end;
+            } else {
+                i++;
+            }
+        }
+        return spans;
+    }
+
+    /**
+     * findCommentSpans driven by byte class masks: only slashes and quotes are visited
+     */
+    private static findCommentSpansMasked(bytes: Buffer, masks: ByteMasks): number[] {
+        const spans: number[] = [];
+        const candidates = (1 << ByteClass.Slash) | (1 << ByteClass.Quote);
+        const literalStops = (1 << ByteClass.Quote) | (1 << ByteClass.Backslash);
+
+        let i = masks.next(0, candidates);
+        while (i !== -1) {
+            const byte = bytes[i];
+            if (byte === Byte.Slash && bytes[i + 1] === Byte.Star) {
+                const close = bytes.indexOf('*/', i + 2);
+                if (close === -1) {
+                    i++;
+                } else {
+                    spans.push(i, close + 2);
+                    i = close + 2;
+                }
+            } else if (byte === Byte.Slash && bytes[i + 1] === Byte.Slash) {
+                const end = masks.next(i + 2, 1 << ByteClass.LineBreak);
+                spans.push(i, end === -1 ? bytes.length : end);
+                i = end === -1 ? bytes.length : end;
+            } else if (byte === Byte.DoubleQuote || byte === Byte.Quote) {
+                // Same as skipLiteral, jumping between quotes and backslashes
+                let end = -1;
+                for (let j = masks.next(i + 1, literalStops); j !== -1; j = masks.next(j + 1, literalStops)) {
+                    if (bytes[j] === byte) {
+                        end = j + 1;
+                        break;
+                    }
+                    if (bytes[j] === Byte.Backslash) {
+                        const next = bytes[j + 1];
+                        if (next === undefined || next === Byte.LineFeed || next === Byte.CarriageReturn) {
+                            break;
+                        }
+                        j++;
+                    }
+                }
+                i = end === -1 ? i + 1 : end;
+            } else {
+                i++;
+            }
+            i = i < bytes.length ? masks.next(i, candidates) : -1;
+        }
+        return spans;
+    }
+
+    /**
+     * Copy of the bytes with comment spans replaced by spaces (line breaks kept)
+     */
+    private static blankSpans(bytes: Buffer, spans: number[]): Buffer {
+        const blanked = Buffer.from(bytes);
+        for (let s = 0; s < spans.length; s += 2) {
+            for (let i = spans[s]; i < spans[s + 1]; i++) {
+                if (blanked[i] !== Byte.LineFeed && blanked[i] !== Byte.CarriageReturn) {
+                    blanked[i] = Byte.Space;
+                }
+            }
+        }
+        return blanked;
+    }
+
+    /**
+     * Index after the closing quote of a literal starting at start, or -1 if unterminated
+     * An escaped line break ends the match like '.' in the comment regex
+     */
+    private static skipLiteral(bytes: Buffer, start: number, quote: number): number {
+        for (let i = start + 1; i < bytes.length; i++) {
+            const byte = bytes[i];
+            if (byte === quote) {
+                return i + 1;
+            }
+            if (byte === Byte.Backslash) {
+                const next = bytes[i + 1];
+                if (next === undefined || next === Byte.LineFeed || next === Byte.CarriageReturn) {
+                    return -1;
+                }
+                i++;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Decode a short byte range: ASCII as latin1 (no validation), anything else as UTF-8
+     */
+    private static decodeIdentifier(bytes: Buffer, start: number, end: number): string {
+        for (let i = start; i < end; i++) {
+            if (bytes[i] >= 0x80) {
+                return bytes.toString('utf8', start, end);
+            }
+        }
+        return bytes.toString('latin1', start, end);
+    }
+
+    private static isBlank(byte: number): boolean {
+        return byte === Byte.Space || byte === Byte.Tab || byte === Byte.CarriageReturn ||
+            byte === Byte.VerticalTab || byte === Byte.FormFeed;
+    }
+
+    /**
+     * Parse definitions together with the conditional structure of the file
+     * Each definition records the #if/#ifdef condition guarding it (include guards excluded)
+     */
+    static parseSource(content: string, filePath: string, options?: ParseOptions): ParsedSource {
         // Check if type declaration detection is enabled
         const config = vscode.workspace.getConfiguration('macrolens');
         const detectTypes = config.get('detectTypeDeclarations', true);
         
         // Step 1: Remove all comments first
-        const cleanContent = this.removeComments(content);
+        const cleanContent = options?.commentsRemoved
+            ? content.replace(/[ \t]+\n/g, '\n')
+            : this.removeComments(content);
         
         const defs: MacroDef[] = [];
         const lines = cleanContent.split(/\r?\n/);
+
+        // Conditional structure: skip the directive pass entirely for files without #if
+        let directives: ConditionalDirective[] = [];
+        let guardLine = -1;
+        let conditions = options?.conditions;
+        if (!conditions) {
+            if (CONDITIONAL_HINT.test(cleanContent)) {
+                directives = this.collectConditionalDirectives(lines);
+                guardLine = ConditionStack.findIncludeGuard(directives, lines);
+            }
+            conditions = new ConditionStack(guardLine);
+        }
+        let nextDirective = 0;
         
         // Regex for #define directives
         // CRITICAL: We must preserve the space (or lack thereof) between macro name and (
@@ -308,6 +962,11 @@ export class MacroParser {
         // So we capture everything after the macro name WITHOUT trimming/consuming spaces
         const defineRegex = REGEX_PATTERNS.DEFINE_DIRECTIVE;
         
+        const undefs: MacroUndef[] = [];
+        const undefRegex = REGEX_PATTERNS.UNDEF_DIRECTIVE;
+        const includes: IncludeDirective[] = [];
+        const includeRegex = REGEX_PATTERNS.INCLUDE_DIRECTIVE;
+
         // Regex for type declarations (typedef, struct, enum, union)
         // These patterns detect type names to avoid false "undefined macro" warnings
         
@@ -321,11 +980,41 @@ export class MacroParser {
         const anonymousEnumRegex = REGEX_PATTERNS.ANONYMOUS_ENUM_DECLARATION;
 
         for (let i = 0; i < lines.length; i++) {
+            // Catch up with directives, including those consumed by multi-line declarations
+            let isConditionalDirective = false;
+            while (nextDirective < directives.length && directives[nextDirective].line <= i) {
+                isConditionalDirective = directives[nextDirective].line === i;
+                conditions.apply(directives[nextDirective++]);
+            }
+            if (isConditionalDirective) {
+                continue;
+            }
+            const condition = conditions.current();
+
             let line = lines[i];
             
             // Clean up extra whitespace but preserve structure
             line = line.replace(/[ \t]+/g, ' ').trim();
             
+            if (line.startsWith('#')) {
+                // #include edges feed the include graph
+                const includeMatch = line.match(includeRegex);
+                if (includeMatch) {
+                    const target = includeMatch[2].trim();
+                    if (target) {
+                        includes.push({ target, system: includeMatch[1] === '<', line: i + 1 });
+                    }
+                    continue;
+                }
+
+                // #undef ends the validity range of earlier definitions in this file
+                const undefMatch = line.match(undefRegex);
+                if (undefMatch) {
+                    undefs.push({ name: undefMatch[1], file: filePath, line: i + 1, condition });
+                    continue;
+                }
+            }
+
             // Try to match #define (highest priority)
             const defineMatch = line.match(defineRegex);
             if (defineMatch) {
@@ -403,7 +1092,8 @@ export class MacroParser {
                     body,
                     file: filePath,
                     line: originalLineNumber,
-                    isDefine: true  // This is a real #define macro
+                    isDefine: true,  // This is a real #define macro
+                    condition
                 });
                 continue;
             }
@@ -471,7 +1161,8 @@ export class MacroParser {
                         body: '/* typedef */',
                         file: filePath,
                         line: lineNum,
-                        isDefine: false
+                        isDefine: false,
+                        condition
                     });
                 }
                 
@@ -494,7 +1185,8 @@ export class MacroParser {
                     body: '/* struct */',
                     file: filePath,
                     line: i + 1,
-                    isDefine: false
+                    isDefine: false,
+                    condition
                 });
                 continue;
             }
@@ -509,7 +1201,8 @@ export class MacroParser {
                     body: '/* union */',
                     file: filePath,
                     line: i + 1,
-                    isDefine: false
+                    isDefine: false,
+                    condition
                 });
                 continue;
             }
@@ -542,7 +1235,8 @@ export class MacroParser {
                         body: '/* enum */',
                         file: filePath,
                         line: i + 1,
-                        isDefine: false
+                        isDefine: false,
+                        condition
                     });
                 }
                 
@@ -579,7 +1273,8 @@ export class MacroParser {
                                 body: '/* enum constant */',
                                 file: filePath,
                                 line: enumLineNum,
-                                isDefine: false
+                                isDefine: false,
+                                condition
                             });
                         }
                     }
@@ -589,6 +1284,36 @@ export class MacroParser {
             }
         }
 
-        return defs;
+        this.assignEndLines(defs, undefs);
+        return { defs, undefs, includes, directives, guardLine };
+    }
+
+    /**
+     * Close each #define at the first following #undef of the same name in the file
+     */
+    static assignEndLines(defs: MacroDef[], undefs: MacroUndef[]): void {
+        if (undefs.length === 0) {
+            for (const def of defs) {
+                if (def.endLine !== undefined) {
+                    def.endLine = undefined;
+                }
+            }
+            return;
+        }
+
+        const undefLines = new Map<string, number[]>();
+        for (const undef of undefs) {
+            const lines = undefLines.get(undef.name);
+            if (lines) {
+                lines.push(undef.line);
+            } else {
+                undefLines.set(undef.name, [undef.line]);
+            }
+        }
+
+        for (const def of defs) {
+            const lines = def.isDefine ? undefLines.get(def.name) : undefined;
+            def.endLine = lines?.find(line => line > def.line);
+        }
     }
 }
\ No newline at end of file
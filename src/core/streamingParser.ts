@@ -0,0 +1,350 @@
+import { StringDecoder } from 'string_decoder';
+import { MacroParser, ParsedSource } from './macroParser';
+import { ConditionalDirective, ConditionStack } from './conditionEvaluator';
+import { DATABASE_CONSTANTS, REGEX_PATTERNS } from '../utils/constants';
+
+/** Directives that produce definitions, undefs or include edges */
+const DEFINITION_DIRECTIVE = /^#\s*(?:define|undef|include)\b/;
+const CONDITIONAL_DIRECTIVE_START = /^#\s*(?:if|ifdef|ifndef|elif|else|endif)\b/;
+/** Cheap test before matching the declaration patterns of parseSource */
+const DECLARATION_START = /^(?:typedef|struct|union|enum)\b/;
+
+/** Kept directives are handed to parseSource in batches of about this many characters */
+const BATCH_SIZE = 1 << 20;
+
+/** Tokens of a comment-free line for the reference scan: literals, words and other characters */
+const REFERENCE_TOKEN = /"(?:[^"\\]|\\.)*"|'(?:[^'\\]|\\.)*'|[\w\u0080-\uffff]+|\S/g;
+const WORD_START = /^[\w\u0080-\uffff]/;
+const MACRO_STYLE_NAME = /^[A-Z_][A-Z0-9_]*$/;
+/** Directives whose operand is a path, not code */
+const INCLUDE_DIRECTIVES = new Set(['include', 'include_next', 'import']);
+
+interface DirectiveLine {
+    line: number;   // 0-based
+    text: string;   // Comment-free, whitespace-normalized, continuations joined
+}
+
+/**
+ * Type declaration being collected over several lines, joined the way parseSource does
+ */
+interface Declaration extends DirectiveLine {
+    kind: 'typedef' | 'enum';
+    depth: number;  // Brace depth of a typedef
+}
+
+/**
+ * Parser for oversized files (typically generated headers)
+ *
+ * The file is consumed chunk by chunk. Only preprocessor directive lines and type
+ * declarations (typedef/struct/union/enum, joined into one line each) are kept;
+ * comments and line continuations are tracked across chunk boundaries, so memory is
+ * bounded by the directives and declarations of the file rather than its size.
+ */
+export class StreamingParser {
+    private lineIndex = 0;
+    private partial = '';
+    private inBlockComment = false;
+    private continued: DirectiveLine | null = null;
+    private declaration: Declaration | null = null;
+
+    // Directives of the current chunk, copied out of the chunk string when it is done
+    private pending: DirectiveLine[] = [];
+    private conditionals: ConditionalDirective[] = [];
+    // Lines parsed for definitions: #define/#undef/#include directives and type declarations
+    private definitions: DirectiveLine[] = [];
+
+    // Macro-style names used, as MacroParser.scanReferences records them; null once too
+    // many to keep, and the state of the scan across continuation lines
+    private references: Set<string> | null = new Set();
+    private referenceLineStart = true;
+    private referenceAfterHash = false;
+    private referenceDefinedName = false;
+    private referenceContinued = false;
+
+    // The include guard check needs the first non-blank line after the first conditional
+    private sawConditional = false;
+    private awaitingGuardFollower = false;
+    private guardFollower: string | undefined;
+
+    private constructor() {}
+
+    static async parse(chunks: AsyncIterable<Buffer | string>, filePath: string): Promise<ParsedSource> {
+        const parser = new StreamingParser();
+        const decoder = new StringDecoder('utf8');
+        for await (const chunk of chunks) {
+            parser.push(typeof chunk === 'string' ? chunk : decoder.write(chunk));
+        }
+        parser.push(decoder.end());
+        parser.finish();
+        return parser.build(filePath);
+    }
+
+    private push(text: string): void {
+        const data = this.partial + text;
+        let start = 0;
+        for (let newline = data.indexOf('\n'); newline !== -1; newline = data.indexOf('\n', start)) {
+            const end = newline > start && data.charCodeAt(newline - 1) === 13 ? newline - 1 : newline;
+            this.processLine(data.substring(start, end));
+            start = newline + 1;
+        }
+        this.partial = data.substring(start);
+        this.flushPending();
+    }
+
+    private finish(): void {
+        this.processLine(this.partial);
+        this.partial = '';
+        if (this.continued) {
+            this.pending.push(this.continued);
+            this.continued = null;
+        }
+        if (this.declaration) {
+            this.pending.push(this.declaration);
+            this.declaration = null;
+        }
+        this.flushPending();
+    }
+
+    private processLine(raw: string): void {
+        const index = this.lineIndex++;
+        const line = this.stripComments(raw).replace(/[ \t]+/g, ' ').trim();
+        this.collectReferences(line);
+
+        if (this.awaitingGuardFollower && line !== '') {
+            this.guardFollower = line;
+            this.awaitingGuardFollower = false;
+        }
+
+        if (this.continued) {
+            this.continued.text = this.continued.text.slice(0, -1) + ' ' + line;
+        } else if (line.startsWith('#')) {
+            this.continued = { line: index, text: line };
+        } else {
+            this.processDeclarationLine(index, line);
+            return;
+        }
+
+        if (!this.continued.text.endsWith('\\')) {
+            if (!this.sawConditional && CONDITIONAL_DIRECTIVE_START.test(this.continued.text)) {
+                this.sawConditional = true;
+                this.awaitingGuardFollower = true;
+            }
+            this.pending.push(this.continued);
+            this.continued = null;
+        }
+    }
+
+    /**
+     * Keep the lines of type declarations, ending them where parseSource stops reading:
+     * a typedef at the first ';' outside braces, an enum at its closing brace, and a
+     * struct or union on its first line
+     */
+    private processDeclarationLine(index: number, line: string): void {
+        let declaration = this.declaration;
+        if (declaration) {
+            declaration.text += ' ' + line;
+        } else if (DECLARATION_START.test(line) || line === 'enum') {
+            if (REGEX_PATTERNS.TYPEDEF_DIRECTIVE.test(line)) {
+                declaration = { line: index, text: line, kind: 'typedef', depth: 0 };
+            } else if (REGEX_PATTERNS.STRUCT_DECLARATION.test(line) || REGEX_PATTERNS.UNION_DECLARATION.test(line)) {
+                this.pending.push({ line: index, text: line });
+                return;
+            } else if (REGEX_PATTERNS.ENUM_DECLARATION.test(line) || REGEX_PATTERNS.ANONYMOUS_ENUM_DECLARATION.test(line) || line === 'enum') {
+                declaration = { line: index, text: line, kind: 'enum', depth: 0 };
+            } else {
+                return;
+            }
+        } else {
+            return;
+        }
+
+        const complete = declaration.kind === 'typedef'
+            ? (declaration.depth += StreamingParser.count(line, '{') - StreamingParser.count(line, '}')) === 0 && declaration.text.includes(';')
+            : line.includes('}');
+        if (complete) {
+            this.pending.push({ line: declaration.line, text: declaration.text });
+            this.declaration = null;
+        } else {
+            this.declaration = declaration;
+        }
+    }
+
+    /**
+     * Record the macro-style names a comment-free line uses: not literals, #include
+     * operands or the name a #define or #undef introduces
+     */
+    private collectReferences(line: string): void {
+        if (!this.referenceContinued) {
+            this.referenceLineStart = true;
+            this.referenceAfterHash = false;
+            this.referenceDefinedName = false;
+        }
+        this.referenceContinued = line.endsWith('\\');
+        if (!this.references) {
+            return;
+        }
+
+        for (const [token] of line.matchAll(REFERENCE_TOKEN)) {
+            if (token === '#' && this.referenceLineStart) {
+                this.referenceAfterHash = true;
+            } else if (token[0] === '"' || token[0] === '\'') {
+                this.referenceAfterHash = false;
+            } else if (!WORD_START.test(token)) {
+                this.referenceAfterHash = false;
+                this.referenceDefinedName = false;
+            } else if (this.referenceAfterHash) {
+                this.referenceAfterHash = false;
+                if (INCLUDE_DIRECTIVES.has(token)) {
+                    break;
+                }
+                this.referenceDefinedName = token === 'define' || token === 'undef';
+            } else if (this.referenceDefinedName) {
+                this.referenceDefinedName = false;
+            } else if (MACRO_STYLE_NAME.test(token)) {
+                this.references.add(token);
+                if (this.references.size > DATABASE_CONSTANTS.STREAM_REFERENCE_LIMIT) {
+                    this.references = null;
+                    return;
+                }
+            }
+            this.referenceLineStart = false;
+        }
+    }
+
+    private static count(text: string, char: string): number {
+        let count = 0;
+        for (let i = text.indexOf(char); i !== -1; i = text.indexOf(char, i + 1)) {
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * Classify the directives of a chunk. Joining and splitting their text copies it,
+     * so the kept strings no longer reference the (large) chunk string.
+     */
+    private flushPending(): void {
+        if (this.pending.length === 0) {
+            return;
+        }
+
+        const texts = this.pending.map(directive => directive.text).join('\n').split('\n');
+        for (let i = 0; i < this.pending.length; i++) {
+            const line = this.pending[i].line;
+            const conditional = ConditionStack.parseDirective(texts[i], line);
+            if (conditional) {
+                this.conditionals.push(conditional);
+            } else if (!texts[i].startsWith('#') || DEFINITION_DIRECTIVE.test(texts[i])) {
+                this.definitions.push({ line, text: texts[i] });
+            }
+        }
+        this.pending = [];
+    }
+
+    /**
+     * Blank comments in one line, carrying an open block comment over to the next line
+     */
+    private stripComments(line: string): string {
+        if (!this.inBlockComment && line.indexOf('/') === -1) {
+            return line;
+        }
+
+        let result = '';
+        let segmentStart = 0;
+        let i = 0;
+        while (i < line.length) {
+            if (this.inBlockComment) {
+                const close = line.indexOf('*/', i);
+                if (close === -1) {
+                    return result;
+                }
+                this.inBlockComment = false;
+                i = close + 2;
+                segmentStart = i;
+                result += ' ';
+                continue;
+            }
+
+            const char = line[i];
+            if (char === '"' || char === '\'') {
+                i = StreamingParser.skipLiteral(line, i);
+            } else if (char === '/' && line[i + 1] === '*') {
+                result += line.substring(segmentStart, i);
+                this.inBlockComment = true;
+                i += 2;
+            } else if (char === '/' && line[i + 1] === '/') {
+                return result + line.substring(segmentStart, i);
+            } else {
+                i++;
+            }
+        }
+        return result + line.substring(segmentStart);
+    }
+
+    /**
+     * Index after a string or character literal on one line; unterminated quotes are skipped
+     */
+    private static skipLiteral(line: string, start: number): number {
+        const quote = line[start];
+        for (let i = start + 1; i < line.length; i++) {
+            if (line[i] === '\\') {
+                i++;
+            } else if (line[i] === quote) {
+                return i + 1;
+            }
+        }
+        return start + 1;
+    }
+
+    /**
+     * Parse the kept directives in batches, replaying conditional directives in between
+     */
+    private build(filePath: string): ParsedSource {
+        const guardLine = ConditionStack.findIncludeGuardFollowedBy(this.conditionals, this.guardFollower);
+        const conditions = new ConditionStack(guardLine);
+        const result: ParsedSource = {
+            defs: [], undefs: [], includes: [], directives: this.conditionals, guardLine,
+            references: this.references ? Array.from(this.references) : [MacroParser.ANY_REFERENCE]
+        };
+
+        let batch: string[] = [];
+        let batchLines: number[] = [];
+        let batchSize = 0;
+        const flush = () => {
+            if (batch.length === 0) {
+                return;
+            }
+            const parsed = MacroParser.parseSource(batch.join('\n'), filePath, { conditions, commentsRemoved: true });
+            for (const def of parsed.defs) {
+                result.defs.push({ ...def, line: batchLines[def.line - 1] + 1 });
+            }
+            for (const undef of parsed.undefs) {
+                result.undefs.push({ ...undef, line: batchLines[undef.line - 1] + 1 });
+            }
+            for (const include of parsed.includes) {
+                result.includes.push({ ...include, line: batchLines[include.line - 1] + 1 });
+            }
+            batch = [];
+            batchLines = [];
+            batchSize = 0;
+        };
+
+        let next = 0;
+        for (const definition of this.definitions) {
+            while (next < this.conditionals.length && this.conditionals[next].line < definition.line) {
+                flush();
+                conditions.apply(this.conditionals[next++]);
+            }
+            batch.push(definition.text);
+            batchLines.push(definition.line);
+            batchSize += definition.text.length;
+            if (batchSize >= BATCH_SIZE) {
+                flush();
+            }
+        }
+        flush();
+
+        MacroParser.assignEndLines(result.defs, result.undefs);
+        return result;
+    }
+}
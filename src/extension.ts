@@ -2,11 +2,14 @@
 import * as vscode from 'vscode';
 import { MacroDatabase, MacroDef } from './core/macroDb';
 import { MacroExpander } from './core/macroExpander';
+import { IndexMaintenance } from './core/indexMaintenance';
 import { MacroHoverProvider } from './features/hoverProvider';
 import { MacroDiagnostics } from './features/diagnostics';
 import { MacroTreeProvider } from './features/treeProvider';
+import { MacroReferenceProvider } from './features/referenceProvider';
+import { ExpansionDocumentProvider } from './features/expansionDocumentProvider';
 import { Configuration } from './configuration';
-import { FILE_PATTERNS } from './utils/constants';
+import { GlobMatcher } from './utils/globMatcher';
 
 let treeProvider: MacroTreeProvider;
 let diagnostics: MacroDiagnostics;
@@ -15,6 +18,7 @@ let expander: MacroExpander;
 let config: Configuration;
 let hoverProvider: MacroHoverProvider | null = null;
 let hoverProviderDisposables: vscode.Disposable[] = [];
+let fileWatcherDisposables: vscode.Disposable[] = [];
 
 export async function activate(context: vscode.ExtensionContext) {
     console.log('MacroLens activating...');
@@ -50,9 +54,10 @@ export async function activate(context: vscode.ExtensionContext) {
 
 async function checkForCppFiles(): Promise<boolean> {
     try {
+        const { includeGlob, excludeGlobs } = Configuration.getInstance().getConfig();
         const files = await vscode.workspace.findFiles(
-            FILE_PATTERNS.C_CPP_GLOB,
-            FILE_PATTERNS.EXCLUDE_PATTERNS,
+            includeGlob,
+            GlobMatcher.join(excludeGlobs),
             1 // Only check for existence, limit to 1 file
         );
         return files.length > 0;
@@ -61,6 +66,32 @@ async function checkForCppFiles(): Promise<boolean> {
     }
 }
 
+/**
+ * Full project scan after activation, with its progress in the status bar
+ */
+async function indexProject(): Promise<void> {
+    try {
+        // Macro expansion requires global knowledge of all definitions
+        await macroDb.scanProject(false, vscode.ProgressLocation.Window);
+        
+        // Get scan results for user feedback
+        const allMacros = macroDb.getAllDefinitions();
+        const totalMacros = Array.from(allMacros.values()).reduce((sum, defs) => sum + defs.length, 0);
+        
+        vscode.window.showInformationMessage(
+            `MacroLens: Initialization completed - Found ${totalMacros} macro definitions`
+        );
+        
+        // Show database type info
+        if (macroDb.isUsingInMemory()) {
+            vscode.window.showInformationMessage('MacroLens: Using in-memory storage (native database unavailable)');
+        }
+    } catch (error) {
+        console.error('MacroLens initialization error:', error);
+        vscode.window.showErrorMessage(`MacroLens: Failed to initialize - ${error}. Extension will continue with limited functionality.`);
+    }
+}
+
 function registerBasicCommands(context: vscode.ExtensionContext): void {
     // Register minimal commands that work without database
     context.subscriptions.push(
@@ -78,7 +109,7 @@ function registerBasicCommands(context: vscode.ExtensionContext): void {
             }
             
             try {
-                macroDb.initialize(context);
+                await macroDb.initialize(context);
                 // Force rebuild on manual rescan
                 await macroDb.scanProject(true);
                 vscode.window.showInformationMessage('MacroLens: Project rescan completed successfully');
@@ -102,33 +133,22 @@ function registerBasicCommands(context: vscode.ExtensionContext): void {
 }
 
 async function initializeMacroLens(context: vscode.ExtensionContext): Promise<void> {
+    let initialized = false;
     try {
         // Initialize database with extension context
-        macroDb.initialize(context);
-
-        // Always perform full project scan for proper macro analysis
-        // Macro expansion requires global knowledge of all definitions
-        await macroDb.scanProject();
-        
-        // Get scan results for user feedback
-        const allMacros = macroDb.getAllDefinitions();
-        const totalMacros = Array.from(allMacros.values()).reduce((sum, defs) => sum + defs.length, 0);
-        
-        vscode.window.showInformationMessage(
-            `MacroLens: Initialization completed - Found ${totalMacros} macro definitions`
-        );
-        
-        // Show database type info
-        if (macroDb.isUsingInMemory()) {
-            vscode.window.showInformationMessage('MacroLens: Using in-memory storage (native database unavailable)');
-        }
+        await macroDb.initialize(context);
+        initialized = true;
     } catch (error) {
         console.error('MacroLens initialization error:', error);
         vscode.window.showErrorMessage(`MacroLens: Failed to initialize - ${error}. Extension will continue with limited functionality.`);
     }
 
+    // Vacuum, analyze and check the index file while the editor is idle
+    context.subscriptions.push(new IndexMaintenance(macroDb));
+
     // Initialize tree provider
     treeProvider = new MacroTreeProvider(expander, config);
+    context.subscriptions.push(treeProvider);
 
     // Register the tree view
     const treeView = vscode.window.createTreeView('macrolensTree', {
@@ -156,38 +176,41 @@ async function initializeMacroLens(context: vscode.ExtensionContext): Promise<vo
             { scheme: 'file', language: 'cpp' },
             hoverProvider
         );
-        hoverProviderDisposables.push(cHoverDisposable, cppHoverDisposable);
-        context.subscriptions.push(cHoverDisposable, cppHoverDisposable);
+        hoverProviderDisposables.push(cHoverDisposable, cppHoverDisposable, hoverProvider);
+        context.subscriptions.push(cHoverDisposable, cppHoverDisposable, hoverProvider);
     }
 
+    // Expansions too large for the hover open as read-only documents
+    const expansionDocuments = ExpansionDocumentProvider.getInstance();
+    context.subscriptions.push(
+        vscode.workspace.registerTextDocumentContentProvider(ExpansionDocumentProvider.SCHEME, expansionDocuments),
+        expansionDocuments
+    );
+
+    // Find All References is answered from the reference index
+    const referenceProvider = new MacroReferenceProvider();
+    context.subscriptions.push(
+        vscode.languages.registerReferenceProvider({ scheme: 'file', language: 'c' }, referenceProvider),
+        vscode.languages.registerReferenceProvider({ scheme: 'file', language: 'cpp' }, referenceProvider)
+    );
+
     // Initialize diagnostics if enabled
     if (config.getConfig().enableDiagnostics) {
         diagnostics = new MacroDiagnostics();
         context.subscriptions.push(diagnostics);
     }
 
-    // Watch for file changes
-    const watcher = vscode.workspace.createFileSystemWatcher('**/*.{c,cpp,cc,h,hpp,hh}');
-    context.subscriptions.push(
-        watcher,
-        watcher.onDidCreate(async (uri) => {
-            // Incremental scan for new files
-            macroDb.queueFileForScan(uri);
-        }),
-        watcher.onDidChange(async (uri) => {
-            // Incremental scan for changed files
-            macroDb.queueFileForScan(uri);
-        }),
-        watcher.onDidDelete(async (uri) => {
-            // Remove deleted file from database
-            await macroDb.removeFile(uri);
-        })
-    );
+    // Watch for file changes; recreated when includeGlob changes
+    watchFiles();
+    context.subscriptions.push({ dispose: () => disposeFileWatchers() });
 
     // Register document event handlers
     context.subscriptions.push(
         // Only analyze the active document when it changes
         vscode.workspace.onDidChangeTextDocument(async e => {
+            // Keep definitions of unsaved buffers current before anything queries them
+            macroDb.updateOverlay(e);
+
             if (!diagnostics) { return; }
             
             const focusOnly = config.getConfig().diagnosticsFocusOnly;
@@ -230,7 +253,13 @@ async function initializeMacroLens(context: vscode.ExtensionContext): Promise<vo
             if (!diagnostics) { return; }
             
             // When DB updates, we should re-analyze open documents because
-            // macros they use might have changed (e.g. in a header file)
+            // macros they use might have changed (e.g. in a header file).
+            // The reference index narrows this to documents using a changed macro;
+            // unsaved documents are not indexed and are always re-analyzed.
+            const affected = await macroDb.getAffectedFiles(uri);
+            const isAffected = (doc: vscode.TextDocument) =>
+                (doc.languageId === 'c' || doc.languageId === 'cpp') &&
+                (!affected || doc.isDirty || affected.has(doc.uri.fsPath));
             
             const focusOnly = config.getConfig().diagnosticsFocusOnly;
             
@@ -238,22 +267,30 @@ async function initializeMacroLens(context: vscode.ExtensionContext): Promise<vo
                 // Only re-analyze if it's the active document
                 if (vscode.window.activeTextEditor) {
                     const doc = vscode.window.activeTextEditor.document;
-                    if (doc.languageId === 'c' || doc.languageId === 'cpp') {
+                    if (isAffected(doc)) {
                         await diagnostics.analyze(doc);
                     }
                 }
             } else {
-                // Re-analyze all open C/C++ documents
+                // Re-analyze the affected open C/C++ documents
                 // This is important if a header file changed
                 vscode.workspace.textDocuments.forEach(doc => {
-                    if (doc.languageId === 'c' || doc.languageId === 'cpp') {
+                    if (isAffected(doc)) {
                         diagnostics.analyze(doc);
                     }
                 });
             }
         }),
 
+        // Persist the already parsed unsaved definitions instead of re-reading the file
+        vscode.workspace.onDidSaveTextDocument(async doc => {
+            await macroDb.commitOverlay(doc);
+        }),
+
         vscode.workspace.onDidCloseTextDocument(doc => {
+            // Unsaved edits are abandoned when a dirty document is closed
+            macroDb.discardOverlay(doc.uri);
+
             if (diagnostics && doc.languageId === 'c' || doc.languageId === 'cpp') {
                 // Clear diagnostics when file is closed
                 diagnostics.clearDiagnostics(doc);
@@ -393,8 +430,18 @@ async function initializeMacroLens(context: vscode.ExtensionContext): Promise<vo
             await openMacroDefinitionFromHover(macroArg);
         }),
 
+        vscode.commands.registerCommand('macrolens.openExpansion', async (args) => {
+            if (!args?.uri) {
+                vscode.window.showWarningMessage('MacroLens: No expansion specified');
+                return;
+            }
+            const document = await vscode.workspace.openTextDocument(vscode.Uri.parse(args.uri));
+            await vscode.window.showTextDocument(document, { preview: true });
+        }),
+
         // Show statistics command
         vscode.commands.registerCommand('macrolens.showStatistics', async () => {
+            await macroDb.measureIndex();
             const stats = macroDb.getStatistics();
             
             // Helper to format bytes to human readable
@@ -412,6 +459,15 @@ async function initializeMacroLens(context: vscode.ExtensionContext): Promise<vo
                 '### Memory Usage',
                 `**Definitions Map**: ${stats.memoryUsage.definitionsMapSize} unique macros, ${stats.memoryUsage.totalDefinitions} total definitions (${formatBytes(stats.memoryUsage.definitionsMapBytes)})`,
             ];
+
+            const indexLines = stats.index ? [
+                '',
+                '### Index File',
+                `**Size**: ${formatBytes(stats.index.sizeBytes)}`,
+                `**Free Space**: ${formatBytes(stats.index.freeBytes)} (${(stats.index.sizeBytes > 0 ? stats.index.freeBytes / stats.index.sizeBytes * 100 : 0).toFixed(1)}% fragmentation)`,
+                `**Last Maintenance**: ${stats.index.lastMaintenance ? new Date(stats.index.lastMaintenance).toLocaleString() : 'not yet this session'}`,
+                `**Integrity Check**: ${stats.index.integrity ?? 'pending'}`,
+            ] : [];
             
 
             
@@ -426,6 +482,7 @@ async function initializeMacroLens(context: vscode.ExtensionContext): Promise<vo
                 `**Average Scan Time**: ${stats.averageScanTime.toFixed(2)}ms`,
                 '',
                 ...memoryLines,
+                ...indexLines,
                 '',
                 '### Debounce Settings',
                 `**Response Delay**: ${stats.debounceSettings.delay}ms`,
@@ -472,8 +529,8 @@ async function initializeMacroLens(context: vscode.ExtensionContext): Promise<vo
                         { scheme: 'file', language: 'cpp' },
                         hoverProvider
                     );
-                    hoverProviderDisposables = [cHoverDisposable, cppHoverDisposable];
-                    context.subscriptions.push(cHoverDisposable, cppHoverDisposable);
+                    hoverProviderDisposables = [cHoverDisposable, cppHoverDisposable, hoverProvider];
+                    context.subscriptions.push(cHoverDisposable, cppHoverDisposable, hoverProvider);
                     vscode.window.showInformationMessage('MacroLens: Hover provider enabled');
                 } else {
                     // Dispose all hover providers
@@ -518,8 +575,37 @@ async function initializeMacroLens(context: vscode.ExtensionContext): Promise<vo
                 macroDb.updateConfigurationSettings();
                 vscode.window.showInformationMessage('MacroLens: Debounce settings updated');
             }
+
+            // Re-filter conditional definitions (the database notifies listeners itself)
+            if (e.affectsConfiguration('macrolens.activeConfiguration') ||
+                e.affectsConfiguration('macrolens.scopeToIncludes')) {
+                macroDb.updateConfigurationSettings();
+            }
+            if (e.affectsConfiguration('macrolens.compileCommandsPath')) {
+                macroDb.loadCompileCommands();
+            }
+            if (e.affectsConfiguration('macrolens.streamingThreshold') ||
+                e.affectsConfiguration('macrolens.maxFileSize')) {
+                macroDb.updateConfigurationSettings();
+            }
+            // Index newly included files and drop newly excluded ones
+            if (e.affectsConfiguration('macrolens.includeGlob') ||
+                e.affectsConfiguration('macrolens.excludeGlobs') ||
+                e.affectsConfiguration('macrolens.useGitignore')) {
+                if (e.affectsConfiguration('macrolens.includeGlob')) {
+                    watchFiles();
+                }
+                macroDb.updateConfigurationSettings();
+                await macroDb.scanProject(false);
+            }
         })
     );
+
+    // Index the project in the background: hover, diagnostics and the tree view are
+    // registered and answer from what is indexed so far
+    if (initialized) {
+        indexProject();
+    }
 }
 
 async function openMacroDefinitionFromHover(macroName: string): Promise<void> {
@@ -569,10 +655,50 @@ async function revealMacroDefinition(def: MacroDef): Promise<void> {
     editor.revealRange(new vscode.Range(position, position), vscode.TextEditorRevealType.InCenter);
 }
 
+/**
+ * (Re)create the watchers for source files matching includeGlob and for the compilation database
+ */
+function watchFiles() {
+    disposeFileWatchers();
+
+    // Excluded files are filtered by queueFileForScan
+    const watcher = vscode.workspace.createFileSystemWatcher(config.getConfig().includeGlob);
+    fileWatcherDisposables.push(
+        watcher,
+        watcher.onDidCreate(async (uri) => {
+            // Incremental scan for new files
+            macroDb.queueFileForScan(uri);
+        }),
+        watcher.onDidChange(async (uri) => {
+            // Incremental scan for changed files
+            macroDb.queueFileForScan(uri);
+        }),
+        watcher.onDidDelete(async (uri) => {
+            // Remove deleted file from database
+            await macroDb.removeFile(uri);
+        })
+    );
+
+    // Reload command line definitions when the compilation database is regenerated
+    const compileCommandsWatcher = vscode.workspace.createFileSystemWatcher('**/compile_commands.json');
+    const reloadCompileCommands = () => macroDb.loadCompileCommands();
+    fileWatcherDisposables.push(
+        compileCommandsWatcher,
+        compileCommandsWatcher.onDidCreate(reloadCompileCommands),
+        compileCommandsWatcher.onDidChange(reloadCompileCommands),
+        compileCommandsWatcher.onDidDelete(reloadCompileCommands)
+    );
+}
+
+function disposeFileWatchers() {
+    fileWatcherDisposables.forEach(disposable => disposable.dispose());
+    fileWatcherDisposables = [];
+}
+
 export function deactivate() {
     try {
         if (hoverProvider) {
-            // hoverProvider.dispose();
+            hoverProvider.dispose();
         }
         if (diagnostics) {
             diagnostics.dispose();
@@ -1,15 +1,147 @@
 import * as vscode from 'vscode';
-import { MacroDatabase } from '../core/macroDb';
+import { MacroDatabase, MacroDef } from '../core/macroDb';
 import { MacroParser } from '../core/macroParser';
 import { MacroUtils } from '../utils/macroUtils';
-import { MacroExpander } from '../core/macroExpander';
-import { REGEX_PATTERNS, BUILTIN_IDENTIFIERS } from '../utils/constants';
+import { MacroExpander, ExpansionResult } from '../core/macroExpander';
+import { BUILTIN_IDENTIFIERS } from '../utils/constants';
 import { Configuration } from '../configuration';
 
+/**
+ * Identifier of the analyzed text
+ * Lookups about it are filled in by the table on first request and shared by all rules.
+ */
+interface CallSite {
+    name: string;
+    start: number;
+    parenIndex: number;      // Index of the '(' following the name, -1 when not a call
+    isMacroName: boolean;    // Uppercase name, as REGEX_PATTERNS.MACRO_NAME matches
+    position?: vscode.Position;
+    defs?: MacroDef[];
+    args?: { args: string[]; endIndex: number } | null;
+    insideDefineBody?: boolean;
+}
+
+/**
+ * Call sites of one document
+ * The text is tokenized once, and each site is resolved against the database and its
+ * arguments parsed at most once, however many rules look at it.
+ */
+class CallSiteTable {
+    private static readonly IDENTIFIER = /\b[A-Za-z_]\w*/g;
+    private static readonly CALL_PAREN = /\s*\(/y;
+    private static readonly MACRO_NAME = /^[A-Z_][A-Z0-9_]*$/;
+    private directiveLines?: number[];
+
+    constructor(
+        readonly document: vscode.TextDocument,
+        private source: string,     // Document text, with all its directives
+        readonly text: string,      // Cleaned text the rules analyze
+        private db: MacroDatabase
+    ) {}
+
+    *walk(): Generator<CallSite> {
+        const identifier = new RegExp(CallSiteTable.IDENTIFIER);
+        const callParen = new RegExp(CallSiteTable.CALL_PAREN);
+        let match;
+        while ((match = identifier.exec(this.text))) {
+            callParen.lastIndex = identifier.lastIndex;
+            yield {
+                name: match[0],
+                start: match.index,
+                parenIndex: callParen.test(this.text) ? callParen.lastIndex - 1 : -1,
+                isMacroName: CallSiteTable.MACRO_NAME.test(match[0])
+            };
+        }
+    }
+
+    positionOf(site: CallSite): vscode.Position {
+        return site.position ??= this.document.positionAt(site.start);
+    }
+
+    nameRange(site: CallSite): vscode.Range {
+        const pos = this.positionOf(site);
+        return new vscode.Range(pos, pos.translate(0, site.name.length));
+    }
+
+    locationOf(site: CallSite): { file: string; line: number } {
+        return { file: this.document.uri.fsPath, line: this.positionOf(site).line + 1 };
+    }
+
+    /**
+     * Definitions live at the site
+     */
+    definitionsAt(site: CallSite): MacroDef[] {
+        return site.defs ??= this.db.getDefinitionsAt(site.name, this.document.uri.fsPath, this.positionOf(site).line + 1);
+    }
+
+    argumentsOf(site: CallSite): { args: string[]; endIndex: number } | null {
+        if (site.args === undefined) {
+            site.args = MacroUtils.extractArguments(this.text, site.parenIndex);
+        }
+        return site.args;
+    }
+
+    isInsideDefineBody(site: CallSite): boolean {
+        return site.insideDefineBody ??= MacroParser.isInsideDefineBody(this.text, site.start);
+    }
+
+    /**
+     * Index of the stretch of lines holding the site, stretches being delimited by the
+     * #define and #undef directives of the document
+     * Definitions only change with the line at those directives, so whatever is looked up
+     * for a call holds for the same call anywhere in its stretch.
+     */
+    directiveSpanOf(site: CallSite): number {
+        if (!this.directiveLines) {
+            this.directiveLines = [];
+            for (const match of this.source.matchAll(/^[ \t]*#[ \t]*(?:define|undef)\b/gm)) {
+                this.directiveLines.push(this.document.positionAt(match.index!).line);
+            }
+        }
+
+        // Directives at or before the site's line
+        const line = this.positionOf(site).line;
+        let low = 0;
+        let high = this.directiveLines.length;
+        while (low < high) {
+            const mid = (low + high) >>> 1;
+            if (this.directiveLines[mid] <= line) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low;
+    }
+}
+
+/**
+ * Diagnostic check fed by the call-site walk
+ * Rules see every identifier in text order, then get a last call to report what
+ * depends on the whole document.
+ */
+interface DiagnosticRule {
+    readonly diagnostics: vscode.Diagnostic[];
+    visit?(site: CallSite): void;
+    finish?(): void;
+}
+
+/**
+ * Diagnostics of one document, valid while neither the document nor the definitions change
+ */
+interface DocumentDiagnostics {
+    version: number;
+    generation: number;
+    indexing: boolean;      // Computed while the project was being indexed
+    diagnostics: vscode.Diagnostic[];
+}
+
 export class MacroDiagnostics {
     private diagnosticCollection: vscode.DiagnosticCollection;
     private db: MacroDatabase;
     private expander: MacroExpander;
+    private cache = new Map<string, DocumentDiagnostics>();
+    private disposables: vscode.Disposable[] = [];
     // Debounce timer to avoid frequent diagnostics
     private debounceTimer: NodeJS.Timeout | null = null;
     private maxWaitTimer: NodeJS.Timeout | null = null;
@@ -19,9 +151,25 @@ export class MacroDiagnostics {
         this.diagnosticCollection = vscode.languages.createDiagnosticCollection('macrolens');
         this.db = MacroDatabase.getInstance();
         this.expander = new MacroExpander();
+
+        this.disposables.push(
+            vscode.workspace.onDidChangeConfiguration(e => {
+                if (e.affectsConfiguration('macrolens')) {
+                    this.cache.clear();
+                }
+            }),
+            vscode.workspace.onDidCloseTextDocument(document => this.cache.delete(document.uri.toString()))
+        );
     }
 
     async analyze(document: vscode.TextDocument): Promise<void> {
+        // Unchanged document and definitions (e.g. switching back to an editor):
+        // the last result is published again without waiting for the debounce
+        if (this.republish(document)) {
+            this.pendingDocs.delete(document);
+            return;
+        }
+
         // Add to pending set
         this.pendingDocs.add(document);
 
@@ -76,10 +224,30 @@ export class MacroDiagnostics {
         }
     }
 
+    /**
+     * Publish the cached diagnostics of a document if they are still valid
+     */
+    private republish(document: vscode.TextDocument): boolean {
+        const entry = this.cache.get(document.uri.toString());
+        if (!entry ||
+            entry.version !== document.version ||
+            entry.generation !== this.db.getGeneration() ||
+            entry.indexing !== this.db.isIndexing()) {
+            return false;
+        }
+        this.diagnosticCollection.set(document.uri, entry.diagnostics);
+        return true;
+    }
+
     private async analyzeImmediate(document: vscode.TextDocument): Promise<void> {
         if (document.languageId !== 'c' && document.languageId !== 'cpp') {
             return;
         }
+        if (this.republish(document)) {
+            return;
+        }
+        const generation = this.db.getGeneration();
+        const indexing = this.db.isIndexing();
 
         // Process text with whitespace placeholders to preserve positions
         // Order is important: comments first, then preprocessor, then parameters
@@ -90,631 +258,515 @@ export class MacroDiagnostics {
             )
         );
 
-        const diagnostics: vscode.Diagnostic[] = [];
-
-        // Step 1: Check for argument count mismatches in function-like macro calls
-        this.checkArgumentCountMismatches(document, cleanText, diagnostics);
-
-        // Step 2: Check for unbalanced parentheses in macro definitions (must run before expansion checks)
-        this.checkUnbalancedParentheses(document, cleanText, diagnostics);
-
-        // Step 3: Check for undefined macros and expansion results
-        // This unified approach checks both:
-        // - Whether macros themselves are defined
-        // - Whether their expansion results contain undefined macros
-        this.checkUndefinedMacrosInExpansions(document, cleanText, diagnostics);
-
-        // Step 4: Check for multiple definitions
-        this.checkMultipleDefinitions(document, cleanText, diagnostics);
+        const sites = new CallSiteTable(document, originalText, cleanText, this.db);
+        const rules: DiagnosticRule[] = [
+            // Argument count mismatches in function-like macro calls
+            this.argumentCountRule(sites),
+            // Unbalanced parentheses in macro definitions
+            this.unbalancedParenthesesRule(sites),
+            // Undefined macros and expansion results
+            // Skipped while the project is being indexed: most macros are not known yet, and the
+            // document is analyzed again when the scan completes
+            ...(indexing ? [] : [this.undefinedMacroRule(sites)]),
+            // Multiple definitions
+            this.multipleDefinitionsRule(sites)
+        ];
+
+        // One walk over the identifiers feeds every rule
+        const visitors = rules.filter(rule => rule.visit);
+        for (const site of sites.walk()) {
+            for (const rule of visitors) {
+                rule.visit!(site);
+            }
+        }
+        for (const rule of rules) {
+            rule.finish?.();
+        }
 
+        // Rules report in their declaration order
+        const diagnostics = rules.flatMap(rule => rule.diagnostics);
+        this.cache.set(document.uri.toString(), { version: document.version, generation, indexing, diagnostics });
         this.diagnosticCollection.set(document.uri, diagnostics);
     }
 
     /**
-     * Check for undefined macros through expansion results
+     * Undefined macros, checked through expansion results
      * This unified approach checks:
      * 1. Whether macros themselves are defined
      * 2. Whether their expansion results contain undefined macros
+     *
+     * Function-like calls are checked as they are visited; object-like candidates wait
+     * for the end of the walk, since they are skipped when the name is called anywhere
+     * in the document or when they sit inside a call's arguments.
      */
-    private checkUndefinedMacrosInExpansions(
-        document: vscode.TextDocument,
-        cleanText: string,
-        diagnostics: vscode.Diagnostic[]
-    ): void {
+    private undefinedMacroRule(sites: CallSiteTable): DiagnosticRule {
+        const diagnostics: vscode.Diagnostic[] = [];
         const checkedMacros = new Set<string>();
         const macroArgRanges: {start: number, end: number}[] = [];
-        
-        // Part 1: Check function-like macro calls (only uppercase identifiers)
-        let match;
-        REGEX_PATTERNS.FUNCTION_LIKE_MACRO_CALL.lastIndex = 0;
-
-        while ((match = REGEX_PATTERNS.FUNCTION_LIKE_MACRO_CALL.exec(cleanText))) {
-            const macroName = match[1];
-            const callStartIndex = match.index;
-            const parenStartIndex = match.index + match[0].length - 1;
-
-            // Skip built-in identifiers
-            if (BUILTIN_IDENTIFIERS.has(macroName)) {
-                continue;
-            }
-
-            // Mark as checked to avoid duplicate checks in object-like pass
-            checkedMacros.add(macroName);
-
-            // Get macro definition
-            const defs = this.db.getDefinitions(macroName);
-            
-            // Check if macro itself is undefined
-            if (defs.length === 0) {
-                const pos = document.positionAt(callStartIndex);
-                const range = new vscode.Range(
-                    pos,
-                    pos.translate(0, macroName.length)
-                );
-
-                // Simplified diagnostic - suggestions will be shown in hover
-                const diagnostic = new vscode.Diagnostic(
-                    range,
-                    `Undefined macro '${macroName}'`,
-                    vscode.DiagnosticSeverity.Warning
-                );
-                diagnostic.source = 'MacroLens';
-                diagnostic.code = 'undefined-macro';
-
-                diagnostics.push(diagnostic);
-                continue;
-            }
-
-            // Skip non-macro definitions (typedef, struct, enum, union)
-            if (defs[0].isDefine === false) {
-                continue;
-            }
-
-            // Extract arguments from the call
-            const argsResult = MacroUtils.extractArguments(cleanText, parenStartIndex);
-            if (!argsResult) {
-                continue;
-            }
-
-            const { args, endIndex } = argsResult;
-            
-            // Store the argument range to skip object-like macro checks inside it
-            // Range is from after '(' to before ')'
-            macroArgRanges.push({
-                start: parenStartIndex + 1,
-                end: endIndex - 1
-            });
-
-            // Expand the macro and check for undefined macros in the result
-            const expansionResult = this.expander.expand(macroName, args);
+        const objectLikeCandidates: CallSite[] = [];
+
+        const report = (site: CallSite, message: string, severity: vscode.DiagnosticSeverity, code: string) => {
+            // Simplified diagnostic - suggestions will be shown in hover
+            const diagnostic = new vscode.Diagnostic(sites.nameRange(site), message, severity);
+            diagnostic.source = 'MacroLens';
+            diagnostic.code = code;
+            diagnostics.push(diagnostic);
+        };
+
+        // Expand the macro and check for undefined macros in the result
+        // Identical calls between the same directives expand alike, so each is expanded once
+        const expansions = new Map<string, ExpansionResult>();
+        const checkExpansion = (site: CallSite, args: string[] | undefined) => {
+            const key = `${sites.directiveSpanOf(site)}\0${site.name}${args ? '(' + args.join('\0') : ''}`;
+            let expansionResult = expansions.get(key);
+            if (!expansionResult) {
+                expansionResult = this.expander.expand(site.name, args, { ...sites.locationOf(site), recordSteps: false });
+                expansions.set(key, expansionResult);
+            }
+            const macroName = site.name;
 
             // Check for unbalanced parentheses errors
-            if (expansionResult.hasErrors && 
-                expansionResult.errorMessage && 
+            if (expansionResult.hasErrors &&
+                expansionResult.errorMessage &&
                 expansionResult.errorMessage.includes('unbalanced parentheses')) {
-                
+
                 // Skip if this is a #define statement (not a macro call)
                 // We only want to report usage errors, not definition errors
-                const pos = document.positionAt(callStartIndex);
-                const line = document.lineAt(pos.line);
-                const isDefineLine = /^\s*#\s*define\s+/.test(line.text);
-                
-                if (!isDefineLine) {
-                    const range = new vscode.Range(
-                        pos,
-                        pos.translate(0, macroName.length)
-                    );
-
+                const line = sites.document.lineAt(sites.positionOf(site).line);
+                if (!/^\s*#\s*define\s+/.test(line.text)) {
                     // Extract the unbalanced macro name from error message
                     const unbalancedMatch = expansionResult.errorMessage.match(/Macro '(\w+)'/);
                     const unbalancedMacroName = unbalancedMatch ? unbalancedMatch[1] : 'unknown';
-
-                    const diagnostic = new vscode.Diagnostic(
-                        range,
+                    report(site,
                         `Macro '${macroName}' expands to '${unbalancedMacroName}' which has unbalanced parentheses`,
-                        vscode.DiagnosticSeverity.Error
-                    );
-                    diagnostic.source = 'MacroLens';
-                    diagnostic.code = 'unbalanced-parentheses-usage';
-
-                    diagnostics.push(diagnostic);
+                        vscode.DiagnosticSeverity.Error, 'unbalanced-parentheses-usage');
                 }
-                continue; // Skip further checks for this macro
+                return; // Skip further checks for this macro
             }
 
             if (expansionResult.undefinedMacros && expansionResult.undefinedMacros.size > 0) {
-                const pos = document.positionAt(callStartIndex);
-                const range = new vscode.Range(
-                    pos,
-                    pos.translate(0, macroName.length)
-                );
-
-                // Simplified diagnostic - suggestions will be shown in hover
                 const undefinedList = Array.from(expansionResult.undefinedMacros).join(', ');
-
-                const diagnostic = new vscode.Diagnostic(
-                    range,
+                report(site,
                     `Macro '${macroName}' expands to undefined macro${expansionResult.undefinedMacros.size > 1 ? 's' : ''}: ${undefinedList}`,
-                    vscode.DiagnosticSeverity.Warning
-                );
-                diagnostic.source = 'MacroLens';
-                diagnostic.code = 'macro-expansion-undefined';
-
-                diagnostics.push(diagnostic);
+                    vscode.DiagnosticSeverity.Warning, 'macro-expansion-undefined');
             }
-        }
+        };
 
-        // Part 2: Check object-like macros (without parentheses)
-        REGEX_PATTERNS.OBJECT_LIKE_MACRO.lastIndex = 0;
+        return {
+            diagnostics,
 
-        while ((match = REGEX_PATTERNS.OBJECT_LIKE_MACRO.exec(cleanText))) {
-            const macroName = match[1];
-            const callStartIndex = match.index;
+            // Function-like macro calls (only uppercase identifiers)
+            visit: site => {
+                if (!site.isMacroName || BUILTIN_IDENTIFIERS.has(site.name)) {
+                    return;
+                }
+                if (site.parenIndex === -1) {
+                    if (site.name.length > 1) {
+                        objectLikeCandidates.push(site);
+                    }
+                    return;
+                }
 
-            // Skip built-in identifiers
-            if (BUILTIN_IDENTIFIERS.has(macroName)) {
-                continue;
-            }
+                // Mark as checked to avoid duplicate checks in object-like pass
+                checkedMacros.add(site.name);
 
-            // Skip if already checked as function-like macro
-            if (checkedMacros.has(macroName)) {
-                continue;
-            }
+                // Check if macro itself is undefined
+                const defs = sites.definitionsAt(site);
+                if (defs.length === 0) {
+                    report(site, `Undefined macro '${site.name}'`, vscode.DiagnosticSeverity.Warning, 'undefined-macro');
+                    return;
+                }
 
-            // Skip if this token is inside a #define body
-            // Let expansion checking handle it instead (more accurate)
-            if (MacroParser.isInsideDefineBody(cleanText, callStartIndex)) {
-                continue;
-            }
+                // Skip non-macro definitions (typedef, struct, enum, union)
+                if (defs[0].isDefine === false) {
+                    return;
+                }
 
-            // CRITICAL: Skip if inside function-like macro arguments
-            // Example: FOO(BAR) - BAR will be checked via FOO's expansion
-            // Optimized: Use pre-calculated ranges instead of re-scanning
-            let isInsideArg = false;
-            for (const range of macroArgRanges) {
-                if (callStartIndex >= range.start && callStartIndex <= range.end) {
-                    isInsideArg = true;
-                    break;
+                const argsResult = sites.argumentsOf(site);
+                if (!argsResult) {
+                    return;
                 }
-            }
-            if (isInsideArg) {
-                continue;
-            }
 
-            // Skip struct/union member access (e.g. obj.MEMBER or ptr->MEMBER)
-            if (this.isMemberAccess(cleanText, callStartIndex)) {
-                continue;
-            }
+                // Store the argument range to skip object-like macro checks inside it
+                // Range is from after '(' to before ')'
+                macroArgRanges.push({
+                    start: site.parenIndex + 1,
+                    end: argsResult.endIndex - 1
+                });
+
+                checkExpansion(site, argsResult.args);
+            },
+
+            // Object-like macros (without parentheses)
+            finish: () => {
+                // Candidates and argument ranges are both in text order, so the ranges
+                // starting before a candidate are consumed once across all candidates
+                let nextRange = 0;
+                let argsEnd = -1;
+
+                for (const site of objectLikeCandidates) {
+                    while (nextRange < macroArgRanges.length && macroArgRanges[nextRange].start <= site.start) {
+                        argsEnd = Math.max(argsEnd, macroArgRanges[nextRange++].end);
+                    }
 
-            // Skip if it looks like a variable declaration (e.g. int VAL;)
-            if (this.isDeclaration(cleanText, callStartIndex)) {
-                continue;
-            }
+                    // Skip if already checked as function-like macro
+                    if (checkedMacros.has(site.name)) {
+                        continue;
+                    }
 
-            // Get macro definition
-            const defs = this.db.getDefinitions(macroName);
-            
-            // Check if macro itself is undefined
-            if (defs.length === 0) {
-                const pos = document.positionAt(callStartIndex);
-                const range = new vscode.Range(
-                    pos,
-                    pos.translate(0, macroName.length)
-                );
-
-                // Simplified diagnostic - suggestions will be shown in hover
-                const diagnostic = new vscode.Diagnostic(
-                    range,
-                    `Undefined macro '${macroName}'`,
-                    vscode.DiagnosticSeverity.Warning
-                );
-                diagnostic.source = 'MacroLens';
-                diagnostic.code = 'undefined-macro';
-
-                diagnostics.push(diagnostic);
-                continue;
-            }
+                    // Skip if this token is inside a #define body
+                    // Let expansion checking handle it instead (more accurate)
+                    if (sites.isInsideDefineBody(site)) {
+                        continue;
+                    }
 
-            // Skip non-macro definitions (typedef, struct, enum, union)
-            if (defs[0].isDefine === false) {
-                continue;
-            }
+                    // CRITICAL: Skip if inside function-like macro arguments
+                    // Example: FOO(BAR) - BAR will be checked via FOO's expansion
+                    if (site.start <= argsEnd) {
+                        continue;
+                    }
 
-            // Skip function-like macros (they need parentheses)
-            if (defs[0].params && defs[0].params.length > 0) {
-                continue;
-            }
+                    // Skip struct/union member access (e.g. obj.MEMBER or ptr->MEMBER)
+                    if (this.isMemberAccess(sites.text, site.start)) {
+                        continue;
+                    }
 
-            // Expand the macro and check for undefined macros in the result
-            const expansionResult = this.expander.expand(macroName);
+                    // Skip if it looks like a variable declaration (e.g. int VAL;)
+                    if (this.isDeclaration(sites.text, site.start)) {
+                        continue;
+                    }
 
-            // Check for unbalanced parentheses errors
-            if (expansionResult.hasErrors && 
-                expansionResult.errorMessage && 
-                expansionResult.errorMessage.includes('unbalanced parentheses')) {
-                
-                // Skip if this is a #define statement (not a macro call)
-                // We only want to report usage errors, not definition errors
-                const pos = document.positionAt(callStartIndex);
-                const line = document.lineAt(pos.line);
-                const isDefineLine = /^\s*#\s*define\s+/.test(line.text);
-                
-                if (!isDefineLine) {
-                    const range = new vscode.Range(
-                        pos,
-                        pos.translate(0, macroName.length)
-                    );
+                    // Check if macro itself is undefined
+                    const defs = sites.definitionsAt(site);
+                    if (defs.length === 0) {
+                        report(site, `Undefined macro '${site.name}'`, vscode.DiagnosticSeverity.Warning, 'undefined-macro');
+                        continue;
+                    }
 
-                    // Extract the unbalanced macro name from error message
-                    const unbalancedMatch = expansionResult.errorMessage.match(/Macro '(\w+)'/);
-                    const unbalancedMacroName = unbalancedMatch ? unbalancedMatch[1] : 'unknown';
+                    // Skip non-macro definitions (typedef, struct, enum, union)
+                    if (defs[0].isDefine === false) {
+                        continue;
+                    }
 
-                    const diagnostic = new vscode.Diagnostic(
-                        range,
-                        `Macro '${macroName}' expands to '${unbalancedMacroName}' which has unbalanced parentheses`,
-                        vscode.DiagnosticSeverity.Error
-                    );
-                    diagnostic.source = 'MacroLens';
-                    diagnostic.code = 'unbalanced-parentheses-usage';
+                    // Skip function-like macros (they need parentheses)
+                    if (defs[0].params && defs[0].params.length > 0) {
+                        continue;
+                    }
 
-                    diagnostics.push(diagnostic);
+                    checkExpansion(site, undefined);
                 }
-                continue; // Skip further checks for this macro
-            }
-
-            if (expansionResult.undefinedMacros && expansionResult.undefinedMacros.size > 0) {
-                const pos = document.positionAt(callStartIndex);
-                const range = new vscode.Range(
-                    pos,
-                    pos.translate(0, macroName.length)
-                );
-
-                // Simplified diagnostic - suggestions will be shown in hover
-                const undefinedList = Array.from(expansionResult.undefinedMacros).join(', ');
-
-                const diagnostic = new vscode.Diagnostic(
-                    range,
-                    `Macro '${macroName}' expands to undefined macro${expansionResult.undefinedMacros.size > 1 ? 's' : ''}: ${undefinedList}`,
-                    vscode.DiagnosticSeverity.Warning
-                );
-                diagnostic.source = 'MacroLens';
-                diagnostic.code = 'macro-expansion-undefined';
-
-                diagnostics.push(diagnostic);
             }
-        }
+        };
     }
 
     /**
-     * Check for argument count mismatches in function-like macro calls
+     * Argument count mismatches in function-like macro calls
      * Handles variadic macros (..., __VA_ARGS__) correctly
      */
-    private checkArgumentCountMismatches(
-        document: vscode.TextDocument,
-        cleanText: string,
-        diagnostics: vscode.Diagnostic[]
-    ): void {
-        // Find all function-like macro calls: MACRO_NAME(args)
-        const macroCallPattern = /\b([A-Za-z_]\w*)\s*\(/g;
-        let match;
+    private argumentCountRule(sites: CallSiteTable): DiagnosticRule {
+        const diagnostics: vscode.Diagnostic[] = [];
 
-        while ((match = macroCallPattern.exec(cleanText))) {
-            const macroName = match[1];
-            const callStartIndex = match.index;
-            const parenStartIndex = match.index + match[0].length - 1;
+        return {
+            diagnostics,
+            visit: site => {
+                const macroName = site.name;
 
-            // Skip built-in identifiers
-            if (BUILTIN_IDENTIFIERS.has(macroName)) {
-                continue;
-            }
+                // Only calls, skipping built-in identifiers
+                if (site.parenIndex === -1 || BUILTIN_IDENTIFIERS.has(macroName)) {
+                    return;
+                }
 
-            // Get macro definition
-            const defs = this.db.getDefinitions(macroName);
-            if (defs.length === 0) {
-                continue; // Already handled by undefined macro check
-            }
+                // Get the macro definition live at the call site
+                const defs = sites.definitionsAt(site);
+                if (defs.length === 0) {
+                    return; // Already handled by undefined macro check
+                }
 
-            // Skip non-macro definitions
-            if (defs[0].isDefine === false) {
-                continue;
-            }
+                // Skip non-macro definitions
+                if (defs[0].isDefine === false) {
+                    return;
+                }
 
-            // Only check function-like macros (those with parameters)
-            const def = defs[0]; // Use first definition
-            if (!def.params || def.params.length === 0) {
-                continue;
-            }
+                // Only check function-like macros (those with parameters)
+                const def = defs[0]; // Use first definition
+                if (!def.params || def.params.length === 0) {
+                    return;
+                }
 
-            // Extract arguments from the call
-            const argsResult = MacroUtils.extractArguments(cleanText, parenStartIndex);
-            if (!argsResult) {
-                continue; // Malformed call, skip
-            }
+                // Extract arguments from the call
+                const argsResult = sites.argumentsOf(site);
+                if (!argsResult) {
+                    return; // Malformed call, skip
+                }
 
-            const { args } = argsResult;
-            
-            // Skip argument count validation if any argument contains __VA_ARGS__
-            // because __VA_ARGS__ will be expanded to an unknown number of arguments at preprocessing time
-            const hasVaArgs = args.some(arg => /\b__VA_ARGS__\b/.test(arg));
-            if (hasVaArgs) {
-                continue; // Cannot validate argument count when __VA_ARGS__ is present
-            }
-            
-            const callArgCount = args.length;
+                const { args } = argsResult;
 
-            // Determine if macro is variadic
-            const isVariadic = def.params.some(p => p.trim() === '...' || p.includes('...'));
-            
-            let expectedMinArgs: number;
-            let expectedMaxArgs: number | null; // null means unlimited
-            let isPureVariadic = false;
-
-            if (isVariadic) {
-                // Variadic macro: count non-variadic parameters
-                const nonVariadicParams = def.params.filter(p => p.trim() !== '...' && !p.includes('...'));
-                
-                // Pure variadic: #define FOO(...) or #define FOO(args...)
-                // These can accept 0 or more arguments
-                if (nonVariadicParams.length === 0) {
-                    isPureVariadic = true;
-                    expectedMinArgs = 0;
-                    expectedMaxArgs = null;
-                } else {
-                    // Mixed variadic: #define FOO(fmt, ...) or #define FOO(a, b, ...)
-                    // Standard C requires at least one variadic argument (to avoid trailing comma issue)
-                    // However, GNU C and C++20 allow empty __VA_ARGS__
-                    // We'll be lenient and only require fixed parameters
-                    expectedMinArgs = nonVariadicParams.length;
-                    expectedMaxArgs = null; // Unlimited arguments allowed
+                // Skip argument count validation if any argument contains __VA_ARGS__
+                // because __VA_ARGS__ will be expanded to an unknown number of arguments at preprocessing time
+                const hasVaArgs = args.some(arg => /\b__VA_ARGS__\b/.test(arg));
+                if (hasVaArgs) {
+                    return; // Cannot validate argument count when __VA_ARGS__ is present
                 }
-            } else {
-                // Non-variadic macro: exact parameter count required
-                expectedMinArgs = def.params.length;
-                expectedMaxArgs = def.params.length;
-            }
 
-            // Check argument count
-            let hasError = false;
-            let errorMessage = '';
-
-            if (callArgCount < expectedMinArgs) {
-                hasError = true;
-                if (isPureVariadic) {
-                    // This shouldn't happen since pure variadic has min 0
-                    errorMessage = `Macro '${macroName}' is variadic and accepts any number of arguments`;
-                } else if (isVariadic) {
-                    errorMessage = `Macro '${macroName}' requires at least ${expectedMinArgs} argument${expectedMinArgs !== 1 ? 's' : ''}, but ${callArgCount} provided`;
+                const callArgCount = args.length;
+
+                // Determine if macro is variadic
+                const isVariadic = def.params.some(p => p.trim() === '...' || p.includes('...'));
+
+                let expectedMinArgs: number;
+                let expectedMaxArgs: number | null; // null means unlimited
+                let isPureVariadic = false;
+
+                if (isVariadic) {
+                    // Variadic macro: count non-variadic parameters
+                    const nonVariadicParams = def.params.filter(p => p.trim() !== '...' && !p.includes('...'));
+
+                    // Pure variadic: #define FOO(...) or #define FOO(args...)
+                    // These can accept 0 or more arguments
+                    if (nonVariadicParams.length === 0) {
+                        isPureVariadic = true;
+                        expectedMinArgs = 0;
+                        expectedMaxArgs = null;
+                    } else {
+                        // Mixed variadic: #define FOO(fmt, ...) or #define FOO(a, b, ...)
+                        // Standard C requires at least one variadic argument (to avoid trailing comma issue)
+                        // However, GNU C and C++20 allow empty __VA_ARGS__
+                        // We'll be lenient and only require fixed parameters
+                        expectedMinArgs = nonVariadicParams.length;
+                        expectedMaxArgs = null; // Unlimited arguments allowed
+                    }
                 } else {
-                    errorMessage = `Macro '${macroName}' requires exactly ${expectedMinArgs} argument${expectedMinArgs !== 1 ? 's' : ''}, but ${callArgCount} provided`;
+                    // Non-variadic macro: exact parameter count required
+                    expectedMinArgs = def.params.length;
+                    expectedMaxArgs = def.params.length;
                 }
-            } else if (expectedMaxArgs !== null && callArgCount > expectedMaxArgs) {
-                hasError = true;
-                errorMessage = `Macro '${macroName}' requires exactly ${expectedMaxArgs} argument${expectedMaxArgs !== 1 ? 's' : ''}, but ${callArgCount} provided`;
-            }
-
-            if (hasError) {
-                // Position is now directly available since we use whitespace placeholders
-                const pos = document.positionAt(callStartIndex);
-                const range = new vscode.Range(
-                    pos,
-                    pos.translate(0, macroName.length)
-                );
-
-                const diagnostic = new vscode.Diagnostic(
-                    range,
-                    errorMessage,
-                    vscode.DiagnosticSeverity.Error
-                );
-                diagnostic.source = 'MacroLens';
-                diagnostic.code = 'macro-argument-count';
-
-                diagnostics.push(diagnostic);
-            }
-        }
-    }
-
-    /**
-     * Escape special regex characters in a string
-     */
-    private escapeRegex(str: string): string {
-        return str.replace(/[.*+?^${}()|[\]\\]/g, '\\$&');
-    }
 
-    /**
-     * Check for multiple definitions of the same macro
-     */
-    private checkMultipleDefinitions(
-        document: vscode.TextDocument,
-        cleanText: string,
-        diagnostics: vscode.Diagnostic[]
-    ): void {
-        const seenMacros = new Set<string>();
-        
-        // Find all macro usages (both function-like and object-like)
-        let match;
-        REGEX_PATTERNS.MACRO_NAME.lastIndex = 0;
-
-        while ((match = REGEX_PATTERNS.MACRO_NAME.exec(cleanText))) {
-            const macroName = match[0];
-            const matchIndex = match.index;
-            
-            // Skip if we've already checked this macro
-            if (seenMacros.has(macroName)) {
-                continue;
-            }
-            seenMacros.add(macroName);
-            
-            // Skip built-in preprocessor identifiers
-            if (BUILTIN_IDENTIFIERS.has(macroName)) {
-                continue;
-            }
-
-            // Skip if this token is adjacent to ## (token concatenation)
-            if (MacroParser.isAdjacentToTokenPaste(cleanText, matchIndex, macroName.length)) {
-                continue;
-            }
-
-            // Skip if this token is inside a #define body
-            if (MacroParser.isInsideDefineBody(cleanText, matchIndex)) {
-                continue;
-            }
-
-            const defs = this.db.getDefinitions(macroName);
-
-            // Skip if this is not a #define macro (typedef, struct, enum, union, etc.)
-            if (defs.length > 0 && defs[0].isDefine === false) {
-                continue;
-            }
-            
-            // Check for multiple definitions
-            if (defs.length > 1) {
-                // Find all positions of this macro in cleanText (positions are now accurate)
-                const positions: number[] = [];
-                const macroRegex = new RegExp(`\\b${this.escapeRegex(macroName)}\\b`, 'g');
-                let match;
-                
-                while ((match = macroRegex.exec(cleanText)) !== null) {
-                    const position = match.index;
-                    // Skip if inside #define body (checked by MacroParser)
-                    if (!MacroParser.isInsideDefineBody(cleanText, position)) {
-                        positions.push(position);
+                // Check argument count
+                let hasError = false;
+                let errorMessage = '';
+
+                if (callArgCount < expectedMinArgs) {
+                    hasError = true;
+                    if (isPureVariadic) {
+                        // This shouldn't happen since pure variadic has min 0
+                        errorMessage = `Macro '${macroName}' is variadic and accepts any number of arguments`;
+                    } else if (isVariadic) {
+                        errorMessage = `Macro '${macroName}' requires at least ${expectedMinArgs} argument${expectedMinArgs !== 1 ? 's' : ''}, but ${callArgCount} provided`;
+                    } else {
+                        errorMessage = `Macro '${macroName}' requires exactly ${expectedMinArgs} argument${expectedMinArgs !== 1 ? 's' : ''}, but ${callArgCount} provided`;
                     }
+                } else if (expectedMaxArgs !== null && callArgCount > expectedMaxArgs) {
+                    hasError = true;
+                    errorMessage = `Macro '${macroName}' requires exactly ${expectedMaxArgs} argument${expectedMaxArgs !== 1 ? 's' : ''}, but ${callArgCount} provided`;
                 }
-                
-                const locations = defs.map(def => `${def.file}:${def.line}`).join(', ');
-                
-                for (const position of positions) {
-                    const pos = document.positionAt(position);
-                    const range = new vscode.Range(
-                        pos,
-                        pos.translate(0, macroName.length)
-                    );
 
+                if (hasError) {
+                    // Position is now directly available since we use whitespace placeholders
                     const diagnostic = new vscode.Diagnostic(
-                        range,
-                        `Macro '${macroName}' has ${defs.length} definitions (${locations})`,
-                        vscode.DiagnosticSeverity.Information
+                        sites.nameRange(site),
+                        errorMessage,
+                        vscode.DiagnosticSeverity.Error
                     );
                     diagnostic.source = 'MacroLens';
-                    diagnostic.code = 'macro-redefinition';
+                    diagnostic.code = 'macro-argument-count';
 
                     diagnostics.push(diagnostic);
                 }
             }
-        }
+        };
     }
 
     /**
-     * Check for unbalanced parentheses in macro definitions
-     * This checks the body content directly from source code
-     * AND checks usages of macros that have unbalanced parentheses
+     * Multiple definitions of the same macro
+     * Occurrences are gathered per name during the walk; each name is then judged from
+     * its first occurrence, as before, and reported at every occurrence.
      */
-    private checkUnbalancedParentheses(
-        document: vscode.TextDocument,
-        cleanText: string,
-        diagnostics: vscode.Diagnostic[]
-    ): void {
-        const lines = cleanText.split(/\r?\n/);
-        let currentLine = 0;
-
-        for (let i = 0; i < lines.length; i++) {
-            const line = lines[i];
-            currentLine = i;
-
-            // Match #define directives
-            // Use a more lenient regex that captures everything after the macro name
-            // This allows us to detect unbalanced parentheses
-            const defineMatch = line.match(/^\s*#\s*define\s+([A-Za-z_]\w*)(.*)/);
-            if (!defineMatch) {
-                continue;
-            }
-
-            const macroName = defineMatch[1];
-            const restOfLine = defineMatch[2];
-            let body = restOfLine.trim();
-
-            // Handle multi-line macros with backslash continuation
-            let j = i;
-            while (j < lines.length) {
-                const currentLineRaw = lines[j];
-                const trimmedLine = currentLineRaw.trimEnd();
-                if (!trimmedLine.endsWith('\\')) {
-                    break;
+    private multipleDefinitionsRule(sites: CallSiteTable): DiagnosticRule {
+        const diagnostics: vscode.Diagnostic[] = [];
+        // Find all macro usages (both function-like and object-like), first occurrence first
+        const occurrences = new Map<string, CallSite[]>();
+
+        return {
+            diagnostics,
+            visit: site => {
+                if (!site.isMacroName) {
+                    return;
                 }
-                
-                if (j + 1 >= lines.length) {
-                    break;
+                const list = occurrences.get(site.name);
+                if (list) {
+                    list.push(site);
+                } else {
+                    occurrences.set(site.name, [site]);
                 }
-                
-                j++;
-                const nextLine = lines[j].trim();
-                
-                if (j === i + 1) {
-                    body = body.trimEnd();
-                    if (body.endsWith('\\')) {
-                        body = body.slice(0, -1).trimEnd();
+            },
+            finish: () => {
+                for (const [macroName, list] of occurrences) {
+                    const first = list[0];
+
+                    // Skip built-in preprocessor identifiers
+                    if (BUILTIN_IDENTIFIERS.has(macroName)) {
+                        continue;
+                    }
+
+                    // Skip if this token is adjacent to ## (token concatenation)
+                    if (MacroParser.isAdjacentToTokenPaste(sites.text, first.start, macroName.length)) {
+                        continue;
+                    }
+
+                    // Skip if this token is inside a #define body
+                    if (sites.isInsideDefineBody(first)) {
+                        continue;
+                    }
+
+                    // Definitions visible from this file (scoped to its includes when enabled)
+                    const defs = sites.definitionsAt(first);
+
+                    // Skip if this is not a #define macro (typedef, struct, enum, union, etc.)
+                    if (defs.length > 0 && defs[0].isDefine === false) {
+                        continue;
+                    }
+
+                    // Check for multiple definitions
+                    if (defs.length > 1) {
+                        const locations = defs.map(def => `${def.file}:${def.line}`).join(', ');
+
+                        for (const site of list) {
+                            // Skip if inside #define body (checked by MacroParser)
+                            if (sites.isInsideDefineBody(site)) {
+                                continue;
+                            }
+
+                            const diagnostic = new vscode.Diagnostic(
+                                sites.nameRange(site),
+                                `Macro '${macroName}' has ${defs.length} definitions (${locations})`,
+                                vscode.DiagnosticSeverity.Information
+                            );
+                            diagnostic.source = 'MacroLens';
+                            diagnostic.code = 'macro-redefinition';
+
+                            diagnostics.push(diagnostic);
+                        }
                     }
                 }
-                
-                body += ' ' + nextLine;
             }
+        };
+    }
 
-            // Check 1: Parser detected unbalanced parentheses in parameter list (from database)
-            // This is a syntax error - function-like macro with malformed parameter list
-            const defs = this.db.getDefinitions(macroName);
-            // Find the definition for this specific file and line (1-indexed)
-            const currentFilePath = document.uri.fsPath;
-            const currentLineNumber = currentLine + 1; // Convert to 1-indexed
-            const currentDef = defs.find(d => 
-                d.file === currentFilePath && d.line === currentLineNumber
-            );
-            const hasUnbalancedMarker = currentDef && currentDef.body.startsWith('/*UNBALANCED*/');
-            
-            // Check 2: Direct body content analysis (may be false positive for valid object-like macros)
-            const isBodyUnbalanced = !this.hasBalancedParentheses(body);
-
-            // Report appropriate severity based on error type
-            if (hasUnbalancedMarker) {
-                // Error: Parameter list has unbalanced parentheses (syntax error)
-                const macroNameIndex = line.indexOf(macroName);
-                if (macroNameIndex !== -1) {
-                    const startPos = new vscode.Position(currentLine, macroNameIndex);
-                    const endPos = new vscode.Position(currentLine, macroNameIndex + macroName.length);
-                    const range = new vscode.Range(startPos, endPos);
+    /**
+     * Unbalanced parentheses in macro definitions
+     * This checks the body content directly from source code, line by line over the
+     * #define directives, so it only runs once the walk is done
+     */
+    private unbalancedParenthesesRule(sites: CallSiteTable): DiagnosticRule {
+        const diagnostics: vscode.Diagnostic[] = [];
 
-                    const diagnostic = new vscode.Diagnostic(
-                        range,
-                        `Macro '${macroName}' has unbalanced parentheses in parameter list`,
-                        vscode.DiagnosticSeverity.Error
-                    );
-                    diagnostic.source = 'MacroLens';
-                    diagnostic.code = 'unbalanced-parentheses';
+        return {
+            diagnostics,
+            finish: () => {
+                const document = sites.document;
+                const lines = sites.text.split(/\r?\n/);
+                let currentLine = 0;
+
+                for (let i = 0; i < lines.length; i++) {
+                    const line = lines[i];
+                    currentLine = i;
+
+                    // Match #define directives
+                    // Use a more lenient regex that captures everything after the macro name
+                    // This allows us to detect unbalanced parentheses
+                    const defineMatch = line.match(/^\s*#\s*define\s+([A-Za-z_]\w*)(.*)/);
+                    if (!defineMatch) {
+                        continue;
+                    }
 
-                    diagnostics.push(diagnostic);
-                }
-            } else if (isBodyUnbalanced) {
-                // Warning: Body has unbalanced parentheses (may be intentional for object-like macros)
-                const macroNameIndex = line.indexOf(macroName);
-                if (macroNameIndex !== -1) {
-                    const startPos = new vscode.Position(currentLine, macroNameIndex);
-                    const endPos = new vscode.Position(currentLine, macroNameIndex + macroName.length);
-                    const range = new vscode.Range(startPos, endPos);
+                    const macroName = defineMatch[1];
+                    const restOfLine = defineMatch[2];
+                    let body = restOfLine.trim();
+
+                    // Handle multi-line macros with backslash continuation
+                    let j = i;
+                    while (j < lines.length) {
+                        const currentLineRaw = lines[j];
+                        const trimmedLine = currentLineRaw.trimEnd();
+                        if (!trimmedLine.endsWith('\\')) {
+                            break;
+                        }
+
+                        if (j + 1 >= lines.length) {
+                            break;
+                        }
+
+                        j++;
+                        const nextLine = lines[j].trim();
+
+                        if (j === i + 1) {
+                            body = body.trimEnd();
+                            if (body.endsWith('\\')) {
+                                body = body.slice(0, -1).trimEnd();
+                            }
+                        }
+
+                        body += ' ' + nextLine;
+                    }
 
-                    const diagnostic = new vscode.Diagnostic(
-                        range,
-                        `Macro '${macroName}' has unbalanced parentheses in body`,
-                        vscode.DiagnosticSeverity.Warning
+                    // Check 1: Parser detected unbalanced parentheses in parameter list (from database)
+                    // This is a syntax error - function-like macro with malformed parameter list
+                    const defs = this.db.getDefinitions(macroName);
+                    // Find the definition for this specific file and line (1-indexed)
+                    const currentFilePath = document.uri.fsPath;
+                    const currentLineNumber = currentLine + 1; // Convert to 1-indexed
+                    const currentDef = defs.find(d =>
+                        d.file === currentFilePath && d.line === currentLineNumber
                     );
-                    diagnostic.source = 'MacroLens';
-                    diagnostic.code = 'unbalanced-parentheses-body';
+                    const hasUnbalancedMarker = currentDef && currentDef.body.startsWith('/*UNBALANCED*/');
+
+                    // Check 2: Direct body content analysis (may be false positive for valid object-like macros)
+                    const isBodyUnbalanced = !this.hasBalancedParentheses(body);
+
+                    // Report appropriate severity based on error type
+                    if (hasUnbalancedMarker) {
+                        // Error: Parameter list has unbalanced parentheses (syntax error)
+                        const macroNameIndex = line.indexOf(macroName);
+                        if (macroNameIndex !== -1) {
+                            const startPos = new vscode.Position(currentLine, macroNameIndex);
+                            const endPos = new vscode.Position(currentLine, macroNameIndex + macroName.length);
+                            const range = new vscode.Range(startPos, endPos);
+
+                            const diagnostic = new vscode.Diagnostic(
+                                range,
+                                `Macro '${macroName}' has unbalanced parentheses in parameter list`,
+                                vscode.DiagnosticSeverity.Error
+                            );
+                            diagnostic.source = 'MacroLens';
+                            diagnostic.code = 'unbalanced-parentheses';
+
+                            diagnostics.push(diagnostic);
+                        }
+                    } else if (isBodyUnbalanced) {
+                        // Warning: Body has unbalanced parentheses (may be intentional for object-like macros)
+                        const macroNameIndex = line.indexOf(macroName);
+                        if (macroNameIndex !== -1) {
+                            const startPos = new vscode.Position(currentLine, macroNameIndex);
+                            const endPos = new vscode.Position(currentLine, macroNameIndex + macroName.length);
+                            const range = new vscode.Range(startPos, endPos);
+
+                            const diagnostic = new vscode.Diagnostic(
+                                range,
+                                `Macro '${macroName}' has unbalanced parentheses in body`,
+                                vscode.DiagnosticSeverity.Warning
+                            );
+                            diagnostic.source = 'MacroLens';
+                            diagnostic.code = 'unbalanced-parentheses-body';
+
+                            diagnostics.push(diagnostic);
+                        }
+                    }
 
-                    diagnostics.push(diagnostic);
+                    // Skip the lines we already processed in multi-line macro
+                    i = j;
                 }
             }
-
-            // Skip the lines we already processed in multi-line macro
-            i = j;
-        }
+        };
     }
 
     /**
@@ -773,6 +825,8 @@ export class MacroDiagnostics {
             clearTimeout(this.debounceTimer);
             this.debounceTimer = null;
         }
+        this.disposables.forEach(disposable => disposable.dispose());
+        this.cache.clear();
         this.diagnosticCollection.dispose();
     }
 
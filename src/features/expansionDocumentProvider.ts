@@ -0,0 +1,128 @@
+import * as vscode from 'vscode';
+import { HOVER_CONSTANTS } from '../utils/constants';
+
+interface StoredExpansion {
+    text: string;
+    loaded: number;     // Characters provided to the document so far
+    scheduled: boolean; // The next page is about to be added
+}
+
+/**
+ * Read-only documents showing expansions too large for a hover
+ *
+ * The hover keeps the expanded text here and links to a document for it. The document
+ * starts with the first page and grows by one page per update while it is visible, so
+ * the editor shows something at once and never has to take hundreds of KB in one go.
+ * Expansions whose documents are open are never evicted.
+ */
+export class ExpansionDocumentProvider implements vscode.TextDocumentContentProvider, vscode.Disposable {
+    static readonly SCHEME = 'macrolens-expansion';
+
+    private static instance: ExpansionDocumentProvider;
+    private expansions = new Map<string, StoredExpansion>();
+    private nextId = 1;
+    private changeEmitter = new vscode.EventEmitter<vscode.Uri>();
+    readonly onDidChange = this.changeEmitter.event;
+    private visibilityListener: vscode.Disposable;
+
+    private constructor() {
+        // Documents opened in the background load the rest of their pages once shown
+        this.visibilityListener = vscode.window.onDidChangeVisibleTextEditors(editors => {
+            for (const editor of editors) {
+                if (editor.document.uri.scheme === ExpansionDocumentProvider.SCHEME) {
+                    this.scheduleNextPage(editor.document.uri);
+                }
+            }
+        });
+    }
+
+    static getInstance(): ExpansionDocumentProvider {
+        if (!ExpansionDocumentProvider.instance) {
+            ExpansionDocumentProvider.instance = new ExpansionDocumentProvider();
+        }
+        return ExpansionDocumentProvider.instance;
+    }
+
+    /**
+     * URI of a new expansion document; its text is only kept once a hover linking to it
+     * is shown (see keep), so prefetched hovers never push out stored expansions
+     */
+    createUri(macroName: string): vscode.Uri {
+        const id = String(this.nextId++);
+        // The .cpp extension gives the document C++ highlighting
+        return vscode.Uri.from({ scheme: ExpansionDocumentProvider.SCHEME, path: `/${macroName} expansion.cpp`, query: id });
+    }
+
+    /**
+     * Keep the expansion of a hover being shown available, as the newest
+     */
+    keep(uri: vscode.Uri, text: string): void {
+        const expansion = this.expansions.get(uri.query) ?? { text, loaded: 0, scheduled: false };
+        this.expansions.delete(uri.query);
+        this.expansions.set(uri.query, expansion);
+        this.evict();
+    }
+
+    provideTextDocumentContent(uri: vscode.Uri): string {
+        const expansion = this.expansions.get(uri.query);
+        if (!expansion) {
+            return '// This expansion is no longer available; hover the macro again to open it.';
+        }
+        expansion.loaded = Math.min(expansion.text.length, Math.max(expansion.loaded, HOVER_CONSTANTS.EXPANSION_PAGE_SIZE));
+        this.scheduleNextPage(uri);
+        return expansion.text.substring(0, expansion.loaded);
+    }
+
+    /**
+     * Add the next page once the current one is shown; documents not visible in an
+     * editor wait until they are
+     */
+    private scheduleNextPage(uri: vscode.Uri): void {
+        const expansion = this.expansions.get(uri.query);
+        if (!expansion || expansion.scheduled || expansion.loaded === 0 || expansion.loaded >= expansion.text.length) {
+            return;
+        }
+        expansion.scheduled = true;
+        setTimeout(() => {
+            expansion.scheduled = false;
+            if (this.expansions.get(uri.query) !== expansion || !ExpansionDocumentProvider.isVisible(uri)) {
+                return;
+            }
+            expansion.loaded = Math.min(expansion.text.length, expansion.loaded + HOVER_CONSTANTS.EXPANSION_PAGE_SIZE);
+            this.changeEmitter.fire(uri);
+        }, 0);
+    }
+
+    private static isVisible(uri: vscode.Uri): boolean {
+        return vscode.window.visibleTextEditors.some(editor => editor.document.uri.toString() === uri.toString());
+    }
+
+    /**
+     * Drop the oldest expansions beyond MAX_STORED_EXPANSIONS, skipping those whose
+     * documents are open (they may still be loading)
+     */
+    private evict(): void {
+        let excess = this.expansions.size - HOVER_CONSTANTS.MAX_STORED_EXPANSIONS;
+        if (excess <= 0) {
+            return;
+        }
+        const open = new Set(vscode.workspace.textDocuments
+            .filter(document => document.uri.scheme === ExpansionDocumentProvider.SCHEME)
+            .map(document => document.uri.query));
+        for (const oldest of Array.from(this.expansions.keys())) {
+            if (excess === 0) {
+                break;
+            }
+            if (!open.has(oldest)) {
+                this.expansions.delete(oldest);
+                excess--;
+            }
+        }
+    }
+
+    dispose(): void {
+        this.visibilityListener.dispose();
+        this.changeEmitter.dispose();
+        this.expansions.clear();
+    }
+}
@@ -1,19 +1,70 @@
 import * as vscode from 'vscode';
 import { MacroDatabase } from '../core/macroDb';
-import { MacroExpander } from '../core/macroExpander';
+import { ExpansionLimit, MacroExpander } from '../core/macroExpander';
 import { MacroUtils } from '../utils/macroUtils';
 import { MacroParser } from '../core/macroParser';
 import { Configuration } from '../configuration';
-import { SUGGESTION_CONSTANTS } from '../utils/constants';
-
-export class MacroHoverProvider implements vscode.HoverProvider {
+import { HOVER_CONSTANTS, SUGGESTION_CONSTANTS } from '../utils/constants';
+import { ExpansionDocumentProvider } from './expansionDocumentProvider';
+
+/**
+ * Hover for a macro call, with the expansion its link opens (if any) so that the link
+ * keeps working when the hover is shown again from the cache
+ */
+interface ResolvedHover {
+    hover: vscode.Hover | undefined;
+    expansion?: { uri: vscode.Uri; text: string };
+    partial?: boolean;  // Incomplete (time budget, or an undefined name while prefetching), so computed again next time
+    // Undefined names in the expansion whose suggestions a prefetch did not look up
+    unsuggested?: string[];
+}
+
+/**
+ * Hovers of one document, valid while neither the document nor the definitions change
+ */
+interface DocumentHoverCache {
+    version: number;
+    generation: number;
+    hovers: Map<string, Promise<ResolvedHover>>;  // By macro call span
+}
+
+export class MacroHoverProvider implements vscode.HoverProvider, vscode.Disposable {
     private expander: MacroExpander;
     private db: MacroDatabase;
     private config: Configuration;
+    private cache = new Map<string, DocumentHoverCache>();
+    private disposables: vscode.Disposable[] = [];
+    private prefetchTimer: NodeJS.Timeout | undefined;
+    private prefetchPass = 0;
+
+    private static readonly TRUNCATION_REASONS: Record<ExpansionLimit, string> = {
+        depth: 'maximum expansion depth reached (`macrolens.maxExpansionDepth`)',
+        steps: 'maximum number of substitutions reached (`macrolens.maxExpansionSteps`)',
+        length: 'expanded text too long (`macrolens.maxExpansionLength`)',
+        time: 'time limit reached (`macrolens.expansionTimeout`)'
+    };
+
     constructor() {
         this.db = MacroDatabase.getInstance();
         this.expander = new MacroExpander();
         this.config = Configuration.getInstance();
+
+        // Prefetch once the view settles; any change cancels a pass in progress
+        const schedulePrefetch = () => this.schedulePrefetch();
+        this.disposables.push(
+            vscode.window.onDidChangeTextEditorVisibleRanges(schedulePrefetch),
+            vscode.window.onDidChangeActiveTextEditor(schedulePrefetch),
+            vscode.workspace.onDidChangeTextDocument(schedulePrefetch),
+            this.db.onDidChange(schedulePrefetch),
+            vscode.workspace.onDidChangeConfiguration(e => {
+                if (e.affectsConfiguration('macrolens')) {
+                    this.cache.clear();
+                    schedulePrefetch();
+                }
+            }),
+            vscode.workspace.onDidCloseTextDocument(document => this.cache.delete(document.uri.toString()))
+        );
+        this.schedulePrefetch();
     }
 
 
@@ -22,8 +73,21 @@ export class MacroHoverProvider implements vscode.HoverProvider {
         document: vscode.TextDocument,
         position: vscode.Position
     ): Promise<vscode.Hover | undefined> {
-        const line = document.lineAt(position);
-        
+        const resolved = await this.hoverAt(document, position);
+        if (resolved?.expansion) {
+            ExpansionDocumentProvider.getInstance().keep(resolved.expansion.uri, resolved.expansion.text);
+        }
+        return resolved?.hover;
+    }
+
+    /**
+     * Hover at a position, computed once per macro call for a document version and
+     * definition generation
+     * @param prefetch Computed ahead of time: symbol lookups for suggestions are left to
+     * the hover that is actually shown
+     */
+    private async hoverAt(document: vscode.TextDocument, position: vscode.Position, prefetch: boolean = false): Promise<ResolvedHover | undefined> {
+
         // First get the current word as fallback
         const wordRange = document.getWordRangeAtPosition(position);
         const currentWord = wordRange ? document.getText(wordRange) : '';
@@ -59,17 +123,140 @@ export class MacroHoverProvider implements vscode.HoverProvider {
         if (!macroName) {
             return undefined;
         }
-        
-        const defs = this.db.getDefinitions(macroName);
+
+        // Every position inside the same macro call shows the same hover
+        let key: string | undefined;
+        if (macroMatch.start !== undefined && macroMatch.end !== undefined) {
+            key = `${startOffset + macroMatch.start}:${startOffset + macroMatch.end}`;
+        } else if (wordRange) {
+            key = `${document.offsetAt(wordRange.start)}:${document.offsetAt(wordRange.end)}`;
+        }
+        if (key === undefined) {
+            return this.resolveHover(document, position, wordRange, macroName, args, prefetch);
+        }
+        const hovers = this.hoversOf(document);
+        let resolved = hovers.get(key);
+        if (!resolved) {
+            resolved = this.cacheHover(hovers, key, this.resolveHover(document, position, wordRange, macroName, args, prefetch));
+        }
+        if (prefetch) {
+            return resolved;
+        }
+
+        // A prefetched hover gets its suggestions once it is shown
+        const result = await resolved;
+        if (!result.unsuggested) {
+            return result;
+        }
+        const completed = this.withSuggestions(result, result.unsuggested);
+        return hovers.get(key) === resolved ? this.cacheHover(hovers, key, completed) : completed;
+    }
+
+    private cacheHover(hovers: Map<string, Promise<ResolvedHover>>, key: string, pending: Promise<ResolvedHover>): Promise<ResolvedHover> {
+        hovers.set(key, pending);
+        // A result cut short by the time budget depends on the load of the moment
+        const forget = () => {
+            if (hovers.get(key) === pending) {
+                hovers.delete(key);
+            }
+        };
+        pending.then(result => result.partial && forget(), forget);
+        return pending;
+    }
+
+    private schedulePrefetch(): void {
+        this.prefetchPass++;
+        if (this.prefetchTimer) {
+            clearTimeout(this.prefetchTimer);
+        }
+        const pass = this.prefetchPass;
+        this.prefetchTimer = setTimeout(() => {
+            this.prefetchTimer = undefined;
+            // The first scan competes for the same thread; wait for it to finish
+            if (this.db.isIndexing()) {
+                this.schedulePrefetch();
+                return;
+            }
+            this.prefetchVisible(pass).catch(error => console.warn('MacroLens: Hover prefetch failed:', error));
+        }, HOVER_CONSTANTS.PREFETCH_DELAY);
+        this.prefetchTimer.unref?.();
+    }
+
+    /**
+     * Compute the hovers of the macros visible in the editors, so that the first hover
+     * on any of them comes from the cache
+     * Runs in short slices; a newer pass (the view, a document or the definitions
+     * changed) stops this one.
+     */
+    private async prefetchVisible(pass: number): Promise<void> {
+        let sliceStart = Date.now();
+        let prefetched = 0;
+        for (const editor of vscode.window.visibleTextEditors) {
+            const document = editor.document;
+            if (document.uri.scheme !== 'file' || (document.languageId !== 'c' && document.languageId !== 'cpp')) {
+                continue;
+            }
+            for (const range of editor.visibleRanges) {
+                for (let lineNumber = range.start.line; lineNumber <= range.end.line; lineNumber++) {
+                    for (const match of document.lineAt(lineNumber).text.matchAll(/[A-Za-z_]\w*/g)) {
+                        const defs = this.db.getDefinitionsAt(match[0], document.uri.fsPath, lineNumber + 1);
+                        if (defs.length === 0 || defs[0].isDefine === false) {
+                            continue;
+                        }
+                        if (prefetched++ >= HOVER_CONSTANTS.PREFETCH_LIMIT) {
+                            return;
+                        }
+                        await this.hoverAt(document, new vscode.Position(lineNumber, match.index!), true);
+                        if (Date.now() - sliceStart >= HOVER_CONSTANTS.PREFETCH_SLICE) {
+                            // Let hovers and other work run before the next slice
+                            await new Promise(resolve => setTimeout(resolve, 0));
+                            sliceStart = Date.now();
+                        }
+                        if (pass !== this.prefetchPass) {
+                            return;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    private hoversOf(document: vscode.TextDocument): Map<string, Promise<ResolvedHover>> {
+        const uri = document.uri.toString();
+        const generation = this.db.getGeneration();
+        let entry = this.cache.get(uri);
+        if (!entry || entry.version !== document.version || entry.generation !== generation) {
+            entry = { version: document.version, generation, hovers: new Map() };
+            this.cache.set(uri, entry);
+        }
+        return entry.hovers;
+    }
+
+    private async resolveHover(
+        document: vscode.TextDocument,
+        position: vscode.Position,
+        wordRange: vscode.Range | undefined,
+        macroName: string,
+        args: string[] | undefined,
+        prefetch: boolean
+    ): Promise<ResolvedHover> {
+        const line = document.lineAt(position);
+
+        // Resolve the definition live at this line (respects #undef and local redefinitions)
+        const location = { file: document.uri.fsPath, line: position.line + 1 };
+        const defs = this.db.getDefinitionsAt(macroName, location.file, location.line);
         
         if (defs.length === 0) {
-            // Show suggestions for undefined macros
-            return this.provideUndefinedMacroHover(macroName, wordRange);
+            // Show suggestions for undefined macros (looked up only for a shown hover)
+            if (prefetch) {
+                return { hover: undefined, partial: true };
+            }
+            return { hover: await this.provideUndefinedMacroHover(macroName, wordRange) };
         }
 
         // Skip if this is not a #define macro (typedef, struct, enum, union, etc.)
         if (defs[0].isDefine === false) {
-            return undefined;
+            return { hover: undefined };
         }
 
         const def = defs[0];
@@ -88,10 +275,10 @@ export class MacroHoverProvider implements vscode.HoverProvider {
             }
             content.appendMarkdown('\nThis macro has mismatched parentheses and cannot be expanded.');
             content.isTrusted = true;
-            return new vscode.Hover(content, wordRange);
+            return { hover: new vscode.Hover(content, wordRange) };
         }
         
-        const result = this.expander.expand(macroName, args);
+        const result = this.expander.expand(macroName, args, { ...location, definition: def, recordSteps: false });
         const content = new vscode.MarkdownString();
 
         // Show definition
@@ -111,7 +298,7 @@ export class MacroHoverProvider implements vscode.HoverProvider {
             content.appendMarkdown(`\n❌ **Expansion Error:**\n`);
             content.appendMarkdown(`${result.errorMessage}\n`);
             content.isTrusted = true;
-            return new vscode.Hover(content, wordRange);
+            return { hover: new vscode.Hover(content, wordRange) };
         }
 
         // Show warning if multiple definitions exist
@@ -126,8 +313,11 @@ export class MacroHoverProvider implements vscode.HoverProvider {
 
 
         // Show final result
-        content.appendMarkdown('\n**Final Result:**\n');
-        content.appendCodeblock(result.finalText, 'cpp');
+        content.appendMarkdown(result.truncated ? '\n**Partial Result:**\n' : '\n**Final Result:**\n');
+        const expansion = this.appendExpansionText(content, macroName, result.finalText);
+        if (result.truncated) {
+            content.appendMarkdown(`\n✂️ **Expansion truncated:** ${MacroHoverProvider.TRUNCATION_REASONS[result.truncated]}\n`);
+        }
 
         if (result.concatenatedMacros && result.concatenatedMacros.length > 0) {
             content.appendMarkdown('\n**Macros created via concatenation:**\n');
@@ -138,23 +328,9 @@ export class MacroHoverProvider implements vscode.HoverProvider {
         }
 
         // Provide suggestions for undefined macros in the expansion result
-        if (result.undefinedMacros && result.undefinedMacros.size > 0) {
-            const undefinedWithSuggestions: string[] = [];
-            for (const undefinedMacro of result.undefinedMacros) {
-                if (!this.shouldSuggestForName(undefinedMacro)) {
-                    continue;
-                }
-                // Use VS Code API for suggestions
-                const suggestions = await this.findSimilarSymbols(undefinedMacro);
-                if (suggestions.length > 0) {
-                    undefinedWithSuggestions.push(`  - \`${undefinedMacro}\`: Did you mean ${suggestions.map(s => `\`${s}\``).join(', ')}?`);
-                }
-            }
-            
-            if (undefinedWithSuggestions.length > 0) {
-                content.appendMarkdown('\n**Suggestions for undefined macros:**\n');
-                content.appendMarkdown(undefinedWithSuggestions.join('\n') + '\n');
-            }
+        const undefinedNames = Array.from(result.undefinedMacros ?? []).filter(name => this.shouldSuggestForName(name));
+        if (undefinedNames.length > 0 && !prefetch) {
+            await this.appendSuggestions(content, undefinedNames);
         }
 
         content.isTrusted = true;
@@ -166,10 +342,76 @@ export class MacroHoverProvider implements vscode.HoverProvider {
         const endPos = new vscode.Position(position.line, macroEndChar);
         const hoverRange = new vscode.Range(startPos, endPos);
 
-        return new vscode.Hover(content, hoverRange);
+        return {
+            hover: new vscode.Hover(content, hoverRange),
+            expansion,
+            partial: result.truncated === 'time',
+            unsuggested: prefetch && undefinedNames.length > 0 ? undefinedNames : undefined
+        };
+    }
+
+    /**
+     * A prefetched hover with the suggestions it left out
+     */
+    private async withSuggestions(resolved: ResolvedHover, names: string[]): Promise<ResolvedHover> {
+        const hover = resolved.hover!;
+        const content = new vscode.MarkdownString((hover.contents[0] as vscode.MarkdownString).value);
+        await this.appendSuggestions(content, names);
+        content.isTrusted = true;
+        return { ...resolved, hover: new vscode.Hover(content, hover.range), unsuggested: undefined };
     }
 
-    private findMacroAtPosition(lineText: string, character: number, currentWord: string): { macroName: string; args?: string[] } {
+    private async appendSuggestions(content: vscode.MarkdownString, undefinedMacros: string[]): Promise<void> {
+        const undefinedWithSuggestions: string[] = [];
+        for (const undefinedMacro of undefinedMacros) {
+            // Use VS Code API for suggestions
+            const suggestions = await this.findSimilarSymbols(undefinedMacro);
+            if (suggestions.length > 0) {
+                undefinedWithSuggestions.push(`  - \`${undefinedMacro}\`: Did you mean ${suggestions.map(s => `\`${s}\``).join(', ')}?`);
+            }
+        }
+
+        if (undefinedWithSuggestions.length > 0) {
+            content.appendMarkdown('\n**Suggestions for undefined macros:**\n');
+            content.appendMarkdown(undefinedWithSuggestions.join('\n') + '\n');
+        }
+    }
+
+    /**
+     * Render an expansion, or only its beginning with a link to the whole text if it
+     * is too long for the hover widget
+     * Returns the expansion the link opens, if any.
+     */
+    private appendExpansionText(content: vscode.MarkdownString, macroName: string, text: string): ResolvedHover['expansion'] {
+        if (text.length <= HOVER_CONSTANTS.PREVIEW_LENGTH) {
+            content.appendCodeblock(text, 'cpp');
+            return undefined;
+        }
+
+        // Cut at a line break or space when there is one reasonably close to the limit
+        let end = HOVER_CONSTANTS.PREVIEW_LENGTH;
+        const breakAt = Math.max(text.lastIndexOf('\n', end), text.lastIndexOf(' ', end));
+        if (breakAt > end * 0.8) {
+            end = breakAt;
+        }
+        content.appendCodeblock(`${text.substring(0, end)} …`, 'cpp');
+
+        let lines = 1;
+        for (let index = text.indexOf('\n'); index !== -1; index = text.indexOf('\n', index + 1)) {
+            lines++;
+        }
+        const uri = ExpansionDocumentProvider.getInstance().createUri(macroName);
+        const openCommand = vscode.Uri.parse(
+            `command:macrolens.openExpansion?${encodeURIComponent(JSON.stringify({ uri: uri.toString() }))}`
+        );
+        content.appendMarkdown(
+            `\n📄 Showing ${end.toLocaleString()} of ${text.length.toLocaleString()} characters` +
+            ` (${lines.toLocaleString()} ${lines === 1 ? 'line' : 'lines'}) | [Open Full Expansion](${openCommand})\n`
+        );
+        return { uri, text };
+    }
+
+    private findMacroAtPosition(lineText: string, character: number, currentWord: string): { macroName: string; args?: string[]; start?: number; end?: number } {
         const result = MacroUtils.findMacroAtPosition(lineText, character);
         return result || { macroName: currentWord };
     }
@@ -264,5 +506,12 @@ export class MacroHoverProvider implements vscode.HoverProvider {
         }
     }
 
-
-}
\ No newline at end of file
+    dispose(): void {
+        this.prefetchPass++;
+        if (this.prefetchTimer) {
+            clearTimeout(this.prefetchTimer);
+        }
+        this.disposables.forEach(disposable => disposable.dispose());
+        this.cache.clear();
+    }
+}
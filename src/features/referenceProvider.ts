@@ -0,0 +1,101 @@
+import * as vscode from 'vscode';
+import { MacroDatabase } from '../core/macroDb';
+import { MacroParser } from '../core/macroParser';
+
+/**
+ * Find All References for macros
+ *
+ * Candidate files come from the reference index (plus the defining files and open
+ * documents, whose unsaved text is not indexed), so only files actually using the name
+ * are read; names the index does not record are searched in every indexed file.
+ * Occurrences in comments and string literals are skipped.
+ */
+export class MacroReferenceProvider implements vscode.ReferenceProvider {
+    private db: MacroDatabase;
+
+    constructor() {
+        this.db = MacroDatabase.getInstance();
+    }
+
+    async provideReferences(
+        document: vscode.TextDocument,
+        position: vscode.Position,
+        context: vscode.ReferenceContext,
+        token: vscode.CancellationToken
+    ): Promise<vscode.Location[] | undefined> {
+        const wordRange = document.getWordRangeAtPosition(position, /[A-Za-z_]\w*/);
+        if (!wordRange) {
+            return undefined;
+        }
+        const name = document.getText(wordRange);
+        const defs = this.db.getDefinitions(name).filter(def => def.isDefine !== false);
+        if (defs.length === 0) {
+            return undefined;
+        }
+
+        const files = new Set(await this.db.getReferencingFiles(name));
+        for (const def of defs) {
+            files.add(def.file);
+        }
+        const openDocuments = new Map<string, vscode.TextDocument>();
+        for (const doc of vscode.workspace.textDocuments) {
+            if (doc.uri.scheme === 'file' && (doc.languageId === 'c' || doc.languageId === 'cpp')) {
+                openDocuments.set(doc.uri.fsPath, doc);
+                files.add(doc.uri.fsPath);
+            }
+        }
+
+        const locations: vscode.Location[] = [];
+        for (const file of files) {
+            if (token.isCancellationRequested) {
+                return undefined;
+            }
+            const uri = vscode.Uri.file(file);
+            let text: string;
+            try {
+                const open = openDocuments.get(file);
+                text = open ? open.getText() : Buffer.from(await vscode.workspace.fs.readFile(uri)).toString('utf8');
+            } catch {
+                continue;
+            }
+            for (const range of MacroReferenceProvider.findOccurrences(text, name, context.includeDeclaration)) {
+                locations.push(new vscode.Location(uri, range));
+            }
+        }
+        return locations;
+    }
+
+    /**
+     * Ranges of a name outside comments and literals
+     * @param includeDeclaration Also report the name of #define directives
+     */
+    static findOccurrences(text: string, name: string, includeDeclaration: boolean): vscode.Range[] {
+        if (!text.includes(name)) {
+            return [];
+        }
+
+        const clean = MacroParser.removeCommentsWithPlaceholders(text);
+        const pattern = new RegExp(`"(?:[^"\\\\\\n]|\\\\.)*"|'(?:[^'\\\\\\n]|\\\\.)*'|(?<!\\w)${name}(?!\\w)`, 'g');
+        const declaration = /^[ \t]*#[ \t]*(?:define|undef)[ \t]+$/;
+
+        const ranges: vscode.Range[] = [];
+        let line = 0;
+        let lineStart = 0;
+        let match: RegExpExecArray | null;
+        while ((match = pattern.exec(clean)) !== null) {
+            if (match[0] !== name) {
+                continue;
+            }
+            for (let newline = clean.indexOf('\n', lineStart); newline !== -1 && newline < match.index; newline = clean.indexOf('\n', lineStart)) {
+                line++;
+                lineStart = newline + 1;
+            }
+            if (!includeDeclaration && declaration.test(clean.substring(lineStart, match.index))) {
+                continue;
+            }
+            const character = match.index - lineStart;
+            ranges.push(new vscode.Range(line, character, line, character + name.length));
+        }
+        return ranges;
+    }
+}
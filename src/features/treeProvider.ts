@@ -1,7 +1,21 @@
 import * as vscode from 'vscode';
 import { MacroExpander } from '../core/macroExpander';
+import { ExpansionTrace, TextEdit } from '../core/expansionTrace';
 import { Configuration } from '../configuration';
 import { MacroUtils } from '../utils/macroUtils';
+import { TREE_CONSTANTS } from '../utils/constants';
+
+/**
+ * Name of the macro call last resolved from the cursor, captured against a document version
+ * Only the name is tracked: inside the arguments, a nested call may be the better match.
+ */
+interface ResolvedMacroName {
+    uri: string;
+    version: number;
+    line: number;
+    start: number;
+    end: number;    // Offset just past the name, still a position on it
+}
 
 class MacroNode extends vscode.TreeItem {
     public children: MacroNode[] = [];
@@ -79,13 +93,17 @@ class MacroNode extends vscode.TreeItem {
     }
 }
 
-export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
+export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode>, vscode.Disposable {
     private _onDidChangeTreeData = new vscode.EventEmitter<MacroNode | undefined>();
     readonly onDidChangeTreeData = this._onDidChangeTreeData.event;
 
     private rootMacro: string | undefined;
     private rootArgs: string[] | undefined;
     private expandedNodes = new Map<string, MacroNode[]>(); // Track expanded children for each node
+    private cursorThrottleTimer: NodeJS.Timeout | null = null;
+    private pendingCursorEditor: vscode.TextEditor | null = null;
+    private lastResolvedName: ResolvedMacroName | null = null;
+    private disposables: vscode.Disposable[] = [];
 
     constructor(
         private expander: MacroExpander,
@@ -99,8 +117,19 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
         });
 
         // Listen for cursor position changes
-        vscode.window.onDidChangeTextEditorSelection(this.onCursorPositionChanged.bind(this));
-        vscode.window.onDidChangeActiveTextEditor(this.onActiveEditorChanged.bind(this));
+        this.disposables.push(
+            vscode.window.onDidChangeTextEditorSelection(this.onCursorPositionChanged.bind(this)),
+            vscode.window.onDidChangeActiveTextEditor(this.onActiveEditorChanged.bind(this))
+        );
+    }
+
+    dispose(): void {
+        if (this.cursorThrottleTimer) {
+            clearTimeout(this.cursorThrottleTimer);
+            this.cursorThrottleTimer = null;
+        }
+        this.pendingCursorEditor = null;
+        this.disposables.forEach(disposable => disposable.dispose());
     }
 
     getTreeItem(element: MacroNode): vscode.TreeItem {
@@ -321,8 +350,8 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
         // Sort by position (descending) to avoid index shifting
         macros.sort((a, b) => b.startIndex - a.startIndex);
         
-        let expandedText = text;
         const expandedMacros: string[] = [];
+        const edits: TextEdit[] = [];
         
         for (const macro of macros) {
             const db = this.expander['db'];
@@ -361,14 +390,13 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
             }
             
             
-            // Replace in text
-            expandedText = expandedText.substring(0, macro.startIndex) + 
-                         substituted + 
-                         expandedText.substring(macro.endIndex);
+            // Replaced all at once below, rather than copying the whole text per macro
+            edits.push({ offset: macro.startIndex, removed: macro.endIndex - macro.startIndex, inserted: substituted });
             
             expandedMacros.push(macro.name);
         }
         
+        const expandedText = ExpansionTrace.applyEdits(text, edits);
         return expandedText === text ? null : expandedText;
     }
 
@@ -495,12 +523,33 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
     }
 
     private onCursorPositionChanged(event: vscode.TextEditorSelectionChangeEvent) {
-        if (event.textEditor.document.languageId === 'c' || event.textEditor.document.languageId === 'cpp') {
-            this.updateCurrentMacro(event.textEditor);
+        const editor = event.textEditor;
+        if (editor.document.languageId !== 'c' && editor.document.languageId !== 'cpp') {
+            return;
+        }
+
+        // Cursor is still on the name of the macro we resolved last time - nothing to do
+        if (this.isOnResolvedName(editor)) {
+            this.pendingCursorEditor = null;
+            return;
+        }
+
+        // Throttle to one resolution per frame; the latest editor state wins
+        this.pendingCursorEditor = editor;
+        if (!this.cursorThrottleTimer) {
+            this.cursorThrottleTimer = setTimeout(() => {
+                this.cursorThrottleTimer = null;
+                const pending = this.pendingCursorEditor;
+                this.pendingCursorEditor = null;
+                if (pending) {
+                    this.updateCurrentMacro(pending);
+                }
+            }, TREE_CONSTANTS.CURSOR_THROTTLE_MS);
         }
     }
 
     private onActiveEditorChanged(editor: vscode.TextEditor | undefined) {
+        this.pendingCursorEditor = null;
         if (editor && (editor.document.languageId === 'c' || editor.document.languageId === 'cpp')) {
             this.updateCurrentMacro(editor);
         } else {
@@ -508,6 +557,25 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
         }
     }
 
+    /**
+     * Check whether the cursor is still on the name of the last resolved macro
+     * No smaller call can contain that position, so resolving again would find the same macro.
+     * Offsets are only trusted for the document version they were computed against
+     */
+    private isOnResolvedName(editor: vscode.TextEditor): boolean {
+        const span = this.lastResolvedName;
+        if (!span) {
+            return false;
+        }
+        const document = editor.document;
+        const position = editor.selection.active;
+        return span.uri === document.uri.toString() &&
+            span.version === document.version &&
+            span.line === position.line &&
+            position.character >= span.start &&
+            position.character <= span.end;
+    }
+
     private updateCurrentMacro(editor: vscode.TextEditor) {
         const position = editor.selection.active;
         const macroInfo = this.findMacroAtPosition(editor.document, position);
@@ -519,21 +587,29 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
             
             // Skip if not found or if it's a type declaration (isDefine === false)
             if (defs.length === 0 || defs[0].isDefine === false) {
-                this.clear();
+                this.clearIfShowing();
                 return;
             }
+
+            this.lastResolvedName = {
+                uri: editor.document.uri.toString(),
+                version: editor.document.version,
+                line: position.line,
+                start: macroInfo.start,
+                end: macroInfo.start + macroInfo.name.length
+            };
             
             // Only update if it's a different macro
             if (macroInfo.name !== this.rootMacro || 
-                JSON.stringify(macroInfo.args) !== JSON.stringify(this.rootArgs)) {
+                !MacroUtils.sameArguments(macroInfo.args, this.rootArgs)) {
                 this.showExpansion(macroInfo.name, macroInfo.args);
             }
         } else {
-            this.clear();
+            this.clearIfShowing();
         }
     }
 
-    private findMacroAtPosition(document: vscode.TextDocument, position: vscode.Position): {name: string, args?: string[]} | null {
+    private findMacroAtPosition(document: vscode.TextDocument, position: vscode.Position): {name: string, args?: string[], start: number, end: number} | null {
         const line = document.lineAt(position.line);
         const text = line.text;
         
@@ -541,12 +617,23 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
         const result = MacroUtils.findMacroAtPosition(text, position.character);
         
         // Convert result format to match expected return type
-        return result ? { name: result.macroName, args: result.args } : null;
+        return result ? { name: result.macroName, args: result.args, start: result.start, end: result.end } : null;
+    }
+
+    /**
+     * Clear the tree only when something is shown, avoiding redundant refresh events
+     */
+    private clearIfShowing() {
+        this.lastResolvedName = null;
+        if (this.rootMacro) {
+            this.clear();
+        }
     }
 
 
 
     clear() {
+        this.lastResolvedName = null;
         this.rootMacro = undefined;
         this.rootArgs = undefined;
         this.expandedNodes.clear();
@@ -573,8 +660,8 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
         // Sort by position (descending) to avoid index shifting
         macros.sort((a, b) => b.startIndex - a.startIndex);
         
-        let expandedText = text;
         const expandedMacros: string[] = [];
+        const edits: TextEdit[] = [];
         
         for (const macro of macros) {
             const db = this.expander['db'];
@@ -617,14 +704,13 @@ export class MacroTreeProvider implements vscode.TreeDataProvider<MacroNode> {
                 substituted = MacroUtils.substituteParameters(substituted, def.params, macro.args);
             }
             
-            // Replace in text
-            expandedText = expandedText.substring(0, macro.startIndex) + 
-                         substituted + 
-                         expandedText.substring(macro.endIndex);
+            // Replaced all at once below, rather than copying the whole text per macro
+            edits.push({ offset: macro.startIndex, removed: macro.endIndex - macro.startIndex, inserted: substituted });
             
             expandedMacros.push(macro.name);
         }
         
+        const expandedText = ExpansionTrace.applyEdits(text, edits);
         return expandedText === text ? null : expandedText;
     }
 
@@ -1,7 +1,33 @@
 import * as assert from 'assert';
 import * as vscode from 'vscode';
+import * as fs from 'fs';
+import * as os from 'os';
+import * as path from 'path';
+import * as crypto from 'crypto';
+import { execFileSync } from 'child_process';
 import { MacroDatabase } from '../core/macroDb';
 import { MacroExpander } from '../core/macroExpander';
+import { DocumentOverlay } from '../core/documentOverlay';
+import { SnapshotBuilder } from '../core/definitionSnapshot';
+import { DatabaseClient } from '../core/databaseClient';
+import { InternTable } from '../core/internTable';
+import { ConditionEvaluator } from '../core/conditionEvaluator';
+import { MacroParser } from '../core/macroParser';
+import { IncludeGraph } from '../core/includeGraph';
+import { CompileCommands } from '../core/compileCommands';
+import { ByteClass, ByteClassifier } from '../core/byteClassifier';
+import { StreamingParser } from '../core/streamingParser';
+import { FileWalker } from '../core/fileWalker';
+import { GitReconciler } from '../core/gitReconciler';
+import { MacroReferenceProvider } from '../features/referenceProvider';
+import { MacroHoverProvider } from '../features/hoverProvider';
+import { ExpansionDocumentProvider } from '../features/expansionDocumentProvider';
+import { MacroDiagnostics } from '../features/diagnostics';
+import { MacroTreeProvider } from '../features/treeProvider';
+import { Configuration } from '../configuration';
+import { GlobMatcher } from '../utils/globMatcher';
+import { MacroUtils } from '../utils/macroUtils';
+import { HOVER_CONSTANTS } from '../utils/constants';
 
 suite('Extension Test Suite', () => {
 	vscode.window.showInformationMessage('Start all tests.');
@@ -95,4 +121,1099 @@ suite('Extension Test Suite', () => {
 			(db as any).definitions = originalDefinitions;
 		}
 	});
+
+	test('should re-parse only edited lines of an unsaved buffer', () => {
+		const makeDocument = (text: string, version: number) => ({
+			getText: () => text,
+			version,
+			uri: vscode.Uri.file('/overlay.h')
+		}) as unknown as vscode.TextDocument;
+
+		const overlay = DocumentOverlay.fromDocument(makeDocument('#define A 1\nint x;\n#define B 2\n', 1));
+		const applied = overlay.applyChanges(makeDocument('#define A 1\n#define NEW 3\nint x;\n#define B 2\n', 2), [{
+			range: new vscode.Range(1, 0, 1, 0),
+			rangeOffset: 12,
+			rangeLength: 0,
+			text: '#define NEW 3\n'
+		}]);
+
+		assert.strictEqual(applied, true);
+		assert.strictEqual(overlay.getDefinitions('NEW')?.[0].line, 2);
+		assert.strictEqual(overlay.getDefinitions('B')?.[0].line, 4);
+	});
+
+	test('should record and evaluate conditional branches', () => {
+		const source = '#ifndef CFG_H\n#define CFG_H\n#ifdef _WIN32\n#define PATH_SEP 1\n#else\n#define PATH_SEP 2\n#endif\n#endif\n';
+		const defs = MacroParser.parseMacros(source, '/cfg.h');
+		const pathSep = defs.filter(def => def.name === 'PATH_SEP');
+
+		assert.strictEqual(defs.find(def => def.name === 'CFG_H')?.condition, undefined);
+		assert.deepStrictEqual(pathSep.map(def => def.condition), ['defined(_WIN32)', '!defined(_WIN32)']);
+
+		const evaluator = new ConditionEvaluator(['_WIN32'], () => false);
+		assert.deepStrictEqual(evaluator.filter(pathSep).map(def => def.body), ['1']);
+
+		// Macros the project may define are unknown, so their branches stay visible
+		const unknown = new ConditionEvaluator(['OTHER'], name => name === 'FEATURE');
+		assert.strictEqual(unknown.isActive('(FEATURE > 1)'), true);
+		assert.strictEqual(unknown.isActive('defined(OTHER) && !defined(OTHER)'), false);
+	});
+
+	test('should resolve the definition live at a line', () => {
+		const db = MacroDatabase.getInstance();
+		const originalDefinitions = (db as any).definitions;
+		const header = { name: 'MODE', body: '1', file: '/inc/mode.h', line: 1, isDefine: true };
+		const local = { name: 'MODE', body: '2', file: '/src/main.c', line: 10, isDefine: true };
+		const customDefinitions = new Map();
+		customDefinitions.set('MODE', [header, local]);
+
+		try {
+			(db as any).definitions = customDefinitions;
+			assert.deepStrictEqual(db.getDefinitionsAt('MODE', '/src/main.c', 5), [header]);
+			assert.deepStrictEqual(db.getDefinitionsAt('MODE', '/src/main.c', 12), [local]);
+			assert.deepStrictEqual(db.getDefinitionsAt('MODE', '/src/other.c', 12), [header, local]);
+		} finally {
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should scope definitions to the include closure', () => {
+		const parsed = MacroParser.parseSource('#include "util/log.h"\n#include <stdio.h>\n', '/proj/src/main.c');
+		assert.deepStrictEqual(parsed.includes.map(include => include.target), ['util/log.h', 'stdio.h']);
+
+		const graph = new IncludeGraph();
+		graph.setIncludes('/proj/src/main.c', parsed.includes);
+		graph.setIncludes('/proj/src/util/log.h', [{ target: 'config.h', system: false, line: 1 }]);
+		graph.setIncludes('/proj/include/config.h', []);
+		graph.setIncludes('/proj/other/config.h', []);
+		graph.setIncludes('/proj/other/unrelated.h', []);
+
+		assert.strictEqual(graph.isReachable('/proj/src/main.c', '/proj/src/util/log.h'), true);
+		assert.strictEqual(graph.isReachable('/proj/src/main.c', '/proj/other/unrelated.h'), false);
+		assert.strictEqual(graph.isReachable('/proj/src/other.c', '/proj/src/util/log.h'), undefined);
+
+		// Include directories are searched before falling back to suffix matches
+		graph.setIncludeDirectories(['/proj/include']);
+		assert.strictEqual(graph.isReachable('/proj/src/main.c', '/proj/include/config.h'), true);
+		assert.strictEqual(graph.isReachable('/proj/src/main.c', '/proj/other/config.h'), false);
+	});
+
+	test('should read per-unit definitions from compile commands', () => {
+		const commands = CompileCommands.parse(JSON.stringify([
+			{ directory: '/proj/build', file: '../src/a.c', command: 'cc -DMODE=2 -D "GREET=\\"hi\\"" -I../include -c ../src/a.c' },
+			{ directory: '/proj/build', file: '../src/b.c', arguments: ['cc', '-DMODE=2', '-DGREET="hi"', '-I', '../include', '-c', '../src/b.c'] },
+			{ directory: '/proj/build', file: '../src/c.c', arguments: ['cc', '-DMODE=2', '-UMODE', '-DSQ(x)=((x)*(x))', '-DFLAG', '-c', '../src/c.c'] }
+		]), '/proj/build/compile_commands.json');
+
+		assert.strictEqual(commands.unitCount, 3);
+		assert.strictEqual(commands.configurationCount, 2);
+		assert.strictEqual(commands.getDefinitions('/proj/src/a.c', 'GREET')?.[0].body, '"hi"');
+		assert.strictEqual(commands.getDefinitions('/proj/src/c.c', 'MODE'), undefined);
+		assert.deepStrictEqual(commands.getDefinitions('/proj/src/c.c', 'SQ')?.[0].params, ['x']);
+		assert.strictEqual(commands.getDefinitions('/proj/src/c.c', 'FLAG')?.[0].body, '1');
+		// Headers use the most common configuration
+		assert.strictEqual(commands.getDefinitions('/proj/include/a.h', 'MODE')?.[0].body, '2');
+		assert.deepStrictEqual(commands.getIncludeDirectories(), ['/proj/include']);
+	});
+
+	test('should extract includes from raw bytes without a full parse', () => {
+		const source = '/* header\n#include "hidden.h"\n */ #include "a.h"\n// #include "b.h"\nint main(void) { return 0; }\n  #  include <c.h>\n';
+		const parsed = MacroParser.parseBuffer(Buffer.from(source), '/src/main.c');
+		assert.deepStrictEqual(parsed.includes, MacroParser.parseSource(source, '/src/main.c').includes);
+		assert.deepStrictEqual(parsed.includes.map(include => include.target), ['a.h', 'c.h']);
+
+		// Files with definitions take the regular path
+		const withDefine = MacroParser.parseBuffer(Buffer.from('#include "a.h"\n#define X 1\n'), '/src/x.c');
+		assert.deepStrictEqual(withDefine.defs.map(def => def.name), ['X']);
+
+		// Only the lines the parser reads are decoded; the result is that of the whole text
+		const mixed = '#ifndef M_H\r\n#define M_H\r\nstatic int counter;\r\n#define F(x) \\\r\n  typedef_like(x)\r\nint f(void) { return 0; }\r\n' +
+			'typedef struct {\r\n  int a;\r\n} T;\r\nenum\r\n{\r\n  RED,\r\n  GREEN\r\n};\r\nstruct S *next;\r\nunsigned u;\r\n#endif\r\n';
+		const decoded: string = (MacroParser as any).decodeParsedLines(Buffer.from(mixed), true);
+		assert.strictEqual(decoded.split('\n').length, mixed.split('\n').length);
+		assert.ok(!decoded.includes('counter') && !decoded.includes('int f') && !decoded.includes('unsigned'));
+		const sparse = MacroParser.parseBuffer(Buffer.from(mixed), '/m.h');
+		const whole = MacroParser.parseSource(mixed, '/m.h');
+		assert.deepStrictEqual([sparse.defs, sparse.directives, sparse.guardLine], [whole.defs, whole.directives, whole.guardLine]);
+	});
+
+	test('should classify bytes with the SIMD kernel when available', () => {
+		const classifier = ByteClassifier.getInstance();
+		if (!classifier) {
+			return;
+		}
+		const bytes = Buffer.from('int a; // x\n'.repeat(10) + '#define S "q\\"" /* c */\n');
+		const masks = classifier.classify(bytes);
+		const slash = 1 << ByteClass.Slash;
+		const quote = 1 << ByteClass.Quote;
+		assert.strictEqual(masks.next(0, slash), bytes.indexOf('/'));
+		assert.strictEqual(masks.next(0, 1 << ByteClass.Hash), bytes.indexOf('#'));
+		assert.strictEqual(masks.next(bytes.indexOf('"') + 1, quote), bytes.indexOf('"', bytes.indexOf('"') + 1));
+		assert.strictEqual(masks.next(bytes.length - 1, slash), -1);
+
+		// Inputs larger than the module memory are classified in chunks without growing it
+		const memory = (classifier as any).memory.buffer.byteLength;
+		const large = Buffer.alloc(memory * 3 + 5, 'a');
+		large[memory + 7] = '#'.charCodeAt(0);
+		large[large.length - 1] = '/'.charCodeAt(0);
+		const largeMasks = classifier.classify(large);
+		assert.strictEqual(largeMasks.next(0, 1 << ByteClass.Hash), memory + 7);
+		assert.strictEqual(largeMasks.next(0, slash), large.length - 1);
+		assert.strictEqual((classifier as any).memory.buffer.byteLength, memory);
+
+		// Large buffers take the masked comment scan; results match the string parser
+		const source = '/* c */\n#define A "/* no */" // tail\n'.repeat(300);
+		assert.deepStrictEqual(MacroParser.parseBuffer(Buffer.from(source), '/a.h').defs, MacroParser.parseSource(source, '/a.h').defs);
+	});
+
+	test('should stream oversized files with constructs split across chunks', async () => {
+		const source = '#ifndef BIG_H\n#define BIG_H\n/* a #define HIDDEN 1\n*/ #define A 1\n#define ADD(a, \\\n  b) ((a) + (b)) // sum\nint x;\n#ifdef X\n#include "x.h"\n#endif\n#undef A\n' +
+			'typedef struct {\n  int a; /* } */\n} POINT, *POINT_PTR;\nstruct NODE { int v; };\nunion VALUE\n{ int i; };\n#ifdef E\nenum COLOR\n{\n  RED = 1,\n  GREEN\n};\n#endif\nenum { FLAG_A, FLAG_B };\n#endif\n';
+		async function* chunks() {
+			const bytes = Buffer.from(source);
+			for (let i = 0; i < bytes.length; i += 5) {
+				yield bytes.subarray(i, i + 5);
+			}
+		}
+		const streamed = await StreamingParser.parse(chunks(), '/big.h');
+		const parsed = MacroParser.parseSource(source, '/big.h');
+		assert.deepStrictEqual(streamed.defs, parsed.defs);
+		assert.ok(['POINT', 'POINT_PTR', 'NODE', 'VALUE', 'COLOR', 'RED', 'GREEN', 'FLAG_B'].every(name => streamed.defs.some(def => def.name === name)));
+		assert.deepStrictEqual(streamed.undefs, parsed.undefs);
+		assert.deepStrictEqual(streamed.includes, parsed.includes);
+		assert.strictEqual(streamed.guardLine, parsed.guardLine);
+
+		// Uses are recorded like for buffered files
+		const used = 'int y = LIMIT + f("NOT_A_USE", \'Q\');\n#include "INCLUDED.h"\n#define TWICE(x) \\\n  (SCALE * (x))\n#undef TWICE\n#if defined(FEATURE) // OFF\n#endif\n';
+		async function* usedChunks() {
+			yield used.substring(0, 20);
+			yield used.substring(20);
+		}
+		const references = (await StreamingParser.parse(usedChunks(), '/used.h')).references!;
+		assert.deepStrictEqual(references.sort(), MacroParser.findReferences(Buffer.from(used)).sort());
+		assert.deepStrictEqual(references, ['FEATURE', 'LIMIT', 'SCALE']);
+
+		// A file with too many names to keep counts as using every name
+		async function* manyNames() {
+			for (let i = 0; i <= 50000; i++) {
+				yield `int v${i} = NAME_${i};\n`;
+			}
+		}
+		assert.deepStrictEqual((await StreamingParser.parse(manyNames(), '/many.h')).references, [MacroParser.ANY_REFERENCE]);
+		const db = MacroDatabase.getInstance();
+		const [originalDb, originalInitialized] = [(db as any).db, (db as any).initialized];
+		let params: unknown[] = [];
+		Object.assign(db as any, { db: { all: async (_sql: string, ...args: unknown[]) => (params = args, []) }, initialized: true });
+		try {
+			await db.getReferencingFiles('LIMIT');
+			assert.deepStrictEqual(params, ['LIMIT', MacroParser.ANY_REFERENCE]);
+		} finally {
+			Object.assign(db as any, { db: originalDb, initialized: originalInitialized });
+		}
+	});
+
+	test('should match workspace paths against include and exclude globs', () => {
+		const exclude = new GlobMatcher(['**/node_modules/**', 'third_party/**', '**/*.gen.h']);
+		assert.ok(exclude.matches('node_modules/x.h'));
+		assert.ok(exclude.matches('src\\node_modules\\y\\x.h'));
+		assert.ok(exclude.matches('third_party/z/a.h'));
+		assert.ok(exclude.matches('out/proto.gen.h'));
+		assert.ok(!exclude.matches('src/third_party/a.h'));
+		assert.ok(new GlobMatcher(['**/*.{c,h}']).matches('a.h'));
+		assert.ok(new GlobMatcher([]).isEmpty);
+		assert.strictEqual(GlobMatcher.join(['a', 'b']), '{a,b}');
+		assert.strictEqual(GlobMatcher.join([]), undefined);
+	});
+
+	test('should walk the workspace honoring excludes and .gitignore', async () => {
+		const root = fs.mkdtempSync(path.join(os.tmpdir(), 'macrolens-walk-'));
+		try {
+			const files: Record<string, string> = {
+				'.gitignore': 'gen/\n*.tmp.h\n!keep.tmp.h\n',
+				'a.h': '#define A 1\n',
+				'keep.tmp.h': '',
+				'drop.tmp.h': '',
+				'notes.txt': '',
+				'gen/g.h': '',
+				'src/b.c': '',
+				'src/.gitignore': '/local.h\n',
+				'src/local.h': '',
+				'src/sub/local.h': '',
+				'node_modules/m.h': ''
+			};
+			for (const [file, content] of Object.entries(files)) {
+				fs.mkdirSync(path.dirname(path.join(root, file)), { recursive: true });
+				fs.writeFileSync(path.join(root, file), content);
+			}
+
+			const found: string[] = [];
+			const walk = FileWalker.walk(root, {
+				include: new GlobMatcher(['**/*.{c,h}']),
+				exclude: new GlobMatcher(['**/node_modules/**']),
+				useGitignore: true,
+				concurrency: 2
+			});
+			for await (const batch of walk) {
+				for (const file of batch) {
+					found.push(path.relative(root, file.path).replace(/\\/g, '/'));
+					if (file.path.endsWith('a.h')) {
+						assert.strictEqual(file.size, 12);
+					}
+				}
+			}
+			assert.deepStrictEqual(found.sort(), ['a.h', 'keep.tmp.h', 'src/b.c', 'src/sub/local.h']);
+			assert.strictEqual(walk.found, found.length);
+		} finally {
+			fs.rmSync(root, { recursive: true, force: true });
+		}
+	});
+
+	test('should list files changed since a commit with git', async () => {
+		const root = fs.realpathSync(fs.mkdtempSync(path.join(os.tmpdir(), 'macrolens-git-')));
+		const git = (...args: string[]) => execFileSync('git', ['-c', 'user.name=t', '-c', 'user.email=t@t', ...args], { cwd: root });
+		try {
+			try {
+				git('init', '-q');
+			} catch {
+				return; // git is not installed
+			}
+			fs.writeFileSync(path.join(root, 'a.h'), '#define A 1\n');
+			fs.writeFileSync(path.join(root, 'b.h'), '#define B 1\n');
+			git('add', '-A');
+			git('commit', '-qm', 'first');
+			const repository = await GitReconciler.open(root);
+			assert.ok(repository);
+			const first = await repository.getHead();
+
+			fs.writeFileSync(path.join(root, 'a.h'), '#define A 2\n');
+			git('commit', '-qam', 'second');
+			const second = await repository.getHead();
+			assert.deepStrictEqual(await repository.getChangedFiles(first!, second!), [path.join(root, 'a.h')]);
+			assert.deepStrictEqual(await repository.getDirtyFiles(), []);
+
+			git('mv', 'b.h', 'c.h');
+			fs.writeFileSync(path.join(root, 'd.h'), '');
+			assert.deepStrictEqual((await repository.getDirtyFiles())!.sort(), ['b.h', 'c.h', 'd.h'].map(file => path.join(root, file)));
+			assert.strictEqual(await repository.getChangedFiles('0000000000000000000000000000000000000000', second!), undefined);
+		} finally {
+			fs.rmSync(root, { recursive: true, force: true });
+		}
+	});
+
+	test('should index macro references and find their occurrences', () => {
+		const source = '#include <LIB/CFG.h>\n#define WRAP(x) (INNER + x) /* NOT_USED */\n#undef GONE\nint v = WRAP(0x1F) + "IN_STRING" + Mixed;\n#if defined(FEATURE)\n#endif\n';
+		assert.deepStrictEqual(MacroParser.findReferences(Buffer.from(source)).sort(), ['FEATURE', 'INNER', 'WRAP']);
+		assert.deepStrictEqual(MacroParser.parseBuffer(Buffer.from('int x = LIMIT;\n'), '/a.c').references, ['LIMIT']);
+
+		const text = '#define WRAP(x) (x)\n// WRAP\nint a = WRAP(1), b = "WRAP", WRAPPED = 0;\n  a += WRAP(2);\n';
+		const all = MacroReferenceProvider.findOccurrences(text, 'WRAP', true);
+		assert.deepStrictEqual(all.map(range => [range.start.line, range.start.character]), [[0, 8], [2, 8], [3, 7]]);
+		assert.strictEqual(MacroReferenceProvider.findOccurrences(text, 'WRAP', false).length, 2);
+	});
+
+	test('should build the next generation of definitions without touching the published one', () => {
+		const a = { name: 'A', body: '1', file: '/a.h', line: 1, isDefine: true };
+		const b = { name: 'B', body: '2', file: '/b.h', line: 1, isDefine: true };
+		const shared = { name: 'S', body: '3', file: '/a.h', line: 2, isDefine: true };
+		const sharedB = { ...shared, file: '/b.h' };
+		const definitions = new Map([['A', [a]], ['B', [b]], ['S', [shared, sharedB]]]);
+		const undefs = new Map([['A', [{ name: 'A', file: '/a.h', line: 5 }]]]);
+
+		const builder = new SnapshotBuilder(definitions, undefs);
+		const previous = builder.replaceFile('/a.h', { defs: [{ ...shared, body: '4' }], undefs: [], includes: [] });
+		const next = builder.build();
+
+		assert.deepStrictEqual(previous, [a, shared]);
+		assert.deepStrictEqual(Array.from(next.definitions.keys()).sort(), ['B', 'S']);
+		assert.deepStrictEqual(next.definitions.get('S')!.map(def => def.body), ['3', '4']);
+		assert.strictEqual(next.undefs.has('A'), false);
+		// Unchanged names share their arrays; the published maps are untouched
+		assert.strictEqual(next.definitions.get('B'), definitions.get('B'));
+		assert.deepStrictEqual(definitions.get('S'), [shared, sharedB]);
+		assert.strictEqual(definitions.size, 3);
+		assert.strictEqual(undefs.get('A')!.length, 1);
+
+		const db = MacroDatabase.getInstance();
+		const generation = db.getGeneration();
+		(db as any).publish(new Map([['/gen.h', { defs: [{ name: 'GEN_ONLY', body: '1', file: '/gen.h', line: 1, isDefine: true }], undefs: [], includes: [] }]]));
+		assert.ok(db.getGeneration() > generation);
+		assert.strictEqual(db.getDefinitions('GEN_ONLY').length, 1);
+		(db as any).publish(new Map([['/gen.h', null]]));
+		assert.strictEqual(db.getDefinitions('GEN_ONLY').length, 0);
+	});
+
+	test('should save the git state after an open transaction instead of inside it', async () => {
+		// Writes outside transaction() wait for an open transaction instead of joining it
+		const db = MacroDatabase.getInstance();
+		const originalDb = (db as any).db;
+		const originalGitState = (db as any).gitState;
+		const log: string[] = [];
+		(db as any).db = {
+			exec: async (sql: string) => { log.push(sql); },
+			batch: async () => { log.push('git_state'); },
+			sync: async () => undefined
+		};
+		try {
+			const transaction = (db as any).transaction(() => new Promise(resolve => setTimeout(resolve, 10)));
+			await (db as any).saveGitState('0123abcd', []);
+			await transaction;
+			assert.deepStrictEqual(log, ['BEGIN TRANSACTION', 'COMMIT', 'git_state']);
+		} finally {
+			(db as any).db = originalDb;
+			(db as any).gitState = originalGitState;
+		}
+	});
+
+	test('should run database requests in order through the worker client', async () => {
+		try {
+			require('node:sqlite');
+		} catch {
+			return; // node:sqlite is not available
+		}
+		// With node:sqlite present the worker must open
+		const client = await DatabaseClient.openWorker(':memory:');
+		try {
+			await client.exec('CREATE TABLE t (id INTEGER PRIMARY KEY, v TEXT)');
+			const insert = 'INSERT INTO t (id, v) VALUES (?, ?)';
+			client.write([{ sql: insert, params: [1, 'a'] }, { sql: insert, params: [2, 'b'] }]);
+
+			// Requests made in the same tick travel in one message and run in order
+			const [count, row] = await Promise.all([
+				client.get<{ n: number }>('SELECT COUNT(*) AS n FROM t'),
+				client.get<{ v: string }>('SELECT v FROM t WHERE id = ?', 2)
+			]);
+			assert.strictEqual(count!.n, 2);
+			assert.strictEqual(row!.v, 'b');
+
+			client.write([{ sql: insert, params: [1, 'duplicate'] }]);
+			await assert.rejects(client.sync());
+			await client.sync();
+			assert.strictEqual((await client.all('SELECT id FROM t')).length, 2);
+		} finally {
+			await client.close();
+		}
+	});
+
+	test('should store each distinct name, parameter list and body once', () => {
+		const ids = {
+			files: new InternTable(),
+			names: new InternTable([{ id: 7, key: 'KNOWN' }]),
+			params: new InternTable(),
+			bodies: new InternTable()
+		};
+		const defs = [
+			{ name: 'A', params: ['x', 'y'], body: '/* enum constant */', file: '', line: 1, isDefine: true },
+			{ name: 'B', params: ['x', 'y'], body: '/* enum constant */', file: '', line: 2, isDefine: true },
+			{ name: 'KNOWN', body: '/* enum constant */', file: '', line: 3, isDefine: true }
+		];
+		const statements: Array<{ sql: string; params: any[] }> = (MacroDatabase.getInstance() as any)
+			.fileWriteStatements(ids, 'inc/a.h', 1, { defs, undefs: [{ name: 'A', file: '', line: 4 }], includes: [], references: ['KNOWN'] });
+		const count = (table: string) => statements.filter(statement => statement.sql.startsWith(`INSERT INTO ${table} `)).length;
+
+		assert.strictEqual(count('names'), 2);
+		assert.strictEqual(count('param_lists'), 1);
+		assert.strictEqual(count('bodies'), 1);
+		const macros = statements.filter(statement => statement.sql.startsWith('INSERT INTO macros')).map(statement => statement.params);
+		assert.deepStrictEqual(macros.map(row => row[0]), [ids.names.get('A'), ids.names.get('B'), 7]);
+		assert.deepStrictEqual(macros.map(row => row[2]), [1, 1, 1]);
+		assert.strictEqual(macros[2][1], null);
+		// New ids continue after the stored ones
+		assert.ok(ids.names.get('A')! > 7);
+
+		// Rewriting the file only replaces its rows
+		const again = (MacroDatabase.getInstance() as any).fileWriteStatements(ids, 'inc/a.h', 2, { defs, undefs: [], includes: [], references: [] });
+		assert.ok(again.every((statement: { sql: string }) => !/INTO (files|names|param_lists|bodies) /.test(statement.sql)));
+
+		// Bodies are keyed by the full sha256 of their text, and only the digest stays in memory
+		const sha256 = (text: string) => crypto.createHash('sha256').update(text).digest('base64');
+		const other = (MacroDatabase.getInstance() as any).fileWriteStatements(ids, 'inc/b.h', 1, {
+			defs: [{ name: 'C', body: '/* enum constant */ + 1', file: '', line: 1, isDefine: true }], undefs: [], includes: [], references: []
+		});
+		const body = other.find((statement: { sql: string }) => statement.sql.startsWith('INSERT INTO bodies '));
+		assert.deepStrictEqual(body.params, [2, sha256('/* enum constant */ + 1'), '/* enum constant */ + 1']);
+		assert.strictEqual(ids.bodies.get(sha256('/* enum constant */')), 1);
+		assert.strictEqual(ids.bodies.get('/* enum constant */'), undefined);
+	});
+
+	test('should maintain the index file in short steps', async () => {
+		const db = MacroDatabase.getInstance();
+		let steps = 0;
+		while (await db.runMaintenanceStep()) {
+			assert.ok(++steps < 1000, 'maintenance pass does not end');
+		}
+
+		const index = db.getStatistics().index;
+		if (db.isUsingInMemory() || !index) {
+			return; // Nothing to maintain without an index file
+		}
+		assert.notStrictEqual(index.lastMaintenance, null);
+		assert.strictEqual(index.integrity, 'ok');
+		assert.ok(index.freeBytes <= index.sizeBytes);
+
+		// The last check is kept in the index, so a new session does not check again
+		const check = (db as any).lastIntegrityCheck;
+		(db as any).lastIntegrityCheck = null;
+		await (db as any).loadIntegrityCheck();
+		assert.deepStrictEqual((db as any).lastIntegrityCheck, check);
+
+		// An index without incremental vacuum is only rewritten once much of it is free
+		const originalDb = (db as any).db;
+		let freePages = 10;
+		const executed: string[] = [];
+		(db as any).db = {
+			get: async (sql: string) => ({ 'PRAGMA auto_vacuum': { auto_vacuum: 0 }, 'PRAGMA page_count': { page_count: 100 }, 'PRAGMA freelist_count': { freelist_count: freePages } } as Record<string, object>)[sql],
+			exec: async (sql: string) => { executed.push(sql); }
+		};
+		try {
+			await (db as any).runMaintenance('vacuum');
+			assert.deepStrictEqual(executed, []);
+			freePages = 60;
+			// ...and not while a project scan runs
+			(db as any).scanning = true;
+			await (db as any).runMaintenance('vacuum');
+			assert.deepStrictEqual(executed, []);
+			(db as any).scanning = false;
+			await (db as any).runMaintenance('vacuum');
+			assert.ok(executed.length === 1 && executed[0].includes('VACUUM'));
+		} finally {
+			(db as any).db = originalDb;
+			(db as any).scanning = false;
+		}
+	});
+
+	test('should return a truncated partial expansion when a budget runs out', () => {
+		const db = MacroDatabase.getInstance();
+		const expander = new MacroExpander();
+		const originalDefinitions = (db as any).definitions;
+		// Each level doubles the text: 2^24 copies of 1 at the bottom
+		const customDefinitions = new Map();
+		for (let i = 0; i < 24; i++) {
+			customDefinitions.set(`BLOW${i}`, [{ name: `BLOW${i}`, body: `BLOW${i + 1} BLOW${i + 1}`, file: 'test.h', line: i + 1, isDefine: true }]);
+		}
+		customDefinitions.set('BLOW24', [{ name: 'BLOW24', body: '1', file: 'test.h', line: 25, isDefine: true }]);
+
+		try {
+			(db as any).definitions = customDefinitions;
+			const start = Date.now();
+			const result = expander.expand('BLOW0');
+
+			assert.ok(Date.now() - start < 2000);
+			assert.strictEqual(result.hasErrors, false);
+			assert.ok(result.truncated !== undefined);
+			assert.ok(result.steps.length > 0);
+			assert.ok(result.finalText.includes('BLOW'));
+		} finally {
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should rebuild expansion steps from their edits', () => {
+		const db = MacroDatabase.getInstance();
+		const expander = new MacroExpander();
+		const originalDefinitions = (db as any).definitions;
+		const customDefinitions = new Map();
+		customDefinitions.set('SUM', [{ name: 'SUM', params: ['a', 'b'], body: '(a + b)', file: 'test.h', line: 1, isDefine: true }]);
+		customDefinitions.set('ONE', [{ name: 'ONE', body: '1', file: 'test.h', line: 2, isDefine: true }]);
+		customDefinitions.set('TWO', [{ name: 'TWO', body: 'SUM(ONE, ONE)', file: 'test.h', line: 3, isDefine: true }]);
+		customDefinitions.set('TOP', [{ name: 'TOP', body: 'SUM(TWO, ONE) * TWO', file: 'test.h', line: 4, isDefine: true }]);
+
+		try {
+			(db as any).definitions = customDefinitions;
+			const result = expander.expand('TOP');
+			assert.ok(result.steps.length > 2);
+			assert.strictEqual(result.steps[0].from, 'TOP');
+			assert.strictEqual(result.steps[0].to, 'SUM(TWO, ONE) * TWO');
+			// Read out of order: every step starts from the text the previous one produced
+			for (const index of [2, 0, 1, result.steps.length - 1]) {
+				if (index > 0) {
+					assert.strictEqual(result.steps[index].from, result.steps[index - 1].to);
+				}
+			}
+			assert.ok(!/[A-Z]/.test(result.steps[result.steps.length - 1].to));
+
+			const unrecorded = expander.expand('TOP', undefined, { recordSteps: false });
+			assert.strictEqual(unrecorded.steps.length, 0);
+			assert.strictEqual(unrecorded.finalText, result.finalText);
+			assert.strictEqual(unrecorded.isComplete, true);
+		} finally {
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should stop mutually recursive macros at the call already being expanded', () => {
+		const db = MacroDatabase.getInstance();
+		const expander = new MacroExpander();
+		const originalDefinitions = (db as any).definitions;
+		const customDefinitions = new Map();
+		customDefinitions.set('PING', [{ name: 'PING', params: ['x'], body: 'PONG(x)', file: 'test.h', line: 1, isDefine: true }]);
+		customDefinitions.set('PONG', [{ name: 'PONG', params: ['x'], body: 'PING(x)', file: 'test.h', line: 2, isDefine: true }]);
+		customDefinitions.set('TWICE', [{ name: 'TWICE', params: ['x'], body: '(x) + (x)', file: 'test.h', line: 3, isDefine: true }]);
+
+		try {
+			(db as any).definitions = customDefinitions;
+			const result = expander.expand('PING', ['1']);
+			assert.strictEqual(result.hasErrors, false);
+			assert.strictEqual(result.finalText, 'PING(1)');
+
+			// Nothing is left on the chain for the next expansions
+			const other = expander.expand('TWICE', ['2']);
+			assert.strictEqual(other.hasErrors, false);
+			assert.strictEqual(other.finalText, '(2) + (2)');
+			assert.strictEqual(expander.expand('PING', ['3']).finalText, 'PING(3)');
+		} finally {
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should expand a large X-macro table in one layer', () => {
+		const db = MacroDatabase.getInstance();
+		const expander = new MacroExpander();
+		const originalDefinitions = (db as any).definitions;
+		const count = 1500;
+		const customDefinitions = new Map();
+		customDefinitions.set('ENTRY', [{ name: 'ENTRY', params: ['n', 'v'], body: '{ n, v },', file: 'test.h', line: 1, isDefine: true }]);
+		const table = Array.from({ length: count }, (_, i) => `ENTRY(E${i}, (${i}))`).join(' ');
+		customDefinitions.set('TABLE', [{ name: 'TABLE', body: `${table} "ENTRY(x, y)"`, file: 'test.h', line: 2, isDefine: true }]);
+
+		try {
+			(db as any).definitions = customDefinitions;
+			const start = Date.now();
+			const result = expander.expand('TABLE', undefined, { recordSteps: false });
+
+			assert.ok(Date.now() - start < 2000);
+			assert.strictEqual(result.truncated, undefined);
+			const expected = Array.from({ length: count }, (_, i) => `{ E${i}, (${i}) },`).join(' ');
+			assert.strictEqual(result.finalText, `${expected} "ENTRY(x, y)"`);
+
+			// Depths computed in one pass match the per-position computation
+			const text = 'A(B(C) "(" D) E';
+			const macros = MacroUtils.findAllMacros(text, { calculateDepth: true });
+			for (const macro of macros) {
+				assert.strictEqual(macro.depth, MacroUtils.calculateNestingDepth(text.substring(0, macro.start)));
+			}
+		} finally {
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should page a large expansion into its document', async () => {
+		const provider = ExpansionDocumentProvider.getInstance();
+		const pageSize = HOVER_CONSTANTS.EXPANSION_PAGE_SIZE;
+		// Expansions within the default length limit still load in several pages
+		assert.ok(pageSize * 3 <= Configuration.getInstance().getConfig().maxExpansionLength);
+		const text = 'x'.repeat(pageSize * 2 + 10);
+		const uri = provider.createUri('TABLE');
+		assert.strictEqual(uri.scheme, ExpansionDocumentProvider.SCHEME);
+		assert.ok(provider.provideTextDocumentContent(uri).startsWith('//'));
+		provider.keep(uri, text);
+
+		const updates: vscode.Uri[] = [];
+		const subscription = provider.onDidChange(changed => updates.push(changed));
+		const isVisible = (ExpansionDocumentProvider as any).isVisible;
+		let visible = false;
+		(ExpansionDocumentProvider as any).isVisible = () => visible;
+		try {
+			// Pages are only added while the document is shown
+			assert.strictEqual(provider.provideTextDocumentContent(uri).length, pageSize);
+			await new Promise(resolve => setTimeout(resolve, 10));
+			assert.strictEqual(updates.length, 0);
+			visible = true;
+			(provider as any).scheduleNextPage(uri);
+			await new Promise(resolve => setTimeout(resolve, 10));
+			assert.strictEqual(updates.length, 1);
+			assert.strictEqual(provider.provideTextDocumentContent(uri).length, pageSize * 2);
+			await new Promise(resolve => setTimeout(resolve, 10));
+			assert.strictEqual(provider.provideTextDocumentContent(uri), text);
+			await new Promise(resolve => setTimeout(resolve, 10));
+			assert.strictEqual(updates.length, 2);
+
+			// Only the most recent expansions are kept
+			for (let i = 0; i < HOVER_CONSTANTS.MAX_STORED_EXPANSIONS; i++) {
+				provider.keep(provider.createUri('OTHER'), 'y');
+			}
+			assert.ok(provider.provideTextDocumentContent(uri).startsWith('//'));
+		} finally {
+			(ExpansionDocumentProvider as any).isVisible = isVisible;
+			subscription.dispose();
+		}
+	});
+
+	test('should serve hovers from the cache until the document or definitions change', async () => {
+		const db = MacroDatabase.getInstance();
+		const originalDefinitions = (db as any).definitions;
+		const customDefinitions = new Map();
+		customDefinitions.set('SQUARE', [{ name: 'SQUARE', params: ['x'], body: '((x) * (x))', file: '/hover.h', line: 1, isDefine: true }]);
+		const text = 'int y = SQUARE(3);';
+		const makeDocument = (version: number) => ({
+			uri: vscode.Uri.file('/hover.c'),
+			version,
+			lineCount: 1,
+			lineAt: () => ({ text }),
+			offsetAt: (position: vscode.Position) => position.character,
+			positionAt: (offset: number) => new vscode.Position(0, offset),
+			getText: (range: vscode.Range) => text.substring(range.start.character, range.end.character),
+			getWordRangeAtPosition: (position: vscode.Position) => {
+				for (const match of text.matchAll(/\w+/g)) {
+					if (match.index! <= position.character && position.character <= match.index! + match[0].length) {
+						return new vscode.Range(0, match.index!, 0, match.index! + match[0].length);
+					}
+				}
+				return undefined;
+			}
+		}) as unknown as vscode.TextDocument;
+
+		const provider = new MacroHoverProvider();
+		try {
+			(db as any).definitions = customDefinitions;
+			// The first lookup notices the replaced definitions and starts a new generation
+			db.getDefinitionsAt('SQUARE', '/hover.c', 1);
+			const document = makeDocument(1);
+			const first = await provider.provideHover(document, new vscode.Position(0, 9));
+			assert.ok(first);
+			// Anywhere in the same call, same document version and generation
+			assert.strictEqual(await provider.provideHover(document, new vscode.Position(0, 15)), first);
+
+			const edited = await provider.provideHover(makeDocument(2), new vscode.Position(0, 9));
+			assert.ok(edited && edited !== first);
+			(db as any).generation++;
+			const republished = await provider.provideHover(makeDocument(2), new vscode.Position(0, 9));
+			assert.ok(republished && republished !== edited);
+		} finally {
+			provider.dispose();
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should feed every diagnostic rule from one walk over the call sites', async () => {
+		const db = MacroDatabase.getInstance();
+		const originalDefinitions = (db as any).definitions;
+		const customDefinitions = new Map();
+		customDefinitions.set('SQUARE', [{ name: 'SQUARE', params: ['x'], body: '((x) * (x))', file: '/rules.h', line: 1, isDefine: true }]);
+		customDefinitions.set('SIZE', [
+			{ name: 'SIZE', body: '64', file: '/rules.h', line: 2, isDefine: true },
+			{ name: 'SIZE', body: '128', file: '/other.h', line: 1, isDefine: true }
+		]);
+		customDefinitions.set('LOCAL', [{ name: 'LOCAL', body: '(1 + 2', file: '/rules.c', line: 1, isDefine: true }]);
+		const lines = [
+			'#define LOCAL (1 + 2',
+			'int a = SQUARE(1, 2) + GHOST + SIZE;',
+			'int b = SQUARE(3) + SQUARE(3) + SIZE;'
+		];
+		const text = lines.join('\n');
+		const document = {
+			uri: vscode.Uri.file('/rules.c'),
+			languageId: 'c',
+			getText: () => text,
+			lineAt: (line: number) => ({ text: lines[line] }),
+			positionAt: (offset: number) => {
+				const before = text.substring(0, offset).split('\n');
+				return new vscode.Position(before.length - 1, before[before.length - 1].length);
+			}
+		} as unknown as vscode.TextDocument;
+
+		const diagnostics = new MacroDiagnostics();
+		let reported: vscode.Diagnostic[] = [];
+		(diagnostics as any).diagnosticCollection.dispose();
+		(diagnostics as any).diagnosticCollection = { set: (_uri: vscode.Uri, list: vscode.Diagnostic[]) => { reported = list; }, dispose() {} };
+		try {
+			(db as any).definitions = customDefinitions;
+			await (diagnostics as any).analyzeImmediate(document);
+			// Rules report in order: argument count, definitions, undefined macros, redefinitions
+			assert.deepStrictEqual(reported.map(d => `${d.code}@${d.range.start.line}:${d.range.start.character}`), [
+				'macro-argument-count@1:8',
+				'unbalanced-parentheses-body@0:8',
+				'undefined-macro@1:23',
+				'macro-redefinition@1:31',
+				'macro-redefinition@2:32'
+			]);
+		} finally {
+			diagnostics.dispose();
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should republish cached diagnostics until the document or definitions change', async () => {
+		const db = MacroDatabase.getInstance();
+		const originalDefinitions = (db as any).definitions;
+		const customDefinitions = new Map();
+		customDefinitions.set('SQUARE', [{ name: 'SQUARE', params: ['x'], body: '((x) * (x))', file: '/cached.h', line: 1, isDefine: true }]);
+		const text = 'int a = SQUARE(1, 2);';
+		let analyses = 0;
+		const makeDocument = (version: number) => ({
+			uri: vscode.Uri.file('/cached.c'),
+			languageId: 'c',
+			version,
+			getText: () => { analyses++; return text; },
+			lineAt: () => ({ text }),
+			positionAt: (offset: number) => new vscode.Position(0, offset)
+		}) as unknown as vscode.TextDocument;
+
+		const diagnostics = new MacroDiagnostics();
+		const published: vscode.Diagnostic[][] = [];
+		(diagnostics as any).diagnosticCollection.dispose();
+		(diagnostics as any).diagnosticCollection = { set: (_uri: vscode.Uri, list: vscode.Diagnostic[]) => { published.push(list); }, delete() {}, dispose() {} };
+		try {
+			(db as any).definitions = customDefinitions;
+			// The first lookup notices the replaced definitions and starts a new generation
+			db.getDefinitionsAt('SQUARE', '/cached.c', 1);
+			await (diagnostics as any).analyzeImmediate(makeDocument(1));
+			assert.strictEqual(analyses, 1);
+			assert.deepStrictEqual(published[0].map(d => d.code), ['macro-argument-count']);
+
+			// Switching back to the unchanged document publishes the same result without a debounce
+			await diagnostics.analyze(makeDocument(1));
+			assert.strictEqual(analyses, 1);
+			assert.strictEqual(published[1], published[0]);
+			assert.strictEqual((diagnostics as any).pendingDocs.size, 0);
+
+			await (diagnostics as any).analyzeImmediate(makeDocument(2));
+			assert.strictEqual(analyses, 2);
+			(db as any).generation++;
+			await (diagnostics as any).analyzeImmediate(makeDocument(2));
+			assert.strictEqual(analyses, 3);
+		} finally {
+			diagnostics.dispose();
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should throttle tree cursor tracking and resolve nested calls off the resolved name', async () => {
+		const db = MacroDatabase.getInstance();
+		const originalDefinitions = (db as any).definitions;
+		const customDefinitions = new Map();
+		customDefinitions.set('OUTER', [{ name: 'OUTER', params: ['a'], body: '(a)', file: '/tree.h', line: 1, isDefine: true }]);
+		customDefinitions.set('INNER', [{ name: 'INNER', params: ['a'], body: '(a)', file: '/tree.h', line: 2, isDefine: true }]);
+		const text = 'int v = OUTER(INNER(x));';
+		const document = { uri: vscode.Uri.file('/tree.c'), languageId: 'c', version: 1, lineAt: () => ({ text }) };
+		const provider = new MacroTreeProvider(new MacroExpander(), Configuration.getInstance());
+		const resolved: number[] = [];
+		const updateCurrentMacro = (provider as any).updateCurrentMacro.bind(provider);
+		(provider as any).updateCurrentMacro = (editor: vscode.TextEditor) => {
+			resolved.push(editor.selection.active.character);
+			updateCurrentMacro(editor);
+		};
+		const moveTo = (character: number) => (provider as any).onCursorPositionChanged({
+			textEditor: { document, selection: { active: new vscode.Position(0, character) } }
+		});
+		const nextFrame = () => new Promise(resolve => setTimeout(resolve, 50));
+
+		try {
+			(db as any).definitions = customDefinitions;
+			// A burst of moves resolves once, at the latest position
+			moveTo(8);
+			moveTo(9);
+			moveTo(10);
+			await nextFrame();
+			assert.deepStrictEqual(resolved, [10]);
+			assert.strictEqual((provider as any).rootMacro, 'OUTER');
+
+			// Still on the resolved name: nothing is scheduled
+			moveTo(12);
+			assert.strictEqual((provider as any).cursorThrottleTimer, null);
+
+			// Inside the arguments, the nested call is the smallest enclosing one
+			moveTo(15);
+			await nextFrame();
+			assert.deepStrictEqual(resolved, [10, 15]);
+			assert.strictEqual((provider as any).rootMacro, 'INNER');
+
+			// Disposing drops a pending resolution
+			moveTo(9);
+			provider.dispose();
+			await nextFrame();
+			assert.deepStrictEqual(resolved, [10, 15]);
+		} finally {
+			provider.dispose();
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should return every definition still possibly live after conditional branches', () => {
+		const db = MacroDatabase.getInstance();
+		const originalDefinitions = (db as any).definitions;
+		const customDefinitions = new Map();
+		const win = { name: 'X', body: '1', file: '/cond.c', line: 2, isDefine: true, condition: 'defined(_WIN32)' };
+		const other = { name: 'X', body: '2', file: '/cond.c', line: 4, isDefine: true, condition: '!defined(_WIN32)' };
+		const fallback = { name: 'Y', body: '0', file: '/cond.h', line: 1, isDefine: true };
+		const local = { name: 'Y', body: '1', file: '/cond.c', line: 7, isDefine: true, condition: '!defined(Y)' };
+		const later = { name: 'Z', body: '3', file: '/cond.c', line: 12, isDefine: true };
+		const earlier = { name: 'Z', body: '2', file: '/cond.c', line: 10, isDefine: true, condition: 'defined(DEBUG)' };
+		customDefinitions.set('X', [win, other]);
+		customDefinitions.set('Y', [fallback, local]);
+		customDefinitions.set('Z', [earlier, later]);
+		try {
+			(db as any).definitions = customDefinitions;
+			// #ifdef _WIN32 / #define X 1 / #else / #define X 2 / #endif
+			assert.deepStrictEqual(db.getDefinitionsAt('X', '/cond.c', 20), [other, win]);
+			assert.deepStrictEqual(db.getDefinitionsAt('X', '/cond.c', 3), [win]);
+			// #ifndef Y / #define Y 1 / #endif keeps the header's definition possibly live
+			assert.deepStrictEqual(db.getDefinitionsAt('Y', '/cond.c', 20), [local, fallback]);
+			// An unconditional definition hides the earlier branches
+			assert.deepStrictEqual(db.getDefinitionsAt('Z', '/cond.c', 20), [later]);
+			assert.deepStrictEqual(db.getDefinitionsAt('Z', '/cond.c', 11), [earlier]);
+		} finally {
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should keep the generation for overlay edits that leave definitions unchanged', () => {
+		const db = MacroDatabase.getInstance();
+		const texts = ['#define A 1\nint x;\n', '#define A 1\nint xy;\n', '#define A 2\nint xy;\n', '/* c */\n#define A 2\nint xy;\n'];
+		const edit = (version: number, range: vscode.Range, text: string) => db.updateOverlay({
+			document: { getText: () => texts[version - 1], version, isDirty: true, uri: vscode.Uri.file('/typing.h') },
+			contentChanges: [{ range, rangeOffset: 0, rangeLength: 0, text }]
+		} as unknown as vscode.TextDocumentChangeEvent);
+		try {
+			(db as any).overlays.set('/typing.h', DocumentOverlay.fromDocument({ getText: () => texts[0], version: 1, uri: vscode.Uri.file('/typing.h') } as unknown as vscode.TextDocument));
+			const generation = db.getGeneration();
+			edit(2, new vscode.Range(1, 5, 1, 5), 'y');
+			assert.strictEqual(db.getGeneration(), generation);
+			edit(3, new vscode.Range(0, 10, 0, 11), '2');
+			assert.strictEqual(db.getGeneration(), generation + 1);
+			// A rebuild that moves the definition changes lookups too
+			edit(4, new vscode.Range(0, 0, 0, 0), '/* c */\n');
+			assert.strictEqual(db.getGeneration(), generation + 2);
+		} finally {
+			db.discardOverlay(vscode.Uri.file('/typing.h'));
+		}
+	});
+
+	test('should widen affected files to includers and to every file for unindexed macro names', async () => {
+		const db = MacroDatabase.getInstance();
+		const file = (defs: Array<{ name: string; body: string; isDefine: boolean }>, includes: string[] = []) => ({
+			defs: defs.map((def, index) => ({ ...def, file: '', line: index + 1 })),
+			undefs: [],
+			includes: includes.map((target, index) => ({ target, system: false, line: index + 1 }))
+		});
+		const publish = (updates: Array<[string, ReturnType<typeof file> | null]>) => (db as any).publish(new Map(updates));
+		const affected = (path: string) => db.getAffectedFiles(vscode.Uri.file(path));
+		try {
+			publish([
+				['/refs/inc/base.h', file([{ name: 'BASE_X', body: '1', isDefine: true }])],
+				['/refs/inc/mid.h', file([], ['base.h'])],
+				['/refs/src/a.c', file([], ['../inc/mid.h'])],
+				['/refs/src/other.c', file([])]
+			]);
+			for (const path of ['/refs/inc/base.h', '/refs/inc/mid.h', '/refs/src/a.c', '/refs/src/other.c']) {
+				await affected(path);
+			}
+
+			publish([['/refs/inc/base.h', file([{ name: 'BASE_X', body: '2', isDefine: true }])]]);
+			assert.deepStrictEqual(Array.from((await affected('/refs/inc/base.h'))!).sort(), ['/refs/inc/base.h', '/refs/inc/mid.h', '/refs/src/a.c']);
+
+			// Uses of lowercase macros are not indexed; type names do not matter
+			publish([['/refs/inc/base.h', file([{ name: 'BASE_X', body: '2', isDefine: true }, { name: 'node', body: '/* struct */', isDefine: false }])]]);
+			assert.ok(await affected('/refs/inc/base.h'));
+			publish([['/refs/inc/base.h', file([{ name: 'BASE_X', body: '2', isDefine: true }, { name: 'wrap', body: 'helper(BASE_X)', isDefine: true }])]]);
+			assert.strictEqual(await affected('/refs/inc/base.h'), undefined);
+			assert.ok((db as any).getDependents().get('helper').has('wrap'));
+		} finally {
+			publish(['/refs/inc/base.h', '/refs/inc/mid.h', '/refs/src/a.c', '/refs/src/other.c'].map(path => [path, null]));
+			for (const path of ['/refs/inc/base.h', '/refs/inc/mid.h', '/refs/src/a.c', '/refs/src/other.c']) {
+				await affected(path);
+			}
+		}
+	});
+
+	test('should keep prefetched expansions out of the document store and not cache timed-out hovers', async () => {
+		const db = MacroDatabase.getInstance();
+		const originalDefinitions = (db as any).definitions;
+		const customDefinitions = new Map();
+		customDefinitions.set('BIG', [{ name: 'BIG', body: 'x', file: '/big.h', line: 1, isDefine: true }]);
+		const text = 'int y = BIG;';
+		const document = {
+			uri: vscode.Uri.file('/prefetch.c'),
+			version: 1,
+			lineCount: 1,
+			lineAt: () => ({ text }),
+			offsetAt: (position: vscode.Position) => position.character,
+			positionAt: (offset: number) => new vscode.Position(0, offset),
+			getText: (range: vscode.Range) => text.substring(range.start.character, range.end.character),
+			getWordRangeAtPosition: () => new vscode.Range(0, 8, 0, 11)
+		} as unknown as vscode.TextDocument;
+
+		const provider = new MacroHoverProvider();
+		const expansion = 'y'.repeat(HOVER_CONSTANTS.PREVIEW_LENGTH * 2);
+		let truncated: string | undefined;
+		let expansions = 0;
+		let lookups = 0;
+		(provider as any).expander = {
+			expand: () => (expansions++, { finalText: expansion, steps: [], truncated, undefinedMacros: new Set(['MISSING_NAME', 'lower']) })
+		};
+		(provider as any).findSimilarSymbols = async () => (lookups++, ['MISSING_NAMES']);
+		try {
+			(db as any).definitions = customDefinitions;
+			db.getDefinitionsAt('BIG', '/prefetch.c', 1);
+
+			// A prefetched hover links to a document that is only kept once the hover is shown
+			const prefetched = await (provider as any).hoverAt(document, new vscode.Position(0, 9), true);
+			const documents = ExpansionDocumentProvider.getInstance();
+			assert.ok(documents.provideTextDocumentContent(prefetched.expansion.uri).startsWith('//'));
+
+			// Suggestions are looked up only for the shown hover, which is then cached with them
+			assert.strictEqual(lookups, 0);
+			assert.deepStrictEqual(prefetched.unsuggested, ['MISSING_NAME']);
+			const shown = await provider.provideHover(document, new vscode.Position(0, 9));
+			assert.ok(documents.provideTextDocumentContent(prefetched.expansion.uri).startsWith('y'));
+			assert.ok((shown!.contents[0] as vscode.MarkdownString).value.includes('MISSING_NAMES'));
+			await provider.provideHover(document, new vscode.Position(0, 9));
+			assert.strictEqual(lookups, 1);
+
+			assert.strictEqual(expansions, 1);
+
+			// Prefetching an undefined name neither looks it up nor caches the empty result
+			const undefinedName = await (provider as any).hoverAt(document, new vscode.Position(0, 4), true);
+			assert.strictEqual(undefinedName.hover, undefined);
+			assert.strictEqual(lookups, 1);
+
+			// Results cut short by the time budget are computed again
+			truncated = 'time';
+			(db as any).generation++;
+			await provider.provideHover(document, new vscode.Position(0, 9));
+			await provider.provideHover(document, new vscode.Position(0, 9));
+			assert.strictEqual(expansions, 3);
+		} finally {
+			provider.dispose();
+			(db as any).definitions = originalDefinitions;
+		}
+	});
+
+	test('should load a stored index once and report only cold scans as indexing', async () => {
+		const db = MacroDatabase.getInstance();
+		const stubs = ['db', 'initialized', 'loadCompileCommands', 'reconcileWithGit', 'findWorkspaceFiles',
+			'findPriorityFiles', 'updateFiles', 'loadDefinitions', 'scanProjectWithProgress'];
+		const originals = stubs.map(key => [key, Object.getOwnPropertyDescriptor(db, key)] as const);
+		const originalFolders = vscode.workspace.workspaceFolders;
+		let stored: object | undefined;
+		let loads = 0;
+		const scans: { loaded: boolean; indexing: boolean }[] = [];
+		Object.assign(db as any, {
+			db: { get: async () => stored },
+			initialized: true,
+			loadCompileCommands: async () => undefined,
+			reconcileWithGit: async () => false,
+			findWorkspaceFiles: () => ({ batches: [], found: () => 0 }),
+			findPriorityFiles: async () => [],
+			updateFiles: async () => undefined,
+			loadDefinitions: async () => { loads++; },
+			scanProjectWithProgress: async (_files: unknown, _progress: unknown, loaded: boolean) => {
+				scans.push({ loaded, indexing: db.isIndexing() });
+			}
+		});
+		try {
+			(vscode.workspace as any).workspaceFolders = undefined;
+
+			// Warm: the stored index is loaded once and lookups count as complete
+			stored = { 1: 1 };
+			await db.scanProject();
+			assert.strictEqual(loads, 1);
+			assert.deepStrictEqual(scans.pop(), { loaded: true, indexing: false });
+
+			// Cold: definitions are missing until the scan loads them
+			stored = undefined;
+			await db.scanProject();
+			assert.strictEqual(loads, 1);
+			assert.deepStrictEqual(scans.pop(), { loaded: false, indexing: true });
+			assert.strictEqual(db.isIndexing(), false);
+		} finally {
+			(vscode.workspace as any).workspaceFolders = originalFolders;
+			for (const [key, descriptor] of originals) {
+				if (descriptor) {
+					Object.defineProperty(db, key, descriptor);
+				} else {
+					delete (db as any)[key];
+				}
+			}
+		}
+	});
+	test('should report scan progress against the files found so far', async () => {
+		const db = MacroDatabase.getInstance();
+		const stubs = ['db', 'transaction', 'getIds', 'parseFile', 'fileWriteStatements', 'fileDeleteStatements', 'loadDefinitions'];
+		const originals = stubs.map(key => [key, Object.getOwnPropertyDescriptor(db, key)] as const);
+		Object.assign(db as any, {
+			db: { all: async () => [{ path: 'gone.h', mtime: 1 }], write: () => undefined },
+			transaction: (work: () => Promise<void>) => work(),
+			getIds: async () => ({}),
+			parseFile: async () => ({ defs: [], undefs: [], includes: [], directives: [], guardLine: -1 }),
+			fileWriteStatements: () => [],
+			fileDeleteStatements: () => [],
+			loadDefinitions: async () => undefined
+		});
+		const reports: { message?: string; increment?: number }[] = [];
+		let found = 0;
+		const entry = (name: string) => ({ uri: vscode.Uri.file(`/walk/${name}`), size: 1, mtime: 2 });
+		async function* batches() {
+			found = 2;
+			yield [entry('a.h'), entry('b.h')];
+			found = 4;
+			yield [entry('c.h'), entry('d.h')];
+		}
+		try {
+			await (db as any).scanProjectWithProgress({ batches: batches(), found: () => found }, { report: (value: object) => reports.push(value) });
+			assert.deepStrictEqual(reports.map(report => report.increment), [50, 50, 0, 0, 0]);
+			assert.ok(reports[2].message!.endsWith('(3/4)'));
+			assert.strictEqual(reports.reduce((sum, report) => sum + report.increment!, 0), 100);
+		} finally {
+			for (const [key, descriptor] of originals) {
+				if (descriptor) {
+					Object.defineProperty(db, key, descriptor);
+				} else {
+					delete (db as any)[key];
+				}
+			}
+		}
+	});
+	test('should run one project scan at a time and rebuild only once writes drained', async () => {
+		const db = MacroDatabase.getInstance();
+		const stubs = ['db', 'initialized', 'runScan', 'resetDatabase', 'initDatabase', 'loadCompileCommands', 'transactionQueue'];
+		const originals = stubs.map(key => [key, Object.getOwnPropertyDescriptor(db, key)] as const);
+		const runScan = (db as any).runScan;
+		const events: string[] = [];
+		let running = 0;
+		Object.assign(db as any, {
+			db: {},
+			initialized: true,
+			runScan: async (forceRebuild: boolean) => {
+				assert.strictEqual(running++, 0, 'scans overlap');
+				events.push(`scan ${forceRebuild}`);
+				await new Promise(resolve => setTimeout(resolve, 5));
+				running--;
+			}
+		});
+		try {
+			// A scan requested while one runs waits; later requests join it and may upgrade it to a rebuild
+			const first = db.scanProject(false);
+			await new Promise(resolve => setTimeout(resolve, 0));
+			const second = db.scanProject(false);
+			const third = db.scanProject(true);
+			await Promise.all([first, second, third]);
+			assert.deepStrictEqual(events, ['scan false', 'scan true']);
+
+			// The connection is only replaced once pending write transactions are done
+			events.length = 0;
+			let finishWrite!: () => void;
+			(db as any).transactionQueue = new Promise<void>(resolve => finishWrite = resolve);
+			Object.assign(db as any, {
+				resetDatabase: async () => { events.push('reset'); },
+				initDatabase: async () => undefined,
+				loadCompileCommands: async () => { throw new Error('stop'); }
+			});
+			const rebuild = runScan.call(db, true, vscode.ProgressLocation.Window).catch((error: Error) => events.push(error.message));
+			await new Promise(resolve => setTimeout(resolve, 5));
+			assert.deepStrictEqual(events, []);
+			events.push('write done');
+			finishWrite();
+			await rebuild;
+			assert.deepStrictEqual(events, ['write done', 'reset', 'stop']);
+		} finally {
+			for (const [key, descriptor] of originals) {
+				if (descriptor) {
+					Object.defineProperty(db, key, descriptor);
+				} else {
+					delete (db as any)[key];
+				}
+			}
+		}
+	});
+
 });
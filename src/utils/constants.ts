@@ -44,6 +44,70 @@ export const DATABASE_CONSTANTS = {
     
     /** Threshold for "multiple files" pending */
     MULTIPLE_FILES_THRESHOLD: 3,
+
+    /** Default size in MB above which files are parsed as a stream of chunks */
+    DEFAULT_STREAMING_THRESHOLD_MB: 4,
+
+    /** Default size in MB above which files are not indexed (0 = no limit) */
+    DEFAULT_MAX_FILE_SIZE_MB: 0,
+
+    /** Chunk size for streamed files */
+    STREAM_CHUNK_SIZE: 1 << 20,
+
+    /** Distinct referenced names recorded for a streamed file; past it the file counts as using every name */
+    STREAM_REFERENCE_LIMIT: 50000,
+
+    /** Pending watcher events from which changes are taken from git instead (pull, branch switch) */
+    GIT_STORM_THRESHOLD: 200,
+
+    /** Time without user activity after which index maintenance runs */
+    MAINTENANCE_IDLE_DELAY: 30000,
+
+    /** Free pages returned to the file system per maintenance step */
+    VACUUM_PAGES_PER_STEP: 2048,
+
+    /** Share of free pages above which an index without incremental vacuum is rewritten to enable it */
+    VACUUM_CONVERSION_FREE_RATIO: 0.25,
+
+    /** Rows ANALYZE samples per index (bounds the cost of refreshing planner statistics) */
+    ANALYSIS_LIMIT: 1000,
+
+    /** Minimum time between two integrity checks of the index */
+    INTEGRITY_CHECK_INTERVAL: 24 * 60 * 60 * 1000,
+
+    /** Files indexed ahead of a cold scan (open files, their includes and neighbours) */
+    PRIORITY_SCAN_LIMIT: 200,
+} as const;
+
+/**
+ * Hover constants
+ */
+export const HOVER_CONSTANTS = {
+    /** Characters of an expansion rendered in the hover; longer ones open in a document */
+    PREVIEW_LENGTH: 4000,
+
+    /** Characters added to the expansion document per update while it loads (a few previews' worth) */
+    EXPANSION_PAGE_SIZE: 32 * 1024,
+
+    /** Expansions kept for their documents; the oldest are dropped first */
+    MAX_STORED_EXPANSIONS: 16,
+
+    /** Idle time in milliseconds (no scrolling, editing or editor switch) before hovers of visible macros are prefetched */
+    PREFETCH_DELAY: 1500,
+
+    /** Milliseconds of prefetching between two yields to the event loop */
+    PREFETCH_SLICE: 5,
+
+    /** Maximum number of macros prefetched per pass */
+    PREFETCH_LIMIT: 200,
+} as const;
+
+/**
+ * Tree view constants
+ */
+export const TREE_CONSTANTS = {
+    /** Minimum interval between cursor-driven tree refreshes (one animation frame at 60 Hz) */
+    CURSOR_THROTTLE_MS: 16,
 } as const;
 
 /**
@@ -53,8 +117,11 @@ export const FILE_PATTERNS = {
     /** C/C++ file glob pattern */
     C_CPP_GLOB: '**/*.{c,cpp,cc,h,hpp,hh}',
     
-    /** Exclude patterns for scanning */
-    EXCLUDE_PATTERNS: '{**/node_modules/**,**/build/**,**/dist/**,**/.git/**}',
+    /** Default exclude globs for scanning */
+    EXCLUDE_GLOBS: ['**/node_modules/**', '**/build/**', '**/dist/**', '**/.git/**'],
+
+    /** Locations searched for compile_commands.json, relative to the workspace root */
+    COMPILE_COMMANDS_LOCATIONS: ['compile_commands.json', 'build/compile_commands.json'],
 } as const;
 
 /**
@@ -63,6 +130,9 @@ export const FILE_PATTERNS = {
 export const REGEX_PATTERNS = {
     /** Matches C/C++ macro names (uppercase with underscores) */
     MACRO_NAME: /\b[A-Z_][A-Z0-9_]*\b/g,
+
+    /** Matches any C/C++ identifier */
+    IDENTIFIER: /\b[A-Za-z_]\w*\b/g,
     
     /** Matches macro name with optional function call syntax */
     MACRO_WITH_CALL: /\b([A-Za-z_]\w*)\s*(\()?/g,
@@ -78,6 +148,8 @@ export const REGEX_PATTERNS = {
     
     /** Matches #define directive */
     DEFINE_DIRECTIVE: /^\s*#\s*define\s+([A-Za-z_]\w*)(.*)$/,
+    UNDEF_DIRECTIVE: /^\s*#\s*undef\s+([A-Za-z_]\w*)/,
+    INCLUDE_DIRECTIVE: /^\s*#\s*include\s*([<"])([^>"]+)[>"]/,
     
     /** Matches function-like #define directive (with parentheses immediately after name, NO space) */
     DEFINE_FUNCTION_LIKE: /^\s*#\s*define\s+([A-Za-z_]\w*)\(/,
@@ -103,6 +175,9 @@ export const REGEX_PATTERNS = {
     /** Matches C/C++ file extensions */
     CPP_FILE_EXTENSION: /\.(c|cpp|cc|h|hpp|hh)$/i,
     
+    /** Matches translation unit (non-header) file extensions */
+    SOURCE_FILE_EXTENSION: /\.(c|cpp|cc|cxx)$/i,
+    
     /** Matches file path separator (cross-platform) */
     PATH_SEPARATOR: /[/\\]/,
     
@@ -0,0 +1,94 @@
+/**
+ * Matches workspace-relative paths against glob patterns
+ *
+ * Supports the subset of glob syntax used by VS Code settings: `**`, `*`, `?`,
+ * `{a,b}` alternatives and `[...]` character classes. Paths use '/' separators.
+ */
+export class GlobMatcher {
+    private readonly regex: RegExp | null;
+
+    constructor(patterns: readonly string[]) {
+        const sources = patterns.filter(pattern => pattern.trim() !== '').map(pattern => GlobMatcher.toRegExpSource(pattern.trim()));
+        this.regex = sources.length > 0 ? new RegExp(`^(?:${sources.join('|')})$`) : null;
+    }
+
+    get isEmpty(): boolean {
+        return this.regex === null;
+    }
+
+    matches(relativePath: string): boolean {
+        return this.regex !== null && this.regex.test(relativePath.replace(/\\/g, '/'));
+    }
+
+    /**
+     * Combine patterns into the single glob accepted by workspace.findFiles
+     */
+    static join(patterns: readonly string[]): string | undefined {
+        const nonEmpty = patterns.filter(pattern => pattern.trim() !== '');
+        if (nonEmpty.length === 0) {
+            return undefined;
+        }
+        return nonEmpty.length === 1 ? nonEmpty[0] : `{${nonEmpty.join(',')}}`;
+    }
+
+    private static toRegExpSource(glob: string): string {
+        let source = '';
+        let braceDepth = 0;
+
+        for (let i = 0; i < glob.length; i++) {
+            const char = glob[i];
+            switch (char) {
+                case '*':
+                    if (glob[i + 1] === '*') {
+                        // "**/" matches zero or more directories, a trailing "**" anything
+                        i++;
+                        if (glob[i + 1] === '/') {
+                            i++;
+                            source += '(?:.*/)?';
+                        } else {
+                            source += '.*';
+                        }
+                    } else {
+                        source += '[^/]*';
+                    }
+                    break;
+                case '?':
+                    source += '[^/]';
+                    break;
+                case '{':
+                    braceDepth++;
+                    source += '(?:';
+                    break;
+                case '}':
+                    if (braceDepth > 0) {
+                        braceDepth--;
+                        source += ')';
+                    } else {
+                        source += '\\}';
+                    }
+                    break;
+                case ',':
+                    source += braceDepth > 0 ? '|' : ',';
+                    break;
+                case '[': {
+                    const close = glob.indexOf(']', i + 1);
+                    if (close === -1) {
+                        source += '\\[';
+                    } else {
+                        const body = glob.substring(i + 1, close).replace(/^!/, '^').replace(/\\/g, '\\\\');
+                        source += `[${body}]`;
+                        i = close;
+                    }
+                    break;
+                }
+                default:
+                    source += /[.+^$()|\\]/.test(char) ? `\\${char}` : char;
+            }
+        }
+
+        while (braceDepth-- > 0) {
+            source += ')';
+        }
+        return source;
+    }
+}
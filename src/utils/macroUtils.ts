@@ -12,12 +12,13 @@ export interface ConcatenationEvent {
 export class MacroUtils {
     /**
      * Find macro call at specific position in text
-     * Returns macro name and arguments if found
+     * Returns macro name, arguments and the start and end offsets of the call if found;
+     * both are inclusive cursor positions (end is just past the name or the closing parenthesis)
      * 
      * FIXED: Now properly handles nested parentheses in arguments
      * Example: A(1, (0), (1)) is correctly parsed as 3 arguments
      */
-    static findMacroAtPosition(lineText: string, character: number): { macroName: string; args?: string[] } | null {
+    static findMacroAtPosition(lineText: string, character: number): { macroName: string; args?: string[]; start: number; end: number } | null {
         // Use a simpler regex to find macro names followed by optional '('
         // Pattern: word characters followed by optional whitespace and '('
         let match;
@@ -66,8 +67,26 @@ export class MacroUtils {
         candidates.sort((a, b) => (a.endPos - a.startPos) - (b.endPos - b.startPos));
         
         const best = candidates[0];
-        return { macroName: best.macroName, args: best.args };
+        return { macroName: best.macroName, args: best.args, start: best.startPos, end: best.endPos };
     }
+    /**
+     * Compare two optional argument lists element by element
+     */
+    static sameArguments(a: string[] | undefined, b: string[] | undefined): boolean {
+        if (a === b) {
+            return true;
+        }
+        if (!a || !b || a.length !== b.length) {
+            return false;
+        }
+        for (let i = 0; i < a.length; i++) {
+            if (a[i] !== b[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     /**
      * Extract function arguments from macro invocation text
      * Handles nested parentheses and commas properly
@@ -422,8 +441,10 @@ export class MacroUtils {
         depth?: number
     }> {
         const macros: Array<{name: string, args?: string[], start: number, end: number, depth?: number}> = [];
-        const literalRanges = this.getStringLiteralRanges(text);
-        const isInsideLiteral = (index: number) => this.isIndexWithinRanges(index, literalRanges);
+        // Both loops visit positions in increasing order, so these helpers continue from
+        // the previous position instead of rescanning the text before every macro
+        const isInsideLiteral = this.literalRangeScanner(this.getStringLiteralRanges(text));
+        const depthAt = this.nestingDepthScanner(text);
         
         // Find macro names with arguments first
         let match;
@@ -452,8 +473,7 @@ export class MacroUtils {
             let depth: number | undefined;
             
             if (options.calculateDepth) {
-                const beforeText = text.substring(0, startIndex);
-                depth = MacroUtils.calculateNestingDepth(beforeText);
+                depth = depthAt(startIndex);
             }
             
             macros.push({
@@ -483,8 +503,7 @@ export class MacroUtils {
             let depth: number | undefined;
             
             if (options.calculateDepth) {
-                const beforeText = text.substring(0, startIndex);
-                depth = MacroUtils.calculateNestingDepth(beforeText);
+                depth = depthAt(startIndex);
             }
             
             macros.push({
@@ -536,6 +555,60 @@ export class MacroUtils {
         return false;
     }
 
+    /**
+     * Membership test for positions visited in increasing order
+     * Ranges are sorted, so ranges ending before the position are never looked at again.
+     */
+    static literalRangeScanner(ranges: Array<{ start: number; end: number }>): (index: number) => boolean {
+        let next = 0;
+        let last = -1;
+        return (index: number) => {
+            if (index < last) {
+                next = 0;
+            }
+            last = index;
+            while (next < ranges.length && ranges[next].end < index) {
+                next++;
+            }
+            return next < ranges.length && ranges[next].start <= index;
+        };
+    }
+
+    /**
+     * Nesting depth before positions visited in increasing order
+     * Same result as calculateNestingDepth on the text before the position, in one pass
+     * over the text for the whole scan.
+     */
+    private static nestingDepthScanner(text: string): (index: number) => number {
+        let position = 0;
+        let depth = 0;
+        let inString = false;
+        let stringChar = '';
+        return (index: number) => {
+            if (index < position) {
+                position = 0;
+                depth = 0;
+                inString = false;
+            }
+            for (; position < index; position++) {
+                const char = text[position];
+                if (!inString) {
+                    if (char === '"' || char === "'") {
+                        inString = true;
+                        stringChar = char;
+                    } else if (char === '(') {
+                        depth++;
+                    } else if (char === ')') {
+                        depth--;
+                    }
+                } else if (char === stringChar && text[position - 1] !== '\\') {
+                    inString = false;
+                }
+            }
+            return Math.max(0, depth);
+        };
+    }
+
     /**
      * Calculate nesting depth based on parentheses count
      */